@@ -0,0 +1,351 @@
+/*****************************************************************************
+ * LuaDB :: alloc.c
+ *
+ * Lua memory allocator for pooled LuaDB states.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deps/lua/lua.h"
+
+#include "alloc.h"
+
+// Small blocks are rounded up to a multiple of the class size; blocks
+// larger than the largest class are allocated from the system directly
+#define LUADB_ALLOC_CLASS_SIZE 16
+#define LUADB_ALLOC_NCLASSES 16
+
+// Arena chunks start with a header sized to keep blocks aligned
+#define LUADB_ALLOC_CHUNK_HEADER 16
+static const size_t LUADB_ALLOC_CHUNK_SIZE = 65536;
+
+typedef struct LuaDB_AllocChunk {
+    struct LuaDB_AllocChunk *next;
+} LuaDB_AllocChunk;
+
+typedef struct LuaDB_AllocBlock {
+    struct LuaDB_AllocBlock *next;
+} LuaDB_AllocBlock;
+
+struct LuaDB_Allocator {
+    bool arena;                                     // true if small blocks use the arena
+    LuaDB_AllocChunk *chunks;                       // every arena chunk
+    char *next;                                     // next free byte in the newest chunk
+    char *end;                                      // end of the newest chunk
+    LuaDB_AllocBlock *free[LUADB_ALLOC_NCLASSES];   // freed blocks by size class
+    size_t request_base;                            // bytes in use when the request began
+    size_t request_limit;                           // bytes a request may add; 0 for none
+    size_t state_limit;                             // bytes the state may use; 0 for none
+    bool enforce;                                   // true while limits are enforced
+    bool limit_hit;                                 // true if the request hit a limit
+    LuaDB_AllocStats stats;
+};
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static inline size_t GetAllocClass(size_t size);
+static bool IsAllocWithinLimits(LuaDB_Allocator *alloc, size_t size);
+static void *ReallocArenaBlock(LuaDB_Allocator *alloc, void *ptr, size_t osize, size_t nsize);
+static void *AllocArenaBlock(LuaDB_Allocator *alloc, size_t cls);
+static void FreeArenaBlock(LuaDB_Allocator *alloc, void *ptr, size_t size);
+static void *AdoptSystemBlock(LuaDB_Allocator *alloc, void *ptr, size_t osize, size_t cls, size_t nsize);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+LuaDB_Allocator *LuaDB_AllocatorNew(bool arena) {
+    LuaDB_Allocator *alloc = calloc(1, sizeof(LuaDB_Allocator));
+    if (!alloc) {
+        return NULL;
+    }
+
+    alloc->arena = arena;
+    return alloc;
+}
+
+void LuaDB_AllocatorFree(LuaDB_Allocator *alloc) {
+    if (!alloc) { return; }
+
+    // Release the arena in bulk; blocks are not returned individually
+    LuaDB_AllocChunk *chunk = alloc->chunks;
+    while (chunk) {
+        LuaDB_AllocChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(alloc);
+}
+
+void *LuaDB_AllocatorAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    LuaDB_Allocator *alloc = ud;
+    assert(alloc);
+
+    // Lua passes the type of the new object in osize when ptr is NULL
+    if (!ptr) { osize = 0; }
+
+    if (nsize == 0) {
+        if (ptr) {
+            if (alloc->arena) {
+                FreeArenaBlock(alloc, ptr, osize);
+            } else {
+                free(ptr);
+            }
+            alloc->stats.frees++;
+            alloc->stats.bytes -= osize;
+        }
+        return NULL;
+    }
+
+    // Only growing a block may fail; Lua requires shrinking to succeed
+    if (alloc->enforce && (nsize > osize) && !IsAllocWithinLimits(alloc, nsize - osize)) {
+        alloc->limit_hit = true;
+        return NULL;
+    }
+
+    void *nptr = (alloc->arena) ?
+                 ReallocArenaBlock(alloc, ptr, osize, nsize) :
+                 realloc(ptr, nsize);
+    if (!nptr) {
+        return NULL;
+    }
+
+    if (!ptr) {
+        alloc->stats.allocs++;
+        alloc->stats.request_allocs++;
+    }
+    alloc->stats.bytes = alloc->stats.bytes - osize + nsize;
+    if (alloc->stats.bytes > alloc->stats.peak_bytes) {
+        alloc->stats.peak_bytes = alloc->stats.bytes;
+    }
+    return nptr;
+}
+
+void LuaDB_AllocatorBeginRequest(LuaDB_Allocator *alloc) {
+    assert(alloc);
+
+    alloc->request_base = alloc->stats.bytes;
+    alloc->stats.request_allocs = 0;
+    alloc->limit_hit = false;
+}
+
+size_t LuaDB_AllocatorFootprint(LuaDB_Allocator *alloc) {
+    assert(alloc);
+
+    return alloc->stats.bytes + alloc->stats.free_bytes + (size_t)(alloc->end - alloc->next);
+}
+
+void LuaDB_AllocatorSetLimits(LuaDB_Allocator *alloc, size_t request_limit, size_t state_limit) {
+    assert(alloc);
+
+    alloc->request_limit = request_limit;
+    alloc->state_limit = state_limit;
+}
+
+void LuaDB_AllocatorEnforceLimits(LuaDB_Allocator *alloc, bool enforce) {
+    assert(alloc);
+
+    alloc->enforce = enforce;
+}
+
+bool LuaDB_AllocatorLimitHit(LuaDB_Allocator *alloc) {
+    assert(alloc);
+
+    return alloc->limit_hit;
+}
+
+void LuaDB_AllocatorGetStats(LuaDB_Allocator *alloc, LuaDB_AllocStats *stats) {
+    assert(alloc);
+    assert(stats);
+
+    *stats = alloc->stats;
+    stats->request_bytes = (alloc->stats.bytes > alloc->request_base) ?
+                           alloc->stats.bytes - alloc->request_base : 0;
+}
+
+int LuaDB_AllocMemStats(lua_State *L) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+
+    lua_createtable(L, 0, 8);
+    if (f != LuaDB_AllocatorAlloc) {
+        size_t bytes = ((size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024) +
+                       (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+        lua_pushinteger(L, (lua_Integer)bytes);
+        lua_setfield(L, -2, "bytes");
+        return 1;
+    }
+
+    LuaDB_AllocStats stats;
+    LuaDB_AllocatorGetStats(ud, &stats);
+    lua_pushinteger(L, (lua_Integer)stats.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)stats.peak_bytes);
+    lua_setfield(L, -2, "peak_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.arena_bytes);
+    lua_setfield(L, -2, "arena_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.free_bytes);
+    lua_setfield(L, -2, "free_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, (lua_Integer)stats.frees);
+    lua_setfield(L, -2, "frees");
+    lua_pushinteger(L, (lua_Integer)stats.reused);
+    lua_setfield(L, -2, "reused");
+    lua_pushinteger(L, (lua_Integer)stats.request_bytes);
+    lua_setfield(L, -2, "request_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.request_allocs);
+    lua_setfield(L, -2, "request_allocs");
+    return 1;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Return the size class (1 to LUADB_ALLOC_NCLASSES) for a block of the
+// given size, or 0 if the block is too large for the arena.
+static inline size_t GetAllocClass(size_t size) {
+    size_t cls = (size + LUADB_ALLOC_CLASS_SIZE - 1) / LUADB_ALLOC_CLASS_SIZE;
+    return (cls <= LUADB_ALLOC_NCLASSES) ? cls : 0;
+}
+
+// Return true if the state may allocate `size` more bytes without going
+// over the request or state limits.
+static bool IsAllocWithinLimits(LuaDB_Allocator *alloc, size_t size) {
+    assert(alloc);
+
+    size_t bytes = alloc->stats.bytes + size;
+    if ((alloc->state_limit > 0) && (bytes > alloc->state_limit)) {
+        return false;
+    }
+    if ((alloc->request_limit > 0) && (bytes > alloc->request_base) &&
+        ((bytes - alloc->request_base) > alloc->request_limit)) {
+        return false;
+    }
+    return true;
+}
+
+// Resize a block, moving it between the arena and the system allocator
+// as its size class changes.
+static void *ReallocArenaBlock(LuaDB_Allocator *alloc, void *ptr, size_t osize, size_t nsize) {
+    assert(alloc);
+
+    size_t ocls = (ptr) ? GetAllocClass(osize) : 0;
+    size_t ncls = GetAllocClass(nsize);
+
+    // Blocks which stay within their size class do not move
+    if (ptr && (ocls != 0) && (ocls == ncls)) {
+        return ptr;
+    }
+
+    // Large blocks stay with the system allocator
+    if ((!ptr || (ocls == 0)) && (ncls == 0)) {
+        return realloc(ptr, nsize);
+    }
+
+    void *nptr = (ncls != 0) ? AllocArenaBlock(alloc, ncls) : malloc(nsize);
+    if (!nptr) {
+        // Lua requires that shrinking a block never fails; an arena block
+        // is at least as large as the class it will be freed into later,
+        // but a system block must become part of the arena first
+        if (!ptr || (nsize > osize)) {
+            return NULL;
+        }
+        return (ocls != 0) ? ptr : AdoptSystemBlock(alloc, ptr, osize, ncls, nsize);
+    }
+
+    if (ptr) {
+        memcpy(nptr, ptr, (osize < nsize) ? osize : nsize);
+        FreeArenaBlock(alloc, ptr, osize);
+    }
+    return nptr;
+}
+
+// Allocate a block of the given size class, preferring previously freed
+// blocks over fresh space in the arena.
+static void *AllocArenaBlock(LuaDB_Allocator *alloc, size_t cls) {
+    assert(alloc);
+    assert(cls > 0 && cls <= LUADB_ALLOC_NCLASSES);
+
+    LuaDB_AllocBlock *block = alloc->free[cls - 1];
+    if (block) {
+        alloc->free[cls - 1] = block->next;
+        alloc->stats.free_bytes -= cls * LUADB_ALLOC_CLASS_SIZE;
+        alloc->stats.reused++;
+        return block;
+    }
+
+    size_t size = cls * LUADB_ALLOC_CLASS_SIZE;
+    if (!alloc->next || ((size_t)(alloc->end - alloc->next) < size)) {
+        LuaDB_AllocChunk *chunk = malloc(LUADB_ALLOC_CHUNK_SIZE);
+        if (!chunk) {
+            return NULL;
+        }
+
+        chunk->next = alloc->chunks;
+        alloc->chunks = chunk;
+        alloc->next = (char *)chunk + LUADB_ALLOC_CHUNK_HEADER;
+        alloc->end = (char *)chunk + LUADB_ALLOC_CHUNK_SIZE;
+        alloc->stats.arena_bytes += LUADB_ALLOC_CHUNK_SIZE;
+    }
+
+    void *ptr = alloc->next;
+    alloc->next += size;
+    return ptr;
+}
+
+// Return a block to its size class free list, or to the system if it is
+// too large for the arena.
+static void FreeArenaBlock(LuaDB_Allocator *alloc, void *ptr, size_t size) {
+    assert(alloc);
+    assert(ptr);
+
+    size_t cls = GetAllocClass(size);
+    if (cls == 0) {
+        free(ptr);
+        return;
+    }
+
+    LuaDB_AllocBlock *block = ptr;
+    block->next = alloc->free[cls - 1];
+    alloc->free[cls - 1] = block;
+    alloc->stats.free_bytes += cls * LUADB_ALLOC_CLASS_SIZE;
+}
+
+// Turn a system block which is shrinking into a size class into a chunk of
+// its own, so it is freed with the arena rather than lost on a free list.
+static void *AdoptSystemBlock(LuaDB_Allocator *alloc, void *ptr, size_t osize, size_t cls, size_t nsize) {
+    assert(alloc);
+    assert(ptr);
+    assert(cls > 0 && cls <= LUADB_ALLOC_NCLASSES);
+
+    // The resize only grows if the block was barely larger than the largest
+    // class; if that fails there is nowhere left to put the block
+    size_t size = LUADB_ALLOC_CHUNK_HEADER + (cls * LUADB_ALLOC_CLASS_SIZE);
+    LuaDB_AllocChunk *chunk = realloc(ptr, size);
+    if (!chunk) {
+        if (osize < size) {
+            return ptr;
+        }
+        chunk = ptr;
+        size = osize;
+    }
+
+    char *block = (char *)chunk + LUADB_ALLOC_CHUNK_HEADER;
+    memmove(block, chunk, nsize);
+    chunk->next = alloc->chunks;
+    alloc->chunks = chunk;
+    alloc->stats.arena_bytes += size;
+    return block;
+}
@@ -0,0 +1,112 @@
+/*****************************************************************************
+ * LuaDB :: alloc.h
+ *
+ * Lua memory allocator for pooled LuaDB states.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_ALLOC_H
+#define LUADB_ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deps/lua/lua.h"
+
+/**
+ * @brief Allocator for a single Lua state. Allocators are not
+ * thread-safe; each allocator must only be used by one state.
+ */
+typedef struct LuaDB_Allocator LuaDB_Allocator;
+
+/**
+ * @brief Memory usage counters kept by an allocator.
+ */
+typedef struct LuaDB_AllocStats {
+    size_t bytes;               /** bytes currently allocated by the state */
+    size_t peak_bytes;          /** largest value of @c bytes */
+    size_t arena_bytes;         /** bytes reserved from the system by the arena */
+    size_t free_bytes;          /** bytes on the arena free lists */
+    size_t allocs;              /** number of allocations made */
+    size_t frees;               /** number of allocations freed */
+    size_t reused;              /** allocations served from a free list */
+    size_t request_bytes;       /** bytes allocated by the current request */
+    size_t request_allocs;      /** allocations made by the current request */
+} LuaDB_AllocStats;
+
+/**
+ * @brief Create a new allocator.
+ *
+ * With @c arena enabled, small blocks are carved out of large arena
+ * chunks and recycled through per-size free lists instead of going
+ * through @c realloc and @c free individually. The arena is released in
+ * bulk when the allocator is freed.
+ *
+ * @param arena true to allocate small blocks from the arena
+ * @returns a new allocator or NULL if no memory was available
+ */
+LuaDB_Allocator *LuaDB_AllocatorNew(bool arena);
+
+/**
+ * @brief Free the allocator and everything it allocated. The state using
+ * the allocator must already be closed.
+ */
+void LuaDB_AllocatorFree(LuaDB_Allocator *alloc);
+
+/**
+ * @brief The @c lua_Alloc function for states using a LuaDB allocator;
+ * @c ud is the @c LuaDB_Allocator.
+ */
+void *LuaDB_AllocatorAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+/**
+ * @brief Reset the per-request counters at the start of a request.
+ */
+void LuaDB_AllocatorBeginRequest(LuaDB_Allocator *alloc);
+
+/**
+ * @brief Return the bytes the state holds from the system: the blocks it
+ * is using plus any arena space kept for reuse. Unlike the collector's
+ * count, this includes arena blocks the state has freed, which are only
+ * returned to the system along with the allocator.
+ */
+size_t LuaDB_AllocatorFootprint(LuaDB_Allocator *alloc);
+
+/**
+ * @brief Set the memory limits for the state using the allocator.
+ * Allocations which would exceed either limit fail, which Lua reports
+ * as a memory error. Limits only apply while they are enforced.
+ *
+ * @param request_limit bytes a single request may add; 0 for no limit
+ * @param state_limit bytes the whole state may use; 0 for no limit
+ */
+void LuaDB_AllocatorSetLimits(LuaDB_Allocator *alloc, size_t request_limit, size_t state_limit);
+
+/**
+ * @brief Start or stop enforcing the allocator limits. Limits should
+ * only be enforced while Lua code runs in protected mode, since a memory
+ * error anywhere else aborts the process.
+ */
+void LuaDB_AllocatorEnforceLimits(LuaDB_Allocator *alloc, bool enforce);
+
+/**
+ * @brief Return true if an allocation was refused for exceeding a limit
+ * since the current request began.
+ */
+bool LuaDB_AllocatorLimitHit(LuaDB_Allocator *alloc);
+
+/**
+ * @brief Copy the counters for the given allocator into @c stats.
+ */
+void LuaDB_AllocatorGetStats(LuaDB_Allocator *alloc, LuaDB_AllocStats *stats);
+
+/**
+ * @brief Return a table describing the memory used by the state. States
+ * which do not use a LuaDB allocator only report @c bytes.
+ */
+int LuaDB_AllocMemStats(lua_State *L);
+
+#endif //LUADB_ALLOC_H
@@ -0,0 +1,850 @@
+/*****************************************************************************
+ * LuaDB :: bench.c
+ *
+ * FastCGI load generator for benchmarking LuaDB workers.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+// getaddrinfo and clock_nanosleep are not part of C99
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deps/fcgi/fastcgi.h"
+
+#include "luadb.h"
+
+#define BENCH_MAX_ENTRIES 256
+#define BENCH_MAX_STATUSES 600
+#define BENCH_LINE_SIZE 4096
+
+static const char *const BENCH_EXEC = "luadb-bench";
+
+// Request ID used for every request; each connection carries one request
+// at a time
+static const int BENCH_REQUEST_ID = 1;
+
+// Initial number of latency samples each thread has room for
+static const size_t BENCH_INITIAL_SAMPLES = 4096;
+
+// A single request in the request mix
+typedef struct BenchEntry {
+    char *method;
+    char *uri;
+    char *body;
+    size_t body_len;
+    unsigned long weight;
+    char *record;               // BEGIN_REQUEST, PARAMS and STDIN records
+    size_t record_len;
+} BenchEntry;
+
+// Latency of a single completed request
+typedef struct BenchSample {
+    long long latency;          // microseconds
+    size_t entry;
+} BenchSample;
+
+// Options shared by every client thread
+typedef struct BenchOpts {
+    const char *device;
+    BenchEntry entries[BENCH_MAX_ENTRIES];
+    size_t nentries;
+    unsigned long total_weight;
+    long concurrency;
+    double rate;                // requests per second; 0 for no limit
+    double duration;            // seconds
+    long requests;              // total requests; 0 to run for `duration`
+    bool keep_conn;
+    long long start;            // monotonic start time (ns)
+    long long stop;             // monotonic stop time (ns)
+    long remaining;             // requests left to send when `requests` > 0
+} BenchOpts;
+
+// A single client thread, which has at most one request in flight
+typedef struct BenchThread {
+    pthread_t thread;
+    BenchOpts *opts;
+    size_t id;
+    uint64_t seed;
+    int sock;
+    BenchSample *samples;
+    size_t nsamples;
+    size_t cap;
+    unsigned long errors;
+    unsigned long entry_errors[BENCH_MAX_ENTRIES];
+    unsigned long statuses[BENCH_MAX_STATUSES];
+} BenchThread;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static void PrintBenchUsage(FILE *dest, const char *cmd);
+static void PrintBenchHelp(FILE *dest, const char *cmd);
+static bool ReadBenchMix(BenchOpts *opts, const char *path);
+static bool AddBenchEntry(BenchOpts *opts, unsigned long weight, const char *method, const char *uri, const char *body);
+static bool BuildBenchRecord(BenchEntry *e, bool keep_conn);
+static void AppendBenchParam(char **p, const char *name, const char *val);
+static FCGI_Header MakeBenchHeader(int type, int request_id, int content_length, int padding_length);
+static void *RunBenchThread(void *arg);
+static int SendBenchRequest(BenchThread *t, BenchEntry *e);
+static int ConnectBenchSocket(const char *device);
+static bool WriteBenchSocket(int sock, const char *buf, size_t len);
+static bool ReadBenchSocket(int sock, void *buf, size_t len);
+static int ParseBenchStatus(const char *head, size_t len);
+static size_t PickBenchEntry(BenchThread *t);
+static bool AddBenchSample(BenchThread *t, long long latency, size_t entry);
+static void PrintBenchReport(BenchOpts *opts, BenchThread *threads, long long elapsed);
+static void PrintBenchLatency(const char *label, BenchSample *samples, size_t n, unsigned long errors);
+static int CompareBenchSamples(const void *a, const void *b);
+static int CompareBenchEntries(const void *a, const void *b);
+static long long GetBenchTime(void);
+static void SleepBenchUntil(long long when);
+static void FreeBenchOpts(BenchOpts *opts);
+
+/*
+ * MAIN
+ */
+
+int main(int argc, char *const argv[]) {
+    BenchOpts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.concurrency = 1;
+    opts.duration = 10;
+    opts.keep_conn = false;
+
+    int exit_code = EXIT_FAILURE;
+    int c;
+    while ((c = getopt(argc, argv, "c:d:hkm:n:r:s:")) != -1) {
+        switch (c) {
+            case 'c':
+                opts.concurrency = strtol(optarg, NULL, 10);
+                if (opts.concurrency <= 0) {
+                    fprintf(stderr, "%s: invalid concurrency '%s'\n", BENCH_EXEC, optarg);
+                    goto exit_bench;
+                }
+                break;
+            case 'd':
+                opts.duration = strtod(optarg, NULL);
+                if (opts.duration <= 0) {
+                    fprintf(stderr, "%s: invalid duration '%s'\n", BENCH_EXEC, optarg);
+                    goto exit_bench;
+                }
+                break;
+            case 'h':
+                PrintBenchHelp(stdout, argv[0]);
+                exit_code = EXIT_SUCCESS;
+                goto exit_bench;
+            case 'k':
+                opts.keep_conn = true;
+                break;
+            case 'm':
+                if (!ReadBenchMix(&opts, optarg)) { goto exit_bench; }
+                break;
+            case 'n':
+                opts.requests = strtol(optarg, NULL, 10);
+                if (opts.requests <= 0) {
+                    fprintf(stderr, "%s: invalid request count '%s'\n", BENCH_EXEC, optarg);
+                    goto exit_bench;
+                }
+                break;
+            case 'r':
+                opts.rate = strtod(optarg, NULL);
+                if (opts.rate <= 0) {
+                    fprintf(stderr, "%s: invalid rate '%s'\n", BENCH_EXEC, optarg);
+                    goto exit_bench;
+                }
+                break;
+            case 's':
+                opts.device = optarg;
+                break;
+            default:
+                PrintBenchUsage(stderr, argv[0]);
+                goto exit_bench;
+        }
+    }
+
+    // Every remaining argument is a URI to GET
+    for (; optind < argc; optind++) {
+        if (!AddBenchEntry(&opts, 1, "GET", argv[optind], NULL)) { goto exit_bench; }
+    }
+
+    if (!opts.device || (opts.nentries == 0)) {
+        PrintBenchUsage(stderr, argv[0]);
+        goto exit_bench;
+    }
+
+    for (size_t i = 0; i < opts.nentries; i++) {
+        if (!BuildBenchRecord(&opts.entries[i], opts.keep_conn)) {
+            fprintf(stderr, "%s: could not allocate request records\n", BENCH_EXEC);
+            goto exit_bench;
+        }
+    }
+
+    BenchThread *threads = calloc((size_t)opts.concurrency, sizeof(BenchThread));
+    if (!threads) {
+        fprintf(stderr, "%s: could not allocate client threads\n", BENCH_EXEC);
+        goto exit_bench;
+    }
+
+    fprintf(stdout, "Benchmarking %s with %ld connection(s)", opts.device, opts.concurrency);
+    if (opts.rate > 0) { fprintf(stdout, " at %.1f req/s", opts.rate); }
+    if (opts.requests > 0) {
+        fprintf(stdout, " for %ld requests\n", opts.requests);
+    } else {
+        fprintf(stdout, " for %.1f s\n", opts.duration);
+    }
+
+    opts.remaining = opts.requests;
+    opts.start = GetBenchTime();
+    opts.stop = opts.start + (long long)(opts.duration * 1e9);
+
+    long nstarted = 0;
+    for (; nstarted < opts.concurrency; nstarted++) {
+        BenchThread *t = &threads[nstarted];
+        t->opts = &opts;
+        t->id = (size_t)nstarted;
+        t->seed = 0x9e3779b97f4a7c15ull * (uint64_t)(nstarted + 1);
+        t->sock = -1;
+        if (pthread_create(&t->thread, NULL, RunBenchThread, t) != 0) {
+            fprintf(stderr, "%s: could not start client thread %ld\n", BENCH_EXEC, nstarted);
+            break;
+        }
+    }
+    for (long i = 0; i < nstarted; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    long long elapsed = GetBenchTime() - opts.start;
+
+    if (nstarted > 0) {
+        PrintBenchReport(&opts, threads, elapsed);
+        exit_code = EXIT_SUCCESS;
+    }
+
+    for (long i = 0; i < opts.concurrency; i++) {
+        free(threads[i].samples);
+    }
+    free(threads);
+
+exit_bench:
+    FreeBenchOpts(&opts);
+    return exit_code;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Print the short usage line
+static void PrintBenchUsage(FILE *dest, const char *cmd) {
+    fprintf(dest, "usage: %s [-h] -s socket [-c conns] [-r rate] [-d secs | -n requests] [-k] [-m mixfile] [uri ...]\n", cmd);
+}
+
+// Print the benchmark help to the given destination file
+static void PrintBenchHelp(FILE *dest, const char *cmd) {
+    PrintBenchUsage(dest, cmd);
+    fprintf(dest, "\n");
+    fprintf(dest, "%s v%d.%d.%d %s\n", BENCH_EXEC,
+            LUADB_MAJOR_VERSION, LUADB_MINOR_VERSION,
+            LUADB_PATCH_VERSION, LUADB_PATCH_STATUS);
+    fprintf(dest, "\n");
+    fprintf(dest, "Options:\n");
+    fprintf(dest, "  -s <port>, -s <dev>  FastCGI socket of the worker (e.g. :8000)\n");
+    fprintf(dest, "  -c conns             number of concurrent connections (default 1)\n");
+    fprintf(dest, "  -r rate              total requests per second (default unlimited)\n");
+    fprintf(dest, "  -d secs              seconds to run for (default 10)\n");
+    fprintf(dest, "  -n requests          number of requests to send instead of -d\n");
+    fprintf(dest, "  -k                   keep connections open between requests\n");
+    fprintf(dest, "  -m mixfile           request mix, one `weight method uri [body]` per line\n");
+    fprintf(dest, "  -h                   print out this help text\n");
+}
+
+// Read the request mix from the given file. Each line holds a weight, an
+// HTTP method, a URI and optionally a request body (the rest of the line).
+// Blank lines and lines starting with `#` are ignored.
+static bool ReadBenchMix(BenchOpts *opts, const char *path) {
+    assert(opts);
+    assert(path);
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: could not open request mix '%s': %s\n", BENCH_EXEC, path, strerror(errno));
+        return false;
+    }
+
+    char line[BENCH_LINE_SIZE];
+    bool ok = true;
+    for (int lineno = 1; ok && fgets(line, sizeof(line), f); lineno++) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *p = line + strspn(line, " \t");
+        if ((*p == '\0') || (*p == '#')) { continue; }
+
+        char *end;
+        unsigned long weight = strtoul(p, &end, 10);
+        char *method = strtok(end, " \t");
+        char *uri = strtok(NULL, " \t");
+        char *body = strtok(NULL, "");
+        if ((end == p) || (weight == 0) || !method || !uri || (*uri != '/')) {
+            fprintf(stderr, "%s: invalid request mix line %s:%d\n", BENCH_EXEC, path, lineno);
+            ok = false;
+            break;
+        }
+        if (body) { body += strspn(body, " \t"); }
+        ok = AddBenchEntry(opts, weight, method, uri, body);
+    }
+
+    fclose(f);
+    return ok;
+}
+
+// Add a request to the request mix.
+static bool AddBenchEntry(BenchOpts *opts, unsigned long weight, const char *method, const char *uri, const char *body) {
+    assert(opts);
+    assert(method);
+    assert(uri);
+
+    if (opts->nentries >= BENCH_MAX_ENTRIES) {
+        fprintf(stderr, "%s: too many requests in mix (max %d)\n", BENCH_EXEC, BENCH_MAX_ENTRIES);
+        return false;
+    }
+
+    BenchEntry *e = &opts->entries[opts->nentries];
+    e->method = strdup(method);
+    e->uri = strdup(uri);
+    e->body = strdup((body) ? body : "");
+    if (!e->method || !e->uri || !e->body) {
+        fprintf(stderr, "%s: could not allocate request mix\n", BENCH_EXEC);
+        free(e->method);
+        free(e->uri);
+        free(e->body);
+        memset(e, 0, sizeof(BenchEntry));
+        return false;
+    }
+
+    e->body_len = strlen(e->body);
+    e->weight = weight;
+    opts->total_weight += weight;
+    opts->nentries++;
+    return true;
+}
+
+// Encode the complete FastCGI request for a mix entry once, so sending a
+// request is a single write.
+static bool BuildBenchRecord(BenchEntry *e, bool keep_conn) {
+    assert(e);
+
+    // Split the query string from the path
+    const char *query = strchr(e->uri, '?');
+    size_t path_len = (query) ? (size_t)(query - e->uri) : strlen(e->uri);
+    char *path = strndup(e->uri, path_len);
+    if (!path) { return false; }
+    char length[32];
+    snprintf(length, sizeof(length), "%zu", e->body_len);
+
+    // Parameters take at most 8 bytes of length prefix each
+    size_t params_size = strlen(e->method) + strlen(e->uri) * 2 + strlen(length) + 512;
+    size_t nbody = (e->body_len + FCGI_MAX_LENGTH - 1) / FCGI_MAX_LENGTH;
+    size_t size = (FCGI_HEADER_LEN * (5 + nbody)) + sizeof(FCGI_BeginRequestBody) +
+                  params_size + e->body_len + 8;
+    char *rec = calloc(1, size);
+    if (!rec) {
+        free(path);
+        return false;
+    }
+
+    char *p = rec;
+    FCGI_BeginRequestRecord *begin = (FCGI_BeginRequestRecord *)p;
+    begin->header = MakeBenchHeader(FCGI_BEGIN_REQUEST, BENCH_REQUEST_ID, sizeof(FCGI_BeginRequestBody), 0);
+    begin->body.roleB0 = FCGI_RESPONDER;
+    begin->body.flags = (keep_conn) ? FCGI_KEEP_CONN : 0;
+    p += sizeof(FCGI_BeginRequestRecord);
+
+    // Parameters, as a web server would pass them
+    char *params = p + FCGI_HEADER_LEN;
+    char *q = params;
+    AppendBenchParam(&q, "REQUEST_METHOD", e->method);
+    AppendBenchParam(&q, "REQUEST_URI", e->uri);
+    AppendBenchParam(&q, "DOCUMENT_URI", path);
+    AppendBenchParam(&q, "QUERY_STRING", (query) ? query + 1 : "");
+    AppendBenchParam(&q, "SERVER_PROTOCOL", "HTTP/1.1");
+    AppendBenchParam(&q, "GATEWAY_INTERFACE", "CGI/1.1");
+    AppendBenchParam(&q, "CONTENT_LENGTH", length);
+    AppendBenchParam(&q, "HTTP_HOST", "localhost");
+    AppendBenchParam(&q, "HTTP_USER_AGENT", BENCH_EXEC);
+    free(path);
+    if ((size_t)(q - params) > FCGI_MAX_LENGTH) {
+        free(rec);
+        return false;
+    }
+
+    FCGI_Header *header = (FCGI_Header *)p;
+    *header = MakeBenchHeader(FCGI_PARAMS, BENCH_REQUEST_ID, (int)(q - params), 0);
+    p = q;
+    header = (FCGI_Header *)p;
+    *header = MakeBenchHeader(FCGI_PARAMS, BENCH_REQUEST_ID, 0, 0);
+    p += FCGI_HEADER_LEN;
+
+    // Request body, split into records of the largest allowed size
+    for (size_t off = 0; off < e->body_len; off += FCGI_MAX_LENGTH) {
+        size_t len = e->body_len - off;
+        if (len > FCGI_MAX_LENGTH) { len = FCGI_MAX_LENGTH; }
+        header = (FCGI_Header *)p;
+        *header = MakeBenchHeader(FCGI_STDIN, BENCH_REQUEST_ID, (int)len, 0);
+        p += FCGI_HEADER_LEN;
+        memcpy(p, e->body + off, len);
+        p += len;
+    }
+    header = (FCGI_Header *)p;
+    *header = MakeBenchHeader(FCGI_STDIN, BENCH_REQUEST_ID, 0, 0);
+    p += FCGI_HEADER_LEN;
+
+    e->record = rec;
+    e->record_len = (size_t)(p - rec);
+    return true;
+}
+
+// Append a single FastCGI name-value pair.
+static void AppendBenchParam(char **p, const char *name, const char *val) {
+    assert(p);
+    assert(name);
+    assert(val);
+
+    size_t lens[2] = { strlen(name), strlen(val) };
+    unsigned char *q = (unsigned char *)*p;
+    for (int i = 0; i < 2; i++) {
+        if (lens[i] < 0x80) {
+            *q++ = (unsigned char)lens[i];
+        } else {
+            *q++ = (unsigned char)(((lens[i] >> 24) & 0x7f) | 0x80);
+            *q++ = (unsigned char)((lens[i] >> 16) & 0xff);
+            *q++ = (unsigned char)((lens[i] >> 8) & 0xff);
+            *q++ = (unsigned char)(lens[i] & 0xff);
+        }
+    }
+    memcpy(q, name, lens[0]);
+    q += lens[0];
+    memcpy(q, val, lens[1]);
+    q += lens[1];
+    *p = (char *)q;
+}
+
+// Build the header of a FastCGI record.
+static FCGI_Header MakeBenchHeader(int type, int request_id, int content_length, int padding_length) {
+    FCGI_Header header;
+    header.version = FCGI_VERSION_1;
+    header.type = (unsigned char)type;
+    header.requestIdB1 = (unsigned char)((request_id >> 8) & 0xff);
+    header.requestIdB0 = (unsigned char)(request_id & 0xff);
+    header.contentLengthB1 = (unsigned char)((content_length >> 8) & 0xff);
+    header.contentLengthB0 = (unsigned char)(content_length & 0xff);
+    header.paddingLength = (unsigned char)padding_length;
+    header.reserved = 0;
+    return header;
+}
+
+// Send requests from a single client thread until the benchmark ends.
+//
+// Without a rate, each thread sends its next request as soon as the last
+// one completes. With a rate, requests are sent on a fixed schedule and
+// latency is measured from when each request was due rather than when it
+// was sent, so a stalled worker is not hidden by the client falling behind.
+static void *RunBenchThread(void *arg) {
+    BenchThread *t = arg;
+    assert(t);
+    BenchOpts *opts = t->opts;
+
+    long long interval = 0;
+    long long due = opts->start;
+    if (opts->rate > 0) {
+        interval = (long long)(1e9 * (double)opts->concurrency / opts->rate);
+        due += (long long)(1e9 * (double)t->id / opts->rate);
+    }
+
+    while (true) {
+        if (opts->requests > 0) {
+            if (__atomic_sub_fetch(&opts->remaining, 1, __ATOMIC_RELAXED) < 0) { break; }
+        } else if (GetBenchTime() >= opts->stop) {
+            break;
+        }
+
+        if (interval > 0) {
+            SleepBenchUntil(due);
+            if ((opts->requests == 0) && (due >= opts->stop)) { break; }
+        }
+
+        size_t entry = PickBenchEntry(t);
+        long long sent = (interval > 0) ? due : GetBenchTime();
+        int status = SendBenchRequest(t, &opts->entries[entry]);
+        long long latency = (GetBenchTime() - sent) / 1000;
+        due += interval;
+
+        if (status < 0) {
+            t->errors++;
+            t->entry_errors[entry]++;
+            continue;
+        }
+
+        if (status < BENCH_MAX_STATUSES) { t->statuses[status]++; }
+        if (!AddBenchSample(t, latency, entry)) {
+            fprintf(stderr, "%s: could not allocate latency samples\n", BENCH_EXEC);
+            break;
+        }
+    }
+
+    if (t->sock >= 0) { close(t->sock); }
+    return NULL;
+}
+
+// Send a single request and read the complete response. Returns the HTTP
+// status of the response, or -1 if the request failed.
+static int SendBenchRequest(BenchThread *t, BenchEntry *e) {
+    assert(t);
+    assert(e);
+
+    if (t->sock < 0) {
+        t->sock = ConnectBenchSocket(t->opts->device);
+        if (t->sock < 0) { return -1; }
+    }
+
+    int status = -1;
+    char head[BENCH_LINE_SIZE];
+    size_t head_len = 0;
+    if (!WriteBenchSocket(t->sock, e->record, e->record_len)) { goto request_failed; }
+
+    // Read records until the request ends, keeping the start of the
+    // response to find its status
+    while (true) {
+        FCGI_Header header;
+        if (!ReadBenchSocket(t->sock, &header, sizeof(header))) { goto request_failed; }
+
+        size_t len = ((size_t)header.contentLengthB1 << 8) | header.contentLengthB0;
+        size_t total = len + header.paddingLength;
+        char content[FCGI_MAX_LENGTH + 256];
+        if (!ReadBenchSocket(t->sock, content, total)) { goto request_failed; }
+
+        if (header.type == FCGI_STDOUT) {
+            size_t n = sizeof(head) - head_len;
+            if (len < n) { n = len; }
+            memcpy(head + head_len, content, n);
+            head_len += n;
+        } else if (header.type == FCGI_END_REQUEST) {
+            FCGI_EndRequestBody *end = (FCGI_EndRequestBody *)content;
+            if ((len < sizeof(FCGI_EndRequestBody)) ||
+                (end->protocolStatus != FCGI_REQUEST_COMPLETE)) {
+                goto request_failed;
+            }
+            status = ParseBenchStatus(head, head_len);
+            break;
+        }
+    }
+
+    if (!t->opts->keep_conn) {
+        close(t->sock);
+        t->sock = -1;
+    }
+    return status;
+
+request_failed:
+    close(t->sock);
+    t->sock = -1;
+    return -1;
+}
+
+// Connect to the worker's FastCGI socket, given as `[host]:port` or as the
+// path of a Unix domain socket.
+static int ConnectBenchSocket(const char *device) {
+    assert(device);
+
+    const char *sep = strrchr(device, ':');
+    if (!sep) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, device, sizeof(addr.sun_path) - 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) { return -1; }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    char host[256] = "localhost";
+    size_t hostlen = (size_t)(sep - device);
+    if ((hostlen > 0) && (hostlen < sizeof(host))) {
+        memcpy(host, device, hostlen);
+        host[hostlen] = '\0';
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addrs;
+    if (getaddrinfo(host, sep + 1, &hints, &addrs) != 0) { return -1; }
+
+    int sock = -1;
+    for (struct addrinfo *a = addrs; a && (sock < 0); a = a->ai_next) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock < 0) { continue; }
+        if (connect(sock, a->ai_addr, a->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (sock >= 0) {
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return sock;
+}
+
+// Write the whole buffer to the socket.
+static bool WriteBenchSocket(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Read exactly `len` bytes from the socket.
+static bool ReadBenchSocket(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        } else if (n == 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Return the status from the `Status` header of a CGI response head, or
+// 200 if the response has none.
+static int ParseBenchStatus(const char *head, size_t len) {
+    assert(head || (len == 0));
+
+    const char *p = head;
+    const char *end = head + len;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) { eol = end; }
+        if ((eol == p) || ((eol == p + 1) && (*p == '\r'))) { break; }
+        if (((size_t)(eol - p) > 7) && (strncasecmp(p, "Status:", 7) == 0)) {
+            int status = (int)strtol(p + 7, NULL, 10);
+            return (status > 0) ? status : 200;
+        }
+        p = eol + 1;
+    }
+    return 200;
+}
+
+// Pick the next request from the mix at random by weight.
+static size_t PickBenchEntry(BenchThread *t) {
+    assert(t);
+    BenchOpts *opts = t->opts;
+
+    // xorshift64*
+    t->seed ^= t->seed >> 12;
+    t->seed ^= t->seed << 25;
+    t->seed ^= t->seed >> 27;
+    unsigned long pick = (unsigned long)((t->seed * 2685821657736338717ull) >> 32) % opts->total_weight;
+
+    for (size_t i = 0; i < opts->nentries; i++) {
+        if (pick < opts->entries[i].weight) { return i; }
+        pick -= opts->entries[i].weight;
+    }
+    return opts->nentries - 1;
+}
+
+// Record the latency of a completed request.
+static bool AddBenchSample(BenchThread *t, long long latency, size_t entry) {
+    assert(t);
+
+    if (t->nsamples == t->cap) {
+        size_t cap = (t->cap > 0) ? t->cap * 2 : BENCH_INITIAL_SAMPLES;
+        BenchSample *samples = realloc(t->samples, cap * sizeof(BenchSample));
+        if (!samples) { return false; }
+        t->samples = samples;
+        t->cap = cap;
+    }
+
+    t->samples[t->nsamples].latency = latency;
+    t->samples[t->nsamples].entry = entry;
+    t->nsamples++;
+    return true;
+}
+
+// Print throughput, latency percentiles, errors and response statuses,
+// overall and for every request in the mix.
+static void PrintBenchReport(BenchOpts *opts, BenchThread *threads, long long elapsed) {
+    assert(opts);
+    assert(threads);
+
+    size_t nsamples = 0;
+    unsigned long errors = 0;
+    for (long i = 0; i < opts->concurrency; i++) {
+        nsamples += threads[i].nsamples;
+        errors += threads[i].errors;
+    }
+
+    BenchSample *samples = malloc((nsamples + 1) * sizeof(BenchSample));
+    if (!samples) {
+        fprintf(stderr, "%s: could not allocate report\n", BENCH_EXEC);
+        return;
+    }
+    size_t n = 0;
+    for (long i = 0; i < opts->concurrency; i++) {
+        if (threads[i].nsamples == 0) { continue; }
+        memcpy(&samples[n], threads[i].samples, threads[i].nsamples * sizeof(BenchSample));
+        n += threads[i].nsamples;
+    }
+
+    double secs = (double)elapsed / 1e9;
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Requests:    %zu completed, %lu failed\n", nsamples, errors);
+    fprintf(stdout, "Duration:    %.3f s\n", secs);
+    fprintf(stdout, "Throughput:  %.1f req/s\n", (secs > 0) ? (double)nsamples / secs : 0.0);
+
+    fprintf(stdout, "Statuses:   ");
+    for (int status = 0; status < BENCH_MAX_STATUSES; status++) {
+        unsigned long count = 0;
+        for (long i = 0; i < opts->concurrency; i++) {
+            count += threads[i].statuses[status];
+        }
+        if (count > 0) { fprintf(stdout, " %d=%lu", status, count); }
+    }
+    fprintf(stdout, "\n\n");
+
+    fprintf(stdout, "%-24s %8s %6s %9s %9s %9s %9s %9s %9s\n", "Latency (ms)",
+            "count", "errors", "mean", "p50", "p90", "p99", "p99.9", "max");
+    PrintBenchLatency("all", samples, n, errors);
+
+    // Group samples by request so each can be reported on its own
+    if (opts->nentries > 1) {
+        qsort(samples, n, sizeof(BenchSample), CompareBenchEntries);
+        size_t first = 0;
+        for (size_t e = 0; e < opts->nentries; e++) {
+            size_t last = first;
+            while ((last < n) && (samples[last].entry == e)) { last++; }
+
+            unsigned long entry_errors = 0;
+            for (long i = 0; i < opts->concurrency; i++) {
+                entry_errors += threads[i].entry_errors[e];
+            }
+
+            char label[BENCH_LINE_SIZE];
+            snprintf(label, sizeof(label), "%s %s", opts->entries[e].method, opts->entries[e].uri);
+            PrintBenchLatency(label, &samples[first], last - first, entry_errors);
+            first = last;
+        }
+    }
+
+    free(samples);
+}
+
+// Print latency statistics for a set of samples, sorting them by latency.
+static void PrintBenchLatency(const char *label, BenchSample *samples, size_t n, unsigned long errors) {
+    assert(label);
+
+    if (n == 0) {
+        fprintf(stdout, "%-24.24s %8d %6lu\n", label, 0, errors);
+        return;
+    }
+
+    qsort(samples, n, sizeof(BenchSample), CompareBenchSamples);
+    long long sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += samples[i].latency;
+    }
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    double values[4];
+    for (size_t i = 0; i < 4; i++) {
+        size_t idx = (size_t)(quantiles[i] * (double)(n - 1) + 0.5);
+        values[i] = (double)samples[idx].latency / 1000.0;
+    }
+
+    fprintf(stdout, "%-24.24s %8zu %6lu %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+            label, n, errors, (double)sum / (double)n / 1000.0, values[0], values[1],
+            values[2], values[3], (double)samples[n - 1].latency / 1000.0);
+}
+
+// Order samples by latency.
+static int CompareBenchSamples(const void *a, const void *b) {
+    long long x = ((const BenchSample *)a)->latency;
+    long long y = ((const BenchSample *)b)->latency;
+    return (x > y) - (x < y);
+}
+
+// Order samples by request.
+static int CompareBenchEntries(const void *a, const void *b) {
+    size_t x = ((const BenchSample *)a)->entry;
+    size_t y = ((const BenchSample *)b)->entry;
+    return (x > y) - (x < y);
+}
+
+// Return the current monotonic time in nanoseconds.
+static long long GetBenchTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// Sleep until the given monotonic time (ns).
+static void SleepBenchUntil(long long when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(when / 1000000000);
+    ts.tv_nsec = (long)(when % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Free the request mix.
+static void FreeBenchOpts(BenchOpts *opts) {
+    assert(opts);
+
+    for (size_t i = 0; i < opts->nentries; i++) {
+        free(opts->entries[i].method);
+        free(opts->entries[i].uri);
+        free(opts->entries[i].body);
+        free(opts->entries[i].record);
+    }
+    opts->nentries = 0;
+}
@@ -0,0 +1,567 @@
+/*****************************************************************************
+ * LuaDB :: body.c
+ *
+ * Lazy HTTP request body reader.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+#include "deps/fcgi/fcgiapp.h"
+
+#include "body.h"
+#include "log.h"
+#include "sched.h"
+
+static const char *const LUADB_BODY_REGISTRY_NAME = "luadb.Body";
+static const char *const LUADB_BODY_CURRENT_KEY = "luadb.body";
+
+#define LUADB_BODY_CHUNK_SIZE 8192
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+// HTTP request body type
+//
+// The body is read from the FastCGI input stream only as far as Lua code
+// has asked for it: `read` and `lines` pull just enough to return their
+// next result, while `all` and the metamethods read the rest of it. Bytes
+// read so far are kept in `buf`, or in `file` once there are more than
+// `spill_size` of them, so the whole body can still be returned later.
+typedef struct LuaDB_RequestBody {
+    FCGX_Stream *in;
+    int fd;
+    size_t len_hint;
+    size_t spill_size;
+    char *buf;
+    size_t len;
+    size_t cap;
+    FILE *file;
+    size_t pos;
+    size_t scan;            // bytes after `pos` known to hold no newline
+    bool started;
+    bool loaded;
+    bool failed;
+    bool closed;
+} LuaDB_RequestBody;
+
+// Result of reading a single chunk of the body from the web server
+typedef enum LuaDB_BodyRead {
+    LUADB_BODY_READ_MORE,
+    LUADB_BODY_READ_DONE,
+    LUADB_BODY_READ_WAIT,
+    LUADB_BODY_READ_ERROR,
+} LuaDB_BodyRead;
+
+static int RequestBody_ToString(lua_State *L);
+static int RequestBody_Concat(lua_State *L);
+static int RequestBody_Len(lua_State *L);
+static int RequestBody_Close(lua_State *L);
+static int RequestBody_All(lua_State *L);
+static int RequestBody_Lines(lua_State *L);
+static int RequestBody_Read(lua_State *L);
+
+static int RequestBody_ToStringK(lua_State *L, int status, lua_KContext ctx);
+static int RequestBody_ConcatK(lua_State *L, int status, lua_KContext ctx);
+static int RequestBody_LenK(lua_State *L, int status, lua_KContext ctx);
+static int RequestBody_AllK(lua_State *L, int status, lua_KContext ctx);
+static int RequestBody_ReadK(lua_State *L, int status, lua_KContext ctx);
+
+static int RequestBodyLinesIter(lua_State *L);
+static int RequestBodyLinesIterK(lua_State *L, int status, lua_KContext ctx);
+static LuaDB_RequestBody *CheckRequestBody(lua_State *L, int idx);
+static inline bool HasRequestBody(LuaDB_RequestBody *body, size_t len);
+static int LoadRequestBody(lua_State *L, LuaDB_RequestBody *body, size_t len, lua_KFunction k);
+static int FindRequestBodyNewline(LuaDB_RequestBody *body, size_t *at);
+static LuaDB_BodyRead ReadRequestBodyChunk(LuaDB_RequestBody *body, size_t len, bool block);
+static bool SpillRequestBody(LuaDB_RequestBody *body);
+static bool ReserveRequestBody(LuaDB_RequestBody *body, size_t n);
+static void PushRequestBodyAll(lua_State *L, LuaDB_RequestBody *body);
+static void CloseRequestBody(LuaDB_RequestBody *body);
+static void CreateRequestBodyMetatable(lua_State *L);
+
+// Request body methods
+static luaL_Reg body_methods[] = {
+        { "__gc", RequestBody_Close },
+        { "__tostring", RequestBody_ToString },
+        { "__concat", RequestBody_Concat },
+        { "__len", RequestBody_Len },
+        { "all", RequestBody_All },
+        { "lines", RequestBody_Lines },
+        { "read", RequestBody_Read },
+        { NULL, NULL },
+};
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void LuaDB_PushRequestBody(lua_State *L, FCGX_Stream *in, int fd, size_t len_hint, size_t spill_size) {
+    assert(L);
+    assert(in);
+
+    luaL_checkstack(L, 3, "Could not allocate memory for request body");
+    LuaDB_RequestBody *body = lua_newuserdata(L, sizeof(LuaDB_RequestBody));
+    memset(body, 0, sizeof(LuaDB_RequestBody));
+    body->in = in;
+    body->fd = fd;
+    body->len_hint = len_hint;
+    body->spill_size = spill_size;
+
+    CreateRequestBodyMetatable(L);
+    lua_setmetatable(L, -2);
+
+    // Keep a reference so the body can be closed at the end of the request
+    // even if Lua code has discarded every reference to it
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_BODY_CURRENT_KEY);
+}
+
+void LuaDB_CloseRequestBody(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 2, "out of memory");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUADB_BODY_CURRENT_KEY) == LUA_TUSERDATA) {
+        CloseRequestBody(lua_touserdata(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_BODY_CURRENT_KEY);
+}
+
+/*
+ * REQUEST BODY METHODS
+ */
+
+static int RequestBody_ToString(lua_State *L) {
+    LuaDB_RequestBody *body = CheckRequestBody(L, 1);
+    if (!body->loaded) { return LoadRequestBody(L, body, SIZE_MAX, RequestBody_ToStringK); }
+    PushRequestBodyAll(L, body);
+    return 1;
+}
+
+static int RequestBody_ToStringK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBody_ToString(L);
+}
+
+// Support the string concatenation operator so routers written for bodies
+// given as strings continue to work.
+static int RequestBody_Concat(lua_State *L) {
+    luaL_checkstack(L, 2, "out of memory");
+
+    for (int i = 1; i <= 2; i++) {
+        if (luaL_testudata(L, i, LUADB_BODY_REGISTRY_NAME)) {
+            LuaDB_RequestBody *body = CheckRequestBody(L, i);
+            if (!body->loaded) { return LoadRequestBody(L, body, SIZE_MAX, RequestBody_ConcatK); }
+        }
+    }
+
+    for (int i = 1; i <= 2; i++) {
+        if (luaL_testudata(L, i, LUADB_BODY_REGISTRY_NAME)) {
+            PushRequestBodyAll(L, CheckRequestBody(L, i));
+        } else if (lua_isstring(L, i)) {
+            lua_pushvalue(L, i);
+        } else {
+            return luaL_error(L, "attempt to concatenate a %s value",
+                              luaL_typename(L, i));
+        }
+    }
+
+    lua_concat(L, 2);
+    return 1;
+}
+
+static int RequestBody_ConcatK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBody_Concat(L);
+}
+
+static int RequestBody_Len(lua_State *L) {
+    LuaDB_RequestBody *body = CheckRequestBody(L, 1);
+    if (!body->loaded) { return LoadRequestBody(L, body, SIZE_MAX, RequestBody_LenK); }
+    lua_pushinteger(L, (lua_Integer)body->len);
+    return 1;
+}
+
+static int RequestBody_LenK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBody_Len(L);
+}
+
+static int RequestBody_Close(lua_State *L) {
+    LuaDB_RequestBody *body = luaL_checkudata(L, 1, LUADB_BODY_REGISTRY_NAME);
+    CloseRequestBody(body);
+    return 0;
+}
+
+// Return the entire request body as a string, regardless of how much of
+// it has already been read using `read` or `lines`.
+static int RequestBody_All(lua_State *L) {
+    LuaDB_RequestBody *body = CheckRequestBody(L, 1);
+    if (!body->loaded) { return LoadRequestBody(L, body, SIZE_MAX, RequestBody_AllK); }
+    PushRequestBodyAll(L, body);
+    return 1;
+}
+
+static int RequestBody_AllK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBody_All(L);
+}
+
+// Return an iterator over each line in the request body. Lines are read
+// starting from the current read position and do not include the
+// trailing newline.
+static int RequestBody_Lines(lua_State *L) {
+    CheckRequestBody(L, 1);
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, RequestBodyLinesIter, 1);
+    return 1;
+}
+
+// Read up to `n` bytes from the current read position in the request
+// body. Only as much of the body as is needed is read from the web
+// server. Returns nil once the entire body has been read.
+static int RequestBody_Read(lua_State *L) {
+    LuaDB_RequestBody *body = CheckRequestBody(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n > 0, 2, "must be a positive integer");
+    size_t end = ((lua_Unsigned)n < (SIZE_MAX - body->pos)) ? body->pos + (size_t)n : SIZE_MAX;
+    if (!HasRequestBody(body, end)) { return LoadRequestBody(L, body, end, RequestBody_ReadK); }
+
+    if (body->pos >= body->len) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t remain = body->len - body->pos;
+    size_t want = ((lua_Unsigned)n < remain) ? (size_t)n : remain;
+    if (!body->file) {
+        lua_pushlstring(L, &body->buf[body->pos], want);
+        body->pos += want;
+        body->scan = 0;
+        return 1;
+    }
+
+    luaL_Buffer b;
+    char *dst = luaL_buffinitsize(L, &b, want);
+    if (fseek(body->file, (long)body->pos, SEEK_SET) != 0) {
+        return luaL_error(L, "could not read request body");
+    }
+    size_t got = fread(dst, 1, want, body->file);
+    body->pos += got;
+    body->scan = 0;
+    luaL_pushresultsize(&b, got);
+    return 1;
+}
+
+static int RequestBody_ReadK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBody_Read(L);
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Iterator function returned by `lines`. The body is read from the web
+// server only until the end of the next line has arrived.
+static int RequestBodyLinesIter(lua_State *L) {
+    LuaDB_RequestBody *body = CheckRequestBody(L, lua_upvalueindex(1));
+
+    size_t nl;
+    int found = FindRequestBodyNewline(body, &nl);
+    if (found < 0) {
+        return luaL_error(L, "could not read request body");
+    } else if ((found == 0) && !body->loaded) {
+        return LoadRequestBody(L, body, body->len + 1, RequestBodyLinesIterK);
+    }
+
+    if (body->pos >= body->len) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t linelen = ((found) ? nl : body->len) - body->pos;
+    if (!body->file) {
+        lua_pushlstring(L, &body->buf[body->pos], linelen);
+    } else {
+        luaL_Buffer b;
+        char *dst = luaL_buffinitsize(L, &b, linelen);
+        if (fseek(body->file, (long)body->pos, SEEK_SET) != 0) {
+            return luaL_error(L, "could not read request body");
+        }
+        size_t got = fread(dst, 1, linelen, body->file);
+        luaL_pushresultsize(&b, got);
+    }
+
+    body->pos += (found) ? linelen + 1 : linelen;
+    body->scan = 0;
+    return 1;
+}
+
+static int RequestBodyLinesIterK(lua_State *L, int status, lua_KContext ctx) {
+    return RequestBodyLinesIter(L);
+}
+
+// Check that the value at the given index is a usable request body.
+// Callers must load as much of the body as they need with
+// `LoadRequestBody` if it has not been read from the web server yet.
+static LuaDB_RequestBody *CheckRequestBody(lua_State *L, int idx) {
+    LuaDB_RequestBody *body = luaL_checkudata(L, idx, LUADB_BODY_REGISTRY_NAME);
+    if (body->closed) {
+        luaL_error(L, "request body is no longer available");
+        return NULL;
+    }
+
+    if (body->failed) {
+        luaL_error(L, "could not read request body");
+        return NULL;
+    }
+
+    return body;
+}
+
+// Return true if the first `len` bytes of the body have been read, or the
+// entire body has been read if it is shorter than that.
+static inline bool HasRequestBody(LuaDB_RequestBody *body, size_t len) {
+    return body->loaded || (body->len >= len);
+}
+
+// Read the body from the FastCGI input stream until at least `len` bytes
+// of it have been read (SIZE_MAX for the entire body), then finish the
+// calling method by calling `k`.
+//
+// When called from a request coroutine, the coroutine yields back to the
+// scheduler whenever those bytes have not arrived yet, so other requests
+// can be served in the meantime. Otherwise, the calling thread blocks
+// until they have been read.
+static int LoadRequestBody(lua_State *L, LuaDB_RequestBody *body, size_t len, lua_KFunction k) {
+    assert(L);
+    assert(body);
+
+    if (!body->started) {
+        body->started = true;
+        if ((body->len_hint > body->spill_size) && !SpillRequestBody(body)) {
+            body->failed = true;
+            return luaL_error(L, "could not read request body");
+        }
+    }
+
+    bool block = !LuaDB_SchedCanYield(L);
+    while (true) {
+        if (HasRequestBody(body, len)) {
+            return k(L, LUA_OK, 0);
+        }
+
+        switch (ReadRequestBodyChunk(body, len, block)) {
+            case LUADB_BODY_READ_MORE:
+                break;
+            case LUADB_BODY_READ_DONE:
+                body->loaded = true;
+                body->in = NULL;
+                break;
+            case LUADB_BODY_READ_WAIT:
+                return LuaDB_SchedYield(L, body->fd, POLLIN, -1, 0, k);
+            case LUADB_BODY_READ_ERROR:
+                body->failed = true;
+                return luaL_error(L, "could not read request body");
+        }
+    }
+}
+
+// Read the next chunk of the body from the FastCGI input stream, reading
+// no further than is needed to have `len` bytes of it. Unless `block` is
+// true, only data which has already arrived is read.
+static LuaDB_BodyRead ReadRequestBodyChunk(LuaDB_RequestBody *body, size_t len, bool block) {
+    assert(body);
+    assert(len > body->len);
+
+    int want = LUADB_BODY_CHUNK_SIZE;
+    if ((len - body->len) < (size_t)want) {
+        want = (int)(len - body->len);
+    }
+    if (!block) {
+        int avail = (int)(body->in->stop - body->in->rdNext);
+        if (avail <= 0) {
+            // Only refill the stream buffer if it already holds the next
+            // record or the socket has data waiting
+            struct pollfd pfd = { body->fd, POLLIN, 0 };
+            if (!body->in->isClosed && (body->fd >= 0) &&
+                !FCGX_HasBufferedInput(body->in) && (poll(&pfd, 1, 0) == 0)) {
+                return LUADB_BODY_READ_WAIT;
+            }
+            want = 1;
+        } else if (avail < want) {
+            want = avail;
+        }
+    }
+
+    char chunk[LUADB_BODY_CHUNK_SIZE];
+    char *dst = chunk;
+    if (!body->file) {
+        if (!ReserveRequestBody(body, LUADB_BODY_CHUNK_SIZE)) { return LUADB_BODY_READ_ERROR; }
+        dst = &body->buf[body->len];
+    }
+
+    int n = FCGX_GetStr(dst, want, body->in);
+    if (n <= 0) { return LUADB_BODY_READ_DONE; }
+
+    if (body->file) {
+        // Reads may have moved the file position since the last write
+        if ((fseek(body->file, 0, SEEK_END) != 0) ||
+            (fwrite(dst, 1, (size_t)n, body->file) != (size_t)n)) {
+            syslog(LOG_ERR, "Could not write request body to temporary file.");
+            return LUADB_BODY_READ_ERROR;
+        }
+        body->len += (size_t)n;
+    } else {
+        body->len += (size_t)n;
+        if ((body->len > body->spill_size) && !SpillRequestBody(body)) {
+            return LUADB_BODY_READ_ERROR;
+        }
+    }
+
+    return LUADB_BODY_READ_MORE;
+}
+
+// Find the first newline at or after the current read position among the
+// bytes read so far, setting `at` to its offset. Returns 1 if a newline
+// was found, 0 if not and -1 if the body could not be read. Bytes already
+// searched are remembered, so lines arriving slowly are not searched again
+// each time more of the body arrives.
+static int FindRequestBodyNewline(LuaDB_RequestBody *body, size_t *at) {
+    assert(body);
+    assert(at);
+
+    size_t from = body->pos + body->scan;
+    if (from >= body->len) {
+        return 0;
+    }
+
+    if (!body->file) {
+        const char *nl = memchr(&body->buf[from], '\n', body->len - from);
+        if (nl) {
+            *at = (size_t)(nl - body->buf);
+            return 1;
+        }
+        body->scan = body->len - body->pos;
+        return 0;
+    }
+
+    if (fseek(body->file, (long)from, SEEK_SET) != 0) {
+        return -1;
+    }
+    for (size_t i = from; i < body->len; i++) {
+        int c = getc(body->file);
+        if (c == EOF) {
+            return -1;
+        } else if (c == '\n') {
+            *at = i;
+            return 1;
+        }
+    }
+    body->scan = body->len - body->pos;
+    return 0;
+}
+
+// Move the body read so far into a temporary file.
+static bool SpillRequestBody(LuaDB_RequestBody *body) {
+    assert(body);
+
+    body->file = tmpfile();
+    if (!body->file) {
+        syslog(LOG_ERR, "Could not create temporary file for request body.");
+        return false;
+    }
+
+    if (body->len > 0 &&
+        fwrite(body->buf, 1, body->len, body->file) != body->len) {
+        syslog(LOG_ERR, "Could not write request body to temporary file.");
+        return false;
+    }
+
+    free(body->buf);
+    body->buf = NULL;
+    body->cap = 0;
+    return true;
+}
+
+// Ensure there is room for `n` more bytes in the in-memory body buffer.
+static bool ReserveRequestBody(LuaDB_RequestBody *body, size_t n) {
+    assert(body);
+
+    if ((body->cap - body->len) >= n) { return true; }
+
+    size_t cap = (body->cap > 0) ? body->cap : LUADB_BODY_CHUNK_SIZE;
+    if ((body->len_hint > cap) && (body->len_hint <= body->spill_size)) {
+        cap = body->len_hint;
+    }
+    while ((cap - body->len) < n) {
+        cap *= 2;
+    }
+
+    char *buf = realloc(body->buf, cap);
+    if (!buf) { return false; }
+    body->buf = buf;
+    body->cap = cap;
+    return true;
+}
+
+// Push the entire body onto the stack as a string.
+static void PushRequestBodyAll(lua_State *L, LuaDB_RequestBody *body) {
+    assert(L);
+    assert(body);
+
+    if (!body->file) {
+        lua_pushlstring(L, (body->buf) ? body->buf : "", body->len);
+        return;
+    }
+
+    luaL_Buffer b;
+    char *dst = luaL_buffinitsize(L, &b, body->len);
+    rewind(body->file);
+    size_t got = fread(dst, 1, body->len, body->file);
+    luaL_pushresultsize(&b, got);
+}
+
+// Release the memory or temporary file holding the body.
+static void CloseRequestBody(LuaDB_RequestBody *body) {
+    assert(body);
+
+    free(body->buf);
+    body->buf = NULL;
+    if (body->file) {
+        fclose(body->file);
+        body->file = NULL;
+    }
+    body->in = NULL;
+    body->len = 0;
+    body->cap = 0;
+    body->closed = true;
+}
+
+// Push the metatable for request body objects, creating it on first use.
+static void CreateRequestBodyMetatable(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 3, "out of memory");
+    if (!luaL_newmetatable(L, LUADB_BODY_REGISTRY_NAME)) { return; }
+
+    // Set the metatable as it's own index
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    // Attach the methods to this table
+    luaL_setfuncs(L, body_methods, 0);
+}
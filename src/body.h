@@ -0,0 +1,48 @@
+/*****************************************************************************
+ * LuaDB :: body.h
+ *
+ * Lazy HTTP request body reader.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_BODY_H
+#define LUADB_BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deps/lua/lua.h"
+#include "deps/fcgi/fcgiapp.h"
+
+/**
+ * @brief Push a new request body object reading from the given FastCGI
+ * input stream onto the stack.
+ *
+ * Nothing is read from the stream until the body is first accessed from
+ * Lua, and then only as much as the method called needs. Once more than
+ * @c spill_size bytes have been read, the body is copied into a temporary
+ * file rather than kept in memory.
+ *
+ * @param L the Lua state
+ * @param in the FastCGI request input stream
+ * @param fd the connection the input stream reads from; request
+ *        coroutines waiting for the body yield until it is readable
+ * @param len_hint the expected body length (e.g. from CONTENT_LENGTH); 0
+ *        if the length is unknown
+ * @param spill_size the largest body size in bytes kept in memory
+ */
+void LuaDB_PushRequestBody(lua_State *L, FCGX_Stream *in, int fd, size_t len_hint, size_t spill_size);
+
+/**
+ * @brief Close the request body object most recently pushed into the
+ * given state. The body object is invalidated and any memory or temporary
+ * file holding the body is released. Lua code holding a reference to the
+ * body object past the end of the request will receive an error if it
+ * tries to read from it.
+ */
+void LuaDB_CloseRequestBody(lua_State *L);
+
+#endif //LUADB_BODY_H
@@ -0,0 +1,462 @@
+/*****************************************************************************
+ * LuaDB :: cache.c
+ *
+ * In-process HTTP response cache.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deps/fcgi/fcgiapp.h"
+
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+#include "sched.h"
+
+#define LUADB_CACHE_KEY_SIZE 512
+#define LUADB_CACHE_HEADER_SIZE 128
+
+// Hash buckets per byte of cache, bounded to a sensible range
+static const size_t LUADB_CACHE_BUCKET_BYTES = 4096;
+static const size_t LUADB_CACHE_MIN_BUCKETS = 64;
+static const size_t LUADB_CACHE_MAX_BUCKETS = 65536;
+
+// A single cached response. The request key, the values of the headers
+// the response varies on and the response itself are stored after the
+// entry in a single allocation. Entries being sent are referenced, so
+// they are only freed once evicted and no longer being sent.
+typedef struct LuaDB_CacheEntry {
+    struct LuaDB_CacheEntry *chain;     // next entry in the same bucket
+    struct LuaDB_CacheEntry *newer;     // more recently used entry
+    struct LuaDB_CacheEntry *older;     // less recently used entry
+    uint32_t hash;
+    long long expires;
+    size_t size;
+    size_t keylen;
+    size_t varylen;                     // header name and value pairs
+    size_t resplen;
+    int refs;
+    bool evicted;
+    char etag[LUADB_CACHE_ETAG_SIZE];
+    char data[];
+} LuaDB_CacheEntry;
+
+typedef struct LuaDB_Cache {
+    pthread_mutex_t lock;
+    LuaDB_CacheEntry **buckets;
+    size_t nbuckets;
+    LuaDB_CacheEntry *newest;
+    LuaDB_CacheEntry *oldest;
+    size_t size;
+    size_t max_size;
+    LuaDB_EnvConfig *config;
+} LuaDB_Cache;
+
+static LuaDB_Cache *cache = NULL;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static char *GetCacheKey(char **envp, char *buf, size_t size, size_t *len);
+static uint32_t HashCacheKey(const char *key, size_t len);
+static size_t GetCacheVary(char **envp, const char *vary, char *buf, size_t size);
+static const char *GetCacheHeader(char **envp, const char *name, size_t len);
+static bool IsCacheVaryMatch(LuaDB_CacheEntry *e, char **envp);
+static LuaDB_CacheEntry *FindCacheEntry(const char *key, size_t keylen, uint32_t hash, char **envp);
+static void UseCacheEntry(LuaDB_CacheEntry *e);
+static void EvictCacheEntry(LuaDB_CacheEntry *e);
+static void FreeCacheKey(char *key, char *buf);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+bool LuaDB_CacheInit(LuaDB_EnvConfig *config) {
+    assert(config);
+    if (cache || (config->cache_max_size <= 0)) { return true; }
+
+    cache = calloc(1, sizeof(LuaDB_Cache));
+    if (!cache) {
+        syslog(LOG_ERR, "Could not allocate memory for response cache.");
+        return false;
+    }
+
+    cache->max_size = (size_t)config->cache_max_size;
+    cache->config = config;
+    cache->nbuckets = LUADB_CACHE_MIN_BUCKETS;
+    while ((cache->nbuckets < LUADB_CACHE_MAX_BUCKETS) &&
+           (cache->nbuckets * LUADB_CACHE_BUCKET_BYTES < cache->max_size)) {
+        cache->nbuckets *= 2;
+    }
+
+    cache->buckets = calloc(cache->nbuckets, sizeof(LuaDB_CacheEntry *));
+    if (!cache->buckets || (pthread_mutex_init(&cache->lock, NULL) != 0)) {
+        syslog(LOG_ERR, "Could not allocate memory for response cache.");
+        free(cache->buckets);
+        free(cache);
+        cache = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void LuaDB_CacheClose(void) {
+    if (!cache) { return; }
+
+    LuaDB_CacheEntry *e = cache->newest;
+    while (e) {
+        LuaDB_CacheEntry *older = e->older;
+        free(e);
+        e = older;
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+    cache = NULL;
+}
+
+bool LuaDB_CacheIsCacheable(char **envp) {
+    if (!cache) { return false; }
+
+    const char *method = FCGX_GetParam("REQUEST_METHOD", envp);
+    return method && ((strcmp(method, "GET") == 0) || (strcmp(method, "HEAD") == 0));
+}
+
+int LuaDB_CacheServe(FCGX_Request *req) {
+    assert(req);
+    if (!LuaDB_CacheIsCacheable(req->envp)) { return 0; }
+
+    char buf[LUADB_CACHE_KEY_SIZE];
+    size_t keylen;
+    char *key = GetCacheKey(req->envp, buf, sizeof(buf), &keylen);
+    if (!key) { return 0; }
+    uint32_t hash = HashCacheKey(key, keylen);
+
+    // Hold a reference while sending so the entry outlives any eviction
+    pthread_mutex_lock(&cache->lock);
+    LuaDB_CacheEntry *e = FindCacheEntry(key, keylen, hash, req->envp);
+    if (e) {
+        UseCacheEntry(e);
+        e->refs++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    FreeCacheKey(key, buf);
+    if (!e) { return 0; }
+
+    int status = 200;
+    if (LuaDB_CacheIsNotModified(req->envp, e->etag)) {
+        char head[LUADB_CACHE_HEADER_SIZE];
+        int len = snprintf(head, sizeof(head), "Status: 304 Not Modified\r\nETag: %s\r\n\r\n", e->etag);
+        FCGX_PutStr(head, len, req->out);
+        status = 304;
+    } else {
+        const char *resp = &e->data[e->keylen + e->varylen];
+        FCGX_PutStr(resp, (int)e->resplen, req->out);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    e->refs--;
+    if (e->evicted && (e->refs == 0)) { free(e); }
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+void LuaDB_CacheStore(char **envp, long long ttl, const char *vary, const char *etag,
+                      const char *head, size_t headlen, const char *body, size_t bodylen) {
+    assert(etag);
+    assert(head);
+    assert(body || (bodylen == 0));
+    if (!LuaDB_CacheIsCacheable(envp) || (ttl <= 0)) { return; }
+
+    char buf[LUADB_CACHE_KEY_SIZE];
+    size_t keylen;
+    char *key = GetCacheKey(envp, buf, sizeof(buf), &keylen);
+    if (!key) { return; }
+
+    size_t varylen = (vary) ? GetCacheVary(envp, vary, NULL, 0) : 0;
+    size_t resplen = headlen + 2 + bodylen;
+    size_t size = sizeof(LuaDB_CacheEntry) + keylen + varylen + resplen;
+    if ((size > cache->max_size) || (resplen > INT32_MAX)) {
+        FreeCacheKey(key, buf);
+        return;
+    }
+
+    LuaDB_CacheEntry *e = malloc(size);
+    if (!e) {
+        syslog(LOG_WARNING, "Could not allocate memory to cache response.");
+        FreeCacheKey(key, buf);
+        return;
+    }
+
+    memset(e, 0, sizeof(LuaDB_CacheEntry));
+    e->hash = HashCacheKey(key, keylen);
+    e->expires = LuaDB_SchedNow() + ttl;
+    e->size = size;
+    e->keylen = keylen;
+    e->varylen = varylen;
+    e->resplen = resplen;
+    strncpy(e->etag, etag, LUADB_CACHE_ETAG_SIZE - 1);
+
+    char *data = e->data;
+    memcpy(data, key, keylen);
+    if (vary) { GetCacheVary(envp, vary, &data[keylen], varylen); }
+    data += keylen + varylen;
+    memcpy(data, head, headlen);
+    memcpy(data + headlen, "\r\n", 2);
+    if (bodylen > 0) { memcpy(data + headlen + 2, body, bodylen); }
+    FreeCacheKey(key, buf);
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Replace the response cached for the same request
+    LuaDB_CacheEntry *prev = FindCacheEntry(e->data, keylen, e->hash, envp);
+    if (prev) { EvictCacheEntry(prev); }
+
+    size_t bucket = e->hash % cache->nbuckets;
+    e->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    e->older = cache->newest;
+    if (cache->newest) { cache->newest->newer = e; }
+    cache->newest = e;
+    if (!cache->oldest) { cache->oldest = e; }
+    cache->size += size;
+
+    while (cache->size > cache->max_size) {
+        EvictCacheEntry(cache->oldest);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void LuaDB_CacheETag(const char *body, size_t len, char etag[LUADB_CACHE_ETAG_SIZE]) {
+    assert(body || (len == 0));
+    assert(etag);
+
+    // FNV-1a hash of the body
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)body[i]) * 1099511628211u;
+    }
+    snprintf(etag, LUADB_CACHE_ETAG_SIZE, "\"%016llx\"", (unsigned long long)hash);
+}
+
+bool LuaDB_CacheIsNotModified(char **envp, const char *etag) {
+    assert(etag);
+    if (!cache) { return false; }
+
+    const char *match = GetCacheHeader(envp, "If-None-Match", 13);
+    if (!match) { return false; }
+
+    // The header is "*" or a comma separated list of entity tags, which
+    // are compared ignoring any weak validator prefix
+    size_t len = strlen(etag);
+    const char *c = match;
+    while (*c) {
+        while ((*c == ' ') || (*c == '\t') || (*c == ',')) { c++; }
+        const char *start = c;
+        while (*c && (*c != ',')) { c++; }
+        const char *end = c;
+        while ((end > start) && ((end[-1] == ' ') || (end[-1] == '\t'))) { end--; }
+
+        if ((end - start == 1) && (*start == '*')) { return true; }
+        if ((end - start > 2) && (strncmp(start, "W/", 2) == 0)) { start += 2; }
+        if (((size_t)(end - start) == len) && (strncmp(start, etag, len) == 0)) { return true; }
+    }
+
+    return false;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Build the cache key (method, document URI and query string) for the
+// request in `buf`, or on the heap if it does not fit. Returns NULL if
+// memory could not be allocated.
+static char *GetCacheKey(char **envp, char *buf, size_t size, size_t *len) {
+    assert(buf);
+    assert(len);
+
+    const char *method = FCGX_GetParam("REQUEST_METHOD", envp);
+    const char *uri = FCGX_GetParam("DOCUMENT_URI", envp);
+    const char *query = FCGX_GetParam(cache->config->fcgi_query.val, envp);
+    if (!method) { method = ""; }
+    if (!uri) { uri = ""; }
+    if (!query) { query = ""; }
+
+    size_t mlen = strlen(method);
+    size_t ulen = strlen(uri);
+    size_t qlen = strlen(query);
+    *len = mlen + 1 + ulen + 1 + qlen;
+
+    char *key = buf;
+    if (*len > size) {
+        key = malloc(*len);
+        if (!key) { return NULL; }
+    }
+
+    memcpy(key, method, mlen);
+    key[mlen] = ' ';
+    memcpy(&key[mlen + 1], uri, ulen);
+    key[mlen + 1 + ulen] = '?';
+    memcpy(&key[mlen + 2 + ulen], query, qlen);
+    return key;
+}
+
+// Free a cache key allocated on the heap by `GetCacheKey`.
+static void FreeCacheKey(char *key, char *buf) {
+    if (key != buf) { free(key); }
+}
+
+// FNV-1a hash of a cache key.
+static uint32_t HashCacheKey(const char *key, size_t len) {
+    assert(key);
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Write the name and value of each request header named in the comma
+// separated `vary` list to `buf`, each terminated by a NUL. Headers the
+// request did not send have an empty value. Returns the number of bytes
+// needed; nothing is written if `buf` is NULL.
+static size_t GetCacheVary(char **envp, const char *vary, char *buf, size_t size) {
+    assert(vary);
+
+    size_t len = 0;
+    const char *c = vary;
+    while (*c) {
+        while ((*c == ' ') || (*c == '\t') || (*c == ',')) { c++; }
+        const char *start = c;
+        while (*c && (*c != ',') && (*c != ' ') && (*c != '\t')) { c++; }
+        size_t namelen = (size_t)(c - start);
+        if (namelen == 0) { continue; }
+
+        const char *value = GetCacheHeader(envp, start, namelen);
+        if (!value) { value = ""; }
+        size_t valuelen = strlen(value);
+
+        if (buf && (len + namelen + valuelen + 2 <= size)) {
+            memcpy(&buf[len], start, namelen);
+            buf[len + namelen] = '\0';
+            memcpy(&buf[len + namelen + 1], value, valuelen + 1);
+        }
+        len += namelen + valuelen + 2;
+    }
+
+    return len;
+}
+
+// Return the value of the named request header, or NULL if the request
+// did not send it. Headers are passed by the web server as parameters
+// with the configured prefix, upper-cased and with dashes replaced by
+// underscores.
+static const char *GetCacheHeader(char **envp, const char *name, size_t len) {
+    assert(name);
+
+    char param[LUADB_CACHE_HEADER_SIZE];
+    LuaDB_Setting *pfx = &cache->config->fcgi_header_prefix;
+    if (pfx->len + len >= sizeof(param)) { return NULL; }
+
+    memcpy(param, pfx->val, pfx->len);
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        param[pfx->len + i] = (c == '-') ? '_' : (char)toupper((unsigned char)c);
+    }
+    param[pfx->len + len] = '\0';
+    return FCGX_GetParam(param, envp);
+}
+
+// Return true if the request sent the same values for the headers the
+// cached response varies on as the request it was cached for.
+static bool IsCacheVaryMatch(LuaDB_CacheEntry *e, char **envp) {
+    assert(e);
+
+    const char *c = &e->data[e->keylen];
+    const char *end = c + e->varylen;
+    while (c < end) {
+        const char *name = c;
+        size_t namelen = strlen(name);
+        const char *value = name + namelen + 1;
+        const char *actual = GetCacheHeader(envp, name, namelen);
+        if (strcmp(value, (actual) ? actual : "") != 0) { return false; }
+        c = value + strlen(value) + 1;
+    }
+
+    return true;
+}
+
+// Find the fresh cached response for the request, evicting any expired
+// response found along the way. Must be called with the cache locked.
+static LuaDB_CacheEntry *FindCacheEntry(const char *key, size_t keylen, uint32_t hash, char **envp) {
+    assert(key);
+
+    long long now = LuaDB_SchedNow();
+    LuaDB_CacheEntry *e = cache->buckets[hash % cache->nbuckets];
+    while (e) {
+        LuaDB_CacheEntry *chain = e->chain;
+        if (e->expires <= now) {
+            EvictCacheEntry(e);
+        } else if ((e->hash == hash) && (e->keylen == keylen) &&
+                   (memcmp(e->data, key, keylen) == 0) && IsCacheVaryMatch(e, envp)) {
+            return e;
+        }
+        e = chain;
+    }
+
+    return NULL;
+}
+
+// Move the entry to the front of the least recently used list. Must be
+// called with the cache locked.
+static void UseCacheEntry(LuaDB_CacheEntry *e) {
+    assert(e);
+    if (cache->newest == e) { return; }
+
+    // Unlink the entry; it is not the newest, so it has a newer entry
+    e->newer->older = e->older;
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        cache->oldest = e->newer;
+    }
+
+    e->newer = NULL;
+    e->older = cache->newest;
+    cache->newest->newer = e;
+    cache->newest = e;
+}
+
+// Remove the entry from the cache, freeing it unless it is still being
+// sent. Must be called with the cache locked.
+static void EvictCacheEntry(LuaDB_CacheEntry *e) {
+    assert(e);
+
+    LuaDB_CacheEntry **link = &cache->buckets[e->hash % cache->nbuckets];
+    while (*link != e) { link = &(*link)->chain; }
+    *link = e->chain;
+
+    if (e->newer) { e->newer->older = e->older; } else { cache->newest = e->older; }
+    if (e->older) { e->older->newer = e->newer; } else { cache->oldest = e->newer; }
+    cache->size -= e->size;
+
+    e->evicted = true;
+    if (e->refs == 0) { free(e); }
+}
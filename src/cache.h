@@ -0,0 +1,90 @@
+/*****************************************************************************
+ * LuaDB :: cache.h
+ *
+ * In-process HTTP response cache.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_CACHE_H
+#define LUADB_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deps/fcgi/fcgiapp.h"
+
+#include "config.h"
+
+// Quoted 64-bit hash in hex and a terminating NUL
+#define LUADB_CACHE_ETAG_SIZE 19
+
+/**
+ * @brief Create the response cache. The cache is shared by every thread
+ * in the process; each worker process keeps its own. Responses are kept
+ * until they expire or the least recently used responses must be evicted
+ * to stay within @c config->cache_max_size bytes.
+ *
+ * @param config the environment configuration, which must outlive the
+ *               cache
+ * @returns true if the cache could be created or is disabled
+ */
+bool LuaDB_CacheInit(LuaDB_EnvConfig *config);
+
+/**
+ * @brief Free every cached response and the cache itself.
+ */
+void LuaDB_CacheClose(void);
+
+/**
+ * @brief Return true if responses may be cached for the given request.
+ * Only GET and HEAD requests are cached.
+ */
+bool LuaDB_CacheIsCacheable(char **envp);
+
+/**
+ * @brief Answer the given request from the cache if a fresh response is
+ * cached for it. Requests whose @c If-None-Match header matches the
+ * cached entity tag are answered with 304 Not Modified.
+ *
+ * @param req the request to answer
+ * @returns the status sent, or 0 if no response was cached
+ */
+int LuaDB_CacheServe(FCGX_Request *req);
+
+/**
+ * @brief Add a response to the cache, replacing any response cached for
+ * the same request.
+ *
+ * @param envp the request parameters the response was produced for
+ * @param ttl the time in milliseconds the response stays fresh
+ * @param vary a comma separated list of request headers whose values
+ *             distinguish responses for the same URI, or NULL
+ * @param etag the entity tag of the response from @c LuaDB_CacheETag
+ * @param head the response status and headers, without the blank line
+ *             which ends them
+ * @param headlen the length of @c head
+ * @param body the response body
+ * @param bodylen the length of @c body
+ */
+void LuaDB_CacheStore(char **envp, long long ttl, const char *vary, const char *etag,
+                      const char *head, size_t headlen, const char *body, size_t bodylen);
+
+/**
+ * @brief Compute the entity tag for a response body.
+ *
+ * @param body the response body
+ * @param len the length of @c body
+ * @param etag receives the quoted entity tag
+ */
+void LuaDB_CacheETag(const char *body, size_t len, char etag[LUADB_CACHE_ETAG_SIZE]);
+
+/**
+ * @brief Return true if the @c If-None-Match header of the given request
+ * matches the entity tag.
+ */
+bool LuaDB_CacheIsNotModified(char **envp, const char *etag);
+
+#endif //LUADB_CACHE_H
@@ -39,12 +39,26 @@ typedef struct DefaultConfig {
     ConfigValidateFunc validate;
 } DefaultConfig;
 
+// Default settings for the default database environment
+static const long LUADB_DEFAULT_DB_MAP_SIZE = 10485760;
+static const long LUADB_DEFAULT_DB_MAX_READERS = 126;
+
+// Default integer configuration value details
+typedef struct DefaultIntConfig {
+    const char *name;
+    size_t len;
+    long val;
+    int offset;
+} DefaultIntConfig;
+
 /*
  * FORWARD DECLARATIONS
  */
 
 static bool LoadConfigFromLua(lua_State *L, LuaDB_EnvConfig *config);
 static inline void LoadConfigSetting(lua_State *L, LuaDB_EnvConfig *config, DefaultConfig *def);
+static inline void LoadIntConfigSetting(lua_State *L, LuaDB_EnvConfig *config, DefaultIntConfig *def);
+static void LoadDbConfig(lua_State *L, LuaDB_EnvConfig *config);
 static inline void ApplyDefaultConfig(LuaDB_EnvConfig *config, LuaDB_Setting *s, DefaultConfig *def);
 static inline char *FormatRouter(LuaDB_EnvConfig *config, const char *val, size_t len);
 
@@ -56,6 +70,34 @@ static DefaultConfig default_cfg[] = {
         { "router", 6,  "reqhandler.lua", offsetof(LuaDB_EnvConfig, router), &FormatRouter, NULL },
         { "fcgi_query", 10, "QUERY_STRING", offsetof(LuaDB_EnvConfig, fcgi_query), NULL, NULL },
         { "fcgi_header_prefix", 18, "HTTP_", offsetof(LuaDB_EnvConfig, fcgi_header_prefix), NULL, NULL },
+        { "metrics_path", 12, "", offsetof(LuaDB_EnvConfig, metrics_path), NULL, NULL },
+        { "profile_output", 14, "", offsetof(LuaDB_EnvConfig, profile_output), NULL, NULL },
+};
+
+// Integer settings; negative values given by users are replaced by defaults.
+static DefaultIntConfig default_int_cfg[] = {
+        { "pool_size", 9, 4, offsetof(LuaDB_EnvConfig, pool_size) },
+        { "pool_max_requests", 17, 1000, offsetof(LuaDB_EnvConfig, pool_max_requests) },
+        { "pool_max_memory", 15, 67108864, offsetof(LuaDB_EnvConfig, pool_max_memory) },
+        { "router_check_interval", 21, 1, offsetof(LuaDB_EnvConfig, router_check_interval) },
+        { "threads", 7, 1, offsetof(LuaDB_EnvConfig, threads) },
+        { "workers", 7, 0, offsetof(LuaDB_EnvConfig, workers) },
+        { "body_spill_size", 15, 1048576, offsetof(LuaDB_EnvConfig, body_spill_size) },
+        { "request_timeout", 15, 30000, offsetof(LuaDB_EnvConfig, request_timeout) },
+        { "request_max_instructions", 24, 0, offsetof(LuaDB_EnvConfig, request_max_instructions) },
+        { "pool_arena", 10, 0, offsetof(LuaDB_EnvConfig, pool_arena) },
+        { "request_max_memory", 18, 0, offsetof(LuaDB_EnvConfig, request_max_memory) },
+        { "state_max_memory", 16, 0, offsetof(LuaDB_EnvConfig, state_max_memory) },
+        { "metrics_max_series", 18, 512, offsetof(LuaDB_EnvConfig, metrics_max_series) },
+        { "trace_sample_rate", 17, 0, offsetof(LuaDB_EnvConfig, trace_sample_rate) },
+        { "trace_header", 12, 0, offsetof(LuaDB_EnvConfig, trace_header) },
+        { "profile_enabled", 15, 0, offsetof(LuaDB_EnvConfig, profile_enabled) },
+        { "profile_interval", 16, 10000, offsetof(LuaDB_EnvConfig, profile_interval) },
+        { "listen_backlog", 14, 128, offsetof(LuaDB_EnvConfig, listen_backlog) },
+        { "queue_size", 10, 0, offsetof(LuaDB_EnvConfig, queue_size) },
+        { "queue_timeout", 13, 1000, offsetof(LuaDB_EnvConfig, queue_timeout) },
+        { "keepalive_timeout", 17, 60000, offsetof(LuaDB_EnvConfig, keepalive_timeout) },
+        { "cache_max_size", 14, 16777216, offsetof(LuaDB_EnvConfig, cache_max_size) },
 };
 
 /*
@@ -72,17 +114,24 @@ bool LuaDB_ReadEnvironmentConfig(LuaDB_EnvConfig *config) {
         return false;
     }
 
+    bool ok = LuaDB_ReadEnvironmentConfigFile(config, cfgfile);
+    free(cfgfile);
+    return ok;
+}
+
+bool LuaDB_ReadEnvironmentConfigFile(LuaDB_EnvConfig *config, const char *path) {
+    assert(config);
+    assert(path);
+
     // Spawn a quick Lua state to read the file
     lua_State *L = LuaDB_NewState();
     if (!L) {
-        free(cfgfile);
         return false;
     }
 
     // Read in our configuration file
-    int err = luaL_dofile(L, cfgfile);
+    int err = luaL_dofile(L, path);
     if (err) {
-        free(cfgfile);
         lua_close(L);
         return false;
     }
@@ -103,6 +152,11 @@ void LuaDB_CleanEnvironmentConfig(LuaDB_EnvConfig *config) {
     free(config->root.val);
     free(config->router.val);
     free(config->fcgi_query.val);
+    free(config->fcgi_header_prefix.val);
+    free(config->metrics_path.val);
+    free(config->profile_output.val);
+    free(config->db_path.val);
+    free(config->db_flags.val);
 }
 
 /*
@@ -119,6 +173,12 @@ static bool LoadConfigFromLua(lua_State *L, LuaDB_EnvConfig *config) {
         LoadConfigSetting(L, config, &default_cfg[i]);
     }
 
+    len = sizeof(default_int_cfg) / sizeof(default_int_cfg[0]);
+    for (size_t i = 0; i < len; i++) {
+        LoadIntConfigSetting(L, config, &default_int_cfg[i]);
+    }
+
+    LoadDbConfig(L, config);
     return true;
 }
 
@@ -158,7 +218,97 @@ static inline void LoadConfigSetting(lua_State *L, LuaDB_EnvConfig *config, Defa
     } else {
         // No value found, use defaults
         ApplyDefaultConfig(config, s, def);
+        lua_pop(L, 1);
+    }
+}
+
+// Load an integer configuration setting from the config table.
+static inline void LoadIntConfigSetting(lua_State *L, LuaDB_EnvConfig *config, DefaultIntConfig *def) {
+    assert(L);
+    assert(config);
+    assert(def);
+
+    // Get a pointer to the setting in the configuration
+    long *s = (long *)((char *)config + def->offset);
+    *s = def->val;
+
+    // Load the configuration given in environment config file
+    lua_pushlstring(L, def->name, def->len);
+    lua_gettable(L, -2);
+
+    int isnum;
+    lua_Integer val = lua_tointegerx(L, -1, &isnum);
+    if (isnum && (val >= 0)) {
+        *s = (long)val;
+    }
+    lua_pop(L, 1);
+}
+
+// Load the default database environment from the `db` table, which may
+// give the `path`, `mapsize` and `maxreaders` of the environment and its
+// `flags` as LMDB flag names (e.g. `{"nosync"}`). The flags are kept as
+// a comma separated list of names. The path is left empty if there is no
+// default environment.
+static void LoadDbConfig(lua_State *L, LuaDB_EnvConfig *config) {
+    assert(L);
+    assert(config);
+
+    config->db_mapsize = LUADB_DEFAULT_DB_MAP_SIZE;
+    config->db_maxreaders = LUADB_DEFAULT_DB_MAX_READERS;
+
+    luaL_checkstack(L, 4, "out of memory");
+    if (lua_getfield(L, -1, "db") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        config->db_path.val = LuaDB_StrDupLen("", 0);
+        config->db_path.len = 0;
+        config->db_flags.val = LuaDB_StrDupLen("", 0);
+        config->db_flags.len = 0;
+        return;
+    }
+
+    size_t len = 0;
+    const char *path = (lua_getfield(L, -1, "path") == LUA_TSTRING) ? lua_tolstring(L, -1, &len) : "";
+    config->db_path.val = LuaDB_StrDupLen(path, len);
+    config->db_path.len = len;
+    lua_pop(L, 1);
+
+    int isnum;
+    lua_getfield(L, -1, "mapsize");
+    lua_Integer val = lua_tointegerx(L, -1, &isnum);
+    if (isnum && (val > 0)) { config->db_mapsize = (long)val; }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "maxreaders");
+    val = lua_tointegerx(L, -1, &isnum);
+    if (isnum && (val > 0)) { config->db_maxreaders = (long)val; }
+    lua_pop(L, 1);
+
+    // Flags may be listed by name or given as `name = true`, the same as
+    // the options accepted by `lmdb.open`
+    lua_pushliteral(L, "");
+    int acc = lua_gettop(L);
+    if (lua_getfield(L, -2, "flags") == LUA_TTABLE) {
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            const char *name = NULL;
+            if ((lua_type(L, -2) == LUA_TSTRING) && lua_toboolean(L, -1)) {
+                name = lua_tostring(L, -2);
+            } else if ((lua_type(L, -2) == LUA_TNUMBER) && (lua_type(L, -1) == LUA_TSTRING)) {
+                name = lua_tostring(L, -1);
+            }
+            if (name) {
+                const char *sep = (lua_rawlen(L, acc) > 0) ? "," : "";
+                lua_pushfstring(L, "%s%s%s", lua_tostring(L, acc), sep, name);
+                lua_replace(L, acc);
+            }
+            lua_pop(L, 1);
+        }
     }
+    lua_pop(L, 1);
+    const char *flags = lua_tolstring(L, acc, &len);
+    config->db_flags.val = LuaDB_StrDupLen(flags, len);
+    config->db_flags.len = len;
+    lua_pop(L, 2);
 }
 
 // Apply default configuration to a setting.
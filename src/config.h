@@ -26,6 +26,34 @@ typedef struct LuaDB_EnvConfig {
     LuaDB_Setting router;
     LuaDB_Setting fcgi_query;
     LuaDB_Setting fcgi_header_prefix;
+    LuaDB_Setting metrics_path;
+    LuaDB_Setting profile_output;
+    LuaDB_Setting db_path;
+    LuaDB_Setting db_flags;
+    long pool_size;
+    long pool_max_requests;
+    long pool_max_memory;
+    long router_check_interval;
+    long threads;
+    long workers;
+    long body_spill_size;
+    long request_timeout;
+    long request_max_instructions;
+    long pool_arena;
+    long request_max_memory;
+    long state_max_memory;
+    long metrics_max_series;
+    long trace_sample_rate;
+    long trace_header;
+    long profile_enabled;
+    long profile_interval;
+    long listen_backlog;
+    long queue_size;
+    long queue_timeout;
+    long keepalive_timeout;
+    long cache_max_size;
+    long db_mapsize;
+    long db_maxreaders;
 } LuaDB_EnvConfig;
 
 /**
@@ -33,6 +61,12 @@ typedef struct LuaDB_EnvConfig {
  */
 bool LuaDB_ReadEnvironmentConfig(LuaDB_EnvConfig *config);
 
+/**
+ * @brief Read in environment settings from the given file rather than
+ * the default configuration file.
+ */
+bool LuaDB_ReadEnvironmentConfigFile(LuaDB_EnvConfig *config, const char *path);
+
 /**
  * @brief Clean up any strings saved in the environment configuration.
  */
@@ -22,6 +22,229 @@ config.root = "/var/www/luadb"
 -- Default: reqhandler
 config.router = "reqhandler.lua"
 
+-- Routing Script Check Interval
+-- Workers load the routing script once and reuse it between
+-- requests. The script is checked for changes at most once in
+-- this many seconds; states are reloaded when it changes. Set
+-- to 0 to check before every request.
+-- Default: 1
+config.router_check_interval = 1
+
+--[[ Worker Configuration ]]--
+-- Settings which control how FastCGI workers reuse Lua states
+-- between requests. Each worker keeps a pool of Lua states with
+-- all of the LuaDB libraries loaded. Globals set by a request are
+-- reset before the state is used to serve another request.
+
+-- Worker Processes
+-- The number of worker processes started by a master process.
+-- The master loads the Lua states before forking each worker and
+-- replaces any worker which exits. Set to 0 to serve requests
+-- from a single process without a master. This setting may be
+-- overridden with the `-w` command line option.
+-- Default: 0
+config.workers = 0
+
+-- Worker Threads
+-- The number of threads accepting requests in each worker. Each
+-- thread keeps its own pool of Lua states. This setting may be
+-- overridden with the `-t` command line option.
+-- Default: 1
+config.threads = 1
+
+-- Listen Backlog
+-- The number of connections the kernel queues on the listening
+-- socket before a worker accepts them. Connections arriving while
+-- the queue is full are refused or dropped by the kernel.
+-- Default: 128
+config.listen_backlog = 128
+
+-- State Pool Size
+-- The number of Lua states kept by each worker thread. Each thread
+-- also keeps up to this many LMDB read transactions for reuse, so
+-- LMDB environments are given at least workers x threads x
+-- pool_size reader slots (`maxreaders`).
+-- Default: 4
+config.pool_size = 4
+
+-- State Request Limit
+-- The number of requests a Lua state serves before it is closed
+-- and replaced with a new state. Set to 0 to never replace states.
+-- Default: 1000
+config.pool_max_requests = 1000
+
+-- State Memory Limit
+-- The size in bytes above which a Lua state is closed and replaced
+-- with a new state after a request. Set to 0 for no limit.
+-- Default: 67108864 (64 MiB)
+config.pool_max_memory = 67108864
+
+-- State Arena Allocator
+-- Set to 1 to allocate small Lua objects for each pooled state from
+-- an arena with per-size free lists rather than the system allocator.
+-- The arena is released in bulk when the state is replaced; blocks
+-- freed in between stay with the state for reuse and count towards
+-- `pool_max_memory`. Set to 0 to use the system allocator for every
+-- object.
+-- Default: 0
+config.pool_arena = 0
+
+-- State Memory Cap
+-- The size in bytes a Lua state may never grow beyond while serving a
+-- request. Allocations past this size fail with a Lua memory error,
+-- the request is answered with 503 Service Unavailable, and the state
+-- is replaced. Unlike `pool_max_memory`, this limit is enforced while
+-- the request runs. Set to 0 for no limit.
+-- Default: 0
+config.state_max_memory = 0
+
+--[[ Request Configuration ]]--
+-- Settings which control how HTTP requests are presented to the
+-- routing script.
+
+-- Request Body Spill Size
+-- Request bodies are read from the web server as the routing script
+-- accesses them. Once more than this many bytes of a body have been
+-- read, it is written to a temporary file rather than kept in memory.
+-- Default: 1048576 (1 MiB)
+config.body_spill_size = 1048576
+
+-- Request Timeout
+-- The wall-clock time in milliseconds a request may take before it is
+-- stopped and answered with 503 Service Unavailable. Time spent waiting
+-- (e.g. in `luadb.sleep`) counts against the limit. Set to 0 for no limit.
+-- Default: 30000 (30 seconds)
+config.request_timeout = 30000
+
+-- Request Instruction Limit
+-- The number of Lua VM instructions a request may run before it is
+-- stopped and answered with 503 Service Unavailable. Set to 0 for no
+-- limit.
+-- Default: 0
+config.request_max_instructions = 0
+
+-- Request Memory Limit
+-- The number of bytes a single request may allocate on top of the
+-- memory its Lua state already used. Allocations past this limit fail
+-- with a Lua memory error, the request is answered with 503 Service
+-- Unavailable, and the state is replaced. Set to 0 for no limit.
+-- Default: 0
+config.request_max_memory = 0
+
+-- Request Queue Size
+-- The number of requests each worker thread accepts beyond its
+-- pool of Lua states. These requests wait in a queue for a state
+-- to become free. Requests arriving while every state is busy and
+-- the queue is full are answered at once with 503 Service
+-- Unavailable, without running the routing script. Set to 0 to
+-- disable the queue and leave waiting connections in the listen
+-- backlog.
+-- Default: 0
+config.queue_size = 0
+
+-- Request Queue Timeout
+-- The time in milliseconds a request may wait in the queue for a
+-- Lua state before it is answered with 503 Service Unavailable.
+-- Set to 0 to wait indefinitely.
+-- Default: 1000 (1 second)
+config.queue_timeout = 1000
+
+-- Keep-Alive Timeout
+-- The time in milliseconds a connection kept open by the web server
+-- (e.g. nginx with `fastcgi_keep_conn on`) may sit idle between
+-- requests before it is closed. Idle connections hold a request slot,
+-- and are also closed early, longest idle first, when a new connection
+-- arrives while every slot is taken. Set to 0 to keep idle connections
+-- open until the web server closes them or their slot is needed.
+-- Default: 60000 (60 seconds)
+config.keepalive_timeout = 60000
+
+--[[ Metrics Configuration ]]--
+-- Request counts and latency histograms, keyed by route (the
+-- document URI) and response status, shared by every thread and
+-- worker process.
+
+-- Metrics Path
+-- The document URI at which metrics are served in the Prometheus
+-- text format. Requests for this path are answered directly and
+-- never reach the routing script. Leave empty to disable metrics.
+-- Default: "" (disabled)
+config.metrics_path = ""
+
+-- Metrics Series Limit
+-- The number of distinct (route, status) pairs to keep metrics for.
+-- Requests for further pairs are counted in the dropped total.
+-- Default: 512
+config.metrics_max_series = 512
+
+-- Trace Sample Rate
+-- Time each phase of one in every N requests (per thread) and log
+-- the timings: checking out a state, pushing the router, reading
+-- the request, routing (with LMDB time shown separately), waiting
+-- and sending the response. Set to 1 to trace every request or 0
+-- to disable tracing.
+-- Default: 0 (disabled)
+config.trace_sample_rate = 0
+
+-- Trace Header
+-- Set to 1 to also send the timings of traced requests to the
+-- client in a Server-Timing header. The header is sent before the
+-- response body, so it cannot include the send phase.
+-- Default: 0 (disabled)
+config.trace_header = 0
+
+--[[ Profiler Configuration ]]--
+-- The profiler samples the Lua stack of running requests and
+-- writes folded stacks which can be turned into flame graphs.
+-- Requests may profile themselves with `luadb.profile()` and
+-- profiling every request may be toggled by sending SIGUSR2 to a
+-- worker; the profile is written when profiling stops.
+
+-- Profile Output
+-- Profiles are written to this path with the worker process ID
+-- appended. Leave empty to disable the profiler, which adds a
+-- small cost to every Lua function return when enabled.
+-- Default: "" (disabled)
+config.profile_output = ""
+
+-- Profile Every Request
+-- Set to 1 to profile every request from startup.
+-- Default: 0
+config.profile_enabled = 0
+
+-- Profile Interval
+-- CPU time between samples, in microseconds.
+-- Default: 10000
+config.profile_interval = 10000
+
+--[[ Response Cache Configuration ]]--
+-- Responses to GET and HEAD requests are cached when the routing
+-- script returns them with a `cache` table, e.g.
+-- `cache = {ttl=60, vary="Accept-Language"}`. Cached responses are
+-- answered without running the routing script until their `ttl`
+-- (in seconds) passes. Each worker process keeps its own cache.
+
+-- Response Cache Size
+-- The number of bytes of responses each worker process caches.
+-- The least recently used responses are evicted to stay within
+-- this size. Set to 0 to disable the cache.
+-- Default: 16777216 (16 MiB)
+config.cache_max_size = 16777216
+
+--[[ Default Database Configuration ]]--
+-- The LMDB environment opened once in each worker process and
+-- exposed to request handlers as the global `db`. It accepts
+-- the same `mapsize`, `maxreaders` and `flags` as `lmdb.open`;
+-- flags may be listed by name (e.g. `flags = {"nosync"}`).
+-- No default environment is opened unless a path is given.
+-- Default: none
+-- config.db = {
+--     path = "/var/lib/luadb",
+--     mapsize = 10485760,
+--     maxreaders = 126,
+--     flags = {},
+-- }
+
 --[[ FastCGI Configuration ]]--
 -- Generally speaking, the configuration settings below should
 -- not need to be modified to get LuaDB working on your system.
@@ -19,7 +19,7 @@
 /* #undef HAVE_IOSTREAM_WITHASSIGN_STREAMBUF */
 
 /* Define if you have the `nsl' library (-lnsl). */
-/* #undef HAVE_LIBNSL */
+#define HAVE_LIBNSL
 
 /* Define if you have the `socket' library (-lsocket). */
 /* #undef HAVE_LIBSOCKET */
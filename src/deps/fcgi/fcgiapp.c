@@ -71,6 +71,13 @@ static int isFastCGI = -1;
 static char *webServerAddressList = NULL;
 static FCGX_Request the_request;
 
+/*
+ * Values reported in answer to FCGI_GET_VALUES
+ */
+static int mgmtMaxConns = 1;
+static int mgmtMaxReqs = 1;
+static int mgmtMpxsConns = 0;
+
 void FCGX_ShutdownPending(void)
 {
     OS_ShutdownPending();
@@ -1312,6 +1319,49 @@ typedef struct FCGX_Stream_Data {
     FCGX_Request *reqDataPtr; /* request data not specific to one stream */
 } FCGX_Stream_Data;
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_HasBufferedInput --
+ *
+ *      Returns nonzero if the input stream can deliver more bytes (or
+ *      EOF) using only bytes already read from the connection, i.e.
+ *      if the next read will not block on the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+int FCGX_HasBufferedInput(FCGX_Stream *stream)
+{
+    FCGX_Stream_Data *data = (FCGX_Stream_Data *)stream->data;
+    const FCGI_Header *header;
+    int buffered, contentLen;
+
+    if (!stream->isReader) {
+        return 0;
+    }
+    if (stream->rdNext != stream->stop) {
+        return 1;
+    }
+
+    buffered = data->buffStop - stream->rdNext;
+    if (data->contentLen > 0) {
+        return buffered > 0;
+    }
+
+    /*
+     * The next record must be buffered past the padding of the
+     * current one: either an empty record (EOF) or a header followed
+     * by at least one content byte.
+     */
+    buffered -= data->paddingLen;
+    if (buffered < (int)sizeof(FCGI_Header)) {
+        return 0;
+    }
+    header = (const FCGI_Header *)(stream->rdNext + data->paddingLen);
+    contentLen = (header->contentLengthB1 << 8) + header->contentLengthB0;
+    return (contentLen == 0) || (buffered > (int)sizeof(FCGI_Header));
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1456,9 +1506,9 @@ static int ProcessManagementRecord(int type, FCGX_Stream *stream)
     FCGX_Stream_Data *data = (FCGX_Stream_Data *)stream->data;
     ParamsPtr paramsPtr = NewParams(3);
     char **pPtr;
-    char response[64]; /* 64 = 8 + 3*(1+1+14+1)* + padding */
+    char response[128]; /* 128 > 8 + 3*(1+1+15+11) + padding */
     char *responseP = &response[FCGI_HEADER_LEN];
-    char *name, value = '\0';
+    char *name, value[16];
     int len, paddedLen;
     if(type == FCGI_GET_VALUES) {
         ReadParams(paramsPtr, stream);
@@ -1470,18 +1520,30 @@ static int ProcessManagementRecord(int type, FCGX_Stream *stream)
             name = *pPtr;
             *(strchr(name, '=')) = '\0';
             if(strcmp(name, FCGI_MAX_CONNS) == 0) {
-                value = '1';
+                sprintf(value, "%d", mgmtMaxConns);
             } else if(strcmp(name, FCGI_MAX_REQS) == 0) {
-                value = '1';
+                sprintf(value, "%d", mgmtMaxReqs);
             } else if(strcmp(name, FCGI_MPXS_CONNS) == 0) {
-                value = '0';
+                sprintf(value, "%d", mgmtMpxsConns);
             } else {
                 name = NULL;
             }
             if(name != NULL) {
+                /*
+                 * Names may be repeated, so stop once the next pair
+                 * would not fit in the response.
+                 */
+                int valueLen = strlen(value);
                 len = strlen(name);
-                sprintf(responseP, "%c%c%s%c", len, 1, name, value);
-                responseP += len + 3;
+                if(len + valueLen + 2 > &response[sizeof(response)] - responseP) {
+                    break;
+                }
+                *responseP++ = (char) len;
+                *responseP++ = (char) valueLen;
+                memcpy(responseP, name, len);
+                responseP += len;
+                memcpy(responseP, value, valueLen);
+                responseP += valueLen;
 	    }
         }
         len = responseP - &response[FCGI_HEADER_LEN];
@@ -1629,6 +1691,18 @@ static void FillBuffProc(FCGX_Stream *stream)
     int status, count;
 
     for (;;) {
+        /*
+         * If we're in a recursive call from ProcessHeader and the
+         * current record has been fully consumed, deliver EOF now:
+         * the next record may not have been sent yet, so reading
+         * could block or fail.
+         */
+        if(data->eorStop && data->contentLen == 0 && data->paddingLen == 0
+                && stream->rdNext == data->buffStop) {
+            stream->stop = stream->rdNext;
+            stream->isClosed = TRUE;
+            return;
+        }
         /*
          * If data->buff is empty, do a read.
          */
@@ -2037,6 +2111,29 @@ void FCGX_Free(FCGX_Request * request, int close)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_SetManagementValues --
+ *
+ *      Sets the values reported to the web server in answer to
+ *      FCGI_GET_VALUES.  Values below zero are left unchanged.
+ *
+ *----------------------------------------------------------------------
+ */
+void FCGX_SetManagementValues(int maxConns, int maxReqs, int mpxsConns)
+{
+    if (maxConns >= 0) {
+        mgmtMaxConns = maxConns;
+    }
+    if (maxReqs >= 0) {
+        mgmtMaxReqs = maxReqs;
+    }
+    if (mpxsConns >= 0) {
+        mgmtMpxsConns = (mpxsConns != 0);
+    }
+}
+
 int FCGX_OpenSocket(const char *path, int backlog)
 {
     int rc = OS_CreateLocalIpcFd(path, backlog);
@@ -160,6 +160,22 @@ DLLAPI int FCGX_Init(void);
  */
 DLLAPI int FCGX_OpenSocket(const char *path, int backlog);
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_SetManagementValues --
+ *
+ *      Set the values reported to the web server in answer to an
+ *      FCGI_GET_VALUES management record: the maximum number of
+ *      concurrent connections the application will accept, the
+ *      maximum number of concurrent requests, and whether it
+ *      multiplexes requests over a single connection.  Values below
+ *      zero are left unchanged; the defaults are 1, 1 and 0.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI void FCGX_SetManagementValues(int maxConns, int maxReqs, int mpxsConns);
+
 /*
  *----------------------------------------------------------------------
  *
@@ -441,6 +457,24 @@ DLLAPI char *FCGX_GetLine(char *str, int n, FCGX_Stream *stream);
  */
 
 DLLAPI  int FCGX_HasSeenEOF(FCGX_Stream *stream);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_HasBufferedInput --
+ *
+ *      Returns nonzero if the input stream can deliver more bytes (or
+ *      EOF) using only bytes already read from the connection.  Callers
+ *      polling the connection for readability must check this first,
+ *      since bytes which were already read will not wake up the poll.
+ *
+ * Results:
+ *	1 if the next read will not block on the connection, 0 if it may.
+ *
+ *----------------------------------------------------------------------
+ */
+
+DLLAPI  int FCGX_HasBufferedInput(FCGX_Stream *stream);
 
 /*
  *======================================================================
@@ -9,25 +9,64 @@
  *****************************************************************************/
 
 #include <assert.h>
-#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "deps/lua/lua.h"
 #include "deps/lua/lauxlib.h"
 #include "deps/fcgi/fcgiapp.h"
 
+#include "alloc.h"
+#include "body.h"
+#include "cache.h"
 #include "config.h"
 #include "fcgi.h"
+#include "http.h"
+#include "lmdb.h"
 #include "log.h"
-#include "query.h"
+#include "metrics.h"
+#include "params.h"
+#include "pool.h"
+#include "profile.h"
+#include "sched.h"
 #include "state.h"
+#include "trace.h"
 
-static const int FASTCGI_DEFAULT_BACKLOG = 10;
-static const int FASTCGI_DEFAULT_NUM_VARS = 20;
-static const int FASTCGI_DEFAULT_NUM_HEADERS = 10;  /* Approx num headers/req */
-static const char FASTCGI_KEY_VALUE_SEP = '=';
+static const time_t FASTCGI_RESPAWN_DELAY = 1;      /* Seconds */
+
+#define FASTCGI_HEAD_BUFFER_SIZE 1024
+
+// Responses sent when the routing engine could not produce a response
+static const char *const FASTCGI_RESPONSE_ERROR =
+        "Status: 500 Internal Server Error\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 21\r\n\r\n"
+        "Internal Server Error";
+static const char *const FASTCGI_RESPONSE_UNAVAILABLE =
+        "Status: 503 Service Unavailable\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 19\r\n\r\n"
+        "Service Unavailable";
+
+#ifndef _WIN32
+// Set by the master process signal handler to stop supervising workers
+static volatile sig_atomic_t master_shutdown = 0;
+#endif
 
 /*
  * FORWARD DECLARATIONS
@@ -39,21 +78,112 @@ typedef enum LuaDB_FcgxResult {
     LUADB_FCGX_FATAL,
 } LuaDB_FcgxResult;
 
-static int InitFcgxRequest(FCGX_Request *req, const char *device);
-static LuaDB_FcgxResult ProcessFcgxRequest(FCGX_Request *req, LuaDB_EnvConfig *config, const char **paths, size_t npaths);
-static bool RouteHttpRequest(lua_State *L);
-static void SendHttpResponse(lua_State *L, FCGX_Request *req);
-static void SendHttpResponseStatus(lua_State *L, FCGX_Request *req);
-static void SendHttpResponseHeaders(lua_State *L, FCGX_Request *req);
+// A single request being served by a thread. Each slot owns its own
+// request object; while a request is in flight, the slot holds the pooled
+// Lua state serving it and the coroutine running the routing engine.
+typedef struct LuaDB_FcgiSlot {
+    FCGX_Request req;
+    LuaDB_PoolState *ps;
+    lua_State *co;
+    LuaDB_SchedWait wait;
+    LuaDB_SchedBudget budget;
+    LuaDB_Trace trace;
+    long long start;
+    long long idle_since;   // when a kept-alive connection last went idle
+    int status;
+    bool active;
+    bool ready;
+    bool queued;            // request waiting for a free Lua state
+    bool streaming;         // coroutine is generating the response body
+    bool local;             // request from the HTTP listener, not a web server
+} LuaDB_FcgiSlot;
+
+// A single request accepting thread. Each thread owns its own request
+// slots and pool of Lua states, so threads never share a Lua state. A
+// thread serves up to one request per pooled state at a time, switching
+// between requests whenever one of them waits. Requests accepted while
+// every state is busy wait in the thread's queue for a state to free up.
+typedef struct LuaDB_FcgiThread {
+    pthread_t thread;
+    LuaDB_FcgiSlot *slots;
+    size_t nslots;
+    size_t nbusy;           // slots holding a Lua state
+    size_t nqueued;         // slots waiting for a Lua state
+    LuaDB_FcgiSlot shed;    // accepts requests rejected with a full queue
+    bool shedding;
+    int sock;
+    LuaDB_StatePool pool;
+    LuaDB_EnvConfig *config;
+    unsigned long requests;
+    int exit_code;
+    bool http;
+} LuaDB_FcgiThread;
+
+// HTTP response status and headers, assembled so they can be sent to the
+// web server in a single write. Heads which do not fit in `local` are
+// moved onto the heap.
+typedef struct LuaDB_FcgxHead {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool ok;
+    char local[FASTCGI_HEAD_BUFFER_SIZE];
+} LuaDB_FcgxHead;
+
+static int OpenFcgxSocket(const char *device, int backlog);
+static bool InitFcgiThread(LuaDB_FcgiThread *t, int sock, LuaDB_EnvConfig *config, const char **paths, size_t npaths);
+static int RunFcgiThreads(LuaDB_FcgiThread *threads, size_t nthreads);
+static void *RunFcgiThread(void *arg);
+static void *RunHttpThread(void *arg);
+#ifndef _WIN32
+static int RunFcgiMaster(LuaDB_FcgiThread *threads, size_t nthreads, size_t nworkers);
+static pid_t SpawnFcgiWorker(LuaDB_FcgiThread *threads, size_t nthreads);
+static void HandleMasterSignal(int sig);
+#endif
+static void CloseFcgiThread(LuaDB_FcgiThread *t);
+static bool PollFcgiThread(LuaDB_FcgiThread *t, struct pollfd *fds, LuaDB_FcgiSlot **polled, bool *accept);
+static bool AcceptFcgxRequests(LuaDB_FcgiThread *t);
+static void CloseIdleFcgxConnections(LuaDB_FcgiThread *t);
+static LuaDB_FcgiSlot *GetOldestIdleFcgxConnection(LuaDB_FcgiThread *t);
+static void CloseIdleFcgxConnection(LuaDB_FcgiSlot *slot);
+static bool ShedFcgxRequests(LuaDB_FcgiThread *t);
+static LuaDB_FcgxResult StartFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static LuaDB_FcgxResult RunFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static void QueueFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static void DrainFcgxQueue(LuaDB_FcgiThread *t);
+static void ShedFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static LuaDB_FcgxResult ResumeFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot, int nargs);
+static void FinishFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static void EndFcgxRequest(LuaDB_FcgiSlot *slot);
+static LuaDB_HttpResult StartLocalFcgxRequest(void *arg, LuaDB_HttpCall *call);
+static LuaDB_HttpResult ResumeLocalFcgxRequest(void *arg, LuaDB_HttpCall *call);
+static LuaDB_HttpResult GetLocalFcgxResult(LuaDB_FcgiSlot *slot, LuaDB_HttpCall *call);
+static long long GetFcgxRequestDeadline(LuaDB_FcgiSlot *slot);
+static bool IsFcgxRequestOverBudget(LuaDB_FcgiSlot *slot);
+static bool IsFcgxMetricsRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot);
+static int SendHttpResponse(lua_State *L, FCGX_Request *req, LuaDB_Trace *timing);
+static void SendHttpCannedResponse(LuaDB_FcgiSlot *slot, int status);
+static void SendHttpMetrics(FCGX_Request *req);
+static bool IsFcgxRequestSampled(LuaDB_FcgiThread *t);
+static bool CacheHttpResponse(lua_State *L, FCGX_Request *req, LuaDB_FcgxHead *head, char *etag);
+static int AppendHttpResponseStatus(lua_State *L, LuaDB_FcgxHead *head);
+static void AppendHttpResponseTiming(LuaDB_Trace *trace, LuaDB_FcgxHead *head);
+static void AppendHttpResponseHeaders(lua_State *L, LuaDB_FcgxHead *head, bool *has_length);
+static void AppendHttpResponseContentLength(lua_State *L, LuaDB_FcgxHead *head);
 static void SendHttpResponseBody(lua_State *L, FCGX_Request *req);
+static void SendHttpResponseBodyChunks(lua_State *L, FCGX_Request *req);
+static bool StartHttpResponseBody(LuaDB_FcgiSlot *slot);
+static int SendHttpResponseBodyFunction(lua_State *L);
+static int SendHttpResponseBodyFunctionK(lua_State *L, int status, lua_KContext ctx);
+static int SendHttpResponseBodyCoroutine(lua_State *L);
+static int SendHttpResponseBodyCoroutineK(lua_State *L, int status, lua_KContext ctx);
+static bool FlushHttpResponseChunk(lua_State *L, int idx, FCGX_Stream *out);
+static bool WriteHttpResponseChunk(lua_State *L, int idx, FCGX_Stream *out);
 static bool ReadHttpRequest(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config);
-static bool ReadHttpRequestHeaders(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config);
-static bool ReadHttpRequestVars(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config);
-static bool ReadHttpRequestBody(lua_State *L, FCGX_Request *req);
-static bool ReadHttpRequestQueryString(lua_State *L, const char *qs, size_t *len);
-static inline void PushQueryValueString(lua_State *L, const char *key, size_t keylen, const char *val, size_t vallen);
-static char *ConvertEnvVarToHeader(LuaDB_Setting *pfx, const char *in, size_t len, size_t *outlen);
-static char *ConvertEnvVarToLower(const char *in, size_t len);
+static bool ReadHttpRequestBody(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config);
+static void InitFcgxHead(LuaDB_FcgxHead *head);
+static void AppendFcgxHead(LuaDB_FcgxHead *head, const char *s, size_t len);
+static void FreeFcgxHead(LuaDB_FcgxHead *head);
 
 /*
  * PUBLIC FUNCTIONS
@@ -64,121 +194,1073 @@ int LuaDB_FcgiStartWorker(const char *device) {
 }
 
 int LuaDB_FcgiStartWorkerWithPaths(const char *device, const char **paths, size_t npaths) {
-    FCGX_Request req;
+    LuaDB_FcgiOpts opts = { paths, npaths, 0, 0, false, NULL };
+    return LuaDB_FcgiStartWorkerWithOpts(device, &opts);
+}
+
+int LuaDB_FcgiStartWorkerWithOpts(const char *device, LuaDB_FcgiOpts *opts) {
     LuaDB_EnvConfig config;
     openlog("luadb", LOG_PID, LOG_USER);
-    syslog(LOG_INFO, "Starting FastCGI worker on %s", device);
+    const char *kind = (opts->http) ? "HTTP" : "FastCGI";
+    syslog(LOG_INFO, "Starting %s worker on %s", kind, device);
 
     // Read the default environment configuration
-    if (!LuaDB_ReadEnvironmentConfig(&config)) {
+    bool read = (opts->config) ? LuaDB_ReadEnvironmentConfigFile(&config, opts->config) :
+                                 LuaDB_ReadEnvironmentConfig(&config);
+    if (!read) {
         syslog(LOG_ERR, "Failed to read environment configuration.");
         return EXIT_FAILURE;
     }
 
-    // Initialize the FCGI app request
-    if (!InitFcgxRequest(&req, device)) {
-        syslog(LOG_ERR, "Failed to intialize FastCGI request.");
+    // Command line options take precedence over configuration
+    size_t nthreads = (size_t)((opts->threads > 0) ? opts->threads : config.threads);
+    size_t nworkers = (size_t)((opts->workers > 0) ? opts->workers : config.workers);
+    if (nthreads == 0) { nthreads = 1; }
+
+    // Open the socket shared by every thread
+    int backlog = (config.listen_backlog > INT_MAX) ? INT_MAX : (int)config.listen_backlog;
+    int sock = (opts->http) ? LuaDB_HttpOpenSocket(device, backlog) :
+                              OpenFcgxSocket(device, backlog);
+    if (sock == -1) {
+        LuaDB_CleanEnvironmentConfig(&config);
+        return EXIT_FAILURE;
+    }
+
+    // Metrics are shared with worker processes, so they must exist before
+    // any worker is forked; requests are still served without them
+    if ((config.metrics_path.len > 0) &&
+        !LuaDB_MetricsInit((size_t)config.metrics_max_series)) {
+        syslog(LOG_WARNING, "Could not create metrics; %s will be empty.", config.metrics_path.val);
+    }
+    LuaDB_ProfileInit(config.profile_output.val, config.profile_interval,
+                      (config.profile_enabled != 0));
+    if (!LuaDB_CacheInit(&config)) {
+        syslog(LOG_WARNING, "Could not create response cache; responses will not be cached.");
+    }
+
+    // Create the request object and pool of Lua states for each thread;
+    // worker processes inherit these already loaded from the master
+    LuaDB_FcgiThread *threads = calloc(nthreads, sizeof(LuaDB_FcgiThread));
+    if (!threads) {
+        syslog(LOG_ERR, "Could not allocate memory for FastCGI threads.");
+        LuaDB_CacheClose();
+        LuaDB_MetricsClose();
         LuaDB_CleanEnvironmentConfig(&config);
         return EXIT_FAILURE;
     }
 
-    // Accept FastCGI requests on the given device
-    while (FCGX_Accept_r(&req) >= 0) {
-        LuaDB_FcgxResult result = ProcessFcgxRequest(&req, &config, paths, npaths);
-        if (result == LUADB_FCGX_FATAL) {
-            syslog(LOG_CRIT, "Failed reading the current request. Exiting.");
-            LuaDB_CleanEnvironmentConfig(&config);
-            return EXIT_FAILURE;
+    // Size LMDB read transaction pools before the routing script can open
+    // any environment; each thread runs one request per pooled state
+    size_t nprocs = (nworkers > 0) ? nworkers : 1;
+    size_t npool = (config.pool_size > 0) ? (size_t)config.pool_size : 1;
+    LuaDB_LmdbSetReaderLimits(npool, nprocs * nthreads);
+
+    size_t ninit = 0;
+    for (; ninit < nthreads; ninit++) {
+        if (!InitFcgiThread(&threads[ninit], sock, &config, opts->paths, opts->npaths)) {
+            break;
         }
+        threads[ninit].http = opts->http;
     }
 
+    // Tell web servers which ask how many connections they may keep open;
+    // each connection carries one request at a time, so a connection is
+    // held by a request slot for as long as it stays open
+    if (ninit == nthreads) {
+        size_t max_conns = nprocs * nthreads * threads[0].nslots;
+        FCGX_SetManagementValues((max_conns > INT_MAX) ? INT_MAX : (int)max_conns,
+                                 (max_conns > INT_MAX) ? INT_MAX : (int)max_conns, 0);
+    }
+
+    int exit_code = EXIT_FAILURE;
+    if (ninit == nthreads) {
+#ifndef _WIN32
+        if (nworkers > 0) {
+            exit_code = RunFcgiMaster(threads, nthreads, nworkers);
+        } else {
+            exit_code = RunFcgiThreads(threads, nthreads);
+        }
+#else
+        exit_code = RunFcgiThreads(threads, nthreads);
+#endif
+    }
+
+    // Clean up
+    for (size_t i = 0; i < ninit; i++) {
+        CloseFcgiThread(&threads[i]);
+    }
+
+    free(threads);
+    LuaDB_LmdbCloseEnvs();
+    LuaDB_CacheClose();
+    LuaDB_MetricsClose();
     LuaDB_CleanEnvironmentConfig(&config);
-    syslog(LOG_INFO, "Stopping FastCGI worker on %s", device);
-    return EXIT_SUCCESS;
+    syslog(LOG_INFO, "Stopping %s worker on %s", kind, device);
+    return exit_code;
 }
 
 /*
  * PRIVATE FUNCTIONS
  */
 
-// Initialize the FCGX request structure.
-static int InitFcgxRequest(FCGX_Request *req, const char *device) {
+// Initialize the FastCGI library and open the listening socket.
+static int OpenFcgxSocket(const char *device, int backlog) {
     if (FCGX_Init() != 0) {
         syslog(LOG_ERR, "Failed to intialize FastCGI library.");
-        return 0;
+        return -1;
     }
-    int sock = FCGX_OpenSocket(device, FASTCGI_DEFAULT_BACKLOG);
+    int sock = FCGX_OpenSocket(device, backlog);
     if (sock == -1) {
         syslog(LOG_ERR, "Could not open FastCGI socket '%s'", device);
-        return 0;
+        return -1;
+    }
+
+#ifndef _WIN32
+    // Threads poll the listening socket alongside their in-flight requests,
+    // so accepting must never block once another thread took the connection
+    int flags = fcntl(sock, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        syslog(LOG_ERR, "Could not set FastCGI socket '%s' non-blocking", device);
+        return -1;
+    }
+#endif
+
+    return sock;
+}
+
+// Initialize the request slots and state pool for a single thread.
+static bool InitFcgiThread(LuaDB_FcgiThread *t, int sock, LuaDB_EnvConfig *config, const char **paths, size_t npaths) {
+    assert(t);
+    assert(config);
+
+    t->config = config;
+    t->sock = sock;
+    t->exit_code = EXIT_SUCCESS;
+
+    if (!LuaDB_StatePoolInit(&t->pool, config, paths, npaths)) {
+        syslog(LOG_ERR, "Failed to create pool of lua_State objects.");
+        return false;
+    }
+
+    // Serve at most one request per pooled state at a time, and queue up
+    // to the configured number of requests beyond that
+    t->nslots = t->pool.size + (size_t)t->config->queue_size;
+    t->slots = calloc(t->nslots, sizeof(LuaDB_FcgiSlot));
+    if (!t->slots) {
+        syslog(LOG_ERR, "Could not allocate memory for FastCGI requests.");
+        LuaDB_StatePoolClose(&t->pool);
+        return false;
     }
-    if (FCGX_InitRequest(req, sock, 0) != 0) {
+
+    for (size_t i = 0; i < t->nslots; i++) {
+        if (FCGX_InitRequest(&t->slots[i].req, sock, 0) != 0) {
+            syslog(LOG_ERR, "Failed to initialize FastCGI request object.");
+            CloseFcgiThread(t);
+            return false;
+        }
+    }
+
+    if (FCGX_InitRequest(&t->shed.req, sock, 0) != 0) {
         syslog(LOG_ERR, "Failed to initialize FastCGI request object.");
+        CloseFcgiThread(t);
+        return false;
+    }
+
+    return true;
+}
+
+// Free the request slots and state pool for a single thread.
+static void CloseFcgiThread(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    free(t->slots);
+    t->slots = NULL;
+    t->nslots = 0;
+    LuaDB_StatePoolClose(&t->pool);
+}
+
+// Start every thread after the first; the calling thread serves requests
+// as the first thread. Returns once every thread has stopped.
+static int RunFcgiThreads(LuaDB_FcgiThread *threads, size_t nthreads) {
+    assert(threads);
+
+    // The default environment must be opened by the process which uses it,
+    // so each worker opens its own once it has been forked
+    if (threads[0].config->db_path.len > 0) {
+        if (LuaDB_LmdbOpenDefaultEnv(threads[0].config)) {
+            for (size_t i = 0; i < nthreads; i++) {
+                LuaDB_StatePoolSetup(&threads[i].pool, LuaDB_LmdbAddDefaultEnv);
+            }
+        } else {
+            syslog(LOG_ERR, "Serving requests without the default environment.");
+        }
+    }
+
+    void *(*run)(void *) = (threads[0].http) ? RunHttpThread : RunFcgiThread;
+    syslog(LOG_INFO, "Starting %zu %s threads", nthreads, (threads[0].http) ? "HTTP" : "FastCGI");
+    LuaDB_ProfileStart();
+    size_t nstarted = 1;
+    for (; nstarted < nthreads; nstarted++) {
+        if (pthread_create(&threads[nstarted].thread, NULL,
+                           run, &threads[nstarted]) != 0) {
+            syslog(LOG_ERR, "Could not start FastCGI thread %zu", nstarted);
+            break;
+        }
+    }
+    run(&threads[0]);
+
+    int exit_code = threads[0].exit_code;
+    for (size_t i = 1; i < nstarted; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].exit_code != EXIT_SUCCESS) {
+            exit_code = threads[i].exit_code;
+        }
+    }
+
+    LuaDB_ProfileStop();
+    return exit_code;
+}
+
+// Accept and process FastCGI requests on a single thread.
+//
+// Each request runs the routing engine in its own coroutine. Whenever a
+// request waits (e.g. in `luadb.sleep` or for more of the request body),
+// its coroutine yields back to this loop, which polls the listening
+// socket and the events every waiting request is blocked on, and then
+// resumes whichever requests are ready and accepts new requests into any
+// free slots.
+//
+// Every thread polls the shared listening socket, so the kernel hands
+// each new connection to exactly one thread; threads which lose the race
+// simply go back to polling.
+static void *RunFcgiThread(void *arg) {
+    LuaDB_FcgiThread *t = arg;
+    assert(t);
+
+    struct pollfd *fds = calloc(t->nslots + 1, sizeof(struct pollfd));
+    LuaDB_FcgiSlot **polled = calloc(t->nslots + 1, sizeof(LuaDB_FcgiSlot *));
+    if (!fds || !polled) {
+        syslog(LOG_ERR, "Could not allocate memory for FastCGI scheduler.");
+        t->exit_code = EXIT_FAILURE;
+        free(fds);
+        free(polled);
+        return NULL;
+    }
+
+    while (true) {
+        bool accept = false;
+        if (!PollFcgiThread(t, fds, polled, &accept)) {
+            t->exit_code = EXIT_FAILURE;
+            break;
+        }
+        LuaDB_ProfileCheck();
+
+        // Resume every request whose event is ready, and read the next
+        // request from any kept-alive connection with data waiting
+        for (size_t i = 0; i < t->nslots; i++) {
+            LuaDB_FcgiSlot *slot = &t->slots[i];
+            if (!slot->ready) { continue; }
+            slot->ready = false;
+
+            if (slot->active) {
+                ResumeFcgxRequest(t, slot, 0);
+                continue;
+            } else if (slot->queued) {
+                ShedFcgxRequest(t, slot);
+                continue;
+            }
+
+            int err = FCGX_Accept_r(&slot->req);
+            if (err == 0) {
+                StartFcgxRequest(t, slot);
+            }
+        }
+
+        // Start queued requests on any states freed up above before
+        // accepting new requests
+        DrainFcgxQueue(t);
+        CloseIdleFcgxConnections(t);
+
+        if (accept && !AcceptFcgxRequests(t)) {
+            syslog(LOG_CRIT, "Failed accepting FastCGI requests. Exiting.");
+            t->exit_code = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < t->nslots; i++) {
+        if (t->slots[i].active) { FinishFcgxRequest(t, &t->slots[i]); }
+        if (t->slots[i].queued) { ShedFcgxRequest(t, &t->slots[i]); }
+        FCGX_Free(&t->slots[i].req, 1);
+    }
+    FCGX_Free(&t->shed.req, 1);
+    free(fds);
+    free(polled);
+    return NULL;
+}
+
+// Serve HTTP requests on a single thread from the native HTTP listener.
+static void *RunHttpThread(void *arg) {
+    LuaDB_FcgiThread *t = arg;
+    assert(t);
+
+    static const LuaDB_HttpHandler handler = {
+        .start = StartLocalFcgxRequest,
+        .resume = ResumeLocalFcgxRequest,
+    };
+    if (!LuaDB_HttpRunThread(t->sock, &handler, t)) {
+        syslog(LOG_CRIT, "Failed serving HTTP requests. Exiting.");
+        t->exit_code = EXIT_FAILURE;
+    }
+    return NULL;
+}
+
+// Start a request from the HTTP listener in a free slot, serving it
+// exactly as a request from the web server would be served. Each HTTP
+// connection holds a slot while its request runs, and the listener
+// switches between them whenever one waits.
+//
+// Requests are only started while a Lua state is free. Queued requests are
+// started by whichever request frees a state, so the listener could not
+// tell when they start; it holds requests itself instead until one of its
+// requests finishes.
+static LuaDB_HttpResult StartLocalFcgxRequest(void *arg, LuaDB_HttpCall *call) {
+    LuaDB_FcgiThread *t = arg;
+    assert(t);
+    assert(call);
+
+    if (t->nbusy >= t->pool.size) {
+        return LUADB_HTTP_BUSY;
+    }
+
+    LuaDB_FcgiSlot *slot = NULL;
+    for (size_t i = 0; (i < t->nslots) && !slot; i++) {
+        if (!t->slots[i].active && !t->slots[i].queued) { slot = &t->slots[i]; }
+    }
+    if (!slot) {
+        return LUADB_HTTP_BUSY;
+    }
+
+    slot->local = true;
+    slot->req.in = call->in;
+    slot->req.out = call->out;
+    slot->req.envp = call->envp;
+    call->data = slot;
+
+    StartFcgxRequest(t, slot);
+    return GetLocalFcgxResult(slot, call);
+}
+
+// Resume a request from the HTTP listener once its event is ready or its
+// deadline has passed.
+static LuaDB_HttpResult ResumeLocalFcgxRequest(void *arg, LuaDB_HttpCall *call) {
+    LuaDB_FcgiThread *t = arg;
+    assert(t);
+    assert(call);
+    assert(call->data);
+
+    ResumeFcgxRequest(t, call->data, 0);
+    return GetLocalFcgxResult(call->data, call);
+}
+
+// Report the event the request in the given slot waits on to the HTTP
+// listener, or release the slot if the request has finished.
+static LuaDB_HttpResult GetLocalFcgxResult(LuaDB_FcgiSlot *slot, LuaDB_HttpCall *call) {
+    assert(slot);
+    assert(call);
+
+    if (slot->active) {
+        call->fd = slot->wait.fd;
+        call->events = slot->wait.events;
+        call->deadline = GetFcgxRequestDeadline(slot);
+        return LUADB_HTTP_WAIT;
+    }
+
+    slot->req.in = NULL;
+    slot->req.out = NULL;
+    slot->req.envp = NULL;
+    call->data = NULL;
+    return LUADB_HTTP_DONE;
+}
+
+// Wait until at least one request slot is ready to make progress, marking
+// each ready slot. `accept` is set if new connections are waiting on the
+// listening socket. Returns false if polling failed.
+static bool PollFcgiThread(LuaDB_FcgiThread *t, struct pollfd *fds, LuaDB_FcgiSlot **polled, bool *accept) {
+    assert(t);
+    assert(fds);
+    assert(polled);
+    assert(accept);
+
+    long long now = LuaDB_SchedNow();
+    long long timeout = -1;
+    nfds_t nfds = 0;
+    bool free_slot = false;
+    bool idle_conn = false;
+
+    for (size_t i = 0; i < t->nslots; i++) {
+        LuaDB_FcgiSlot *slot = &t->slots[i];
+        if (slot->queued) {
+            // Request waiting for a Lua state until its deadline
+            if (slot->wait.deadline >= 0) {
+                long long remaining = slot->wait.deadline - now;
+                if (remaining < 0) { remaining = 0; }
+                if ((timeout < 0) || (remaining < timeout)) { timeout = remaining; }
+            }
+        } else if (slot->active) {
+            // Request waiting on an event and/or a timeout
+            if (slot->wait.fd >= 0) {
+                fds[nfds].fd = slot->wait.fd;
+                fds[nfds].events = slot->wait.events;
+                polled[nfds++] = slot;
+            }
+            long long deadline = GetFcgxRequestDeadline(slot);
+            if (deadline >= 0) {
+                long long remaining = deadline - now;
+                if (remaining < 0) { remaining = 0; }
+                if ((timeout < 0) || (remaining < timeout)) { timeout = remaining; }
+            }
+        } else if (slot->req.ipcFd >= 0) {
+            // Idle connection kept open by the web server, until it has
+            // been idle for the keep-alive timeout
+            fds[nfds].fd = slot->req.ipcFd;
+            fds[nfds].events = POLLIN;
+            polled[nfds++] = slot;
+            if (t->config->keepalive_timeout > 0) {
+                long long remaining = slot->idle_since + t->config->keepalive_timeout - now;
+                if (remaining < 0) { remaining = 0; }
+                if ((timeout < 0) || (remaining < timeout)) { timeout = remaining; }
+            }
+            idle_conn = true;
+        } else {
+            free_slot = true;
+        }
+    }
+
+    // Only accept new connections when there is a slot to serve them, an
+    // idle connection which can be closed to make room for them or, once
+    // the queue is full, to turn them away
+    bool queue_full = (t->config->queue_size > 0) &&
+                      (t->nqueued >= (size_t)t->config->queue_size);
+    if (free_slot || idle_conn || queue_full) {
+        fds[nfds].fd = t->sock;
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = NULL;
+    }
+
+    int ms = (timeout > INT_MAX) ? INT_MAX : (int)timeout;
+    int n = poll(fds, nfds, ms);
+    if (n == -1) {
+        if (errno == EINTR) { return true; }
+        syslog(LOG_ERR, "Could not poll FastCGI requests: %s", strerror(errno));
+        return false;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++) {
+        if (fds[i].revents == 0) { continue; }
+        if (polled[i]) {
+            polled[i]->ready = true;
+        } else {
+            *accept = true;
+        }
+    }
+
+    // Requests whose timeout or budget has elapsed are ready too
+    now = LuaDB_SchedNow();
+    for (size_t i = 0; i < t->nslots; i++) {
+        LuaDB_FcgiSlot *slot = &t->slots[i];
+        if (slot->queued) {
+            slot->ready = (slot->wait.deadline >= 0) && (slot->wait.deadline <= now);
+            continue;
+        }
+        if (!slot->active) { continue; }
+        if (((slot->wait.deadline >= 0) && (slot->wait.deadline <= now)) ||
+            LuaDB_SchedBudgetExpired(&slot->budget, now)) {
+            slot->ready = true;
+        }
+    }
+
+    return true;
+}
+
+// Accept new requests into every free slot until no more connections are
+// waiting. Once every slot is taken and the queue is full, the remaining
+// connections are answered with 503 Service Unavailable. Returns false if
+// accepting failed for any reason other than there being no connection
+// left to accept.
+static bool AcceptFcgxRequests(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    for (size_t i = 0; i < t->nslots; i++) {
+        LuaDB_FcgiSlot *slot = &t->slots[i];
+        if (slot->active || slot->queued || (slot->req.ipcFd >= 0)) { continue; }
+
+        int err = FCGX_Accept_r(&slot->req);
+        if ((err == -EAGAIN) || (err == -EWOULDBLOCK) || (err == -EINTR)) {
+            return true;
+        } else if (err < 0) {
+            return false;
+        }
+
+        StartFcgxRequest(t, slot);
+    }
+
+    // Every slot is taken, so make room for waiting connections by closing
+    // the connections which have been idle the longest
+    struct pollfd pending = { .fd = t->sock, .events = POLLIN, .revents = 0 };
+    LuaDB_FcgiSlot *idle;
+    while ((idle = GetOldestIdleFcgxConnection(t)) && (poll(&pending, 1, 0) > 0)) {
+        CloseIdleFcgxConnection(idle);
+
+        int err = FCGX_Accept_r(&idle->req);
+        if ((err == -EAGAIN) || (err == -EWOULDBLOCK) || (err == -EINTR)) {
+            return true;
+        } else if (err < 0) {
+            return false;
+        }
+
+        StartFcgxRequest(t, idle);
+    }
+
+    if ((t->config->queue_size > 0) && (t->nqueued >= (size_t)t->config->queue_size)) {
+        return ShedFcgxRequests(t);
+    }
+    return true;
+}
+
+// Close every kept-alive connection which has been idle for longer than
+// the keep-alive timeout. Each idle connection holds a request slot, so
+// web servers keeping many connections open could otherwise leave no slot
+// free to accept connections from anywhere else.
+static void CloseIdleFcgxConnections(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    if (t->config->keepalive_timeout <= 0) {
+        return;
+    }
+
+    long long now = LuaDB_SchedNow();
+    for (size_t i = 0; i < t->nslots; i++) {
+        LuaDB_FcgiSlot *slot = &t->slots[i];
+        if (slot->active || slot->queued || (slot->req.ipcFd < 0)) { continue; }
+        if (slot->idle_since + t->config->keepalive_timeout <= now) {
+            CloseIdleFcgxConnection(slot);
+        }
+    }
+}
+
+// Return the slot holding the kept-alive connection which has been idle
+// the longest, or NULL if no connection is idle.
+static LuaDB_FcgiSlot *GetOldestIdleFcgxConnection(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    LuaDB_FcgiSlot *oldest = NULL;
+    for (size_t i = 0; i < t->nslots; i++) {
+        LuaDB_FcgiSlot *slot = &t->slots[i];
+        if (slot->active || slot->queued || (slot->req.ipcFd < 0)) { continue; }
+        if (!oldest || (slot->idle_since < oldest->idle_since)) {
+            oldest = slot;
+        }
+    }
+    return oldest;
+}
+
+// Close the idle connection held by the given slot. Nothing is left to
+// send on it, so it is closed at once; libfcgi otherwise waits up to two
+// seconds for the web server to close its end first, which it is not
+// going to do for a connection it means to keep.
+static void CloseIdleFcgxConnection(LuaDB_FcgiSlot *slot) {
+    assert(slot);
+
+    slot->req.detached = 1;
+    FCGX_Free(&slot->req, 1);
+}
+
+// Answer every waiting connection with 503 Service Unavailable without
+// involving Lua, closing each connection afterwards. Returns false if
+// accepting failed for any reason other than there being no connection
+// left to accept.
+static bool ShedFcgxRequests(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    while (true) {
+        int err = FCGX_Accept_r(&t->shed.req);
+        if ((err == -EAGAIN) || (err == -EWOULDBLOCK) || (err == -EINTR)) {
+            return true;
+        } else if (err < 0) {
+            return false;
+        }
+
+        t->shed.start = LuaDB_MetricsNow();
+        t->shed.req.keepConnection = 0;
+        ShedFcgxRequest(t, &t->shed);
+    }
+}
+
+#ifndef _WIN32
+// Fork the given number of worker processes sharing the listening socket
+// and replace any worker which exits until the master is signalled to
+// stop. Each worker is forked from the master after the Lua states have
+// been created and the routing engine loaded, so workers start serving
+// requests immediately.
+static int RunFcgiMaster(LuaDB_FcgiThread *threads, size_t nthreads, size_t nworkers) {
+    assert(threads);
+
+    pid_t *pids = calloc(nworkers, sizeof(pid_t));
+    time_t *started = calloc(nworkers, sizeof(time_t));
+    if (!pids || !started) {
+        syslog(LOG_ERR, "Could not allocate memory for FastCGI workers.");
+        free(pids);
+        free(started);
+        return EXIT_FAILURE;
+    }
+
+    // Stop supervising on SIGTERM and SIGINT; handlers are installed
+    // without SA_RESTART so waitpid is interrupted
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = HandleMasterSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    syslog(LOG_INFO, "Starting %zu FastCGI worker processes", nworkers);
+    for (size_t i = 0; i < nworkers; i++) {
+        pids[i] = SpawnFcgiWorker(threads, nthreads);
+        started[i] = time(NULL);
+    }
+
+    while (!master_shutdown) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        // Find the worker which exited
+        size_t i = 0;
+        for (; (i < nworkers) && (pids[i] != pid); i++);
+        if (i == nworkers) { continue; }
+        pids[i] = 0;
+
+        if (WIFSIGNALED(status)) {
+            syslog(LOG_WARNING, "FastCGI worker %d killed by signal %d",
+                   (int)pid, WTERMSIG(status));
+        } else {
+            syslog(LOG_WARNING, "FastCGI worker %d exited with status %d",
+                   (int)pid, WEXITSTATUS(status));
+        }
+        if (master_shutdown) { break; }
+
+        // Avoid respawning a worker which fails on start in a tight loop
+        if ((time(NULL) - started[i]) < FASTCGI_RESPAWN_DELAY) {
+            sleep((unsigned int)FASTCGI_RESPAWN_DELAY);
+            if (master_shutdown) { break; }
+        }
+        pids[i] = SpawnFcgiWorker(threads, nthreads);
+        started[i] = time(NULL);
+    }
+
+    // Stop every remaining worker
+    syslog(LOG_INFO, "Stopping FastCGI worker processes");
+    for (size_t i = 0; i < nworkers; i++) {
+        if (pids[i] > 0) { kill(pids[i], SIGTERM); }
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        if (pids[i] > 0) { waitpid(pids[i], NULL, 0); }
+    }
+
+    free(pids);
+    free(started);
+    return EXIT_SUCCESS;
+}
+
+// Fork a single worker process which serves requests on the given threads.
+static pid_t SpawnFcgiWorker(LuaDB_FcgiThread *threads, size_t nthreads) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        syslog(LOG_ERR, "Could not fork FastCGI worker process.");
         return 0;
+    } else if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        _exit(RunFcgiThreads(threads, nthreads));
     }
 
-    return 1;
+    return pid;
 }
 
-// Process a single FastCGI request:
-// 1. Create a new LuaDB state.
-// 2. Load in the routing engine specified in user configuration.
-// 3. Call the routing engine with the request table.
-// 4. Process the response from the routing engine and return it to
-//    the web server.
-static LuaDB_FcgxResult ProcessFcgxRequest(FCGX_Request *req, LuaDB_EnvConfig *config, const char **paths, size_t npaths) {
-    // Create a new Lua state
-    lua_State *L = LuaDB_NewStateWithPaths(paths, npaths);
-    if (!L) {
-        syslog(LOG_ERR, "Could not create new lua_State object.");
-        return LUADB_FCGX_ERROR;
+// Signal handler for the master process.
+static void HandleMasterSignal(int sig) {
+    master_shutdown = 1;
+}
+#endif
+
+// Start processing a FastCGI request accepted into the given slot. Metrics
+// requests and requests with a cached response are answered at once. Other
+// requests run if a Lua state is free and no earlier request is waiting
+// for one; otherwise they are queued.
+static LuaDB_FcgxResult StartFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+
+    slot->start = LuaDB_MetricsNow();
+    slot->status = 0;
+
+    // Metrics are served without involving Lua at all
+    if (IsFcgxMetricsRequest(t, slot)) {
+        SendHttpMetrics(&slot->req);
+        EndFcgxRequest(slot);
+        return LUADB_FCGX_SUCCESS;
+    }
+
+    // Cached responses are served without involving Lua either
+    slot->status = LuaDB_CacheServe(&slot->req);
+    if (slot->status != 0) {
+        const char *uri = FCGX_GetParam("DOCUMENT_URI", slot->req.envp);
+        LuaDB_MetricsRecord(uri, slot->status, LuaDB_MetricsNow() - slot->start);
+        EndFcgxRequest(slot);
+        return LUADB_FCGX_SUCCESS;
     }
 
-    // Start the routing engine, which will push a function
-    // onto the stack accepting one parameter (the HTTP request)
-    LuaDB_PathAddAbsolute(L, config->root.val);
-    int err = luaL_dofile(L, config->router.val);
-    if (err) {
-        const char *errmsg = lua_tostring(L, -1);
-        syslog(LOG_ERR, "Error occurred intializing routing engine: %s", errmsg);
-        lua_close(L);
+    if ((t->nbusy >= t->pool.size) || (t->nqueued > 0)) {
+        QueueFcgxRequest(t, slot);
+        return LUADB_FCGX_SUCCESS;
+    }
+    return RunFcgxRequest(t, slot);
+}
+
+// Run a FastCGI request on a free Lua state:
+// 1. Check out a LuaDB state from the pool.
+// 2. Push the routing engine the state loaded from user configuration.
+// 3. Read the request table.
+// 4. Call the routing engine with the request table in a new coroutine,
+//    which runs until the request completes or first waits.
+//
+// Traces begin when the request was accepted, so time spent in the queue
+// counts towards acquiring the state.
+static LuaDB_FcgxResult RunFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+
+    LuaDB_TraceBegin(&slot->trace, slot->start, IsFcgxRequestSampled(t));
+
+    // Check out a Lua state from the pool
+    LuaDB_PoolState *ps = LuaDB_StatePoolAcquire(&t->pool);
+    if (!ps) {
+        syslog(LOG_ERR, "Could not acquire lua_State object from pool.");
+        SendHttpCannedResponse(slot, 503);
+        const char *uri = FCGX_GetParam("DOCUMENT_URI", slot->req.envp);
+        LuaDB_MetricsRecord(uri, slot->status, LuaDB_MetricsNow() - slot->start);
+        EndFcgxRequest(slot);
         return LUADB_FCGX_ERROR;
     }
+    lua_State *L = ps->L;
+    slot->ps = ps;
+    slot->active = true;
+    t->nbusy++;
+
+    // Limit the time and instructions the request may use
+    LuaDB_SchedBudgetInit(&slot->budget, t->config->request_timeout,
+                          t->config->request_max_instructions);
+    LuaDB_SchedSetBudget(L, &slot->budget);
+
+    // Create the coroutine which runs the request; it stays referenced
+    // from the bottom of the state's stack until the request finishes
+    slot->co = lua_newthread(L);
+    LuaDB_SchedSetCurrent(L, slot->co);
+    LuaDB_TraceSetCurrent(L, &slot->trace);
+    LuaDB_TraceMark(&slot->trace, LUADB_TRACE_ACQUIRE);
+
+    // Push the routing engine, which is a function accepting
+    // one parameter (the HTTP request)
+    if (!LuaDB_StatePoolPushRouter(ps)) {
+        syslog(LOG_ERR, "No routing engine loaded from '%s'", t->config->router.val);
+        SendHttpCannedResponse(slot, 500);
+        FinishFcgxRequest(t, slot);
+        return LUADB_FCGX_ERROR;
+    }
+    LuaDB_TraceMark(&slot->trace, LUADB_TRACE_ROUTER);
 
     // Read the HTTP request
-    if (!ReadHttpRequest(L, req, config)) {
+    if (!ReadHttpRequest(L, &slot->req, t->config)) {
         syslog(LOG_ERR, "Error occurred reading HTTP request.");
-        lua_close(L);
+        SendHttpCannedResponse(slot, 500);
+        FinishFcgxRequest(t, slot);
         return LUADB_FCGX_ERROR;
     }
+    LuaDB_TraceMark(&slot->trace, LUADB_TRACE_READ);
 
     // Route the HTTP request using the routing engine from the
     // previous step
-    int success = RouteHttpRequest(L);
-    if (!success) {
-        const char *lua_error = lua_tostring(L, -1);
-        syslog(LOG_ERR, "Error occurred routing HTTP request: %s", lua_error);
-        lua_close(L);
+    lua_xmove(L, slot->co, 2);
+    return ResumeFcgxRequest(t, slot, 1);
+}
+
+// Route an HTTP request through the defined routing engine by resuming
+// the request coroutine. The routing engine should accept one parameter
+// (`request`), which includes all of the request details, and return a
+// single table consisting of the response code, response headers, and
+// response body.
+//
+// If the routing engine waits, the request is left in its slot until the
+// scheduler resumes it. Otherwise, the response is sent to the web server
+// and the request is finished. Requests which fail are answered with a
+// canned error response; requests which ran out of budget (including
+// while waiting) or memory are answered with 503 Service Unavailable.
+//
+// Function and coroutine response bodies are generated by a second
+// request coroutine once the status and headers are sent, so they run
+// under the same limits as the routing engine and may wait just as it
+// can. The request finishes once that coroutine does.
+static LuaDB_FcgxResult ResumeFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot, int nargs) {
+    assert(t);
+    assert(slot);
+    lua_State *L = slot->ps->L;
+    lua_State *co = slot->co;
+
+    int status;
+    if (LuaDB_SchedBudgetExpired(&slot->budget, LuaDB_SchedNow())) {
+        LuaDB_SchedBudgetExceed(&slot->budget);
+        luaL_checkstack(co, 1, "out of memory");
+        lua_pushliteral(co, "request exceeded its time budget");
+        status = LUA_ERRRUN;
+    } else {
+        LuaDB_TraceMark(&slot->trace, LUADB_TRACE_WAIT);
+        LuaDB_AllocatorEnforceLimits(slot->ps->alloc, true);
+        status = lua_resume(co, L, nargs);
+        LuaDB_AllocatorEnforceLimits(slot->ps->alloc, false);
+        LuaDB_TraceMark(&slot->trace, (slot->streaming) ? LUADB_TRACE_SEND : LUADB_TRACE_ROUTE);
+
+        // Routers which caught the budget error are stopped here instead
+        if ((status == LUA_OK || status == LUA_YIELD) && slot->budget.exceeded) {
+            luaL_checkstack(co, 1, "out of memory");
+            lua_pushliteral(co, "request exceeded its budget");
+            status = LUA_ERRRUN;
+        }
+    }
+
+    if (status == LUA_YIELD) {
+        LuaDB_SchedGetWait(co, &slot->wait);
+        return LUADB_FCGX_SUCCESS;
+    }
+
+    // The status and headers were sent before the body was generated, so
+    // errors can no longer change the response
+    if (slot->streaming) {
+        if (status != LUA_OK) {
+            luaL_traceback(L, co, lua_tostring(co, -1), 0);
+            syslog(LOG_ERR, "Error occurred generating HTTP response body: %s",
+                   lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+        FinishFcgxRequest(t, slot);
+        return (status == LUA_OK) ? LUADB_FCGX_SUCCESS : LUADB_FCGX_ERROR;
+    }
+
+    if (status != LUA_OK) {
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        syslog(LOG_ERR, "Error occurred routing HTTP request: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        SendHttpCannedResponse(slot, IsFcgxRequestOverBudget(slot) ? 503 : 500);
+        FinishFcgxRequest(t, slot);
+        return LUADB_FCGX_ERROR;
+    }
+
+    // Keep only the first value returned by the routing engine
+    lua_settop(co, 1);
+    if (!lua_istable(co, -1)) {
+        syslog(LOG_ERR, "Routing engine did not return a response table.");
+        SendHttpCannedResponse(slot, 500);
+        FinishFcgxRequest(t, slot);
         return LUADB_FCGX_ERROR;
     }
 
     // Send the response
-    SendHttpResponse(L, req);
-    lua_close(L);
+    lua_xmove(co, L, 1);
+    LuaDB_Trace *timing = (t->config->trace_header) ? &slot->trace : NULL;
+    slot->status = SendHttpResponse(L, &slot->req, timing);
+    if ((slot->status != 304) && StartHttpResponseBody(slot)) {
+        return ResumeFcgxRequest(t, slot, 2);
+    }
+    LuaDB_TraceMark(&slot->trace, LUADB_TRACE_SEND);
+    FinishFcgxRequest(t, slot);
     return LUADB_FCGX_SUCCESS;
 }
 
-// Route an HTTP request through the defined routing engine. The routing
-// engine is a function call which is assumed to be sitting on the stack.
-// It should accept one parameter (`request`), which includes all of the
-// request details, and return a single table consisting of the response
-// code, response headers, and response body.
-static bool RouteHttpRequest(lua_State *L) {
-    assert(L);
+// Finish the request in the given slot: close the request body,
+// parameters and any transactions left open, return the state to the
+// pool, and complete the request with the web server. States whose
+// request ran out of budget or memory may have been stopped at any point,
+// so they are replaced rather than reused.
+static void FinishFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+    lua_State *L = slot->ps->L;
+
+    LuaDB_CloseRequestBody(L);
+    LuaDB_CloseRequestParams(L);
+    LuaDB_LmdbEndRequest(L);
+    LuaDB_SchedSetCurrent(L, NULL);
+    LuaDB_SchedSetBudget(L, NULL);
+    LuaDB_TraceSetCurrent(L, NULL);
+    LuaDB_ProfileEndRequest(L);
+    LuaDB_StatePoolRelease(&t->pool, slot->ps, IsFcgxRequestOverBudget(slot));
+
+    const char *uri = FCGX_GetParam("DOCUMENT_URI", slot->req.envp);
+    LuaDB_MetricsRecord(uri, slot->status, LuaDB_MetricsNow() - slot->start);
+    if (slot->trace.enabled) {
+        LuaDB_TraceLog(&slot->trace, uri, slot->status);
+    }
+    EndFcgxRequest(slot);
+
+    slot->ps = NULL;
+    slot->co = NULL;
+    slot->streaming = false;
+    slot->active = false;
+    slot->ready = false;
+    t->nbusy--;
+}
+
+// Queue the request in the given slot until a Lua state is free or its
+// queue timeout passes.
+static void QueueFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+
+    slot->queued = true;
+    slot->wait.fd = -1;
+    slot->wait.events = 0;
+    slot->wait.deadline = (t->config->queue_timeout > 0) ?
+                          LuaDB_SchedNow() + t->config->queue_timeout : -1;
+    t->nqueued++;
+    LuaDB_MetricsQueue(1);
+}
+
+// Run queued requests, oldest first, while Lua states are free.
+static void DrainFcgxQueue(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    while ((t->nqueued > 0) && (t->nbusy < t->pool.size)) {
+        LuaDB_FcgiSlot *oldest = NULL;
+        for (size_t i = 0; i < t->nslots; i++) {
+            LuaDB_FcgiSlot *slot = &t->slots[i];
+            if (slot->queued && (!oldest || (slot->start < oldest->start))) {
+                oldest = slot;
+            }
+        }
+        assert(oldest);
+
+        oldest->queued = false;
+        oldest->ready = false;
+        t->nqueued--;
+        LuaDB_MetricsQueue(-1);
+        RunFcgxRequest(t, oldest);
+    }
+
+    if ((t->nqueued == 0) && t->shedding) {
+        syslog(LOG_NOTICE, "Request queue drained; no longer shedding requests.");
+        t->shedding = false;
+    }
+}
 
-    // Call the routing engine function
-    int success = lua_pcall(L, 1, 1, 0);
-    return (success != LUA_OK) ? false : true;
+// Answer the request in the given slot with 503 Service Unavailable
+// without running it, removing it from the queue if it was waiting there.
+// The first request shed after the queue last drained is logged.
+static void ShedFcgxRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+
+    long long waited = LuaDB_MetricsNow() - slot->start;
+    if (slot->queued) {
+        slot->queued = false;
+        slot->ready = false;
+        t->nqueued--;
+        LuaDB_MetricsQueue(-1);
+    }
+
+    if (!t->shedding) {
+        syslog(LOG_WARNING, "Shedding requests: %zu queued, request waited %lld ms.",
+               t->nqueued, waited / 1000000);
+        t->shedding = true;
+    }
+
+    SendHttpCannedResponse(slot, 503);
+    LuaDB_MetricsRecord(FCGX_GetParam("DOCUMENT_URI", slot->req.envp), 503, waited);
+    LuaDB_MetricsShed();
+    EndFcgxRequest(slot);
+}
+
+// Complete the request with the web server. Requests from the HTTP
+// listener are completed by the listener once the handler returns.
+static void EndFcgxRequest(LuaDB_FcgiSlot *slot) {
+    assert(slot);
+
+    if (!slot->local) {
+        FCGX_Finish_r(&slot->req);
+        slot->idle_since = LuaDB_SchedNow();
+    }
+}
+
+// Return the monotonic time (ms) by which the request in the given slot
+// must next be resumed, or -1 if it only waits on its event.
+static long long GetFcgxRequestDeadline(LuaDB_FcgiSlot *slot) {
+    assert(slot);
+
+    long long deadline = slot->wait.deadline;
+    if ((slot->budget.deadline >= 0) &&
+        ((deadline < 0) || (slot->budget.deadline < deadline))) {
+        deadline = slot->budget.deadline;
+    }
+    return deadline;
+}
+
+// Return true if the request in the given slot ran out of time or
+// instructions, or was refused memory for exceeding a limit.
+static bool IsFcgxRequestOverBudget(LuaDB_FcgiSlot *slot) {
+    assert(slot);
+    assert(slot->ps);
+
+    return slot->budget.exceeded || LuaDB_AllocatorLimitHit(slot->ps->alloc);
+}
+
+// Send a complete, fixed response with the given status (500 or 503) to
+// the web server.
+static void SendHttpCannedResponse(LuaDB_FcgiSlot *slot, int status) {
+    assert(slot);
+
+    const char *resp = (status == 503) ? FASTCGI_RESPONSE_UNAVAILABLE : FASTCGI_RESPONSE_ERROR;
+    FCGX_PutStr(resp, (int)strlen(resp), slot->req.out);
+    slot->status = status;
+}
+
+// Return true if the request in the given slot is for the metrics path.
+static bool IsFcgxMetricsRequest(LuaDB_FcgiThread *t, LuaDB_FcgiSlot *slot) {
+    assert(t);
+    assert(slot);
+
+    if (t->config->metrics_path.len == 0) { return false; }
+    const char *uri = FCGX_GetParam("DOCUMENT_URI", slot->req.envp);
+    return uri && (strcmp(uri, t->config->metrics_path.val) == 0);
+}
+
+// Return true if the next request on the given thread should be traced.
+static bool IsFcgxRequestSampled(LuaDB_FcgiThread *t) {
+    assert(t);
+
+    if (t->config->trace_sample_rate <= 0) { return false; }
+    return (t->requests++ % (unsigned long)t->config->trace_sample_rate) == 0;
+}
+
+// Send the metrics for every worker to the web server.
+static void SendHttpMetrics(FCGX_Request *req) {
+    assert(req);
+
+    static const char *const head = "Status: 200\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    FCGX_PutStr(head, (int)strlen(head), req->out);
+    LuaDB_MetricsWrite(req->out, req->listen_sock);
 }
 
 // Read the HTTP response from the Lua State and send it to the web server.
@@ -188,413 +1270,539 @@ static bool RouteHttpRequest(lua_State *L) {
 // values:
 // - `status` : Lua string or number (e.g. "200 OK" or 200)
 // - `headers` : Lua table of HTTP headers
-// - `body` : Lua string or table
-static void SendHttpResponse(lua_State *L, FCGX_Request *req) {
+// - `body` : Lua string, table, function or coroutine
+//
+// The status and headers are assembled into a single buffer and sent to
+// the web server with one write. If `timing` is given, the phases timed
+// so far are added in a Server-Timing header. Returns the numeric
+// response status.
+//
+// Successful responses to GET and HEAD requests may also carry a `cache`
+// table (`{ttl=secs, vary="Header, ..."}`), in which case the response is
+// cached and sent with an ETag header. Requests whose If-None-Match
+// header already matches are answered with 304 Not Modified.
+static int SendHttpResponse(lua_State *L, FCGX_Request *req, LuaDB_Trace *timing) {
     assert(L);
     assert(req);
 
-    SendHttpResponseStatus(L, req);
-    SendHttpResponseHeaders(L, req);
+    LuaDB_FcgxHead head;
+    InitFcgxHead(&head);
+
+    bool has_length = false;
+    int status = AppendHttpResponseStatus(L, &head);
+    AppendHttpResponseHeaders(L, &head, &has_length);
+    if (!has_length) {
+        AppendHttpResponseContentLength(L, &head);
+    }
+
+    char etag[LUADB_CACHE_ETAG_SIZE];
+    if ((status == 200) && CacheHttpResponse(L, req, &head, etag) &&
+        LuaDB_CacheIsNotModified(req->envp, etag)) {
+        FreeFcgxHead(&head);
+        InitFcgxHead(&head);
+        AppendFcgxHead(&head, "Status: 304 Not Modified\r\nETag: ", 32);
+        AppendFcgxHead(&head, etag, strlen(etag));
+        AppendFcgxHead(&head, "\r\n\r\n", 4);
+        if (head.ok) { FCGX_PutStr(head.buf, (int)head.len, req->out); }
+        FreeFcgxHead(&head);
+        return 304;
+    }
+
+    if (timing && timing->enabled) {
+        AppendHttpResponseTiming(timing, &head);
+    }
+    AppendFcgxHead(&head, "\r\n", 2);
+
+    if (head.ok && (head.len <= INT_MAX)) {
+        FCGX_PutStr(head.buf, (int)head.len, req->out);
+    } else {
+        syslog(LOG_ERR, "Could not allocate memory to send response headers.");
+    }
+    FreeFcgxHead(&head);
+
     SendHttpResponseBody(L, req);
+    return status;
 }
 
-// Send the HTTP response status back to the web server from a Lua table
-// assumed to be sitting on the stack.
-static void SendHttpResponseStatus(lua_State *L, FCGX_Request *req) {
+// Cache the response in the table assumed to be sitting on the stack if
+// it has a `cache` table with a positive `ttl`, adding an ETag header to
+// the response head first. Only string bodies and arrays of strings are
+// cached. Returns true and fills `etag` if the response was cached.
+static bool CacheHttpResponse(lua_State *L, FCGX_Request *req, LuaDB_FcgxHead *head, char *etag) {
     assert(L);
     assert(req);
+    assert(head);
+    assert(etag);
+
+    if (!LuaDB_CacheIsCacheable(req->envp)) { return false; }
+
+    luaL_checkstack(L, 4, "Could not allocate memory to cache response");
+    if (lua_getfield(L, -1, "cache") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_getfield(L, -1, "ttl");
+    lua_getfield(L, -2, "vary");
+    lua_Number ttl = lua_tonumber(L, -2);
+    const char *vary = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
+
+    // Arrays of chunks are cached as a single string
+    bool cached = false;
+    int type = lua_getfield(L, -4, "body");
+    if (type == LUA_TTABLE) {
+        int idx = lua_gettop(L);
+        bool strings = true;
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
+        for (lua_Integer i = 1; strings && (i <= n); i++) {
+            strings = (lua_rawgeti(L, idx, i) == LUA_TSTRING);
+            if (strings) {
+                luaL_addvalue(&b);
+            } else {
+                lua_pop(L, 1);
+            }
+        }
+        luaL_pushresult(&b);
+        lua_replace(L, idx);
+        if (strings) { type = LUA_TSTRING; }
+    }
+
+    if ((type == LUA_TSTRING) && (ttl > 0) && head->ok) {
+        size_t len;
+        const char *body = lua_tolstring(L, -1, &len);
+        LuaDB_CacheETag(body, len, etag);
+        AppendFcgxHead(head, "ETag: ", 6);
+        AppendFcgxHead(head, etag, strlen(etag));
+        AppendFcgxHead(head, "\r\n", 2);
+        if (head->ok) {
+            LuaDB_CacheStore(req->envp, (long long)(ttl * 1000), vary, etag,
+                             head->buf, head->len, body, len);
+            cached = true;
+        }
+    }
 
-    // Get the status string
-    luaL_checkstack(L, 3, "Could not allocate memory to send response status");
-    lua_pushlstring(L, "status", 7);
-    size_t statlen;
+    // Pop the body, vary, ttl and cache table
+    lua_pop(L, 4);
+    return cached;
+}
+
+// Add the HTTP response status from a Lua table assumed to be sitting on
+// the stack to the response head. Returns the numeric status code, which
+// is 200 (the web server default) if the response did not set one.
+static int AppendHttpResponseStatus(lua_State *L, LuaDB_FcgxHead *head) {
+    assert(L);
+    assert(head);
+
+    int code = 200;
+    luaL_checkstack(L, 2, "Could not allocate memory to send response status");
+    lua_pushlstring(L, "status", 6);
     int type = lua_gettable(L, -2);
     if (type == LUA_TSTRING || type == LUA_TNUMBER) {
-        const char *status = luaL_tolstring(L, -1, &statlen);
-        FCGX_FPrintF(req->out, "%s\r\n", status);
+        size_t statlen;
+        const char *status = lua_tolstring(L, -1, &statlen);
+        AppendFcgxHead(head, "Status: ", 8);
+        AppendFcgxHead(head, status, statlen);
+        AppendFcgxHead(head, "\r\n", 2);
+
+        // Statuses may include a reason phrase after the code
+        int parsed = 0;
+        for (size_t i = 0; (i < statlen) && (i < 3) && (status[i] >= '0') && (status[i] <= '9'); i++) {
+            parsed = (parsed * 10) + (status[i] - '0');
+        }
+        if (parsed > 0) { code = parsed; }
     }
 
     // Pop the status from the stack
-    if (type != LUA_TNONE) { lua_pop(L, 1); }
+    lua_pop(L, 1);
+    return code;
 }
 
-// Send the HTTP response headers back to the web server from a Lua table
-// assumed to be sitting on the stack.
-static void SendHttpResponseHeaders(lua_State *L, FCGX_Request *req) {
+// Add a Server-Timing header with the request phases timed so far to the
+// response head.
+static void AppendHttpResponseTiming(LuaDB_Trace *trace, LuaDB_FcgxHead *head) {
+    assert(trace);
+    assert(head);
+
+    char timing[FASTCGI_HEAD_BUFFER_SIZE];
+    size_t len = LuaDB_TraceServerTiming(trace, timing, sizeof(timing));
+    if (len >= sizeof(timing)) { return; }
+
+    AppendFcgxHead(head, "Server-Timing: ", 15);
+    AppendFcgxHead(head, timing, len);
+    AppendFcgxHead(head, "\r\n", 2);
+}
+
+// Add the HTTP response headers from a Lua table assumed to be sitting on
+// the stack to the response head. `has_length` is set if the headers
+// include a Content-Length header.
+static void AppendHttpResponseHeaders(lua_State *L, LuaDB_FcgxHead *head, bool *has_length) {
     assert(L);
-    assert(req);
+    assert(head);
+    assert(has_length);
 
     luaL_checkstack(L, 4, "Could not allocate to send response headers");
 
     // Push headers onto the stack
     lua_pushlstring(L, "headers", 7);
-    if (lua_gettable(L, -2) != LUA_TTABLE) { return; }
+    if (lua_gettable(L, -2) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
 
     // Iterate on the response headers
     lua_pushnil(L);
     while (lua_next(L, -2) != 0) {
-        if ((lua_type(L, -2) != LUA_TSTRING) ||
-            (lua_type(L, -1) != LUA_TSTRING))
-        {
+        if ((lua_type(L, -2) != LUA_TSTRING) || !lua_isstring(L, -1)) {
             syslog(LOG_ERR, "HTTP header fields and values must be strings.");
-            luaL_error(L, "HTTP header fields and their values must be strings.");
-            return;
+            lua_pop(L, 1);
+            continue;
         }
-        const char *key = lua_tostring(L, -2);
-        const char *val = lua_tostring(L, -1);
-        FCGX_FPrintF(req->out, "%s: %s\r\n", key, val);
+
+        size_t keylen, vallen;
+        const char *key = lua_tolstring(L, -2, &keylen);
+        const char *val = lua_tolstring(L, -1, &vallen);
+        if ((keylen == 14) && (strncasecmp(key, "Content-Length", 14) == 0)) {
+            *has_length = true;
+        }
+
+        AppendFcgxHead(head, key, keylen);
+        AppendFcgxHead(head, ": ", 2);
+        AppendFcgxHead(head, val, vallen);
+        AppendFcgxHead(head, "\r\n", 2);
         lua_pop(L, 1);  /* pop the value */
     }
 
     // Pop the headers
     lua_pop(L, 1);
+}
 
-    // HTTP header separator
-    FCGX_FPrintF(req->out, "\r\n");
+// Add a Content-Length header to the response head if the length of the
+// response body in the table assumed to be sitting on the stack is known
+// up front (i.e. it is a string or an array of strings).
+static void AppendHttpResponseContentLength(lua_State *L, LuaDB_FcgxHead *head) {
+    assert(L);
+    assert(head);
+
+    luaL_checkstack(L, 3, "Could not allocate memory to send response headers");
+    lua_pushlstring(L, "body", 4);
+    int type = lua_gettable(L, -2);
+
+    size_t len = 0;
+    bool known = true;
+    if (type == LUA_TSTRING) {
+        len = lua_rawlen(L, -1);
+    } else if (type == LUA_TTABLE) {
+        lua_Integer n = (lua_Integer)lua_rawlen(L, -1);
+        for (lua_Integer i = 1; known && (i <= n); i++) {
+            if (lua_rawgeti(L, -1, i) == LUA_TSTRING) {
+                len += lua_rawlen(L, -1);
+            } else {
+                known = false;
+            }
+            lua_pop(L, 1);
+        }
+    } else {
+        known = false;
+    }
+    lua_pop(L, 1);
+
+    if (!known) { return; }
+
+    // Format the length without going through printf
+    char digits[24];
+    size_t pos = sizeof(digits);
+    do {
+        digits[--pos] = (char)('0' + (len % 10));
+        len /= 10;
+    } while (len > 0);
+
+    AppendFcgxHead(head, "Content-Length: ", 16);
+    AppendFcgxHead(head, &digits[pos], sizeof(digits) - pos);
+    AppendFcgxHead(head, "\r\n", 2);
 }
 
 // Send the HTTP response body back to the web server from a Lua table
 // assumed to be sitting on the stack.
+//
+// The body may be given as:
+// - a string, which is written as is
+// - an array of string chunks, which are written in order without
+//   first being concatenated
+//
+// Function and coroutine bodies are left to `StartHttpResponseBody`.
 static void SendHttpResponseBody(lua_State *L, FCGX_Request *req) {
     assert(L);
     assert(req);
 
     luaL_checkstack(L, 2, "Could not allocate memory to send response body");
     lua_pushlstring(L, "body", 4);
-    if (lua_gettable(L, -2) != LUA_TSTRING) { return; }
-    const char *body = lua_tostring(L, -1);
-    FCGX_FPrintF(req->out, "%s", body);
+    switch (lua_gettable(L, -2)) {
+        case LUA_TSTRING:
+            WriteHttpResponseChunk(L, -1, req->out);
+            break;
+        case LUA_TTABLE:
+            SendHttpResponseBodyChunks(L, req);
+            break;
+        default:
+            break;
+    }
+
+    // Pop the body
+    lua_pop(L, 1);
 }
 
-// Read in the HTTP request from the FastCGI server to a Lua table value
-// containing the following fields:
-// - `vars` : server variables
-// - `headers` : any HTTP request headers
-// - `body` : the request body as a string
-//
-// Leaves one unnamed table on the stack to be consumed by the routing
-// engine function (as a parameter).
-static bool ReadHttpRequest(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config) {
+// Send each chunk of an array of chunks assumed to be sitting on the stack.
+static void SendHttpResponseBodyChunks(lua_State *L, FCGX_Request *req) {
     assert(L);
+    assert(req);
 
-    // Add the request object
-    lua_createtable(L, 0, 4);
-
-    // Add the request body
-    bool loaded_body = ReadHttpRequestBody(L, req);
-    if (!loaded_body) { return false; }
-
-    // Add the request headers
-    bool loaded_headers = ReadHttpRequestHeaders(L, req, config);
-    if (!loaded_headers) { return false; }
+    lua_Integer len = (lua_Integer)lua_rawlen(L, -1);
+    for (lua_Integer i = 1; i <= len; i++) {
+        lua_rawgeti(L, -1, i);
+        bool written = WriteHttpResponseChunk(L, -1, req->out);
+        lua_pop(L, 1);
+        if (!written) { return; }
+    }
+}
 
-    // Add any web-server variables
-    bool loaded_vars = ReadHttpRequestVars(L, req, config);
-    if (!loaded_vars) { return false; }
+// Start generating the body of the response table sitting on the stack of
+// the slot's state, if the body is a function or a coroutine. The body is
+// generated by a new request coroutine, which is left in the slot ready
+// to be resumed with its two arguments. Returns false if the response has
+// no such body.
+//
+// A function body is called repeatedly until it returns nil; a coroutine
+// body is resumed until it finishes. Each chunk is flushed to the web
+// server immediately.
+static bool StartHttpResponseBody(LuaDB_FcgiSlot *slot) {
+    assert(slot);
+    assert(slot->ps);
+    lua_State *L = slot->ps->L;
+
+    luaL_checkstack(L, 3, "Could not allocate memory to send response body");
+    lua_CFunction send;
+    switch (lua_getfield(L, -1, "body")) {
+        case LUA_TFUNCTION:
+            send = SendHttpResponseBodyFunction;
+            break;
+        case LUA_TTHREAD:
+            send = SendHttpResponseBodyCoroutine;
+            break;
+        default:
+            lua_pop(L, 1);
+            return false;
+    }
 
-    // Push the request table
+    // The coroutine stays referenced from the state's stack, in place of
+    // the body, until the request finishes
+    lua_State *co = lua_newthread(L);
+    luaL_checkstack(co, 3, "Could not allocate memory to send response body");
+    lua_pushcfunction(co, send);
+    lua_pushlightuserdata(co, slot->req.out);
+    lua_pushvalue(L, -2);
+    lua_xmove(L, co, 1);
+    lua_remove(L, -2);
+
+    slot->co = co;
+    slot->streaming = true;
+    LuaDB_SchedSetCurrent(L, co);
     return true;
 }
 
-// Read in the FastCGI parameters from the web server. Create a new Lua
-// table and push that into the `request` table which is assumed to be
-// sitting on the stack.
-//
-// If a variable matching the FastCGI query string name (default: QUERY_STRING)
-// is found among the variables, it will be parsed into a separate Lua table
-// which will be pushed into the `request` table under the `query` key.
-static bool ReadHttpRequestVars(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config) {
-    assert(L);
-    assert(req);
-    assert(config);
-    const char *qs = NULL;
-
-    luaL_checkstack(L, 4, "Could not allocate memory for request variable table");
+// Send chunks produced by calling the function body until it returns nil.
+// Runs in a request coroutine with the output stream and the function as
+// its arguments; the function may wait as the routing engine can.
+static int SendHttpResponseBodyFunction(lua_State *L) {
+    return SendHttpResponseBodyFunctionK(L, LUA_OK, 0);
+}
 
-    // Create the `request.vars` table
-    lua_pushlstring(L, "vars", 4);
-    lua_createtable(L, 0, FASTCGI_DEFAULT_NUM_VARS);
+// Continue sending a function body; the last chunk produced, if any, sits
+// above the arguments.
+static int SendHttpResponseBodyFunctionK(lua_State *L, int status, lua_KContext ctx) {
+    FCGX_Stream *out = lua_touserdata(L, 1);
+    while ((lua_gettop(L) < 3) || FlushHttpResponseChunk(L, 3, out)) {
+        lua_settop(L, 2);
+        lua_pushvalue(L, 2);
+        lua_callk(L, 0, 1, ctx, SendHttpResponseBodyFunctionK);
+    }
+    return 0;
+}
 
-    // Iterate on every environment variable, looking for HTTP_ prefix
-    char **environ = NULL;
-    environ = req->envp;
-    for (int i = 0; environ[i] != NULL; i++) {
-        // Skip any headers with the prefix HTTP_
-        if (strncmp(environ[i], config->fcgi_header_prefix.val,
-                    config->fcgi_header_prefix.len) == 0) {
-            continue;
-        }
+// Send chunks yielded by the coroutine body until it finishes. A final
+// value returned by the coroutine is also sent. Runs in a request
+// coroutine with the output stream and the coroutine as its arguments.
+//
+// The body coroutine is made the current request coroutine while it runs,
+// so it may wait as the routing engine can; its waits are passed on to the
+// scheduler and it is resumed once the scheduler resumes this coroutine.
+static int SendHttpResponseBodyCoroutine(lua_State *L) {
+    return SendHttpResponseBodyCoroutineK(L, LUA_OK, 0);
+}
 
-        // Find the equals separator for the variable
-        char *sep = strchr(environ[i], FASTCGI_KEY_VALUE_SEP);
-        if (!sep) {
-            syslog(LOG_WARNING, "No '=' separator found in request variable '%s'",
-                   environ[i]);
-            continue;
+// Resume the coroutine body, after it last yielded a chunk or waited.
+static int SendHttpResponseBodyCoroutineK(lua_State *L, int status, lua_KContext ctx) {
+    FCGX_Stream *out = lua_touserdata(L, 1);
+    lua_State *co = lua_tothread(L, 2);
+    lua_settop(L, 2);
+
+    while (true) {
+        LuaDB_SchedSetCurrent(L, co);
+        status = lua_resume(co, L, 0);
+        LuaDB_SchedSetCurrent(L, L);
+
+        if ((status != LUA_OK) && (status != LUA_YIELD)) {
+            lua_xmove(co, L, 1);
+            return lua_error(L);
+        } else if ((status == LUA_YIELD) && LuaDB_SchedIsWaiting(co)) {
+            lua_xmove(co, L, 4);
+            return lua_yieldk(L, 4, ctx, SendHttpResponseBodyCoroutineK);
         }
 
-        // Cache a reference to the query string
-        if (!qs && (strncmp(environ[i], config->fcgi_query.val,
-                            config->fcgi_query.len) == 0)) {
-            qs = sep+1;
+        int nres = lua_gettop(co);
+        luaL_checkstack(L, nres, "Could not allocate memory to send response body");
+        lua_xmove(co, L, nres);
+        bool written = (nres == 0) || lua_isnil(L, -1) || FlushHttpResponseChunk(L, -1, out);
+        lua_settop(L, 2);
+        if (!written || (status == LUA_OK)) {
+            return 0;
         }
+    }
+}
 
-        // Find the length of the key
-        size_t keylen = (size_t)(sep - environ[i]);
+// Write the chunk at the given stack index produced by a response body
+// generator and flush it to the web server. Returns false once the
+// generator has finished (the chunk is nil) or the chunk could not be
+// sent.
+static bool FlushHttpResponseChunk(lua_State *L, int idx, FCGX_Stream *out) {
+    assert(L);
+    assert(out);
 
-        // Force the name to lowercase
-        char *var = ConvertEnvVarToLower(environ[i], keylen);
-        if (!var) { continue; }
+    return !lua_isnil(L, idx) && WriteHttpResponseChunk(L, idx, out) &&
+           (FCGX_FFlush(out) == 0);
+}
 
-        // Push the header key and value into the table
-        lua_pushlstring(L, var, keylen);
-        lua_pushstring(L, sep+1);
-        lua_settable(L, -3);
+// Write a single string (or number) chunk at the given stack index to the
+// FastCGI output stream. Returns false if the chunk is not a string or
+// could not be written.
+static bool WriteHttpResponseChunk(lua_State *L, int idx, FCGX_Stream *out) {
+    assert(L);
+    assert(out);
 
-        // Free the converted header string
-        free(var);
+    if (!lua_isstring(L, idx)) {
+        syslog(LOG_ERR, "HTTP response body chunks must be strings, not %s.",
+               luaL_typename(L, idx));
+        return false;
     }
 
-    lua_settable(L, -3);
-
-    // Create a query table if we found a query string
-    if (qs) {
-        lua_pushlstring(L, "query", 5);
-        if (!ReadHttpRequestQueryString(L, qs, NULL)) {
-            syslog(LOG_WARNING, "Could not parse query string '%s'", qs);
-            lua_pop(L, 1);  // Pop the key if we couldn't parse the query string
-        } else {
-            lua_settable(L, -3);
-        }
+    size_t len;
+    const char *chunk = lua_tolstring(L, idx, &len);
+    while (len > 0) {
+        int n = (len > INT_MAX) ? INT_MAX : (int)len;
+        if (FCGX_PutStr(chunk, n, out) != n) { return false; }
+        chunk += n;
+        len -= (size_t)n;
     }
 
     return true;
 }
 
-// Read in the HTTP request headers from the FastCGI server. Create a new Lua
-// table and push that into the `request` table which is assumed to be
-// sitting on the stack.
+// Read in the HTTP request from the FastCGI server to a Lua table value
+// containing the following fields:
+// - `vars` : server variables
+// - `headers` : any HTTP request headers
+// - `body` : the request body as a string
 //
-// Header names will be converted from their environment variable style
-// names to a more 'correct' HTTP header style using title-casing and
-// underscores will be converted to hyphens. This might mangle certain
-// header names such as "DNT", which will be rendered as "Dnt".
-static bool ReadHttpRequestHeaders(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config) {
+// Leaves one unnamed table on the stack to be consumed by the routing
+// engine function (as a parameter).
+static bool ReadHttpRequest(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config) {
     assert(L);
-    assert(req);
-
-    luaL_checkstack(L, 4, "Could not allocate memory for request headers table");
-
-    // Create the `request.headers` table
-    lua_pushlstring(L, "headers", 7);
-    lua_createtable(L, 0, FASTCGI_DEFAULT_NUM_HEADERS);
-
-    // Iterate on every environment variable, looking for HTTP_ prefix
-    char **environ = NULL;
-    environ = req->envp;
-    for (int i = 0; environ[i] != NULL; i++) {
-        // Skip any headers without the prefix HTTP_
-        if (strncmp(environ[i], config->fcgi_header_prefix.val,
-                    config->fcgi_header_prefix.len) != 0) {
-            continue;
-        }
-
-        // Find the equals separator for the variable
-        char *sep = strchr(environ[i], FASTCGI_KEY_VALUE_SEP);
-        if (!sep) {
-            syslog(LOG_WARNING, "No '=' separator found in header '%s'",
-                   environ[i]);
-            continue;
-        }
-
-        // Find the length of the key
-        size_t keylen = (size_t)(sep - environ[i]);
-        size_t outlen;
 
-        // Convert the environment variable name to a header name
-        char *header = ConvertEnvVarToHeader(&config->fcgi_header_prefix,
-                                             environ[i], keylen, &outlen);
-        if (!header) { continue; }
+    // Add the request object
+    lua_createtable(L, 0, 4);
 
-        // Push the header key and value into the table
-        lua_pushlstring(L, header, outlen);
-        lua_pushstring(L, sep+1);
-        lua_settable(L, -3);
+    // Add the request body
+    bool loaded_body = ReadHttpRequestBody(L, req, config);
+    if (!loaded_body) { return false; }
 
-        // Free the converted header string
-        free(header);
-    }
+    // Add the request headers, web-server variables and query string
+    LuaDB_SetRequestParams(L, -1, req->envp, config);
 
-    // Push the headers table into the `request` table
-    lua_settable(L, -3);
+    // Push the request table
     return true;
 }
 
-// Read in the HTTP request body from the FastCGI server. Read the string
-// value into Lua as a string and push that into the `request` table which
-// is assumed to be sitting on the stack.
-static bool ReadHttpRequestBody(lua_State *L, FCGX_Request *req) {
+// Create the lazy HTTP request body reader and push that into the `request`
+// table which is assumed to be sitting on the stack. Nothing is read from
+// the web server until the routing engine first accesses the body.
+static bool ReadHttpRequestBody(lua_State *L, FCGX_Request *req, LuaDB_EnvConfig *config) {
     assert(L);
     assert(req);
+    assert(config);
 
-    const char *content_length;
-    int body_len;
-
-    // Determine the length of the request body, so we can read it
-    content_length = FCGX_GetParam("CONTENT_LENGTH", req->envp);
-    sscanf(content_length, "%d", &body_len);
-
-    // Allocate memory for the request body
-    luaL_checkstack(L, 2, "Could not allocate memory for request body");
-    char *body = malloc((size_t)body_len + 1);
-    if (!body) { return false; }
-
-    // Read in the request body
-    FCGX_GetStr(body, body_len, req->in);
+    // Determine the expected length of the request body, if it was given
+    size_t len_hint = 0;
+    const char *content_length = FCGX_GetParam("CONTENT_LENGTH", req->envp);
+    if (content_length) {
+        char *end;
+        unsigned long long len = strtoull(content_length, &end, 10);
+        if ((end != content_length) && (len <= SIZE_MAX)) {
+            len_hint = (size_t)len;
+        }
+    }
 
     // Create the `request.body` value
+    luaL_checkstack(L, 2, "Could not allocate memory for request body");
     lua_pushlstring(L, "body", 4);
-    lua_pushlstring(L, body, (size_t)body_len);
+    LuaDB_PushRequestBody(L, req->in, req->ipcFd, len_hint, (size_t)config->body_spill_size);
     lua_settable(L, -3);
-
-    // Free the allocated string and return
-    free(body);
     return true;
 }
 
-// Read the Query String parameter from the FastCGI server and parse it
-// into a Lua table of key-value pairs. Push that into the `request` table
-// assumed to be sitting on the stack.
-//
-// This should be able to handle most common query string cases such as
-// - Multiple query string values with the same key
-// - Keys without a value
-// - Percent encoded query string values (assuming UTF-8 encoded)
-static bool ReadHttpRequestQueryString(lua_State *L, const char *qs, size_t *len) {
-    assert(L);
-    if (!qs) { return false; }
-
-    // Verify we can handle all of these operations
-    luaL_checkstack(L, 6, "out of memory");
-
-    // Set up a query string iterator
-    LuaDB_QueryIter iter;
-    LuaDB_QueryIterInit(&iter, qs, len);
-
-    // Create a table from the query string
-    lua_newtable(L);
-
-    // Iterate over each k/v pair in the query string
-    while (LuaDB_QueryIterNext(&iter)) {
-        // Decode the query string values
-        size_t keylen;
-        char *key = LuaDB_QueryIterKey(&iter, &keylen);
-        if (!key) { continue; }
-        size_t vallen;
-        char *val = LuaDB_QueryIterVal(&iter, &vallen);
-
-        // Push the key onto the stack twice
-        lua_pushlstring(L, key, keylen);
-        lua_pushvalue(L, -1);   // Duplicate the value, since we'll need it
-
-        int type = lua_gettable(L, -3); // Pops the second value
-        if (type == LUA_TTABLE) {       // There were previously values by this name
-            // Get the next array index (#table + 1)
-            lua_len(L, -1);
-            lua_pushinteger(L, 1);
-            lua_arith(L, LUA_OPADD);
-
-            // Add the next query string value at that index
-            PushQueryValueString(L, key, keylen, val, vallen);
-            lua_settable(L, -3);
-            lua_pop(L, 1);
-        } else if ((type == LUA_TNIL) || (type == LUA_TNONE)) { // Not seen before
-            // Add the k/v pair into the table
-            if (type == LUA_TNIL) { lua_pop(L, 1); }
-            PushQueryValueString(L, key, keylen, val, vallen);
-            lua_settable(L, -3);
-        } else {    // This value has been seen once before; need to make it an array
-            lua_createtable(L, 2, 0);
-            lua_rotate(L, -2, 1);       // Swap the table and original value
-            lua_pushinteger(L, 1);      // Push the integer 1 (future key)
-            lua_rotate(L, -2, 1);       // Swap the integer key and value
-            lua_settable(L, -3);        // Set the original key with a new table
-            lua_pushinteger(L, 2);      // Start pushing in the second (new) key
-            PushQueryValueString(L, key, keylen, val, vallen);
-            lua_settable(L, -3);        // Set the new key/value pair into table
-            lua_settable(L, -3);        // Finally, set the table into the query table
-        }
-
-        free(key);
-        free(val);
-    }
+// Prepare an empty response head using its built-in buffer.
+static void InitFcgxHead(LuaDB_FcgxHead *head) {
+    assert(head);
 
-    return true;
+    head->buf = head->local;
+    head->len = 0;
+    head->cap = sizeof(head->local);
+    head->ok = true;
 }
 
-// Push an empty string if the query string value is NULL.
-//
-// Since the equivalent Lua value is Nil, which is also how one checks if
-// a key is not in a table, we need to push an empty string so that callers
-// can still check for the query string key in the table.
-static inline void PushQueryValueString(lua_State *L, const char *key, size_t keylen, const char *val, size_t vallen) {
-    assert(L);
+// Append a string to the response head, moving the head onto the heap if
+// it outgrows its built-in buffer.
+static void AppendFcgxHead(LuaDB_FcgxHead *head, const char *s, size_t len) {
+    assert(head);
+    if (!head->ok) { return; }
 
-    if ((keylen > 0) && (key)) {
-        lua_pushlstring(L, val, vallen);
-    } else {
-        lua_pushstring(L, "");
-    }
-}
-
-// Convert the FastCGI environment variable header names to standard
-// HTTP header names (e.g. HTTP_CONTENT_LENGTH to Content-Length).
-//
-// This function assumes that the `in` pointer contains a 5 character
-// prefix of 'HTTP_', so the length will be reduced by that many chars.
-//
-// This function also assumes that HTTP Header keys are ASCII encoded,
-// which is currently required by RFC 2616 for HTTP Headers.
-static char*ConvertEnvVarToHeader(LuaDB_Setting *pfx, const char *in, size_t len, size_t *outlen) {
-    *outlen = len - pfx->len;
-    char *header = malloc(*outlen + 1);
-    if (!header) { return NULL; }
-
-    bool first = true;
-    for (size_t i = 0; i < (*outlen); i++) {
-        char cur = in[i+pfx->len];
-
-        // Convert all underscores to hyphens
-        if (cur == '_') {
-            cur = '-';
-            first = true;
-        } else {
-            // Convert the first letter of any word to uppercase;
-            // the subsequent letters are all lowercase
-            if (first) {
-                cur = (char) toupper(cur);
-                first = false;
-            } else {
-                cur = (char) tolower(cur);
-            }
+    if ((head->cap - head->len) < len) {
+        size_t cap = head->cap * 2;
+        while ((cap - head->len) < len) {
+            cap *= 2;
         }
 
-        header[i] = cur;
+        char *buf = (head->buf == head->local) ? malloc(cap) : realloc(head->buf, cap);
+        if (!buf) {
+            head->ok = false;
+            return;
+        }
+        if (head->buf == head->local) {
+            memcpy(buf, head->local, head->len);
+        }
+        head->buf = buf;
+        head->cap = cap;
     }
 
-    header[*outlen] = '\0';
-    return header;
+    memcpy(&head->buf[head->len], s, len);
+    head->len += len;
 }
 
-// Convert the FastCGI environment variable name to lower case.
-static char*ConvertEnvVarToLower(const char *in, size_t len) {
-    char *header = malloc(len + 1);
-    if (!header) { return NULL; }
+// Free the response head if it outgrew its built-in buffer.
+static void FreeFcgxHead(LuaDB_FcgxHead *head) {
+    assert(head);
 
-    for (size_t i = 0; i < len; i++) {
-        header[i] = (char)tolower(in[i]);
+    if (head->buf != head->local) {
+        free(head->buf);
     }
-
-    header[len] = '\0';
-    return header;
+    head->buf = NULL;
 }
@@ -11,6 +11,21 @@
 #ifndef LUADB_FCGI_H
 #define LUADB_FCGI_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Options for starting a LuaDB FastCGI worker.
+ */
+typedef struct LuaDB_FcgiOpts {
+    const char **paths;     /** additional Lua include paths */
+    size_t npaths;          /** number of Lua include paths in @c paths */
+    long threads;           /** number of request threads; 0 to use configuration */
+    long workers;           /** number of worker processes; 0 to use configuration */
+    bool http;              /** serve HTTP/1.1 directly rather than FastCGI */
+    const char *config;     /** configuration file; NULL for the default */
+} LuaDB_FcgiOpts;
+
 /**
  * @brief Start a LuaDB FastCGI worker listening on the specified device.
  *
@@ -30,4 +45,19 @@ int LuaDB_FcgiStartWorker(const char *device);
  */
 int LuaDB_FcgiStartWorkerWithPaths(const char *device, const char **paths, size_t npaths);
 
+/**
+ * @brief Start a LuaDB FastCGI worker listening on the specified device
+ * with the given options.
+ *
+ * Each request thread accepts connections on the same socket and owns
+ * its own pool of Lua states. If worker processes are requested, this
+ * process becomes a master which forks that many workers and replaces
+ * any worker which exits.
+ *
+ * @param device the file/device to listen for FastCGI connections
+ * @param opts the worker options
+ * @returns a system exit code indicating failure or success
+ */
+int LuaDB_FcgiStartWorkerWithOpts(const char *device, LuaDB_FcgiOpts *opts);
+
 #endif //LUADB_FCGI_H
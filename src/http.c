@@ -0,0 +1,1258 @@
+/*****************************************************************************
+ * LuaDB :: http.c
+ *
+ * Native HTTP/1.1 listener.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+// getaddrinfo, gmtime_r and MSG_NOSIGNAL are not part of C99
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "deps/fcgi/fcgiapp.h"
+
+#include "http.h"
+#include "log.h"
+#include "profile.h"
+#include "sched.h"
+
+#ifdef __linux__
+
+#define LUADB_HTTP_MAX_VARS 128
+#define LUADB_HTTP_MAX_EVENTS 64
+#define LUADB_HTTP_DATE_SIZE 32
+
+// Largest request head and body accepted; larger requests are refused
+static const size_t LUADB_HTTP_MAX_HEAD = 65536;
+static const size_t LUADB_HTTP_MAX_BODY = 16777216;
+
+// Pipelined requests are not served while this much output is waiting
+// for a slow client
+static const size_t LUADB_HTTP_MAX_PENDING = 262144;
+
+// Initial size and read size of connection and response buffers
+static const size_t LUADB_HTTP_BUFFER_SIZE = 16384;
+
+// Buffers grown past this size by a large request are released once idle
+static const size_t LUADB_HTTP_KEEP_BUFFER_SIZE = 1048576;
+
+typedef struct LuaDB_HttpBuffer {
+    char *buf;
+    size_t len;
+    size_t cap;
+} LuaDB_HttpBuffer;
+
+// A request parsed from the start of a connection's input
+typedef struct LuaDB_HttpRequest {
+    size_t len;                     // bytes of input used by the request
+    char *body;
+    size_t body_len;
+    bool keep_alive;
+    bool head;                      // HEAD request; the body is not sent
+    bool http10;                    // HTTP/1.0 request
+    bool expect;                    // the client sent Expect: 100-continue
+    int error;                      // HTTP status if the request is invalid
+} LuaDB_HttpRequest;
+
+// A single client connection. Each connection serves one request at a
+// time, so the request being served lives with its connection until the
+// handler finishes it.
+typedef struct LuaDB_HttpConn {
+    int fd;
+    LuaDB_HttpBuffer in;            // unread request data
+    LuaDB_HttpBuffer out;           // response data not yet sent
+    size_t sent;                    // bytes of `out` already sent
+    unsigned int events;            // epoll events the connection waits on
+    bool eof;                       // the client closed its end
+    bool close;                     // close once `out` is sent
+    bool continued;                 // sent 100 Continue for the current request
+    bool pending;                   // the current request waits on an event
+    bool stalled;                   // the current request could not be started
+    char addr[INET6_ADDRSTRLEN];
+    char port[8];
+    LuaDB_HttpRequest req;          // the current request
+    LuaDB_HttpBuffer env;           // CGI variables for the current request
+    size_t vars[LUADB_HTTP_MAX_VARS];
+    size_t nvars;
+    char *envp[LUADB_HTTP_MAX_VARS + 1];
+    LuaDB_HttpBuffer resp;          // CGI response from the handler
+    FCGX_Stream body;               // request body presented to the handler
+    FCGX_Stream output;             // writes to `resp`
+    LuaDB_HttpCall call;
+    int wait_fd;                    // descriptor watched for `call`, or -1
+    bool wait_dup;                  // `wait_fd` is a duplicate to close
+    struct LuaDB_HttpConn *prev;    // neighbors in the pending or stalled list
+    struct LuaDB_HttpConn *next;
+} LuaDB_HttpConn;
+
+typedef enum LuaDB_HttpParse {
+    LUADB_HTTP_PARSE_DONE,
+    LUADB_HTTP_PARSE_MORE,
+    LUADB_HTTP_PARSE_ERROR,
+} LuaDB_HttpParse;
+
+// A single event loop thread. Connections whose request waits are kept
+// in the pending list; those whose request could not be started yet are
+// kept in the stalled list, oldest first, until another request finishes.
+typedef struct LuaDB_HttpThread {
+    int sock;
+    int ep;
+    const LuaDB_HttpHandler *handler;
+    void *arg;
+    LuaDB_HttpConn *pending;
+    LuaDB_HttpConn *stalled;
+    LuaDB_HttpConn *stalled_tail;
+    bool finished;                  // a request finished since stalled requests were retried
+    time_t date_time;
+    char date[LUADB_HTTP_DATE_SIZE];
+} LuaDB_HttpThread;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static void AcceptHttpConnections(LuaDB_HttpThread *t);
+static void HandleHttpEvent(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, unsigned int events);
+static void ServeHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static bool ServeHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static void FinishHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static void ResumeHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static void ResumeExpiredHttpRequests(LuaDB_HttpThread *t);
+static void ServeStalledHttpConnections(LuaDB_HttpThread *t);
+static int GetHttpTimeout(LuaDB_HttpThread *t);
+static bool WatchHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, unsigned int events);
+static void WatchHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static void UnwatchHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static bool ReadHttpConnection(LuaDB_HttpConn *conn);
+static bool FlushHttpConnection(LuaDB_HttpConn *conn);
+static void CloseHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn);
+static LuaDB_HttpParse ParseHttpRequest(LuaDB_HttpConn *conn, LuaDB_HttpRequest *req);
+static bool ParseHttpRequestLine(LuaDB_HttpConn *conn, char *line, size_t len, LuaDB_HttpRequest *req);
+static bool ParseHttpHeader(LuaDB_HttpConn *conn, char *line, size_t len, LuaDB_HttpRequest *req);
+static bool AddHttpVar(LuaDB_HttpConn *conn, const char *name, const char *val, size_t len);
+static bool AddHttpPathVar(LuaDB_HttpConn *conn, const char *path, size_t len);
+static void AppendHttpResponse(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, LuaDB_HttpRequest *req);
+static void AppendHttpError(LuaDB_HttpConn *conn, int status);
+static const char *GetHttpReason(int status);
+static const char *GetHttpDate(LuaDB_HttpThread *t);
+static char *FindHttpLineEnd(char *buf, size_t len);
+static bool HasHttpToken(const char *val, size_t len, const char *token);
+static void FillHttpStream(FCGX_Stream *stream);
+static void GrowHttpStream(FCGX_Stream *stream, int doClose);
+static bool ReserveHttpBuffer(LuaDB_HttpBuffer *b, size_t extra);
+static bool AppendHttpBuffer(LuaDB_HttpBuffer *b, const char *s, size_t len);
+static void ReleaseHttpBuffer(LuaDB_HttpBuffer *b);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+int LuaDB_HttpOpenSocket(const char *device, int backlog) {
+    assert(device);
+
+    // Split the optional host from the port
+    char host[256] = "";
+    const char *port = device;
+    const char *sep = strrchr(device, ':');
+    if (sep) {
+        size_t hostlen = (size_t)(sep - device);
+        if (hostlen >= sizeof(host)) {
+            syslog(LOG_ERR, "Invalid HTTP listen address '%s'", device);
+            return -1;
+        }
+        memcpy(host, device, hostlen);
+        host[hostlen] = '\0';
+        port = sep + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *addrs;
+    int err = getaddrinfo((*host) ? host : NULL, port, &hints, &addrs);
+    if (err != 0) {
+        syslog(LOG_ERR, "Could not resolve HTTP listen address '%s': %s", device, gai_strerror(err));
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *a = addrs; a && (sock == -1); a = a->ai_next) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock == -1) { continue; }
+
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if ((bind(sock, a->ai_addr, a->ai_addrlen) == -1) || (listen(sock, backlog) == -1)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (sock == -1) {
+        syslog(LOG_ERR, "Could not open HTTP socket '%s': %s", device, strerror(errno));
+        return -1;
+    }
+
+    // Every thread waits on the listening socket, so accepting must never
+    // block once another thread took the connection
+    int flags = fcntl(sock, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        syslog(LOG_ERR, "Could not set HTTP socket '%s' non-blocking", device);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+bool LuaDB_HttpRunThread(int sock, const LuaDB_HttpHandler *handler, void *arg) {
+    assert(handler);
+
+    LuaDB_HttpThread t;
+    memset(&t, 0, sizeof(t));
+    t.sock = sock;
+    t.handler = handler;
+    t.arg = arg;
+
+    t.ep = epoll_create1(0);
+    if (t.ep == -1) {
+        syslog(LOG_ERR, "Could not create HTTP event loop: %s", strerror(errno));
+        return false;
+    }
+
+    // Threads which lose the race for a new connection go back to waiting
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t.ep, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        syslog(LOG_ERR, "Could not watch HTTP socket: %s", strerror(errno));
+        close(t.ep);
+        return false;
+    }
+
+    struct epoll_event events[LUADB_HTTP_MAX_EVENTS];
+    while (true) {
+        int n = epoll_wait(t.ep, events, LUADB_HTTP_MAX_EVENTS, GetHttpTimeout(&t));
+        if (n == -1) {
+            if (errno == EINTR) {
+                LuaDB_ProfileCheck();
+                continue;
+            }
+            syslog(LOG_ERR, "Could not wait for HTTP events: %s", strerror(errno));
+            break;
+        }
+
+        // Connections with a waiting request are not watched themselves, so
+        // their events are always for the event the request waits on
+        for (int i = 0; i < n; i++) {
+            LuaDB_HttpConn *conn = events[i].data.ptr;
+            if (!conn) {
+                AcceptHttpConnections(&t);
+            } else if (conn->pending) {
+                ResumeHttpRequest(&t, conn);
+            } else {
+                HandleHttpEvent(&t, conn, events[i].events);
+            }
+        }
+
+        ResumeExpiredHttpRequests(&t);
+        ServeStalledHttpConnections(&t);
+        LuaDB_ProfileCheck();
+    }
+
+    close(t.ep);
+    return false;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Accept every connection waiting on the listening socket.
+static void AcceptHttpConnections(LuaDB_HttpThread *t) {
+    assert(t);
+
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept(t->sock, (struct sockaddr *)&addr, &addrlen);
+        if (fd == -1) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                syslog(LOG_WARNING, "Could not accept HTTP connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // Responses are written whole, so there is nothing to gain from
+        // delaying small writes
+        int on = 1;
+        int flags = fcntl(fd, F_GETFL, 0);
+        LuaDB_HttpConn *conn = calloc(1, sizeof(LuaDB_HttpConn));
+        if (!conn || (flags == -1) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+            syslog(LOG_ERR, "Could not set up HTTP connection.");
+            free(conn);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->wait_fd = -1;
+        if (addr.ss_family == AF_INET) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+            inet_ntop(AF_INET, &in->sin_addr, conn->addr, sizeof(conn->addr));
+            snprintf(conn->port, sizeof(conn->port), "%u", (unsigned int)ntohs(in->sin_port));
+        } else if (addr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+            inet_ntop(AF_INET6, &in6->sin6_addr, conn->addr, sizeof(conn->addr));
+            snprintf(conn->port, sizeof(conn->port), "%u", (unsigned int)ntohs(in6->sin6_port));
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(t->ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            syslog(LOG_ERR, "Could not watch HTTP connection: %s", strerror(errno));
+            free(conn);
+            close(fd);
+        }
+    }
+}
+
+// Read from and write to a connection as its events allow.
+static void HandleHttpEvent(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, unsigned int events) {
+    assert(t);
+    assert(conn);
+
+    if (events & EPOLLERR) {
+        CloseHttpConnection(t, conn);
+        return;
+    }
+    if ((events & EPOLLOUT) && !FlushHttpConnection(conn)) {
+        CloseHttpConnection(t, conn);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP)) && !ReadHttpConnection(conn)) {
+        CloseHttpConnection(t, conn);
+        return;
+    }
+
+    ServeHttpConnection(t, conn);
+}
+
+// Serve every complete request read from the connection, unless too much
+// output is already waiting for the client, and send the responses. The
+// connection waits for more requests or to send the remaining output.
+static void ServeHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    while (!conn->close && !conn->pending && !conn->stalled &&
+           ((conn->out.len - conn->sent) < LUADB_HTTP_MAX_PENDING)) {
+        if (!ServeHttpRequest(t, conn)) { break; }
+    }
+
+    if (!FlushHttpConnection(conn)) {
+        CloseHttpConnection(t, conn);
+        return;
+    }
+
+    // Stop reading while output is waiting, so a client which does not
+    // read its responses cannot make the connection buffer without limit.
+    // Connections are not watched at all while their request is waiting;
+    // the request input must stay where it is and the rest of the output
+    // is sent once the request finishes.
+    unsigned int events = EPOLLIN;
+    if (conn->pending || conn->stalled) {
+        events = 0;
+    } else if (conn->sent < conn->out.len) {
+        events = EPOLLOUT;
+    } else if (conn->close || conn->eof) {
+        CloseHttpConnection(t, conn);
+        return;
+    }
+
+    if (!WatchHttpConnection(t, conn, events)) {
+        CloseHttpConnection(t, conn);
+    }
+}
+
+// Serve the request at the start of the connection's input, if all of it
+// has arrived. Returns true if a request was served. Requests which wait
+// or could not be started yet are left with the connection, which is
+// served again once the request finishes or may be started.
+static bool ServeHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    LuaDB_HttpRequest *req = &conn->req;
+    switch (ParseHttpRequest(conn, req)) {
+        case LUADB_HTTP_PARSE_MORE:
+            // Clients which asked may now send the body
+            if (req->expect && !conn->continued) {
+                static const char *const cont = "HTTP/1.1 100 Continue\r\n\r\n";
+                AppendHttpBuffer(&conn->out, cont, strlen(cont));
+                conn->continued = true;
+            }
+            return false;
+        case LUADB_HTTP_PARSE_ERROR:
+            AppendHttpError(conn, req->error);
+            return false;
+        case LUADB_HTTP_PARSE_DONE:
+            break;
+    }
+
+    // Present the request body and response as FastCGI streams
+    FCGX_Stream *in = &conn->body;
+    memset(in, 0, sizeof(FCGX_Stream));
+    in->isReader = 1;
+    in->rdNext = (unsigned char *)req->body;
+    in->stop = in->rdNext + req->body_len;
+    in->stopUnget = in->rdNext;
+    in->wrNext = in->stop;
+    in->fillBuffProc = FillHttpStream;
+
+    conn->resp.len = 0;
+    if (!ReserveHttpBuffer(&conn->resp, LUADB_HTTP_BUFFER_SIZE)) {
+        AppendHttpError(conn, 503);
+        return false;
+    }
+    FCGX_Stream *out = &conn->output;
+    memset(out, 0, sizeof(FCGX_Stream));
+    out->wrNext = (unsigned char *)conn->resp.buf;
+    out->stop = (unsigned char *)conn->resp.buf + conn->resp.cap;
+    out->rdNext = out->stop;
+    out->emptyBuffProc = GrowHttpStream;
+    out->data = &conn->resp;
+
+    for (size_t i = 0; i < conn->nvars; i++) {
+        conn->envp[i] = conn->env.buf + conn->vars[i];
+    }
+    conn->envp[conn->nvars] = NULL;
+
+    memset(&conn->call, 0, sizeof(LuaDB_HttpCall));
+    conn->call.in = in;
+    conn->call.out = out;
+    conn->call.envp = conn->envp;
+    conn->call.fd = -1;
+    conn->call.deadline = -1;
+
+    switch (t->handler->start(t->arg, &conn->call)) {
+        case LUADB_HTTP_BUSY:
+            conn->stalled = true;
+            conn->prev = t->stalled_tail;
+            conn->next = NULL;
+            if (t->stalled_tail) {
+                t->stalled_tail->next = conn;
+            } else {
+                t->stalled = conn;
+            }
+            t->stalled_tail = conn;
+            return false;
+        case LUADB_HTTP_WAIT:
+            conn->pending = true;
+            conn->prev = NULL;
+            conn->next = t->pending;
+            if (t->pending) { t->pending->prev = conn; }
+            t->pending = conn;
+            WatchHttpRequest(t, conn);
+            return false;
+        case LUADB_HTTP_DONE:
+            break;
+    }
+
+    FinishHttpRequest(t, conn);
+    return true;
+}
+
+// Add the response to the request the handler finished to the connection
+// output and discard the request from the connection input.
+static void FinishHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    LuaDB_HttpRequest *req = &conn->req;
+    conn->resp.len = (size_t)((char *)conn->output.wrNext - conn->resp.buf);
+    if (conn->output.FCGI_errno != 0) { conn->resp.len = 0; }
+    AppendHttpResponse(t, conn, req);
+    if (conn->resp.cap > LUADB_HTTP_KEEP_BUFFER_SIZE) { ReleaseHttpBuffer(&conn->resp); }
+
+    memmove(conn->in.buf, conn->in.buf + req->len, conn->in.len - req->len);
+    conn->in.len -= req->len;
+    conn->continued = false;
+    if (!req->keep_alive) { conn->close = true; }
+    t->finished = true;
+}
+
+// Resume the waiting request on the given connection. Once it finishes,
+// the connection serves any requests pipelined behind it.
+static void ResumeHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+    assert(conn->pending);
+
+    UnwatchHttpRequest(t, conn);
+    if (t->handler->resume(t->arg, &conn->call) == LUADB_HTTP_WAIT) {
+        WatchHttpRequest(t, conn);
+        return;
+    }
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        t->pending = conn->next;
+    }
+    if (conn->next) { conn->next->prev = conn->prev; }
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->pending = false;
+
+    FinishHttpRequest(t, conn);
+    ServeHttpConnection(t, conn);
+}
+
+// Resume every waiting request whose deadline has passed.
+static void ResumeExpiredHttpRequests(LuaDB_HttpThread *t) {
+    assert(t);
+
+    long long now = LuaDB_SchedNow();
+    LuaDB_HttpConn *next;
+    for (LuaDB_HttpConn *conn = t->pending; conn; conn = next) {
+        next = conn->next;
+        if ((conn->call.deadline >= 0) && (conn->call.deadline <= now)) {
+            ResumeHttpRequest(t, conn);
+        }
+    }
+}
+
+// Serve stalled connections, oldest first, once requests have finished
+// to make room for them and until the handler has no more room.
+static void ServeStalledHttpConnections(LuaDB_HttpThread *t) {
+    assert(t);
+
+    while (t->stalled && t->finished) {
+        LuaDB_HttpConn *conn = t->stalled;
+        t->stalled = conn->next;
+        if (t->stalled) {
+            t->stalled->prev = NULL;
+        } else {
+            t->stalled_tail = NULL;
+        }
+        conn->next = NULL;
+        conn->stalled = false;
+        ServeHttpConnection(t, conn);
+
+        // Connections which stalled again keep their place in line
+        if (conn->stalled) {
+            if (conn != t->stalled) {
+                t->stalled_tail = conn->prev;
+                t->stalled_tail->next = NULL;
+                conn->prev = NULL;
+                conn->next = t->stalled;
+                t->stalled->prev = conn;
+                t->stalled = conn;
+            }
+            break;
+        }
+    }
+    t->finished = false;
+}
+
+// Return the time (ms) until the earliest waiting request must be
+// resumed, or -1 if every waiting request only waits on its event.
+static int GetHttpTimeout(LuaDB_HttpThread *t) {
+    assert(t);
+
+    long long now = LuaDB_SchedNow();
+    long long timeout = -1;
+    for (LuaDB_HttpConn *conn = t->pending; conn; conn = conn->next) {
+        if (conn->call.deadline < 0) { continue; }
+        long long remaining = conn->call.deadline - now;
+        if (remaining < 0) { remaining = 0; }
+        if ((timeout < 0) || (remaining < timeout)) { timeout = remaining; }
+    }
+    return (timeout > INT_MAX) ? INT_MAX : (int)timeout;
+}
+
+// Change the epoll events the connection waits on; connections waiting on
+// no events are not watched at all. Returns false if the events could not
+// be changed.
+static bool WatchHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, unsigned int events) {
+    assert(t);
+    assert(conn);
+
+    if (events == conn->events) { return true; }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    int op = (events == 0) ? EPOLL_CTL_DEL : ((conn->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(t->ep, op, conn->fd, &ev) == -1) { return false; }
+    conn->events = events;
+    return true;
+}
+
+// Watch the descriptor the connection's request waits on. epoll watches
+// each descriptor once, so requests waiting on a descriptor which is
+// already watched watch a duplicate of it. Requests whose descriptor could
+// not be watched are resumed at once to check it themselves.
+static void WatchHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    conn->wait_fd = -1;
+    conn->wait_dup = false;
+    if (conn->call.fd < 0) { return; }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((conn->call.events & POLLIN) ? EPOLLIN : 0) |
+                ((conn->call.events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+
+    int fd = conn->call.fd;
+    if (epoll_ctl(t->ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        int dupfd = (errno == EEXIST) ? dup(conn->call.fd) : -1;
+        fd = -1;
+        if ((dupfd != -1) && (epoll_ctl(t->ep, EPOLL_CTL_ADD, dupfd, &ev) == 0)) {
+            fd = dupfd;
+            conn->wait_dup = true;
+        } else if (dupfd != -1) {
+            close(dupfd);
+        }
+    }
+
+    if (fd == -1) {
+        syslog(LOG_WARNING, "Could not watch HTTP request event: %s", strerror(errno));
+        conn->call.deadline = LuaDB_SchedNow();
+        return;
+    }
+    conn->wait_fd = fd;
+}
+
+// Stop watching the descriptor the connection's request waited on.
+static void UnwatchHttpRequest(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    if (conn->wait_fd < 0) { return; }
+    epoll_ctl(t->ep, EPOLL_CTL_DEL, conn->wait_fd, NULL);
+    if (conn->wait_dup) { close(conn->wait_fd); }
+    conn->wait_fd = -1;
+    conn->wait_dup = false;
+}
+
+// Read everything the client has sent so far. Returns false if the
+// connection failed.
+static bool ReadHttpConnection(LuaDB_HttpConn *conn) {
+    assert(conn);
+
+    while (conn->in.len < (LUADB_HTTP_MAX_HEAD + LUADB_HTTP_MAX_BODY)) {
+        if (!ReserveHttpBuffer(&conn->in, LUADB_HTTP_BUFFER_SIZE)) { return false; }
+
+        ssize_t n = read(conn->fd, conn->in.buf + conn->in.len, conn->in.cap - conn->in.len);
+        if (n > 0) {
+            conn->in.len += (size_t)n;
+        } else if (n == 0) {
+            conn->eof = true;
+            return true;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Send as much waiting output as the client will take. Returns false if
+// the connection failed.
+static bool FlushHttpConnection(LuaDB_HttpConn *conn) {
+    assert(conn);
+
+    while (conn->sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.buf + conn->sent,
+                         conn->out.len - conn->sent, MSG_NOSIGNAL);
+        if (n >= 0) {
+            conn->sent += (size_t)n;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    conn->out.len = 0;
+    conn->sent = 0;
+    if (conn->out.cap > LUADB_HTTP_KEEP_BUFFER_SIZE) { ReleaseHttpBuffer(&conn->out); }
+    if ((conn->in.len == 0) && (conn->in.cap > LUADB_HTTP_KEEP_BUFFER_SIZE)) {
+        ReleaseHttpBuffer(&conn->in);
+    }
+    return true;
+}
+
+// Close a connection and free its buffers.
+static void CloseHttpConnection(LuaDB_HttpThread *t, LuaDB_HttpConn *conn) {
+    assert(t);
+    assert(conn);
+
+    epoll_ctl(t->ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    ReleaseHttpBuffer(&conn->in);
+    ReleaseHttpBuffer(&conn->out);
+    ReleaseHttpBuffer(&conn->env);
+    ReleaseHttpBuffer(&conn->resp);
+    free(conn);
+}
+
+// Parse the request at the start of the connection's input into the CGI
+// variables of the connection. `req->expect` is set if more input is needed
+// and the client is waiting for permission to send the body.
+static LuaDB_HttpParse ParseHttpRequest(LuaDB_HttpConn *conn, LuaDB_HttpRequest *req) {
+    assert(conn);
+    assert(req);
+
+    memset(req, 0, sizeof(LuaDB_HttpRequest));
+    conn->env.len = 0;
+    conn->nvars = 0;
+
+    // Ignore empty lines before a request
+    size_t skip = 0;
+    while ((skip + 1 < conn->in.len) && (conn->in.buf[skip] == '\r') && (conn->in.buf[skip + 1] == '\n')) {
+        skip += 2;
+    }
+    if (skip > 0) {
+        memmove(conn->in.buf, conn->in.buf + skip, conn->in.len - skip);
+        conn->in.len -= skip;
+    }
+
+    char *buf = conn->in.buf;
+    size_t len = (conn->in.len < LUADB_HTTP_MAX_HEAD) ? conn->in.len : LUADB_HTTP_MAX_HEAD;
+    char *line = buf;
+    char *eol = FindHttpLineEnd(line, len);
+    if (!eol) {
+        if (len >= LUADB_HTTP_MAX_HEAD) { req->error = 414; return LUADB_HTTP_PARSE_ERROR; }
+        return LUADB_HTTP_PARSE_MORE;
+    }
+    if (!ParseHttpRequestLine(conn, line, (size_t)(eol - line), req)) {
+        return LUADB_HTTP_PARSE_ERROR;
+    }
+
+    long long content_length = -1;
+    while (true) {
+        line = eol + 2;
+        eol = FindHttpLineEnd(line, len - (size_t)(line - buf));
+        if (!eol) {
+            if (len >= LUADB_HTTP_MAX_HEAD) { req->error = 431; return LUADB_HTTP_PARSE_ERROR; }
+            req->expect = false;
+            return LUADB_HTTP_PARSE_MORE;
+        }
+        if (eol == line) { break; }
+
+        size_t linelen = (size_t)(eol - line);
+        if ((linelen > 15) && (strncasecmp(line, "content-length:", 15) == 0)) {
+            char *end;
+            const char *val = line + 15;
+            while ((*val == ' ') || (*val == '\t')) { val++; }
+            long long n = strtoll(val, &end, 10);
+            while ((end < eol) && ((*end == ' ') || (*end == '\t'))) { end++; }
+            if ((end != eol) || (n < 0) || ((content_length >= 0) && (n != content_length))) {
+                req->error = 400;
+                return LUADB_HTTP_PARSE_ERROR;
+            }
+            content_length = n;
+        }
+
+        if (!ParseHttpHeader(conn, line, linelen, req)) {
+            return LUADB_HTTP_PARSE_ERROR;
+        }
+    }
+
+    size_t head_len = (size_t)(eol + 2 - buf);
+    if (content_length > (long long)LUADB_HTTP_MAX_BODY) {
+        req->error = 413;
+        return LUADB_HTTP_PARSE_ERROR;
+    }
+
+    req->body = buf + head_len;
+    req->body_len = (content_length > 0) ? (size_t)content_length : 0;
+    req->len = head_len + req->body_len;
+    if (req->len > conn->in.len) { return LUADB_HTTP_PARSE_MORE; }
+
+    if (!AddHttpVar(conn, "REMOTE_ADDR", conn->addr, strlen(conn->addr)) ||
+        !AddHttpVar(conn, "REMOTE_PORT", conn->port, strlen(conn->port))) {
+        req->error = 503;
+        return LUADB_HTTP_PARSE_ERROR;
+    }
+    return LUADB_HTTP_PARSE_DONE;
+}
+
+// Parse the request line into CGI variables.
+static bool ParseHttpRequestLine(LuaDB_HttpConn *conn, char *line, size_t len, LuaDB_HttpRequest *req) {
+    assert(conn);
+    assert(line);
+    assert(req);
+
+    char *method = line;
+    char *sp1 = memchr(line, ' ', len);
+    char *target = (sp1) ? sp1 + 1 : NULL;
+    char *sp2 = (target) ? memchr(target, ' ', len - (size_t)(target - line)) : NULL;
+    char *version = (sp2) ? sp2 + 1 : NULL;
+    if (!sp1 || !sp2 || (sp1 == method) || (sp2 == target) || (*target != '/')) {
+        req->error = 400;
+        return false;
+    }
+
+    size_t version_len = len - (size_t)(version - line);
+    if ((version_len == 8) && (strncmp(version, "HTTP/1.1", 8) == 0)) {
+        req->keep_alive = true;
+    } else if ((version_len == 8) && (strncmp(version, "HTTP/1.0", 8) == 0)) {
+        req->keep_alive = false;
+        req->http10 = true;
+    } else {
+        req->error = (strncmp(version, "HTTP/", 5) == 0) ? 505 : 400;
+        return false;
+    }
+
+    size_t method_len = (size_t)(sp1 - method);
+    size_t target_len = (size_t)(sp2 - target);
+    char *query = memchr(target, '?', target_len);
+    size_t path_len = (query) ? (size_t)(query - target) : target_len;
+    size_t query_len = (query) ? target_len - path_len - 1 : 0;
+    req->head = (method_len == 4) && (strncmp(method, "HEAD", 4) == 0);
+
+    bool ok = AddHttpVar(conn, "REQUEST_METHOD", method, method_len) &&
+              AddHttpVar(conn, "REQUEST_URI", target, target_len) &&
+              AddHttpVar(conn, "QUERY_STRING", (query) ? query + 1 : "", query_len) &&
+              AddHttpVar(conn, "SERVER_PROTOCOL", version, version_len) &&
+              AddHttpVar(conn, "GATEWAY_INTERFACE", "CGI/1.1", 7) &&
+              AddHttpVar(conn, "SERVER_SOFTWARE", "LuaDB", 5);
+    if (!ok) {
+        req->error = 503;
+        return false;
+    }
+    if (!AddHttpPathVar(conn, target, path_len)) {
+        req->error = 400;
+        return false;
+    }
+    return true;
+}
+
+// Parse a single request header into a CGI variable, as a web server
+// would: `Content-Type` and `Content-Length` become `CONTENT_TYPE` and
+// `CONTENT_LENGTH` and every other header is prefixed with `HTTP_`.
+static bool ParseHttpHeader(LuaDB_HttpConn *conn, char *line, size_t len, LuaDB_HttpRequest *req) {
+    assert(conn);
+    assert(line);
+    assert(req);
+
+    char *colon = memchr(line, ':', len);
+    if (!colon || (colon == line) || (*line == ' ') || (*line == '\t')) {
+        req->error = 400;
+        return false;
+    }
+
+    size_t name_len = (size_t)(colon - line);
+    char *val = colon + 1;
+    char *end = line + len;
+    while ((val < end) && ((*val == ' ') || (*val == '\t'))) { val++; }
+    while ((end > val) && ((end[-1] == ' ') || (end[-1] == '\t'))) { end--; }
+    size_t val_len = (size_t)(end - val);
+
+    char name[128];
+    if (name_len + 6 > sizeof(name)) {
+        req->error = 431;
+        return false;
+    }
+
+    if ((name_len == 17) && (strncasecmp(line, "transfer-encoding", 17) == 0)) {
+        // Chunked request bodies are not supported
+        req->error = 501;
+        return false;
+    } else if ((name_len == 10) && (strncasecmp(line, "connection", 10) == 0)) {
+        if (HasHttpToken(val, val_len, "close")) { req->keep_alive = false; }
+        if (HasHttpToken(val, val_len, "keep-alive")) { req->keep_alive = true; }
+    } else if ((name_len == 6) && (strncasecmp(line, "expect", 6) == 0)) {
+        req->expect = HasHttpToken(val, val_len, "100-continue");
+    }
+
+    size_t n = 0;
+    if (!((name_len == 12) && (strncasecmp(line, "content-type", 12) == 0)) &&
+        !((name_len == 14) && (strncasecmp(line, "content-length", 14) == 0))) {
+        memcpy(name, "HTTP_", 5);
+        n = 5;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        char c = line[i];
+        // Headers with underscores could pose as other variables
+        if ((c == '_') || (c == ' ') || (c == '\t') || (c == '=')) { return true; }
+        name[n++] = (c == '-') ? '_' : (char)(((c >= 'a') && (c <= 'z')) ? c - 32 : c);
+    }
+    name[n] = '\0';
+
+    if (!AddHttpVar(conn, name, val, val_len)) {
+        req->error = (conn->nvars >= LUADB_HTTP_MAX_VARS) ? 431 : 503;
+        return false;
+    }
+    return true;
+}
+
+// Add a CGI variable for the current request.
+static bool AddHttpVar(LuaDB_HttpConn *conn, const char *name, const char *val, size_t len) {
+    assert(conn);
+    assert(name);
+    assert(val);
+
+    if (conn->nvars >= LUADB_HTTP_MAX_VARS) { return false; }
+
+    size_t start = conn->env.len;
+    if (!AppendHttpBuffer(&conn->env, name, strlen(name)) ||
+        !AppendHttpBuffer(&conn->env, "=", 1) ||
+        !AppendHttpBuffer(&conn->env, val, len) ||
+        !AppendHttpBuffer(&conn->env, "", 1)) {
+        return false;
+    }
+
+    conn->vars[conn->nvars++] = start;
+    return true;
+}
+
+// Add the percent-decoded request path as the DOCUMENT_URI variable.
+// Returns false if the path decodes to a NUL byte.
+static bool AddHttpPathVar(LuaDB_HttpConn *conn, const char *path, size_t len) {
+    assert(conn);
+    assert(path);
+
+    if (conn->nvars >= LUADB_HTTP_MAX_VARS) { return false; }
+
+    size_t start = conn->env.len;
+    if (!AppendHttpBuffer(&conn->env, "DOCUMENT_URI=", 13) ||
+        !ReserveHttpBuffer(&conn->env, len + 1)) {
+        return false;
+    }
+
+    // Invalid escapes are passed through as they are
+    for (size_t i = 0; i < len; i++) {
+        char c = path[i];
+        if ((c == '%') && (i + 2 < len) && isxdigit((unsigned char)path[i + 1]) &&
+            isxdigit((unsigned char)path[i + 2])) {
+            char hex[3] = { path[i + 1], path[i + 2], '\0' };
+            c = (char)strtol(hex, NULL, 16);
+            if (c == '\0') { return false; }
+            i += 2;
+        }
+        conn->env.buf[conn->env.len++] = c;
+    }
+    conn->env.buf[conn->env.len++] = '\0';
+
+    conn->vars[conn->nvars++] = start;
+    return true;
+}
+
+// Translate the CGI response written by the handler into an HTTP/1.1
+// response on the connection.
+static void AppendHttpResponse(LuaDB_HttpThread *t, LuaDB_HttpConn *conn, LuaDB_HttpRequest *req) {
+    assert(t);
+    assert(conn);
+    assert(req);
+
+    // Requests which could not be served at all produce no output
+    char *resp = conn->resp.buf;
+    size_t len = conn->resp.len;
+    char *body = NULL;
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (memcmp(&resp[i], "\r\n\r\n", 4) == 0) {
+            body = &resp[i + 4];
+            break;
+        }
+    }
+    if (!body) {
+        AppendHttpError(conn, 503);
+        return;
+    }
+
+    // Find the status and the headers the handler did not set
+    const char *status = "200";
+    size_t status_len = 3;
+    bool has_length = false;
+    bool has_connection = false;
+    for (char *line = resp; line < body - 2;) {
+        char *eol = FindHttpLineEnd(line, (size_t)(body - line));
+        if ((eol - line > 7) && (strncasecmp(line, "status:", 7) == 0)) {
+            status = line + 7;
+            while (*status == ' ') { status++; }
+            status_len = (size_t)(eol - status);
+        } else if ((eol - line > 15) && (strncasecmp(line, "content-length:", 15) == 0)) {
+            has_length = true;
+        } else if ((eol - line > 11) && (strncasecmp(line, "connection:", 11) == 0)) {
+            has_connection = true;
+            if (HasHttpToken(line + 11, (size_t)(eol - line - 11), "close")) {
+                req->keep_alive = false;
+            }
+        }
+        line = eol + 2;
+    }
+
+    int code = 0;
+    for (size_t i = 0; (i < status_len) && (i < 3) && (status[i] >= '0') && (status[i] <= '9'); i++) {
+        code = (code * 10) + (status[i] - '0');
+    }
+    bool no_body = req->head || ((code >= 100) && (code < 200)) || (code == 204) || (code == 304);
+    size_t body_len = len - (size_t)(body - resp);
+
+    char head[256];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %.*s%s%s\r\nDate: %s\r\n",
+                     (int)status_len, status, (status_len == 3) ? " " : "",
+                     (status_len == 3) ? GetHttpReason(code) : "", GetHttpDate(t));
+    bool ok = (n > 0) && ((size_t)n < sizeof(head)) && AppendHttpBuffer(&conn->out, head, (size_t)n);
+
+    // Copy every header but the status
+    for (char *line = resp; ok && (line < body - 2);) {
+        char *eol = FindHttpLineEnd(line, (size_t)(body - line));
+        if (!((eol - line > 7) && (strncasecmp(line, "status:", 7) == 0))) {
+            ok = AppendHttpBuffer(&conn->out, line, (size_t)(eol - line + 2));
+        }
+        line = eol + 2;
+    }
+
+    n = 0;
+    if (!has_length && (code != 204) && ((code < 100) || (code >= 200))) {
+        n = snprintf(head, sizeof(head), "Content-Length: %zu\r\n", body_len);
+    }
+    const char *connection = "";
+    if (!has_connection && !req->keep_alive) {
+        connection = "Connection: close\r\n";
+    } else if (!has_connection && req->http10) {
+        connection = "Connection: keep-alive\r\n";
+    }
+    n += snprintf(head + n, sizeof(head) - (size_t)n, "%s\r\n", connection);
+    ok = ok && AppendHttpBuffer(&conn->out, head, (size_t)n);
+    if (!no_body) {
+        ok = ok && AppendHttpBuffer(&conn->out, body, body_len);
+    }
+
+    if (!ok) {
+        syslog(LOG_ERR, "Could not allocate memory for HTTP response.");
+        conn->close = true;
+    }
+}
+
+// Add a response with an empty body for a request which could not be
+// served, and close the connection once it is sent.
+static void AppendHttpError(LuaDB_HttpConn *conn, int status) {
+    assert(conn);
+
+    char resp[128];
+    int n = snprintf(resp, sizeof(resp),
+                     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                     status, GetHttpReason(status));
+    if (n > 0) {
+        AppendHttpBuffer(&conn->out, resp, (size_t)n);
+    }
+    conn->close = true;
+}
+
+// Return the reason phrase for common HTTP statuses.
+static const char *GetHttpReason(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 411: return "Length Required";
+        case 412: return "Precondition Failed";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 415: return "Unsupported Media Type";
+        case 422: return "Unprocessable Entity";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default:  return "";
+    }
+}
+
+// Return the current time formatted for the Date header, which is only
+// formatted again once a second.
+static const char *GetHttpDate(LuaDB_HttpThread *t) {
+    assert(t);
+
+    time_t now = time(NULL);
+    if (now != t->date_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(t->date, sizeof(t->date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        t->date_time = now;
+    }
+    return t->date;
+}
+
+// Return the CRLF ending the line at the start of the buffer, or NULL if
+// the buffer does not hold a whole line.
+static char *FindHttpLineEnd(char *buf, size_t len) {
+    assert(buf || (len == 0));
+
+    for (size_t i = 0; i + 1 < len; i++) {
+        if ((buf[i] == '\r') && (buf[i + 1] == '\n')) {
+            return &buf[i];
+        }
+    }
+    return NULL;
+}
+
+// Return true if a comma-separated header value contains the given token.
+static bool HasHttpToken(const char *val, size_t len, const char *token) {
+    assert(val);
+    assert(token);
+
+    size_t token_len = strlen(token);
+    const char *end = val + len;
+    while (val < end) {
+        while ((val < end) && ((*val == ' ') || (*val == '\t') || (*val == ','))) { val++; }
+        const char *start = val;
+        while ((val < end) && (*val != ',')) { val++; }
+        const char *stop = val;
+        while ((stop > start) && ((stop[-1] == ' ') || (stop[-1] == '\t'))) { stop--; }
+        if (((size_t)(stop - start) == token_len) && (strncasecmp(start, token, token_len) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The request body is read in full before the request is served, so there
+// is never more to read once the stream is empty.
+static void FillHttpStream(FCGX_Stream *stream) {
+    stream->isClosed = 1;
+}
+
+// Grow the response buffer once the handler has filled it. Also called to
+// flush the stream, which has nothing to do until the response is done.
+static void GrowHttpStream(FCGX_Stream *stream, int doClose) {
+    LuaDB_HttpBuffer *b = stream->data;
+    if (stream->wrNext != stream->stop) { return; }
+
+    b->len = (size_t)((char *)stream->wrNext - b->buf);
+    if (!ReserveHttpBuffer(b, b->cap)) {
+        stream->isClosed = 1;
+        stream->FCGI_errno = ENOMEM;
+        return;
+    }
+
+    stream->wrNext = (unsigned char *)b->buf + b->len;
+    stream->stop = (unsigned char *)b->buf + b->cap;
+    stream->rdNext = stream->stop;
+}
+
+// Make room for at least `extra` more bytes in the buffer.
+static bool ReserveHttpBuffer(LuaDB_HttpBuffer *b, size_t extra) {
+    assert(b);
+
+    if (b->cap - b->len >= extra) { return true; }
+
+    size_t cap = (b->cap > 0) ? b->cap : LUADB_HTTP_BUFFER_SIZE;
+    while (cap - b->len < extra) {
+        if (cap > SIZE_MAX / 2) { return false; }
+        cap *= 2;
+    }
+
+    char *buf = realloc(b->buf, cap);
+    if (!buf) { return false; }
+    b->buf = buf;
+    b->cap = cap;
+    return true;
+}
+
+// Append bytes to the buffer.
+static bool AppendHttpBuffer(LuaDB_HttpBuffer *b, const char *s, size_t len) {
+    assert(b);
+
+    if (!ReserveHttpBuffer(b, len)) { return false; }
+    if (len > 0) {
+        memcpy(b->buf + b->len, s, len);
+        b->len += len;
+    }
+    return true;
+}
+
+// Free the memory held by the buffer.
+static void ReleaseHttpBuffer(LuaDB_HttpBuffer *b) {
+    assert(b);
+
+    free(b->buf);
+    b->buf = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+#else //__linux__
+
+int LuaDB_HttpOpenSocket(const char *device, int backlog) {
+    syslog(LOG_ERR, "The HTTP listener is only available on Linux.");
+    return -1;
+}
+
+bool LuaDB_HttpRunThread(int sock, const LuaDB_HttpHandler *handler, void *arg) {
+    return false;
+}
+
+#endif //__linux__
@@ -0,0 +1,90 @@
+/*****************************************************************************
+ * LuaDB :: http.h
+ *
+ * Native HTTP/1.1 listener.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_HTTP_H
+#define LUADB_HTTP_H
+
+#include <stdbool.h>
+
+#include "deps/fcgi/fcgiapp.h"
+
+/**
+ * @brief A single HTTP request being served by a handler.
+ *
+ * Requests are presented as they would be by a FastCGI web server: the
+ * request body is read from @c in, @c envp holds the CGI variables and
+ * request headers, and the response (a CGI-style head followed by the
+ * body) is written to @c out. The streams and variables stay valid until
+ * the handler finishes the request.
+ *
+ * Handlers which cannot finish a request at once set the event it waits
+ * on, and the listener serves other connections until that event is ready
+ * or the deadline passes, then resumes the request.
+ */
+typedef struct LuaDB_HttpCall {
+    FCGX_Stream *in;
+    FCGX_Stream *out;
+    char **envp;
+    int fd;                 /** descriptor the request waits on, or -1 */
+    short events;           /** poll(2) events awaited on @c fd */
+    long long deadline;     /** @c LuaDB_SchedNow time to resume by, or -1 */
+    void *data;             /** handler state for the request */
+} LuaDB_HttpCall;
+
+/**
+ * @brief Progress made by a handler on a single request.
+ */
+typedef enum LuaDB_HttpResult {
+    LUADB_HTTP_DONE,        /** the response is complete */
+    LUADB_HTTP_WAIT,        /** the request waits on the event in the call */
+    LUADB_HTTP_BUSY,        /** the request could not be started yet */
+} LuaDB_HttpResult;
+
+/**
+ * @brief Functions which serve HTTP requests.
+ *
+ * @c start begins serving a request, and @c resume continues a request
+ * which waited once its event is ready or its deadline passes. Requests
+ * which could not be started are started again once another request on
+ * the same thread finishes. @c resume never returns @c LUADB_HTTP_BUSY.
+ * Both are called with the argument given to @c LuaDB_HttpRunThread.
+ */
+typedef struct LuaDB_HttpHandler {
+    LuaDB_HttpResult (*start)(void *arg, LuaDB_HttpCall *call);
+    LuaDB_HttpResult (*resume)(void *arg, LuaDB_HttpCall *call);
+} LuaDB_HttpHandler;
+
+/**
+ * @brief Open a non-blocking HTTP listening socket.
+ *
+ * @param device the port to listen on, optionally preceded by a host
+ *               name or address and a colon (e.g. "8080" or
+ *               "127.0.0.1:8080")
+ * @param backlog the listen queue length
+ * @returns the socket or -1 if it could not be opened
+ */
+int LuaDB_HttpOpenSocket(const char *device, int backlog);
+
+/**
+ * @brief Accept and serve HTTP/1.1 connections on the given listening
+ * socket from the calling thread. Several threads may serve the same
+ * socket. Connections are kept alive and pipelined requests are answered
+ * in order. Requests on different connections are served concurrently,
+ * switching between them whenever one waits. Only returns if the event
+ * loop fails.
+ *
+ * @param sock a listening socket from @c LuaDB_HttpOpenSocket
+ * @param handler the functions which serve each request
+ * @param arg passed to @c handler
+ * @returns false if the event loop failed
+ */
+bool LuaDB_HttpRunThread(int sock, const LuaDB_HttpHandler *handler, void *arg);
+
+#endif //LUADB_HTTP_H
@@ -8,23 +8,35 @@
  * License: MIT (see LICENSE document at source tree root)
  *****************************************************************************/
 
+// realpath is not part of C99
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "deps/lua/lua.h"
 #include "deps/lua/lauxlib.h"
 #include "deps/lmdb/lmdb.h"
 
 #include "lmdb.h"
+#include "log.h"
+#include "sched.h"
+#include "trace.h"
 #include "uuid.h"
 
 static const char *const LMDB_ENV_REGISTRY_NAME = "lmdb.Env";
 static const char *const LMDB_TX_REGISTRY_NAME = "lmdb.Tx";
 static const char *const LMDB_CURSOR_REGISTRY_NAME = "lmdb.Cursor";
-static const unsigned int LMDB_DEFAULT_FLAGS = 0;
+static const char *const LMDB_OPEN_TX_REGISTRY_KEY = "lmdb.OpenTx";
+static const unsigned int LMDB_DEFAULT_FLAGS = MDB_NOTLS;
 static const unsigned int LMDB_DEFAULT_MAX_READERS = 126;
 static const size_t LMDB_DEFAULT_MAP_SIZE = 10485760;
 static const int LMDB_DEFAULT_MODE = 0644;          // -rw-r--r--
@@ -32,6 +44,8 @@ static const int LMDB_DEFAULT_TXN_COUNT = 10;
 static const int LMDB_DEFAULT_CURSOR_COUNT = 10;
 static const int LMDB_MAX_KEY_SEGMENTS = 32;
 static const int LMDB_MAX_KEY_SEG_LENGTH = UCHAR_MAX;
+static const long long LMDB_WAIT_INTERVAL = 10;     // Milliseconds
+static const size_t LMDB_DEFAULT_TXN_POOL_SIZE = 4;
 
 #define LMDB_EMPTY_CHAR '\x01'
 #define LMDB_BOOLEAN_CHAR 'b'
@@ -52,15 +66,65 @@ static const int LMDB_DATA_HAS_CHILDREN = 10;
  * FORWARD DECLARATIONS
  */
 
-// LMDB Transaction type
+// An environment opened once and shared by every Lua state and thread in
+// the process. Environments are opened with MDB_NOTLS unless asked not
+// to be, since a thread serves many requests at once and each may hold a
+// read transaction; without it, each thread has a single reader slot, so
+// requests holding a read transaction are pinned to their thread.
+// The database handle and its key comparator are set up once when the
+// environment is opened and stay valid for every later transaction.
+typedef struct LuaDB_LmdbShared {
+    struct LuaDB_LmdbShared *next;
+    MDB_env *env;
+    MDB_dbi dbi;
+    long pid;               // process which opened the environment
+    int refs;               // Lua handles currently open
+    bool writing;           // a thread in this process holds the write lock
+    pthread_t writer;       // the thread holding it, while `writing`
+    unsigned int flags;     // options the environment was opened with
+    unsigned int max_readers;
+    size_t map_size;
+    char path[];
+} LuaDB_LmdbShared;
+
+// LMDB Environment type; each Lua state holds its own handle to the
+// shared environment, along with the key of the state's table of open
+// transactions and cursors for it
+typedef struct LuaDB_LmdbEnv {
+    LuaDB_LmdbShared *shared;
+    MDB_env *env;
+    MDB_dbi dbi;
+    char *uuid;
+    bool pinned;            // the default environment cannot be closed
+} LuaDB_LmdbEnv;
+
+// LMDB Transaction type; the environment handle is kept alive as the
+// transaction's user value for as long as the transaction exists. The
+// cursor is opened on first use and shared by every lookup and iterator
+// in the transaction; LMDB finds keys on the cursor's current leaf page
+// without searching again from the root.
 typedef struct LuaDB_LmdbTx {
     MDB_txn *txn;
+    MDB_cursor *cur;
     MDB_dbi dbi;
+    LuaDB_LmdbShared *shared;
+    const char *uuid;
+    bool rdonly;
 } LuaDB_LmdbTx;
 
-// LMDB Order type cursor
+// Read transactions which have been reset, kept by each thread so later
+// read transactions on the same environment only need to renew them
+typedef struct LuaDB_LmdbTxnPool {
+    size_t len;
+    size_t cap;
+    struct {
+        LuaDB_LmdbShared *shared;
+        MDB_txn *txn;
+    } entries[];
+} LuaDB_LmdbTxnPool;
+
+// LMDB Order type iterator state; iterators use their transaction's cursor
 typedef struct LuaDB_LmdbOrder {
-    MDB_cursor *cur;
     char *prefix;
     size_t pfxlen;
     char *last;
@@ -71,6 +135,7 @@ typedef struct LuaDB_LmdbOrder {
 static int LmdbEnv_ToString(lua_State *L);
 static int LmdbEnv_BeginTx(lua_State *L);
 static int LmdbEnv_Close(lua_State *L);
+static int LmdbEnv_Gc(lua_State *L);
 static int LmdbEnv_Copy(lua_State *L);
 static int LmdbEnv_Flags(lua_State *L);
 static int LmdbEnv_Info(lua_State *L);
@@ -81,6 +146,7 @@ static int LmdbEnv_Readers(lua_State *L);
 static int LmdbEnv_ReaderCheck(lua_State *L);
 static int LmdbEnv_Stat(lua_State *L);
 static int LmdbEnv_Sync(lua_State *L);
+static int LmdbEnv_Wait(lua_State *L);
 static int LmdbEnv__Uuid(lua_State *L);
 
 static int LmdbTx_ToString(lua_State *L);
@@ -98,14 +164,45 @@ static int LmdbTx_IOrder(lua_State *L);
 
 static int Lmdb_OrderClose(lua_State *L);
 
+static void EndLmdbTx(lua_State *L, int idx);
+static MDB_cursor *GetLmdbTxCursor(lua_State *L, LuaDB_LmdbTx *loc);
+static void CloseLmdbTxCursor(LuaDB_LmdbTx *loc);
+static void TrackLmdbTx(lua_State *L, int idx, bool open);
+static MDB_txn *TakePooledLmdbTxn(LuaDB_LmdbShared *shared);
+static void PoolLmdbTxn(LuaDB_LmdbShared *shared, MDB_txn *txn);
+static void DropPooledLmdbTxns(LuaDB_LmdbShared *shared);
+static LuaDB_LmdbTxnPool *GetLmdbTxnPool(bool create);
+static void CreateLmdbTxnPoolKey(void);
+static void FreeLmdbTxnPool(void *arg);
+
+static int LmdbEnvBeginTxK(lua_State *L, int status, lua_KContext ctx);
+static bool IsLmdbWriterHeld(LuaDB_LmdbShared *shared, bool *here);
+static void SetLmdbWriter(LuaDB_LmdbShared *shared, bool writing);
+static bool IsLmdbTxPinned(LuaDB_LmdbTx *loc);
+static void ReleaseLmdbTx(lua_State *L, LuaDB_LmdbTx *loc);
+static int LmdbEnvWaitK(lua_State *L, int status, lua_KContext ctx);
+static void PushLmdbEnvValue(lua_State *L, LuaDB_LmdbEnv *loc, MDB_val *key);
+static int PushLmdbValue(lua_State *L);
+
+static LuaDB_LmdbShared *AcquireLmdbEnv(const char *path, unsigned int flags, unsigned int max_readers, size_t map_size, int *err);
+static LuaDB_LmdbEnv *NewLmdbEnvHandle(lua_State *L);
+static int LmdbAddDefaultEnvProtected(lua_State *L);
+static void ReleaseLmdbEnv(LuaDB_LmdbShared *shared);
+static void ReopenLmdbEnvHandle(lua_State *L, LuaDB_LmdbEnv *loc);
+static long GetLmdbProcessId(void);
+static void InitLmdbProcessId(void);
+static void ResetLmdbAfterFork(void);
+static void CheckLmdbMaxReaders(LuaDB_LmdbShared *shared);
 static MDB_env *OpenLmdbEnv(const char *path, unsigned int flags, unsigned int max_readers, size_t map_size, int *err);
+static int OpenLmdbDbi(MDB_env *env, unsigned int flags, MDB_dbi *dbi);
 static void ReadLmdbEnvParamsFromLua(lua_State *L, unsigned int *flags, unsigned int *max_readers, size_t *map_size);
+static unsigned int ParseLmdbEnvFlags(const char *names);
 static inline MDB_env *CheckLmdbEnvParam(lua_State *L, int idx);
 static inline LuaDB_LmdbTx *CheckLmdbTxParam(lua_State *L, int idx);
-static void CleanLmdbEnvRefTable(lua_State *L, char *uuid);
+static void CleanLmdbEnvRefTable(lua_State *L, const char *uuid);
 static int LmdbEnvReaderTableCreate(const char *msg, lua_State *L);
-static void AddTxToLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn, int idx);
-static void RemoveTxFromLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn, int idx);
+static void AddTxToLmdbEnvRefTable(lua_State *L, const char *uuid, int idx);
+static void RemoveTxFromLmdbEnvRefTable(lua_State *L, const char *uuid, int idx);
 static char *CreateLmdbEnvRefTable(lua_State *L);
 static char *GetLmdbKeyFromLua(lua_State *L, size_t *len, int idx, int last, bool allow_nil_last);
 static bool PushValueByType(lua_State *L, const char *val, size_t len, int type);
@@ -137,7 +234,7 @@ static luaL_Reg lmdb_lib_funcs[] = {
 
 // LMDB Environment methods
 static luaL_Reg lmdb_env_methods[] = {
-        { "__gc",  LmdbEnv_Close},
+        { "__gc",  LmdbEnv_Gc},
         { "__tostring", LmdbEnv_ToString},
         { "begin", LmdbEnv_BeginTx},
         { "close", LmdbEnv_Close},
@@ -151,6 +248,7 @@ static luaL_Reg lmdb_env_methods[] = {
         { "reader_check", LmdbEnv_ReaderCheck},
         { "stat", LmdbEnv_Stat},
         { "sync", LmdbEnv_Sync},
+        { "wait", LmdbEnv_Wait},
         { "_uuid", LmdbEnv__Uuid},
         { NULL, NULL },
 };
@@ -200,6 +298,27 @@ static luadb_env_flag lmdb_env_opts[] = {
         { NULL, 0 },
 };
 
+// Environments shared by every Lua state in the process
+static LuaDB_LmdbShared *lmdb_envs = NULL;
+static pthread_mutex_t lmdb_envs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Default environment opened from the configuration, exposed as `db`
+static LuaDB_LmdbShared *lmdb_default_env = NULL;
+
+// Key for each thread's pool of reset read transactions
+static pthread_key_t lmdb_txn_pool_key;
+static pthread_once_t lmdb_txn_pool_once = PTHREAD_ONCE_INIT;
+
+// Size of each thread's pool of read transactions, and the number of
+// reader slots environments need for every thread in every process to
+// hold that many transactions; set before any environment is opened
+static size_t lmdb_txn_pool_size = LMDB_DEFAULT_TXN_POOL_SIZE;
+static size_t lmdb_min_readers = 0;
+
+// ID of this process, updated in worker processes as they are forked
+static long lmdb_pid = 0;
+static pthread_once_t lmdb_pid_once = PTHREAD_ONCE_INIT;
+
 /*
  * PUBLIC FUNCTIONS
  */
@@ -210,6 +329,16 @@ void LuaDB_LmdbAddLib(lua_State *L) {
     CreateLmdbTxMetatable(L);
     CreateLmdbCursorMetatable(L);
 
+    // Track the transactions open in this state, weakly, so any left open
+    // when a request ends can be closed
+    luaL_checkstack(L, 4, "out of memory");
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, LMDB_OPEN_TX_REGISTRY_KEY);
+
     // Register library level functions
     luaL_newlib(L, lmdb_lib_funcs);
     lua_setglobal(L, "lmdb");
@@ -223,44 +352,107 @@ int LuaDB_LmdbOpenEnv(lua_State *L) {
     size_t map_size;
     ReadLmdbEnvParamsFromLua(L, &flags, &max_readers, &map_size);
 
-    // Open the environment
+    LuaDB_LmdbEnv *loc = NewLmdbEnvHandle(L);
+
+    // Open the environment, or share it if it is already open
     int err;
-    MDB_env *env = OpenLmdbEnv(path, flags, max_readers, map_size, &err);
-    if (!env) {
+    loc->shared = AcquireLmdbEnv(path, flags, max_readers, map_size, &err);
+    if (!loc->shared) {
         luaL_error(L, "%s", mdb_strerror(err));
         return 0;
     }
+    loc->env = loc->shared->env;
+    loc->dbi = loc->shared->dbi;
+    return 1;
+}
 
-    // Allocate space for the LMDB environment as a full userdata
-    // Store the pointer to the environment there
-    MDB_env **loc = lua_newuserdata(L, sizeof(MDB_env *));
-    if (!loc) {
-        mdb_env_close(env);
-        luaL_error(L, "could not allocate memory for LMDB environment");
-        return 0;
+void LuaDB_LmdbSetReaderLimits(size_t pool_size, size_t nthreads) {
+    lmdb_txn_pool_size = pool_size;
+    lmdb_min_readers = (nthreads > 0) ? pool_size * nthreads : 0;
+    if (lmdb_min_readers > UINT_MAX) { lmdb_min_readers = UINT_MAX; }
+}
+
+bool LuaDB_LmdbOpenDefaultEnv(LuaDB_EnvConfig *config) {
+    assert(config);
+
+    if (config->db_path.len == 0) {
+        return true;
     }
-    *loc = env;
 
-    // Get the UUID for this table, which is used as user_ctx
-    char *uuid = CreateLmdbEnvRefTable(L);
-    if (!uuid) {
-        mdb_env_close(env);
-        luaL_error(L, "could not allocate memory for LMDB environment");
-        return 0;
+    int err;
+    unsigned int flags = ParseLmdbEnvFlags(config->db_flags.val);
+    lmdb_default_env = AcquireLmdbEnv(config->db_path.val, flags,
+                                      (unsigned int)config->db_maxreaders,
+                                      (size_t)config->db_mapsize, &err);
+    if (!lmdb_default_env) {
+        syslog(LOG_ERR, "Could not open default LMDB environment '%s': %s",
+               config->db_path.val, mdb_strerror(err));
+        return false;
     }
 
-    // Set the user context
-    err = mdb_env_set_userctx(env, uuid);
-    if (err != 0) {
-        mdb_env_close(env);
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
+    return true;
+}
+
+void LuaDB_LmdbAddDefaultEnv(lua_State *L) {
+    if (!lmdb_default_env) {
+        return;
     }
 
-    // Set the Env metatable
-    luaL_getmetatable(L, LMDB_ENV_REGISTRY_NAME);
-    lua_setmetatable(L, -2);
-    return 1;
+    // Setup runs outside of any protected call, so errors are caught here
+    lua_pushcfunction(L, LmdbAddDefaultEnvProtected);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+        syslog(LOG_ERR, "Could not add default LMDB environment: %s",
+               lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+void LuaDB_LmdbEndRequest(lua_State *L) {
+    luaL_checkstack(L, 4, "out of memory");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LMDB_OPEN_TX_REGISTRY_KEY) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    // Clearing fields is permitted during traversal
+    int tbl = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, tbl) != 0) {
+        lua_pop(L, 1);
+        EndLmdbTx(L, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+}
+
+void LuaDB_LmdbCloseEnvs(void) {
+    // Transactions pooled by other threads were freed as they exited
+    LuaDB_LmdbTxnPool *pool = GetLmdbTxnPool(false);
+    if (pool) {
+        FreeLmdbTxnPool(pool);
+        pthread_setspecific(lmdb_txn_pool_key, NULL);
+    }
+
+    pthread_mutex_lock(&lmdb_envs_lock);
+    long pid = GetLmdbProcessId();
+    LuaDB_LmdbShared *shared = lmdb_envs;
+    while (shared) {
+        LuaDB_LmdbShared *next = shared->next;
+
+        // Closing an environment inherited across fork would clear the
+        // parent's reader slots, so those are only forgotten
+        if (shared->pid == pid) {
+            if (shared->refs > 0) {
+                syslog(LOG_WARNING, "Closing LMDB environment '%s' with %d open handles.",
+                       shared->path, shared->refs);
+            }
+            mdb_env_close(shared->env);
+        }
+        free(shared);
+        shared = next;
+    }
+    lmdb_envs = NULL;
+    lmdb_default_env = NULL;
+    pthread_mutex_unlock(&lmdb_envs_lock);
 }
 
 int LuaDB_LmdbVersion(lua_State *L) {
@@ -287,8 +479,22 @@ static int LmdbEnv_ToString(lua_State *L) {
 }
 
 static int LmdbEnv_BeginTx(lua_State *L) {
+    return LmdbEnvBeginTxK(L, LUA_OK, 0);
+}
+
+// Begin a transaction, continuing once the scheduler resumes a request
+// which waited for the write lock.
+//
+// LMDB blocks the calling thread until it can take the write lock of the
+// environment. A request waiting for a lock held elsewhere in the process
+// yields instead, so the thread serves other requests in the meantime.
+// Requests holding a write transaction are pinned to their thread and so
+// are never suspended holding the lock; a request which cannot yield and
+// finds the lock held on its own thread could never be given it, so it
+// raises an error rather than blocking the thread for good.
+static int LmdbEnvBeginTxK(lua_State *L, int status, lua_KContext ctx) {
     MDB_env *env = CheckLmdbEnvParam(L, 1);
-    MDB_txn *txn = NULL;
+    LuaDB_LmdbEnv *envloc = lua_touserdata(L, 1);
     unsigned int flags = 0;
 
     // Set the transaction as read only if requested
@@ -296,66 +502,107 @@ static int LmdbEnv_BeginTx(lua_State *L) {
         flags = (lua_toboolean(L, 2) == 1) ? (MDB_RDONLY) : 0;
     }
 
-    // Open the new transaction
-    int err = mdb_txn_begin(env, NULL, flags, &txn);
-    if (err != 0) {
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
+    bool here;
+    if (!(flags & MDB_RDONLY) && IsLmdbWriterHeld(envloc->shared, &here)) {
+        if (LuaDB_SchedCanYield(L)) {
+            return LuaDB_SchedYield(L, -1, 0, LMDB_WAIT_INTERVAL, ctx, LmdbEnvBeginTxK);
+        } else if (here) {
+            luaL_error(L, "LMDB write transaction already open on this thread");
+            return 0;
+        }
     }
 
-    // Allocate space for the LMDB environment as a full userdata
-    // Store the pointer to the environment there
+    // Allocate the transaction handle and register it before beginning the
+    // transaction, so a memory error cannot leave a transaction (or the
+    // write lock) held with nothing left to abort it
+    bool rdonly = ((flags & MDB_RDONLY) != 0);
     LuaDB_LmdbTx *loc = lua_newuserdata(L, sizeof(LuaDB_LmdbTx));
-    loc->txn = txn;
+    loc->txn = NULL;
+    loc->cur = NULL;
+    loc->dbi = envloc->dbi;
+    loc->shared = envloc->shared;
+    loc->uuid = envloc->uuid;
+    loc->rdonly = rdonly;
 
     // Set the Env metatable
     luaL_getmetatable(L, LMDB_TX_REGISTRY_NAME);
     lua_setmetatable(L, -2);
 
-    // Add our weak Txn reference
-    int idx = lua_gettop(L);
-    AddTxToLmdbEnvRefTable(L, env, txn, idx);
+    // Keep the environment handle alive for as long as the transaction
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
 
-    // Get a DBI handle for the database
-    err = mdb_dbi_open(txn, NULL, 0, &loc->dbi);
+    // Add our weak Txn references
+    int idx = lua_gettop(L);
+    AddTxToLmdbEnvRefTable(L, loc->uuid, idx);
+    TrackLmdbTx(L, idx, true);
+    bool pinned = IsLmdbTxPinned(loc);
+    if (pinned) { LuaDB_SchedPin(L, true); }
+
+    // Open the new transaction, renewing a pooled read transaction if
+    // this thread has one for the environment
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
+    MDB_txn *txn = NULL;
+    int err = MDB_NOTFOUND;
+    if (rdonly && (txn = TakePooledLmdbTxn(envloc->shared))) {
+        if ((err = mdb_txn_renew(txn)) != 0) {
+            mdb_txn_abort(txn);
+            txn = NULL;
+        }
+    }
     if (err != 0) {
-        RemoveTxFromLmdbEnvRefTable(L, NULL, txn, idx);
-        mdb_txn_abort(txn);
-        luaL_error(L, "could not create a database handle");
-        return 0;
+        err = mdb_txn_begin(env, NULL, flags, &txn);
     }
-
-    // Set the key comparator
-    err = mdb_set_compare(loc->txn, loc->dbi, CompareKeys);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
     if (err != 0) {
-        RemoveTxFromLmdbEnvRefTable(L, NULL, txn, idx);
-        mdb_txn_abort(txn);
-        luaL_error(L, "error setting key comparison function");
+        RemoveTxFromLmdbEnvRefTable(L, loc->uuid, idx);
+        TrackLmdbTx(L, idx, false);
+        if (pinned) { LuaDB_SchedPin(L, false); }
+        luaL_error(L, "%s", mdb_strerror(err));
         return 0;
     }
+
+    loc->txn = txn;
+    if (!rdonly) { SetLmdbWriter(loc->shared, true); }
     return 1;
 }
 
+// Close this Lua state's handle to the environment, aborting any open
+// cursors and transactions it began. The environment itself stays open
+// for other handles until the worker stops.
 static int LmdbEnv_Close(lua_State *L) {
-    MDB_env **loc = luaL_checkudata(L, 1, LMDB_ENV_REGISTRY_NAME);
-    MDB_env *env = *loc;
+    LuaDB_LmdbEnv *loc = luaL_checkudata(L, 1, LMDB_ENV_REGISTRY_NAME);
 
-    if (!env) {
+    if (!loc->env) {
         luaL_error(L, "LMDB environment not found");
         return 0;
     }
 
-    // Load the UUID associated with this Environment and
-    // load that table onto the stack. Clean up any open
-    // cursors and transactions before closing the environment.
-    char *uuid = mdb_env_get_userctx(env);
-    if (uuid) {
-        CleanLmdbEnvRefTable(L, uuid);
-        free(uuid);
+    if (loc->pinned) {
+        luaL_error(L, "the default environment cannot be closed");
+        return 0;
     }
 
-    mdb_env_close(env);
-    *loc = NULL;
+    // Load the table associated with this handle and clean up any open
+    // cursors and transactions before releasing the environment
+    CleanLmdbEnvRefTable(L, loc->uuid);
+    ReleaseLmdbEnv(loc->shared);
+    loc->shared = NULL;
+    loc->env = NULL;
+    return 0;
+}
+
+// Close the handle, if it is still open, once it is collected.
+static int LmdbEnv_Gc(lua_State *L) {
+    LuaDB_LmdbEnv *loc = luaL_checkudata(L, 1, LMDB_ENV_REGISTRY_NAME);
+
+    loc->pinned = false;
+    if (loc->env) {
+        LmdbEnv_Close(L);
+    }
+    free(loc->uuid);
+    loc->uuid = NULL;
     return 0;
 }
 
@@ -551,16 +798,44 @@ static int LmdbEnv_Sync(lua_State *L) {
     return 1;
 }
 
+// Wait up to `timeout` seconds for the value at the given key to change.
+// Returns true if the value changed and false if the timeout elapsed
+// first. A negative timeout waits indefinitely.
+//
+// While waiting, requests yield back to the scheduler so other requests
+// served by the same thread can proceed.
+static int LmdbEnv_Wait(lua_State *L) {
+    CheckLmdbEnvParam(L, 1);
+    lua_Number timeout = luaL_checknumber(L, 2);
+    luaL_argcheck(L, lua_gettop(L) > 2, 3, "expected a key");
+
+    // Keep the encoded key and its current value on top of the stack
+    MDB_val key;
+    char *tkey = GetLmdbKeyFromLua(L, &key.mv_size, 3, lua_gettop(L), false);
+    luaL_checkstack(L, 3, "out of memory");
+    lua_pushlstring(L, tkey, key.mv_size);
+    free(tkey);
+    key.mv_data = (void *)lua_tostring(L, -1);
+    PushLmdbEnvValue(L, lua_touserdata(L, 1), &key);
+
+    long long deadline = -1;
+    if (timeout >= 0) {
+        deadline = LuaDB_SchedNow() + (long long)(timeout * 1000);
+    }
+
+    return LmdbEnvWaitK(L, LUA_OK, (lua_KContext)deadline);
+}
+
 static int LmdbEnv__Uuid(lua_State *L) {
-    MDB_env *env = CheckLmdbEnvParam(L, 1);
+    CheckLmdbEnvParam(L, 1);
+    LuaDB_LmdbEnv *loc = lua_touserdata(L, 1);
 
-    char *uuid = mdb_env_get_userctx(env);
-    if (!uuid) {
+    if (!loc->uuid) {
         luaL_error(L, "no UUID found for this Environment");
         return 0;
     }
 
-    lua_pushstring(L, uuid);
+    lua_pushstring(L, loc->uuid);
     return 1;
 }
 
@@ -575,84 +850,62 @@ static int LmdbTx_ToString(lua_State *L) {
 }
 
 static int LmdbTx_Close(lua_State *L) {
-    LuaDB_LmdbTx *loc = luaL_checkudata(L, 1, LMDB_TX_REGISTRY_NAME);
-
-    if (!loc) {
-        luaL_error(L, "LMDB transaction not found");
-        return 0;
-    }
-
-    // Get the associated environment
-    MDB_env *env = mdb_txn_env(loc->txn);
-    if (!env) {
-        mdb_txn_abort(loc->txn);
-        loc->txn = NULL;
-        luaL_error(L, "LMDB transaction has no associated environment");
-        return 0;
-    }
-
-    // Clean this Txn reference from the table
-    RemoveTxFromLmdbEnvRefTable(L, env, loc->txn, lua_gettop(L));
-
-    mdb_txn_abort(loc->txn);
-    loc->txn = NULL;
+    luaL_checkudata(L, 1, LMDB_TX_REGISTRY_NAME);
+    EndLmdbTx(L, 1);
     return 0;
 }
 
 static int LmdbTx_Commit(lua_State *L) {
-    LuaDB_LmdbTx *loc = luaL_checkudata(L, 1, LMDB_TX_REGISTRY_NAME);
-
-    if (!loc) {
-        luaL_error(L, "LMDB transaction not found");
-        return 0;
-    }
+    LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, 1);
 
-    // Get the associated environment
-    MDB_env *env = mdb_txn_env(loc->txn);
-    if (!env) {
-        mdb_txn_abort(loc->txn);
-        loc->txn = NULL;
-        luaL_error(L, "LMDB transaction has no associated environment");
-        return 0;
+    // Read transactions have nothing to commit, so they can be pooled
+    if (loc->rdonly) {
+        EndLmdbTx(L, 1);
+        return 1;
     }
 
     // Clean this Txn reference from the table
-    RemoveTxFromLmdbEnvRefTable(L, env, loc->txn, lua_gettop(L));
+    RemoveTxFromLmdbEnvRefTable(L, loc->uuid, 1);
+    TrackLmdbTx(L, 1, false);
+    CloseLmdbTxCursor(loc);
 
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
     int err = mdb_txn_commit(loc->txn);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
+    loc->txn = NULL;
+    ReleaseLmdbTx(L, loc);
     if (err != 0) {
         luaL_error(L, "%s", mdb_strerror(err));
         return 0;
     }
-    loc->txn = NULL;
     return 1;
 }
 
 static int LmdbTx_Data(lua_State *L) {
     LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, 1);
-
-    // Open a new cursor
-    MDB_cursor *cur;
-    int err = mdb_cursor_open(loc->txn, loc->dbi, &cur);
-    if (err != 0) {
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
-    }
+    MDB_cursor *cur = GetLmdbTxCursor(L, loc);
 
     int response = LMDB_DATA_NO_DATA;
     size_t klen;
     char *kstr = GetLmdbKeyFromLua(L, &klen, 2, lua_gettop(L), true);
 
-    // Direct the cursor to the specified node to check if it has a value
+    // Direct the cursor to the specified node to check if it has a value;
+    // otherwise the cursor is left at the node after it
     MDB_val key;
     MDB_val val;
     key.mv_size = klen;
     key.mv_data = kstr;
-    int keyfound = mdb_cursor_get(cur, &key, &val, MDB_SET);
-    if (keyfound == 0) { response += LMDB_DATA_HAS_DATA; }
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
+    int childfound = mdb_cursor_get(cur, &key, &val, MDB_SET_RANGE);
+    if ((childfound == 0) && (key.mv_size == klen) && (memcmp(kstr, key.mv_data, klen) == 0)) {
+        response += LMDB_DATA_HAS_DATA;
 
-    // Direct the cursor to the next node to see if it is a child
-    int childfound = mdb_cursor_get(cur, &key, &val, MDB_NEXT);
+        // Direct the cursor to the next node to see if it is a child
+        childfound = mdb_cursor_get(cur, &key, &val, MDB_NEXT);
+    }
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
 
     // Verify that this prefix matches (if we had a prefix)
     if ((klen > 0) && (strncmp(kstr, (char *) key.mv_data, klen) == 0)) {
@@ -664,7 +917,6 @@ static int LmdbTx_Data(lua_State *L) {
     // Push the response and clean up
     lua_pushinteger(L, response);
     free(kstr);
-    mdb_cursor_close(cur);
     return 1;
 }
 
@@ -677,7 +929,10 @@ static int LmdbTx_Delete(lua_State *L) {
     key.mv_data = tkey;
 
     // Delete the value in the database
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
     int err = mdb_del(loc->txn, loc->dbi, &key, NULL);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
     free(tkey);
     if (err == MDB_NOTFOUND) {
         lua_pushboolean(L, 0);
@@ -694,16 +949,9 @@ static int LmdbTx_Delete(lua_State *L) {
 
 static int LmdbTx__Dump(lua_State *L) {
     LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, 1);
-
-    // Open a new cursor
-    MDB_cursor *cur;
-    MDB_cursor_op op = MDB_NEXT;
+    MDB_cursor *cur = GetLmdbTxCursor(L, loc);
+    MDB_cursor_op op = MDB_FIRST;
     MDB_val key;
-    int err = mdb_cursor_open(loc->txn, loc->dbi, &cur);
-    if (err != 0) {
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
-    }
 
     // Generate the prefix if there is one
     size_t pfxlen;
@@ -730,7 +978,7 @@ static int LmdbTx__Dump(lua_State *L) {
         op = MDB_NEXT;
     }
 
-    mdb_cursor_close(cur);
+    free(prefix);
     return 0;
 }
 
@@ -744,7 +992,11 @@ static int LmdbTx_Get(lua_State *L) {
     key.mv_data = tkey;
 
     // Get the value in the database
-    int err = mdb_get(loc->txn, loc->dbi, &key, &val);
+    MDB_cursor *cur = GetLmdbTxCursor(L, loc);
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
+    int err = mdb_cursor_get(cur, &key, &val, MDB_SET_KEY);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
     free(tkey);
     if (err == MDB_NOTFOUND) {
         lua_pushnil(L);
@@ -775,7 +1027,10 @@ static int LmdbTx_Put(lua_State *L) {
     key.mv_data = tkey;
 
     // Put the values into the database
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
     int err = mdb_put(loc->txn, loc->dbi, &key, &val, flags);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
     free(tkey);
     if (err != 0) {
         luaL_error(L, "%s", mdb_strerror(err));
@@ -786,14 +1041,7 @@ static int LmdbTx_Put(lua_State *L) {
 
 static int LmdbTx_Next(lua_State *L) {
     LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, 1);
-
-    // Open a new cursor
-    MDB_cursor *cur;
-    int err = mdb_cursor_open(loc->txn, loc->dbi, &cur);
-    if (err != 0) {
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
-    }
+    MDB_cursor *cur = GetLmdbTxCursor(L, loc);
 
     // Generate the prefix if there is one
     size_t klen;
@@ -814,7 +1062,11 @@ static int LmdbTx_Next(lua_State *L) {
 
     // Get the key and value from the db
     MDB_val val;
-    if ((mdb_cursor_get(cur, &key, &val, op)) != 0) {
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
+    int found = mdb_cursor_get(cur, &key, &val, op);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
+    if (found != 0) {
         lua_pushnil(L);
         goto LmdbTx_Next_Close;
     }
@@ -838,7 +1090,6 @@ static int LmdbTx_Next(lua_State *L) {
 LmdbTx_Next_Close:
     free(kstr);
     free(prefix);
-    mdb_cursor_close(cur);
     return 1;
 }
 
@@ -861,18 +1112,12 @@ static int LmdbTx__Dbi(lua_State *L) {
  */
 
 static int Lmdb_OrderClose(lua_State *L) {
-    LuaDB_LmdbOrder *cur = luaL_checkudata(L, lua_upvalueindex(1),
-                                            LMDB_CURSOR_REGISTRY_NAME);
+    LuaDB_LmdbOrder *cur = luaL_checkudata(L, 1, LMDB_CURSOR_REGISTRY_NAME);
 
-    if (!cur) {
-        luaL_error(L, "LMDB order cursor not found");
-        return 0;
-    }
-
-    mdb_cursor_close(cur->cur);
     free(cur->prefix);
-    cur->cur = NULL;
+    free(cur->last);
     cur->prefix = NULL;
+    cur->last = NULL;
     return 0;
 }
 
@@ -880,6 +1125,202 @@ static int Lmdb_OrderClose(lua_State *L) {
  * PRIVATE LUA UTILITY FUNCTIONS
  */
 
+// Return the environment already open at the given path in this process,
+// or open it with the given options. Options given when the environment
+// is already open are ignored. Returns NULL and sets `err` if it could
+// not be opened.
+static LuaDB_LmdbShared *AcquireLmdbEnv(const char *path, unsigned int flags, unsigned int max_readers, size_t map_size, int *err) {
+    assert(path);
+    assert(err);
+
+    // Environments are found by their canonical path, so the same files
+    // are never opened twice under different names
+#ifndef _WIN32
+    char *canonical = realpath(path, NULL);
+    const char *key = (canonical) ? canonical : path;
+#else
+    char *canonical = NULL;
+    const char *key = path;
+#endif
+
+    pthread_mutex_lock(&lmdb_envs_lock);
+    long pid = GetLmdbProcessId();
+    LuaDB_LmdbShared *shared = lmdb_envs;
+    for (; shared; shared = shared->next) {
+        if ((shared->pid == pid) && (strcmp(shared->path, key) == 0)) { break; }
+    }
+
+    if (!shared) {
+        // Every thread may hold a full pool of read transactions at once,
+        // and readers beyond the limit fail with MDB_READERS_FULL
+        if (max_readers < lmdb_min_readers) {
+            syslog(LOG_WARNING, "Raising maxreaders of LMDB environment '%s' from %u to %zu "
+                   "for every worker thread to hold %zu read transactions.",
+                   key, max_readers, lmdb_min_readers, lmdb_txn_pool_size);
+            max_readers = (unsigned int)lmdb_min_readers;
+        }
+
+        size_t len = strlen(key);
+        shared = malloc(sizeof(LuaDB_LmdbShared) + len + 1);
+        if (!shared) {
+            *err = ENOMEM;
+        } else if (!(shared->env = OpenLmdbEnv(path, flags, max_readers, map_size, err))) {
+            free(shared);
+            shared = NULL;
+        } else if ((*err = OpenLmdbDbi(shared->env, flags, &shared->dbi)) != 0) {
+            mdb_env_close(shared->env);
+            free(shared);
+            shared = NULL;
+        } else {
+            memcpy(shared->path, key, len + 1);
+            shared->pid = pid;
+            shared->refs = 0;
+            shared->writing = false;
+            shared->flags = flags;
+            shared->max_readers = max_readers;
+            shared->map_size = map_size;
+            shared->next = lmdb_envs;
+            lmdb_envs = shared;
+            CheckLmdbMaxReaders(shared);
+        }
+    }
+
+    if (shared) { shared->refs++; }
+    pthread_mutex_unlock(&lmdb_envs_lock);
+    free(canonical);
+    return shared;
+}
+
+// Push a new environment handle which does not yet refer to any
+// environment. The metatable is set before anything else so the handle
+// is always collected cleanly.
+static LuaDB_LmdbEnv *NewLmdbEnvHandle(lua_State *L) {
+    LuaDB_LmdbEnv *loc = lua_newuserdata(L, sizeof(LuaDB_LmdbEnv));
+    loc->shared = NULL;
+    loc->env = NULL;
+    loc->uuid = NULL;
+    loc->pinned = false;
+    luaL_getmetatable(L, LMDB_ENV_REGISTRY_NAME);
+    lua_setmetatable(L, -2);
+
+    // Get the UUID for the table of this handle's transactions
+    loc->uuid = CreateLmdbEnvRefTable(L);
+    if (!loc->uuid) {
+        luaL_error(L, "could not allocate memory for LMDB environment");
+        return NULL;
+    }
+
+    return loc;
+}
+
+// Set the default environment as the global `db`. Called by
+// LuaDB_LmdbAddDefaultEnv in protected mode.
+static int LmdbAddDefaultEnvProtected(lua_State *L) {
+    LuaDB_LmdbEnv *loc = NewLmdbEnvHandle(L);
+    pthread_mutex_lock(&lmdb_envs_lock);
+    lmdb_default_env->refs++;
+    pthread_mutex_unlock(&lmdb_envs_lock);
+    loc->shared = lmdb_default_env;
+    loc->env = lmdb_default_env->env;
+    loc->dbi = lmdb_default_env->dbi;
+    loc->pinned = true;
+    lua_setglobal(L, "db");
+    return 0;
+}
+
+// Release a handle to a shared environment. Environments stay open once
+// their last handle is released, so later requests do not reopen them,
+// but this thread's pooled read transactions give up their reader slots.
+// Environments opened without MDB_NOTLS are closed instead, since LMDB
+// only frees the reader slot it ties to each thread when it closes.
+static void ReleaseLmdbEnv(LuaDB_LmdbShared *shared) {
+    assert(shared);
+
+    pthread_mutex_lock(&lmdb_envs_lock);
+    int refs = --shared->refs;
+    bool close = (refs == 0) && !(shared->flags & MDB_NOTLS) &&
+                 (shared != lmdb_default_env) && (shared->pid == GetLmdbProcessId());
+    if (close) {
+        LuaDB_LmdbShared **link = &lmdb_envs;
+        while (*link != shared) { link = &(*link)->next; }
+        *link = shared->next;
+    }
+    pthread_mutex_unlock(&lmdb_envs_lock);
+
+    if (close) {
+        mdb_env_close(shared->env);
+        free(shared);
+    } else if (refs == 0) {
+        DropPooledLmdbTxns(shared);
+    }
+}
+
+// Move a handle opened before this worker process was forked onto this
+// process's own environment at the same path. LMDB environments must not
+// be used across fork, so the parent's environment is left untouched.
+static void ReopenLmdbEnvHandle(lua_State *L, LuaDB_LmdbEnv *loc) {
+    assert(loc);
+    assert(loc->shared);
+
+    int err;
+    LuaDB_LmdbShared *old = loc->shared;
+    LuaDB_LmdbShared *shared = AcquireLmdbEnv(old->path, old->flags, old->max_readers,
+                                              old->map_size, &err);
+    if (!shared) {
+        luaL_error(L, "%s", mdb_strerror(err));
+        return;
+    }
+
+    loc->shared = shared;
+    loc->env = shared->env;
+    loc->dbi = shared->dbi;
+}
+
+// Return the ID of the calling process. Worker processes forked after an
+// environment was opened must not use the parent's environment.
+static long GetLmdbProcessId(void) {
+#ifndef _WIN32
+    pthread_once(&lmdb_pid_once, InitLmdbProcessId);
+    return lmdb_pid;
+#else
+    return 0;
+#endif
+}
+
+// Record the ID of this process and keep it current in forked children,
+// so checking whether an environment was inherited needs no system call.
+static void InitLmdbProcessId(void) {
+#ifndef _WIN32
+    lmdb_pid = (long)getpid();
+    pthread_atfork(NULL, NULL, ResetLmdbAfterFork);
+#endif
+}
+
+// Called in each child process after fork. The parent's pooled read
+// transactions hold its reader slots, so the child forgets them rather
+// than resetting or aborting them.
+static void ResetLmdbAfterFork(void) {
+#ifndef _WIN32
+    lmdb_pid = (long)getpid();
+    LuaDB_LmdbTxnPool *pool = GetLmdbTxnPool(false);
+    if (pool) {
+        pthread_setspecific(lmdb_txn_pool_key, NULL);
+        free(pool);
+    }
+#endif
+}
+
+// Warn if the environment has fewer reader slots than every worker thread
+// needs; another process which opened it first decides the actual number.
+static void CheckLmdbMaxReaders(LuaDB_LmdbShared *shared) {
+    unsigned int actual;
+    if ((mdb_env_get_maxreaders(shared->env, &actual) == 0) && (actual < lmdb_min_readers)) {
+        syslog(LOG_WARNING, "LMDB environment '%s' has %u reader slots but worker threads "
+               "may hold %zu read transactions; readers may fail with MDB_READERS_FULL.",
+               shared->path, actual, lmdb_min_readers);
+    }
+}
+
 // Create a new MDB_env with the given options.
 static MDB_env *OpenLmdbEnv(const char *path, unsigned int flags, unsigned int max_readers, size_t map_size, int *err) {
     MDB_env *env = NULL;
@@ -909,6 +1350,32 @@ static MDB_env *OpenLmdbEnv(const char *path, unsigned int flags, unsigned int m
     return env;
 }
 
+// Open the handle for the main database of a new environment and set its
+// key comparator. Both persist for the life of the environment, so
+// transactions use them without opening the database again. Without
+// MDB_NOTLS a read transaction would leave this thread a reader slot, so
+// a write transaction is used unless the environment is read-only.
+static int OpenLmdbDbi(MDB_env *env, unsigned int flags, MDB_dbi *dbi) {
+    MDB_txn *txn = NULL;
+
+    unsigned int txflags = (flags & (MDB_NOTLS | MDB_RDONLY)) ? MDB_RDONLY : 0;
+    int err = mdb_txn_begin(env, NULL, txflags, &txn);
+    if (err != 0) {
+        return err;
+    }
+
+    err = mdb_dbi_open(txn, NULL, 0, dbi);
+    if (err == 0) {
+        err = mdb_set_compare(txn, *dbi, CompareKeys);
+    }
+    if (err != 0) {
+        mdb_txn_abort(txn);
+        return err;
+    }
+
+    return mdb_txn_commit(txn);
+}
+
 // Load the MDB environment options from the user's open parameters.
 static void ReadLmdbEnvParamsFromLua(lua_State *L, unsigned int *flags, unsigned int *max_readers, size_t *map_size) {
     int type = lua_type(L, 2);
@@ -937,15 +1404,11 @@ static void ReadLmdbEnvParamsFromLua(lua_State *L, unsigned int *flags, unsigned
         lua_pushstring(L, f->name);
         ftype = lua_gettable(L, -2);
 
-        // If it wasn't given, just skip it (all options are optional)
-        if (ftype == LUA_TNONE) {
-            continue;
-        }
-
-        // Convert to boolean and add the flag if true
-        val = lua_toboolean(L, -1);
-        if (val) {
-            *flags = *flags | f->val;
+        // Options which were not given keep their default; others are set
+        // or cleared as given
+        if (ftype != LUA_TNIL) {
+            val = lua_toboolean(L, -1);
+            *flags = (val) ? (*flags | f->val) : (*flags & ~f->val);
         }
         lua_pop(L, 1);
     }
@@ -966,6 +1429,32 @@ static void ReadLmdbEnvParamsFromLua(lua_State *L, unsigned int *flags, unsigned
     }
 }
 
+// Add up the values of a comma separated list of environment flag names.
+// Unknown names are logged and ignored.
+static unsigned int ParseLmdbEnvFlags(const char *names) {
+    unsigned int flags = LMDB_DEFAULT_FLAGS;
+    if (!names) { return flags; }
+
+    while (*names != '\0') {
+        size_t len = strcspn(names, ",");
+        luadb_env_flag *f = &lmdb_env_opts[0];
+        for (; f->name != NULL; f++) {
+            if ((strlen(f->name) == len) && (strncmp(f->name, names, len) == 0)) { break; }
+        }
+
+        if (f->name) {
+            flags |= f->val;
+        } else if (len > 0) {
+            syslog(LOG_WARNING, "Ignoring unknown LMDB environment flag '%.*s'", (int)len, names);
+        }
+
+        names += len;
+        if (*names == ',') { names++; }
+    }
+
+    return flags;
+}
+
 // Check for a MDB_env as a function parameter and dereference it
 //
 // This function issues a Lua error if the environment variable isn't
@@ -974,14 +1463,309 @@ static void ReadLmdbEnvParamsFromLua(lua_State *L, unsigned int *flags, unsigned
 static inline MDB_env *CheckLmdbEnvParam(lua_State *L, int idx) {
     assert(L);
 
-    MDB_env **loc = luaL_checkudata(L, idx, LMDB_ENV_REGISTRY_NAME);
+    LuaDB_LmdbEnv *loc = luaL_checkudata(L, idx, LMDB_ENV_REGISTRY_NAME);
 
-    if (!(*loc)) {
+    if (!loc->env) {
         luaL_error(L, "LMDB environment not found");
         return NULL;
     }
 
-    return *loc;
+    // Handles opened while the routing script loaded in the master process
+    // are carried into each worker process
+    if (loc->shared->pid != GetLmdbProcessId()) {
+        ReopenLmdbEnvHandle(L, loc);
+    }
+
+    return loc->env;
+}
+
+// End the transaction at the given stack index if it is still open. Read
+// transactions on MDB_NOTLS environments are reset and kept for reuse by
+// this thread; others are aborted.
+static void EndLmdbTx(lua_State *L, int idx) {
+    LuaDB_LmdbTx *loc = lua_touserdata(L, idx);
+
+    // Transactions already committed, closed or aborted along with their
+    // environment have nothing left to close
+    if (!loc->txn) {
+        return;
+    }
+
+    // Clean this Txn reference from the tables
+    RemoveTxFromLmdbEnvRefTable(L, loc->uuid, idx);
+    TrackLmdbTx(L, idx, false);
+    CloseLmdbTxCursor(loc);
+
+    // Transactions begun before this worker process was forked belong to
+    // the parent, so they are only forgotten
+    if (loc->shared->pid != GetLmdbProcessId()) {
+        if (IsLmdbTxPinned(loc)) { LuaDB_SchedPin(L, false); }
+        loc->txn = NULL;
+        return;
+    }
+
+    // Pooled transactions would keep environments which tie reader slots
+    // to threads from closing, and those threads reuse their slot anyway
+    if (loc->rdonly && (loc->shared->flags & MDB_NOTLS)) {
+        mdb_txn_reset(loc->txn);
+        PoolLmdbTxn(loc->shared, loc->txn);
+    } else {
+        mdb_txn_abort(loc->txn);
+    }
+    ReleaseLmdbTx(L, loc);
+    loc->txn = NULL;
+}
+
+// Add or remove the transaction at the given stack index from the table
+// of transactions open in this state.
+static void TrackLmdbTx(lua_State *L, int idx, bool open) {
+    luaL_checkstack(L, 3, "out of memory");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LMDB_OPEN_TX_REGISTRY_KEY) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pushvalue(L, idx);
+    if (open) {
+        lua_pushboolean(L, 1);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+// Return the cursor for the given transaction, opening it if this is its
+// first use.
+static MDB_cursor *GetLmdbTxCursor(lua_State *L, LuaDB_LmdbTx *loc) {
+    if (loc->cur) {
+        return loc->cur;
+    }
+
+    int err = mdb_cursor_open(loc->txn, loc->dbi, &loc->cur);
+    if (err != 0) {
+        loc->cur = NULL;
+        luaL_error(L, "%s", mdb_strerror(err));
+        return NULL;
+    }
+
+    return loc->cur;
+}
+
+// Close the cursor for the given transaction, if it has one. Cursors must
+// be closed before their transaction ends.
+static void CloseLmdbTxCursor(LuaDB_LmdbTx *loc) {
+    if (loc->cur) {
+        mdb_cursor_close(loc->cur);
+        loc->cur = NULL;
+    }
+}
+
+// Take a reset read transaction for the given environment from this
+// thread's pool, if it has one.
+static MDB_txn *TakePooledLmdbTxn(LuaDB_LmdbShared *shared) {
+    LuaDB_LmdbTxnPool *pool = GetLmdbTxnPool(false);
+    if (!pool) {
+        return NULL;
+    }
+
+    for (size_t i = pool->len; i > 0; i--) {
+        if (pool->entries[i - 1].shared == shared) {
+            MDB_txn *txn = pool->entries[i - 1].txn;
+            pool->len--;
+            pool->entries[i - 1] = pool->entries[pool->len];
+            return txn;
+        }
+    }
+
+    return NULL;
+}
+
+// Keep a reset read transaction in this thread's pool. Each pooled
+// transaction holds a reader slot, so transactions beyond the size of the
+// pool are freed instead. The pool is as large as the number of requests
+// a thread runs at once, so pooling never holds more reader slots than
+// the thread's busiest moment already needed.
+static void PoolLmdbTxn(LuaDB_LmdbShared *shared, MDB_txn *txn) {
+    LuaDB_LmdbTxnPool *pool = GetLmdbTxnPool(true);
+    if (!pool || (pool->len >= pool->cap)) {
+        mdb_txn_abort(txn);
+        return;
+    }
+
+    pool->entries[pool->len].shared = shared;
+    pool->entries[pool->len].txn = txn;
+    pool->len++;
+}
+
+// Free every read transaction this thread has pooled for the given
+// environment.
+static void DropPooledLmdbTxns(LuaDB_LmdbShared *shared) {
+    MDB_txn *txn;
+    while ((txn = TakePooledLmdbTxn(shared))) {
+        mdb_txn_abort(txn);
+    }
+}
+
+// Return the calling thread's pool of reset read transactions, creating
+// it if requested.
+static LuaDB_LmdbTxnPool *GetLmdbTxnPool(bool create) {
+    pthread_once(&lmdb_txn_pool_once, CreateLmdbTxnPoolKey);
+    LuaDB_LmdbTxnPool *pool = pthread_getspecific(lmdb_txn_pool_key);
+    if (pool || !create) {
+        return pool;
+    }
+
+    size_t cap = lmdb_txn_pool_size;
+    pool = calloc(1, sizeof(LuaDB_LmdbTxnPool) + cap * sizeof(pool->entries[0]));
+    if (pool) { pool->cap = cap; }
+    if (pool && (pthread_setspecific(lmdb_txn_pool_key, pool) != 0)) {
+        free(pool);
+        pool = NULL;
+    }
+    return pool;
+}
+
+// Create the key for each thread's pool of read transactions; pools are
+// freed as their threads exit.
+static void CreateLmdbTxnPoolKey(void) {
+    pthread_key_create(&lmdb_txn_pool_key, FreeLmdbTxnPool);
+}
+
+// Abort every transaction in a pool and free the pool.
+static void FreeLmdbTxnPool(void *arg) {
+    LuaDB_LmdbTxnPool *pool = arg;
+    for (size_t i = 0; i < pool->len; i++) {
+        mdb_txn_abort(pool->entries[i].txn);
+    }
+    free(pool);
+}
+
+// Return true if a thread in this process holds the write lock of the
+// given environment, setting `here` if it is the calling thread.
+static bool IsLmdbWriterHeld(LuaDB_LmdbShared *shared, bool *here) {
+    assert(shared);
+    assert(here);
+
+    pthread_mutex_lock(&lmdb_envs_lock);
+    bool writing = shared->writing;
+    *here = writing && pthread_equal(shared->writer, pthread_self());
+    pthread_mutex_unlock(&lmdb_envs_lock);
+    return writing;
+}
+
+// Record that the calling thread took or released the write lock of the
+// given environment.
+static void SetLmdbWriter(LuaDB_LmdbShared *shared, bool writing) {
+    assert(shared);
+
+    pthread_mutex_lock(&lmdb_envs_lock);
+    shared->writing = writing;
+    shared->writer = pthread_self();
+    pthread_mutex_unlock(&lmdb_envs_lock);
+}
+
+// Return true if the request holding the given transaction is pinned to
+// its thread while the transaction is open: write transactions hold the
+// write lock, and read transactions of environments opened without
+// MDB_NOTLS hold the thread's only reader slot.
+static bool IsLmdbTxPinned(LuaDB_LmdbTx *loc) {
+    assert(loc);
+
+    return !loc->rdonly || !(loc->shared->flags & MDB_NOTLS);
+}
+
+// Release what the given transaction held on this thread once it has
+// ended: the write lock, and the pin on the request which held it.
+// Requests are pinned before their transaction begins, since pinning may
+// raise a memory error.
+static void ReleaseLmdbTx(lua_State *L, LuaDB_LmdbTx *loc) {
+    assert(L);
+    assert(loc);
+
+    if (!loc->rdonly) { SetLmdbWriter(loc->shared, false); }
+    if (IsLmdbTxPinned(loc)) { LuaDB_SchedPin(L, false); }
+}
+
+// Continue waiting for the value at a key to change. The stack holds the
+// arguments to `LmdbEnv_Wait` followed by the encoded key and the value
+// when the wait began.
+static int LmdbEnvWaitK(lua_State *L, int status, lua_KContext ctx) {
+    CheckLmdbEnvParam(L, 1);
+    LuaDB_LmdbEnv *loc = lua_touserdata(L, 1);
+    long long deadline = (long long)ctx;
+    int orig = lua_gettop(L);
+
+    MDB_val key;
+    key.mv_data = (void *)lua_tolstring(L, orig - 1, &key.mv_size);
+
+    while (true) {
+        PushLmdbEnvValue(L, loc, &key);
+        bool changed = !lua_rawequal(L, -1, orig);
+        lua_pop(L, 1);
+        if (changed) {
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+
+        long long now = LuaDB_SchedNow();
+        if ((deadline >= 0) && (now >= deadline)) {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+
+        long long wait = LMDB_WAIT_INTERVAL;
+        if ((deadline >= 0) && ((deadline - now) < wait)) {
+            wait = deadline - now;
+        }
+
+        if (LuaDB_SchedCanYield(L)) {
+            return LuaDB_SchedYield(L, -1, 0, wait, ctx, LmdbEnvWaitK);
+        }
+        LuaDB_SchedBlock(-1, 0, wait);
+    }
+}
+
+// Push the value stored at the given key in a new read-only transaction,
+// or nil if there is no value.
+static void PushLmdbEnvValue(lua_State *L, LuaDB_LmdbEnv *loc, MDB_val *key) {
+    assert(L);
+    assert(loc);
+    assert(key);
+    MDB_txn *txn = NULL;
+    MDB_val val;
+
+    luaL_checkstack(L, 2, "out of memory");
+    int err = mdb_txn_begin(loc->env, NULL, MDB_RDONLY, &txn);
+    if (err != 0) {
+        luaL_error(L, "%s", mdb_strerror(err));
+        return;
+    }
+
+    // The value is only valid while the transaction is open, so it is
+    // copied in protected mode and any memory error raised once the
+    // transaction is closed
+    int status = LUA_OK;
+    err = mdb_get(txn, loc->dbi, key, &val);
+    if (err == 0) {
+        lua_pushcfunction(L, PushLmdbValue);
+        lua_pushlightuserdata(L, &val);
+        status = lua_pcall(L, 1, 1, 0);
+    } else {
+        lua_pushnil(L);
+    }
+    mdb_txn_abort(txn);
+
+    if (status != LUA_OK) {
+        lua_error(L);
+    }
+}
+
+// Push a copy of the LMDB value given as a light userdata.
+static int PushLmdbValue(lua_State *L) {
+    MDB_val *val = lua_touserdata(L, 1);
+    lua_pushlstring(L, val->mv_data, val->mv_size);
+    return 1;
 }
 
 // Check for a LuaDB_LmdbTx as a function parameter and dererence it.
@@ -994,7 +1778,11 @@ static inline LuaDB_LmdbTx *CheckLmdbTxParam(lua_State *L, int idx) {
 
     LuaDB_LmdbTx *loc = luaL_checkudata(L, idx, LMDB_TX_REGISTRY_NAME);
 
-    if (!loc) {
+    if (loc->txn && (loc->shared->pid != GetLmdbProcessId())) {
+        EndLmdbTx(L, idx);
+    }
+
+    if (!loc->txn) {
         luaL_error(L, "LMDB transaction not found");
         return NULL;
     }
@@ -1004,7 +1792,7 @@ static inline LuaDB_LmdbTx *CheckLmdbTxParam(lua_State *L, int idx) {
 
 // Clean up any lingering cursors and transactions before closing the
 // entire environment.
-static void CleanLmdbEnvRefTable(lua_State *L, char *uuid) {
+static void CleanLmdbEnvRefTable(lua_State *L, const char *uuid) {
     assert(L);
     assert(uuid);
 
@@ -1023,8 +1811,8 @@ static void CleanLmdbEnvRefTable(lua_State *L, char *uuid) {
     lua_pushnil(L);
     while(lua_next(L, txidx) != 0) {
         // Get the transaction and table
-        MDB_txn **loc = luaL_checkudata(L, -2, LMDB_TX_REGISTRY_NAME);
-        MDB_txn *txn = *loc;
+        LuaDB_LmdbTx *loc = luaL_checkudata(L, -2, LMDB_TX_REGISTRY_NAME);
+        MDB_txn *txn = loc->txn;
         type = lua_type(L, -1);     // Value type
 
         // If there is no table, just continue
@@ -1047,10 +1835,14 @@ static void CleanLmdbEnvRefTable(lua_State *L, char *uuid) {
             lua_pop(L, 1);
         }
 
-        // Abort the transaction and set all of the pointers null
-        mdb_txn_abort(txn);
-        txn = NULL;
-        *loc = NULL;
+        // Abort the transaction and set all of the pointers null; those
+        // begun before this worker process was forked are only forgotten
+        CloseLmdbTxCursor(loc);
+        if (txn && (loc->shared->pid == GetLmdbProcessId())) {
+            mdb_txn_abort(txn);
+            ReleaseLmdbTx(L, loc);
+        }
+        loc->txn = NULL;
 
         // Pop the value from the stack
         lua_pop(L, 1);
@@ -1113,18 +1905,11 @@ static char *CreateLmdbEnvRefTable(lua_State *L) {
     return uuid;
 }
 
-// Add the given Transaction to the Weak Reference table for the
-// given environment. Use the idx to indicate where the Txn is on
-// the Lua stack.
-static void AddTxToLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn, int idx) {
+// Add the Transaction at the given stack index to the Weak Reference
+// table with the given UUID.
+static void AddTxToLmdbEnvRefTable(lua_State *L, const char *uuid, int idx) {
     assert(L);
-    assert(txn);
-
-    if (!env) {
-        env = mdb_txn_env(txn);
-    }
 
-    char *uuid = mdb_env_get_userctx(env);
     if (!uuid) {
         luaL_error(L, "no reference table found for environment");
     }
@@ -1159,18 +1944,11 @@ static void AddTxToLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn, int
     lua_settop(L, idx);
 }
 
-// Remove the given Transaction from the Weak Reference table for
-// the given environment. Use the idx to indicate where the Txn userdata
-// is on the Lua stack.
-static void RemoveTxFromLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn, int idx) {
+// Remove the Transaction at the given stack index from the Weak
+// Reference table with the given UUID.
+static void RemoveTxFromLmdbEnvRefTable(lua_State *L, const char *uuid, int idx) {
     assert(L);
-    assert(txn);
-
-    if (!env) {
-        env = mdb_txn_env(txn);
-    }
 
-    char *uuid = mdb_env_get_userctx(env);
     if (!uuid) {
         luaL_error(L, "no reference table found for environment");
     }
@@ -1186,6 +1964,7 @@ static void RemoveTxFromLmdbEnvRefTable(lua_State *L, MDB_env *env, MDB_txn *txn
     lua_pushvalue(L, idx);
     lua_pushnil(L);
     lua_settable(L, -3);
+    lua_pop(L, 1);
 }
 
 // Concatenate all of the variadic Lua parameters into a single key and
@@ -1292,14 +2071,7 @@ static bool PushValueByType(lua_State *L, const char *val, size_t len, int type)
 
 // Create the LuaDB order closure and push it onto the stack.
 static int CreateLuaDbOrderClosure(lua_State *L, bool with_enum) {
-    LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, 1);
-
-    MDB_cursor *cur;
-    int err = mdb_cursor_open(loc->txn, loc->dbi, &cur);
-    if (err != 0) {
-        luaL_error(L, "%s", mdb_strerror(err));
-        return 0;
-    }
+    CheckLmdbTxParam(L, 1);
 
     // Generate the given prefix
     size_t len;
@@ -1309,7 +2081,6 @@ static int CreateLuaDbOrderClosure(lua_State *L, bool with_enum) {
 
     // Get a full userdatum
     LuaDB_LmdbOrder *curloc = lua_newuserdata(L, sizeof(LuaDB_LmdbOrder));
-    curloc->cur = cur;
     curloc->prefix = pfx;
     curloc->pfxlen = pfxlen;
     curloc->last = (len > 0) ? ComputeNextLexicalValue(last, len) : NULL;
@@ -1324,8 +2095,9 @@ static int CreateLuaDbOrderClosure(lua_State *L, bool with_enum) {
     lua_pushinteger(L, (with_enum) ? 0 : -1);
 
     // Push the private LuaDbOrderTxClosure function on the stack as a closure
-    // containing the previously declared cursor as it's upvalue
-    lua_pushcclosure(L, &LuaDbOrderTxClosure, 2);
+    // containing the iterator state, enumeration and transaction as upvalues
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, &LuaDbOrderTxClosure, 3);
     return 1;
 }
 
@@ -1336,11 +2108,8 @@ static int LuaDbOrderTxClosure(lua_State *L) {
     LuaDB_LmdbOrder *cur = luaL_checkudata(L, lua_upvalueindex(1),
                                             LMDB_CURSOR_REGISTRY_NAME);
     lua_Integer iters = luaL_checkinteger(L, lua_upvalueindex(2));
-
-    if (!cur) {
-        luaL_error(L, "LMDB order cursor not found");
-        return 0;
-    }
+    LuaDB_LmdbTx *loc = CheckLmdbTxParam(L, lua_upvalueindex(3));
+    MDB_cursor *txcur = GetLmdbTxCursor(L, loc);
 
     MDB_val key;
     MDB_val val;
@@ -1355,7 +2124,11 @@ static int LuaDbOrderTxClosure(lua_State *L) {
     }
 
     // Get the key stored in the database
-    if (mdb_cursor_get(cur->cur, &key, &val, cur->op) != 0) {
+    LuaDB_Trace *trace = LuaDB_TraceGetCurrent(L);
+    long long since = LuaDB_TraceNow(trace);
+    int found = mdb_cursor_get(txcur, &key, &val, cur->op);
+    LuaDB_TraceAdd(trace, LUADB_TRACE_LMDB, since);
+    if (found != 0) {
         return 0;
     }
 
@@ -1465,11 +2238,11 @@ static int CompareKeys(const MDB_val *a, const MDB_val *b) {
     for (size_t i = 0, j = 0;
          (i < a->mv_size) && (j < b->mv_size);
          (i += (aseglen + 2)), (j += (bseglen + 2))) {
-        aseglen = GetSegmentLength(&a->mv_data[i]);
-        bseglen = GetSegmentLength(&b->mv_data[i]);
+        aseglen = GetSegmentLength(&((const char *)a->mv_data)[i]);
+        bseglen = GetSegmentLength(&((const char *)b->mv_data)[i]);
         size_t min = (aseglen >= bseglen) ? bseglen : aseglen;
-        const char *adata = GetSegmentData(&a->mv_data[i]);
-        const char *bdata = GetSegmentData(&b->mv_data[i]);
+        const char *adata = GetSegmentData(&((const char *)a->mv_data)[i]);
+        const char *bdata = GetSegmentData(&((const char *)b->mv_data)[i]);
         int cmp = strncmp(adata, bdata, min);
         if (cmp != 0) { return cmp; }
         if (aseglen > bseglen) { return 1; }
@@ -1594,9 +2367,10 @@ static const char *FindFirstDifferentKeyNode(const char *prefix, size_t pfxlen,
     for (size_t i = 0; (i < key->mv_size); i += (seglen + 2)) {
         // Handle no prefix OR perfect-match prefix
         if (i >= pfxlen) {
-            *outlen = GetSegmentLength(&key->mv_data[i]);
-            *type = GetSegmentType(&key->mv_data[i]);
-            return GetSegmentData(&key->mv_data[i]);
+            const char *seg = &((const char *)key->mv_data)[i];
+            *outlen = GetSegmentLength(seg);
+            *type = GetSegmentType(seg);
+            return GetSegmentData(seg);
         }
 
         // Read metadata from the prefix segment
@@ -11,16 +11,68 @@
 #ifndef LUADB_LMDB_H
 #define LUADB_LMDB_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "config.h"
+
 /**
  * @brief Add the LMDB library to the global Lua state.
  */
 void LuaDB_LmdbAddLib(lua_State *L);
 
 /**
- * @brief Create a new LMDB transaction.
+ * @brief Open an LMDB environment for Lua. Each environment is opened
+ * once per process and shared by every Lua state and thread; the handle
+ * returned to Lua only refers to it.
  */
 int LuaDB_LmdbOpenEnv(lua_State *L);
 
+/**
+ * @brief Set how many reset read transactions each thread keeps for reuse,
+ * and the number of threads across every process which use LMDB. Must be
+ * called before any environment is opened.
+ *
+ * Each pooled transaction keeps its reader slot, so environments opened
+ * afterward are given at least @c pool_size times @c nthreads reader
+ * slots, raising the @c maxreaders they were opened with if necessary.
+ *
+ * @param pool_size the number of read transactions pooled by each thread;
+ *        this should be the number of requests a thread serves at once
+ * @param nthreads the number of threads in every process, or 0 to leave
+ *        @c maxreaders as given
+ */
+void LuaDB_LmdbSetReaderLimits(size_t pool_size, size_t nthreads);
+
+/**
+ * @brief Open the default environment named by the @c db table of the
+ * configuration in this process. Does nothing if no default environment
+ * is configured.
+ *
+ * @param config the environment configuration
+ * @returns true if the default environment is open or not configured
+ */
+bool LuaDB_LmdbOpenDefaultEnv(LuaDB_EnvConfig *config);
+
+/**
+ * @brief Set the global @c db in the given Lua state to a handle to the
+ * default environment, if one is open. The handle cannot be closed.
+ */
+void LuaDB_LmdbAddDefaultEnv(lua_State *L);
+
+/**
+ * @brief Close every transaction left open in the given Lua state once a
+ * request ends. Read transactions are reset and kept for reuse, so they
+ * no longer hold back pages from being reused by writers.
+ */
+void LuaDB_LmdbEndRequest(lua_State *L);
+
+/**
+ * @brief Close every LMDB environment opened by this process. Must only
+ * be called once every Lua state using them has been closed.
+ */
+void LuaDB_LmdbCloseEnvs(void);
+
 /**
  * @brief Return the version number of LMDB that LuaDB was compiled with.
  */
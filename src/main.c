@@ -21,6 +21,7 @@
 #include "deps/lua/lauxlib.h"
 
 #include "fcgi.h"
+#include "lmdb.h"
 #include "luadb.h"
 #include "state.h"
 
@@ -42,7 +43,7 @@ static const int REPL_BUFFER_SIZE = 512;
 // Print the short usage line
 static void PrintProgramUsage(FILE *dest, const char *cmd) {
 #ifndef _WIN32
-    fprintf(dest, "usage: %s [-h] [-f] [-p port|device] [-i path] [file]\n", cmd);
+    fprintf(dest, "usage: %s [-h] [-f] [-p port|device] [-H port] [-w workers] [-t threads] [-c config] [-i path] [file]\n", cmd);
 #else
     fprintf(dest, "usage: %s [-h] [-p port|device] [-i path] [file]\n", cmd);
 #endif
@@ -64,7 +65,11 @@ static void PrintLuaDbHelp(FILE *dest, const char *cmd) {
     fprintf(dest, "Options:\n");
 #ifndef _WIN32
     fprintf(dest, "  -p <port>, -p <dev>  start a FastCGI worker\n");
+    fprintf(dest, "  -H <port>            start a worker serving HTTP directly\n");
     fprintf(dest, "  -f                   do not fork this FastCGI process\n");
+    fprintf(dest, "  -w workers           number of FastCGI worker processes\n");
+    fprintf(dest, "  -t threads           number of FastCGI request threads\n");
+    fprintf(dest, "  -c config            read worker configuration from this file\n");
     fprintf(dest, "  -i path              additional include path for Lua scripts\n");
 #else
     fprintf(dest, "  -p <port>, -p <dev>  start as a FastCGI worker\n");
@@ -107,6 +112,7 @@ static int StartLuaRepl(FILE *outdev, FILE *indev, FILE *errdev, char **paths, s
 
 cleanup_repl:
     lua_close(L);
+    LuaDB_LmdbCloseEnvs();
     free(buf);
     return exit_code;
 }
@@ -130,17 +136,19 @@ static int RunLuaScript(const char *fname, FILE *outdev, FILE *indev, FILE *errd
     }
 
     lua_close(L);
+    LuaDB_LmdbCloseEnvs();
     return exit_code;
 }
 
 // Start a FastCGI worker process, unless the user requests no fork.
-static int StartFcgiWorker(FILE *outdev, char *fcgi_dev, bool should_fork, char **paths, size_t npaths) {
+static int StartFcgiWorker(FILE *outdev, char *fcgi_dev, bool should_fork, char **paths, size_t npaths, long threads, long workers, bool http, const char *config) {
+    LuaDB_FcgiOpts opts = { (const char **) paths, npaths, threads, workers, http, config };
 #ifdef _WIN32
-    return LuaDB_FcgiStartWorker(fcgi_dev);
+    return LuaDB_FcgiStartWorkerWithOpts(fcgi_dev, &opts);
 #else //_WIN32
     // Do not fork the process, as requested by the caller
     if (!should_fork) {
-        return LuaDB_FcgiStartWorkerWithPaths(fcgi_dev, (const char **) paths, npaths);
+        return LuaDB_FcgiStartWorkerWithOpts(fcgi_dev, &opts);
     }
 
     // Fork the process
@@ -150,7 +158,7 @@ static int StartFcgiWorker(FILE *outdev, char *fcgi_dev, bool should_fork, char
                 LUADB_EXEC);
         return EXIT_FAILURE;
     } else if (pid == 0) {
-        int exit_code = LuaDB_FcgiStartWorkerWithPaths(fcgi_dev, (const char **) paths, npaths);
+        int exit_code = LuaDB_FcgiStartWorkerWithOpts(fcgi_dev, &opts);
         free(paths);
         _exit(exit_code);
     } else {
@@ -164,8 +172,12 @@ static int ParseCommandLineArguments(int argc, char *const *const argv) {
     int exit_code = EXIT_SUCCESS;
     bool is_fcgi = false;
     bool should_fork = true;
+    bool http = false;
     char *fname = NULL;
     char *fcgi_dev = NULL;
+    char *config = NULL;
+    long threads = 0;
+    long workers = 0;
     char **paths = malloc(sizeof(char*) * 5);
     if (!paths) { exit_code = EXIT_FAILURE; goto exit_main; }
     size_t maxpaths = 5;
@@ -174,7 +186,7 @@ static int ParseCommandLineArguments(int argc, char *const *const argv) {
     int c;
 
     // Parse available arguments
-    while ((c = getopt (argc, argv, "fhi:p::")) != -1) {
+    while ((c = getopt (argc, argv, "c:fhH:i:p::t:w:")) != -1) {
         switch (c) {
             case 'h':
                 PrintLuaDbHelp(stdout, argv[0]);
@@ -182,10 +194,39 @@ static int ParseCommandLineArguments(int argc, char *const *const argv) {
             case 'p':
                 fcgi_dev = (optarg) ? (optarg) : ":8000";
                 is_fcgi = true;
+                http = false;
                 break;
+#ifndef _WIN32
+            case 'H':
+                fcgi_dev = optarg;
+                is_fcgi = true;
+                http = true;
+                break;
+#endif
             case 'f':
                 should_fork = false;
                 break;
+            case 'c':
+                config = optarg;
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                if (threads <= 0) {
+                    fprintf(stderr, "%s: invalid thread count '%s'\n",
+                            LUADB_EXEC, optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto exit_main;
+                }
+                break;
+            case 'w':
+                workers = strtol(optarg, NULL, 10);
+                if (workers <= 0) {
+                    fprintf(stderr, "%s: invalid worker count '%s'\n",
+                            LUADB_EXEC, optarg);
+                    exit_code = EXIT_FAILURE;
+                    goto exit_main;
+                }
+                break;
             case 'i':
                 if (!optarg) { break; }
                 if (npaths >= maxpaths) {
@@ -213,7 +254,7 @@ static int ParseCommandLineArguments(int argc, char *const *const argv) {
 
     // Start the FastCGI (maybe) daemon
     if (is_fcgi) {
-        exit_code = StartFcgiWorker(stdout, fcgi_dev, should_fork, paths, npaths);
+        exit_code = StartFcgiWorker(stdout, fcgi_dev, should_fork, paths, npaths, threads, workers, http, config);
         goto exit_main;
     }
 
@@ -0,0 +1,323 @@
+/*****************************************************************************
+ * LuaDB :: metrics.c
+ *
+ * Request counters and latency histograms shared by every worker.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+// MAP_ANONYMOUS is not part of POSIX
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+#include "deps/fcgi/fcgiapp.h"
+
+#include "log.h"
+#include "metrics.h"
+
+#define LUADB_METRICS_ROUTE_SIZE 128
+#define LUADB_METRICS_NBUCKETS 15
+#define LUADB_METRICS_LINE_SIZE 512
+
+// Upper bounds (in microseconds) of every latency histogram bucket but
+// the last, which counts every request
+static const long long LUADB_METRICS_BUCKET_BOUNDS[LUADB_METRICS_NBUCKETS - 1] = {
+        500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+        500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+// Bucket bounds as printed (in seconds)
+static const char *const LUADB_METRICS_BUCKET_LABELS[LUADB_METRICS_NBUCKETS] = {
+        "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1",
+        "0.25", "0.5", "1", "2.5", "5", "10", "+Inf",
+};
+
+// Number of times to check on a series another writer is filling in
+// before giving up on it (e.g. because that worker died)
+static const int LUADB_METRICS_CLAIM_SPINS = 1000;
+
+typedef enum LuaDB_MetricsState {
+    LUADB_METRICS_EMPTY = 0,
+    LUADB_METRICS_CLAIMED,
+    LUADB_METRICS_READY,
+} LuaDB_MetricsState;
+
+// Counters for a single (route, status) pair
+typedef struct LuaDB_MetricsSeries {
+    int state;
+    int status;
+    char route[LUADB_METRICS_ROUTE_SIZE];
+    uint64_t sum;
+    uint64_t buckets[LUADB_METRICS_NBUCKETS];
+} LuaDB_MetricsSeries;
+
+// Open-addressed table of series in memory shared with forked workers
+typedef struct LuaDB_MetricsTable {
+    size_t size;
+    size_t nseries;
+    uint64_t dropped;
+    int64_t queued;
+    uint64_t shed;
+    LuaDB_MetricsSeries series[];
+} LuaDB_MetricsTable;
+
+static LuaDB_MetricsTable *metrics = NULL;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static LuaDB_MetricsSeries *FindMetricsSeries(const char *route, int status);
+static inline bool IsMetricsSeries(LuaDB_MetricsSeries *s, const char *route, int status);
+static void WriteMetricsSeries(FCGX_Stream *out, LuaDB_MetricsSeries *s);
+static void WriteMetricsListenQueue(FCGX_Stream *out, int sock);
+static void EscapeMetricsLabel(char *dst, size_t size, const char *src);
+static void WriteMetricsLine(FCGX_Stream *out, const char *fmt, ...);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+bool LuaDB_MetricsInit(size_t max_series) {
+    if (metrics) { return true; }
+    if (max_series == 0) { max_series = 1; }
+
+    size_t size = sizeof(LuaDB_MetricsTable) + (max_series * sizeof(LuaDB_MetricsSeries));
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        syslog(LOG_ERR, "Could not map shared memory for metrics.");
+        return false;
+    }
+
+    // Anonymous mappings are zero-filled, so every series starts empty
+    metrics = mem;
+    metrics->size = size;
+    metrics->nseries = max_series;
+    return true;
+}
+
+void LuaDB_MetricsClose(void) {
+    if (!metrics) { return; }
+
+    munmap(metrics, metrics->size);
+    metrics = NULL;
+}
+
+long long LuaDB_MetricsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+void LuaDB_MetricsRecord(const char *route, int status, long long elapsed) {
+    if (!metrics) { return; }
+    if (!route) { route = ""; }
+
+    LuaDB_MetricsSeries *s = FindMetricsSeries(route, status);
+    if (!s) {
+        __atomic_fetch_add(&metrics->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    long long us = (elapsed > 0) ? elapsed / 1000 : 0;
+    size_t bucket = 0;
+    while ((bucket < LUADB_METRICS_NBUCKETS - 1) &&
+           (us > LUADB_METRICS_BUCKET_BOUNDS[bucket])) {
+        bucket++;
+    }
+
+    __atomic_fetch_add(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum, (uint64_t)us, __ATOMIC_RELAXED);
+}
+
+void LuaDB_MetricsQueue(long delta) {
+    if (!metrics) { return; }
+    __atomic_fetch_add(&metrics->queued, (int64_t)delta, __ATOMIC_RELAXED);
+}
+
+void LuaDB_MetricsShed(void) {
+    if (!metrics) { return; }
+    __atomic_fetch_add(&metrics->shed, 1, __ATOMIC_RELAXED);
+}
+
+void LuaDB_MetricsWrite(FCGX_Stream *out, int sock) {
+    assert(out);
+    if (!metrics) { return; }
+
+    WriteMetricsLine(out, "# HELP luadb_request_duration_seconds Request latency by route and status.\n");
+    WriteMetricsLine(out, "# TYPE luadb_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < metrics->nseries; i++) {
+        LuaDB_MetricsSeries *s = &metrics->series[i];
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != LUADB_METRICS_READY) { continue; }
+        WriteMetricsSeries(out, s);
+    }
+
+    WriteMetricsLine(out, "# HELP luadb_metrics_dropped_total Requests not recorded because the metrics table was full.\n");
+    WriteMetricsLine(out, "# TYPE luadb_metrics_dropped_total counter\n");
+    WriteMetricsLine(out, "luadb_metrics_dropped_total %llu\n",
+                     (unsigned long long)__atomic_load_n(&metrics->dropped, __ATOMIC_RELAXED));
+
+    WriteMetricsLine(out, "# HELP luadb_queue_depth Requests waiting for a free Lua state.\n");
+    WriteMetricsLine(out, "# TYPE luadb_queue_depth gauge\n");
+    WriteMetricsLine(out, "luadb_queue_depth %lld\n",
+                     (long long)__atomic_load_n(&metrics->queued, __ATOMIC_RELAXED));
+    WriteMetricsLine(out, "# HELP luadb_requests_shed_total Requests answered with 503 because every Lua state was busy.\n");
+    WriteMetricsLine(out, "# TYPE luadb_requests_shed_total counter\n");
+    WriteMetricsLine(out, "luadb_requests_shed_total %llu\n",
+                     (unsigned long long)__atomic_load_n(&metrics->shed, __ATOMIC_RELAXED));
+
+    WriteMetricsListenQueue(out, sock);
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Find the series for the given route and status, adding it to the
+// table if it is not there yet. Returns NULL if the table is full.
+static LuaDB_MetricsSeries *FindMetricsSeries(const char *route, int status) {
+    assert(route);
+
+    // FNV-1a hash of the route and status
+    uint32_t hash = 2166136261u;
+    for (const char *c = route; *c && (c - route) < LUADB_METRICS_ROUTE_SIZE - 1; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)status) * 16777619u;
+
+    for (size_t i = 0; i < metrics->nseries; i++) {
+        LuaDB_MetricsSeries *s = &metrics->series[(hash + i) % metrics->nseries];
+        int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+        // Claim an empty series; the route and status are filled in
+        // before other writers may match against them
+        if (state == LUADB_METRICS_EMPTY) {
+            if (__atomic_compare_exchange_n(&s->state, &state, LUADB_METRICS_CLAIMED,
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                s->status = status;
+                strncpy(s->route, route, LUADB_METRICS_ROUTE_SIZE - 1);
+                __atomic_store_n(&s->state, LUADB_METRICS_READY, __ATOMIC_RELEASE);
+                return s;
+            }
+        }
+
+        for (int spins = 0; (state == LUADB_METRICS_CLAIMED) && (spins < LUADB_METRICS_CLAIM_SPINS); spins++) {
+            state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        }
+
+        if ((state == LUADB_METRICS_READY) && IsMetricsSeries(s, route, status)) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+// Return true if the series counts the given route and status. Routes
+// longer than a series can store are compared by their stored prefix.
+static inline bool IsMetricsSeries(LuaDB_MetricsSeries *s, const char *route, int status) {
+    return (s->status == status) &&
+           (strncmp(s->route, route, LUADB_METRICS_ROUTE_SIZE - 1) == 0);
+}
+
+// Write the histogram for a single series.
+static void WriteMetricsSeries(FCGX_Stream *out, LuaDB_MetricsSeries *s) {
+    assert(out);
+    assert(s);
+
+    char route[(LUADB_METRICS_ROUTE_SIZE * 2) + 1];
+    EscapeMetricsLabel(route, sizeof(route), s->route);
+
+    // Buckets are stored individually and reported cumulatively; the
+    // count is taken from the same reads so the two always agree
+    unsigned long long count = 0;
+    for (size_t i = 0; i < LUADB_METRICS_NBUCKETS; i++) {
+        count += __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
+        WriteMetricsLine(out, "luadb_request_duration_seconds_bucket{route=\"%s\",status=\"%d\",le=\"%s\"} %llu\n",
+                         route, s->status, LUADB_METRICS_BUCKET_LABELS[i], count);
+    }
+
+    uint64_t sum = __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+    WriteMetricsLine(out, "luadb_request_duration_seconds_sum{route=\"%s\",status=\"%d\"} %llu.%06llu\n",
+                     route, s->status, (unsigned long long)(sum / 1000000),
+                     (unsigned long long)(sum % 1000000));
+    WriteMetricsLine(out, "luadb_request_duration_seconds_count{route=\"%s\",status=\"%d\"} %llu\n",
+                     route, s->status, count);
+}
+
+// Write the number of connections waiting to be accepted on the listening
+// socket and the length of its queue. Only Linux reports these, and only
+// for TCP sockets; nothing is written otherwise.
+static void WriteMetricsListenQueue(FCGX_Stream *out, int sock) {
+    assert(out);
+
+#ifdef __linux__
+    // For listening sockets, the kernel reports the accept queue length
+    // in place of unacknowledged segments and the backlog in place of
+    // selectively acknowledged segments
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if ((sock < 0) || (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) ||
+        (info.tcpi_state != TCP_LISTEN)) {
+        return;
+    }
+
+    WriteMetricsLine(out, "# HELP luadb_listen_queue_depth Connections waiting to be accepted.\n");
+    WriteMetricsLine(out, "# TYPE luadb_listen_queue_depth gauge\n");
+    WriteMetricsLine(out, "luadb_listen_queue_depth %u\n", info.tcpi_unacked);
+    WriteMetricsLine(out, "# HELP luadb_listen_queue_max Connections which may wait to be accepted.\n");
+    WriteMetricsLine(out, "# TYPE luadb_listen_queue_max gauge\n");
+    WriteMetricsLine(out, "luadb_listen_queue_max %u\n", info.tcpi_sacked);
+#else
+    (void)sock;
+#endif
+}
+
+// Escape a label value for the Prometheus text format.
+static void EscapeMetricsLabel(char *dst, size_t size, const char *src) {
+    assert(dst);
+    assert(size > 0);
+    assert(src);
+
+    size_t n = 0;
+    for (; *src && (n + 2 < size); src++) {
+        switch (*src) {
+            case '\\': dst[n++] = '\\'; dst[n++] = '\\'; break;
+            case '"':  dst[n++] = '\\'; dst[n++] = '"'; break;
+            case '\n': dst[n++] = '\\'; dst[n++] = 'n'; break;
+            default:   dst[n++] = *src; break;
+        }
+    }
+    dst[n] = '\0';
+}
+
+// Format a single line of metrics output and write it to the stream.
+static void WriteMetricsLine(FCGX_Stream *out, const char *fmt, ...) {
+    assert(out);
+    assert(fmt);
+
+    char line[LUADB_METRICS_LINE_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0) { return; }
+    if ((size_t)len >= sizeof(line)) { len = sizeof(line) - 1; }
+    FCGX_PutStr(line, len, out);
+}
@@ -0,0 +1,76 @@
+/*****************************************************************************
+ * LuaDB :: metrics.h
+ *
+ * Request counters and latency histograms shared by every worker.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_METRICS_H
+#define LUADB_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deps/fcgi/fcgiapp.h"
+
+/**
+ * @brief Create the shared metrics table. The table is shared by every
+ * thread and by worker processes forked afterwards, so it must be created
+ * before any worker is forked. Metrics are recorded lock-free.
+ *
+ * @param max_series the maximum number of distinct (route, status) pairs
+ *                   to keep; requests for further pairs are only counted
+ *                   as dropped
+ * @returns true if the table could be created
+ */
+bool LuaDB_MetricsInit(size_t max_series);
+
+/**
+ * @brief Free the shared metrics table.
+ */
+void LuaDB_MetricsClose(void);
+
+/**
+ * @brief Return the current monotonic time in nanoseconds.
+ */
+long long LuaDB_MetricsNow(void);
+
+/**
+ * @brief Count a completed request and add its latency to the histogram
+ * for its route and response status. Does nothing if the metrics table
+ * has not been created.
+ *
+ * @param route the route (typically the document URI) of the request
+ * @param status the HTTP response status
+ * @param elapsed the request latency in nanoseconds
+ */
+void LuaDB_MetricsRecord(const char *route, int status, long long elapsed);
+
+/**
+ * @brief Add to the number of requests waiting for a free Lua state.
+ * Does nothing if the metrics table has not been created.
+ *
+ * @param delta 1 when a request starts waiting, -1 when it stops
+ */
+void LuaDB_MetricsQueue(long delta);
+
+/**
+ * @brief Count a request answered with 503 Service Unavailable because
+ * every Lua state was busy. Does nothing if the metrics table has not
+ * been created.
+ */
+void LuaDB_MetricsShed(void);
+
+/**
+ * @brief Write every metric in the Prometheus text exposition format.
+ *
+ * @param out the stream to write to
+ * @param sock the listening socket, whose accept queue is reported where
+ *             the system allows; -1 to omit it
+ */
+void LuaDB_MetricsWrite(FCGX_Stream *out, int sock);
+
+#endif //LUADB_METRICS_H
@@ -0,0 +1,592 @@
+/*****************************************************************************
+ * LuaDB :: params.c
+ *
+ * Lazy HTTP request variable, header, and query string tables.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+
+#include "config.h"
+#include "log.h"
+#include "params.h"
+#include "query.h"
+
+static const char *const LUADB_PARAMS_REGISTRY_NAME = "luadb.Params";
+static const char *const LUADB_VARS_REGISTRY_NAME = "luadb.Vars";
+static const char *const LUADB_HEADERS_REGISTRY_NAME = "luadb.Headers";
+static const char *const LUADB_REQUEST_REGISTRY_NAME = "luadb.Request";
+static const char *const LUADB_PARAMS_BINDINGS_KEY = "luadb.params.bindings";
+static const char *const LUADB_PARAMS_CURRENT_KEY = "luadb.params";
+static const char FASTCGI_KEY_VALUE_SEP = '=';
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+// FastCGI parameters backing the lazy request tables
+typedef struct LuaDB_RequestParams {
+    char **envp;
+    LuaDB_Setting *pfx;
+    LuaDB_Setting *query;
+} LuaDB_RequestParams;
+
+static int Vars_Index(lua_State *L);
+static int Vars_Pairs(lua_State *L);
+static int Headers_Index(lua_State *L);
+static int Headers_Pairs(lua_State *L);
+static int Request_Index(lua_State *L);
+static int ParamsNext(lua_State *L);
+
+static void BindRequestTable(lua_State *L, int bindings, int params, const char *mt, lua_CFunction index, lua_CFunction pairs);
+static LuaDB_RequestParams *GetBoundParams(lua_State *L, int idx);
+static void UnbindRequestTable(lua_State *L, int idx);
+static void PushBindingsTable(lua_State *L);
+static void CreateParamsMetatable(lua_State *L, const char *name, lua_CFunction index, lua_CFunction pairs);
+static int PushPairs(lua_State *L);
+static bool ReadHttpRequestQueryString(lua_State *L, const char *qs, size_t *len);
+static inline void PushQueryValueString(lua_State *L, const char *key, size_t keylen, const char *val, size_t vallen);
+static inline bool IsHeaderEnvVar(LuaDB_RequestParams *params, const char *env);
+static inline char ConvertHeaderChar(char cur, bool *first);
+static bool MatchEnvVarHeader(LuaDB_Setting *pfx, const char *in, size_t len, const char *key, size_t keylen);
+static bool MatchEnvVarLower(const char *in, size_t len, const char *key, size_t keylen);
+static void PushEnvVarAsHeader(lua_State *L, LuaDB_Setting *pfx, const char *in, size_t len);
+static void PushEnvVarAsLower(lua_State *L, const char *in, size_t len);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void LuaDB_SetRequestParams(lua_State *L, int idx, char **envp, LuaDB_EnvConfig *config) {
+    assert(L);
+    assert(envp);
+    assert(config);
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 6, "Could not allocate memory for request parameters");
+
+    // Create the parameters shared by each of the request tables
+    LuaDB_RequestParams *params = lua_newuserdata(L, sizeof(LuaDB_RequestParams));
+    params->envp = envp;
+    params->pfx = &config->fcgi_header_prefix;
+    params->query = &config->fcgi_query;
+    CreateParamsMetatable(L, LUADB_PARAMS_REGISTRY_NAME, NULL, NULL);
+    lua_setmetatable(L, -2);
+
+    // Keep a reference so the parameters can be closed at the end of
+    // the request
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_PARAMS_CURRENT_KEY);
+
+    PushBindingsTable(L);
+    int bindings = lua_gettop(L);
+    int p = bindings - 1;
+
+    // Create the `request.vars` table
+    lua_pushlstring(L, "vars", 4);
+    lua_newtable(L);
+    BindRequestTable(L, bindings, p, LUADB_VARS_REGISTRY_NAME, Vars_Index, Vars_Pairs);
+    lua_rawset(L, idx);
+
+    // Create the `request.headers` table
+    lua_pushlstring(L, "headers", 7);
+    lua_newtable(L);
+    BindRequestTable(L, bindings, p, LUADB_HEADERS_REGISTRY_NAME, Headers_Index, Headers_Pairs);
+    lua_rawset(L, idx);
+
+    // The `request.query` table is parsed on first access
+    lua_pushvalue(L, idx);
+    BindRequestTable(L, bindings, p, LUADB_REQUEST_REGISTRY_NAME, Request_Index, NULL);
+    lua_pop(L, 3);
+}
+
+void LuaDB_CloseRequestParams(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 2, "out of memory");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUADB_PARAMS_CURRENT_KEY) == LUA_TUSERDATA) {
+        LuaDB_RequestParams *params = lua_touserdata(L, -1);
+        params->envp = NULL;
+    }
+    lua_pop(L, 1);
+
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_PARAMS_CURRENT_KEY);
+}
+
+/*
+ * METAMETHODS
+ */
+
+// Look up a single request variable by its lowercase name, caching the
+// value in the table if it is found.
+static int Vars_Index(lua_State *L) {
+    LuaDB_RequestParams *params = GetBoundParams(L, 1);
+    if (!params || (lua_type(L, 2) != LUA_TSTRING)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t keylen;
+    const char *key = lua_tolstring(L, 2, &keylen);
+
+    for (char **env = params->envp; *env != NULL; env++) {
+        if (IsHeaderEnvVar(params, *env)) { continue; }
+
+        char *sep = strchr(*env, FASTCGI_KEY_VALUE_SEP);
+        if (!sep) { continue; }
+
+        if (MatchEnvVarLower(*env, (size_t)(sep - *env), key, keylen)) {
+            lua_pushstring(L, sep+1);
+            lua_pushvalue(L, 2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, 1);
+            return 1;
+        }
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+// Convert every request variable into the table before iterating on it.
+static int Vars_Pairs(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    LuaDB_RequestParams *params = GetBoundParams(L, 1);
+    if (!params) { return PushPairs(L); }
+
+    luaL_checkstack(L, 4, "Could not allocate memory for request variable table");
+    for (char **env = params->envp; *env != NULL; env++) {
+        // Skip any headers with the prefix HTTP_
+        if (IsHeaderEnvVar(params, *env)) { continue; }
+
+        // Find the equals separator for the variable
+        char *sep = strchr(*env, FASTCGI_KEY_VALUE_SEP);
+        if (!sep) {
+            syslog(LOG_WARNING, "No '=' separator found in request variable '%s'",
+                   *env);
+            continue;
+        }
+
+        // Add the variable unless it was already accessed or replaced
+        PushEnvVarAsLower(L, *env, (size_t)(sep - *env));
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, 1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_pushstring(L, sep+1);
+            lua_rawset(L, 1);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+
+    UnbindRequestTable(L, 1);
+    return PushPairs(L);
+}
+
+// Look up a single request header by its HTTP header name, caching the
+// value in the table if it is found.
+static int Headers_Index(lua_State *L) {
+    LuaDB_RequestParams *params = GetBoundParams(L, 1);
+    if (!params || (lua_type(L, 2) != LUA_TSTRING)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t keylen;
+    const char *key = lua_tolstring(L, 2, &keylen);
+
+    for (char **env = params->envp; *env != NULL; env++) {
+        if (!IsHeaderEnvVar(params, *env)) { continue; }
+
+        char *sep = strchr(*env, FASTCGI_KEY_VALUE_SEP);
+        if (!sep) { continue; }
+
+        if (MatchEnvVarHeader(params->pfx, *env, (size_t)(sep - *env), key, keylen)) {
+            lua_pushstring(L, sep+1);
+            lua_pushvalue(L, 2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, 1);
+            return 1;
+        }
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+// Convert every request header into the table before iterating on it.
+//
+// Header names will be converted from their environment variable style
+// names to a more 'correct' HTTP header style using title-casing and
+// underscores will be converted to hyphens. This might mangle certain
+// header names such as "DNT", which will be rendered as "Dnt".
+static int Headers_Pairs(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    LuaDB_RequestParams *params = GetBoundParams(L, 1);
+    if (!params) { return PushPairs(L); }
+
+    luaL_checkstack(L, 4, "Could not allocate memory for request headers table");
+    for (char **env = params->envp; *env != NULL; env++) {
+        // Skip any headers without the prefix HTTP_
+        if (!IsHeaderEnvVar(params, *env)) { continue; }
+
+        // Find the equals separator for the variable
+        char *sep = strchr(*env, FASTCGI_KEY_VALUE_SEP);
+        if (!sep) {
+            syslog(LOG_WARNING, "No '=' separator found in header '%s'", *env);
+            continue;
+        }
+
+        // Add the header unless it was already accessed or replaced
+        PushEnvVarAsHeader(L, params->pfx, *env, (size_t)(sep - *env));
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, 1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_pushstring(L, sep+1);
+            lua_rawset(L, 1);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+
+    UnbindRequestTable(L, 1);
+    return PushPairs(L);
+}
+
+// Parse the query string into the `query` field of the request table the
+// first time it is accessed.
+static int Request_Index(lua_State *L) {
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t keylen;
+    const char *key = lua_tolstring(L, 2, &keylen);
+    if ((keylen != 5) || (memcmp(key, "query", 5) != 0)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    LuaDB_RequestParams *params = GetBoundParams(L, 1);
+    if (!params) {
+        lua_pushnil(L);
+        return 1;
+    }
+    UnbindRequestTable(L, 1);
+
+    // Find the query string among the FastCGI parameters
+    const char *qs = NULL;
+    for (char **env = params->envp; *env != NULL; env++) {
+        if ((strncmp(*env, params->query->val, params->query->len) == 0) &&
+            ((*env)[params->query->len] == FASTCGI_KEY_VALUE_SEP)) {
+            qs = &(*env)[params->query->len + 1];
+            break;
+        }
+    }
+
+    if (!qs) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (!ReadHttpRequestQueryString(L, qs, NULL)) {
+        syslog(LOG_WARNING, "Could not parse query string '%s'", qs);
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+// Iterator function returned by the `__pairs` metamethods.
+static int ParamsNext(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) {
+        return 2;
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Bind the table sitting on top of the stack to the request parameters
+// at index `params` and give it the named metatable.
+static void BindRequestTable(lua_State *L, int bindings, int params, const char *mt, lua_CFunction index, lua_CFunction pairs) {
+    assert(L);
+    assert(mt);
+
+    CreateParamsMetatable(L, mt, index, pairs);
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, params);
+    lua_rawset(L, bindings);
+}
+
+// Return the parameters bound to the table at the given index, or NULL
+// if the table is not bound or the request has ended.
+static LuaDB_RequestParams *GetBoundParams(lua_State *L, int idx) {
+    assert(L);
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 2, "out of memory");
+    PushBindingsTable(L);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    LuaDB_RequestParams *params = luaL_testudata(L, -1, LUADB_PARAMS_REGISTRY_NAME);
+    lua_pop(L, 2);
+
+    if (!params || !params->envp) { return NULL; }
+    return params;
+}
+
+// Remove the binding for a table which no longer needs its parameters.
+static void UnbindRequestTable(lua_State *L, int idx) {
+    assert(L);
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 3, "out of memory");
+    PushBindingsTable(L);
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+// Push the weak-keyed table mapping request tables to their parameters,
+// creating it on first use.
+static void PushBindingsTable(lua_State *L) {
+    assert(L);
+
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUADB_PARAMS_BINDINGS_KEY) == LUA_TTABLE) {
+        return;
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_PARAMS_BINDINGS_KEY);
+}
+
+// Push the named metatable, creating it on first use.
+static void CreateParamsMetatable(lua_State *L, const char *name, lua_CFunction index, lua_CFunction pairs) {
+    assert(L);
+    assert(name);
+
+    luaL_checkstack(L, 2, "out of memory");
+    if (!luaL_newmetatable(L, name)) { return; }
+
+    if (index) {
+        lua_pushcfunction(L, index);
+        lua_setfield(L, -2, "__index");
+    }
+
+    if (pairs) {
+        lua_pushcfunction(L, pairs);
+        lua_setfield(L, -2, "__pairs");
+    }
+}
+
+// Push the values returned from `__pairs` for the table at index 1.
+static int PushPairs(lua_State *L) {
+    lua_pushcfunction(L, ParamsNext);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+// Read the Query String parameter from the FastCGI server and parse it
+// into a Lua table of key-value pairs, which is left on the stack.
+//
+// This should be able to handle most common query string cases such as
+// - Multiple query string values with the same key
+// - Keys without a value
+// - Percent encoded query string values (assuming UTF-8 encoded)
+static bool ReadHttpRequestQueryString(lua_State *L, const char *qs, size_t *len) {
+    assert(L);
+    if (!qs) { return false; }
+
+    // Verify we can handle all of these operations
+    luaL_checkstack(L, 6, "out of memory");
+
+    // Set up a query string iterator
+    LuaDB_QueryIter iter;
+    LuaDB_QueryIterInit(&iter, qs, len);
+
+    // Create a table from the query string
+    lua_newtable(L);
+
+    // Iterate over each k/v pair in the query string
+    while (LuaDB_QueryIterNext(&iter)) {
+        // Decode the query string values
+        size_t keylen;
+        char *key = LuaDB_QueryIterKey(&iter, &keylen);
+        if (!key) { continue; }
+        size_t vallen;
+        char *val = LuaDB_QueryIterVal(&iter, &vallen);
+
+        // Push the key onto the stack twice
+        lua_pushlstring(L, key, keylen);
+        lua_pushvalue(L, -1);   // Duplicate the value, since we'll need it
+
+        int type = lua_gettable(L, -3); // Pops the second value
+        if (type == LUA_TTABLE) {       // There were previously values by this name
+            // Get the next array index (#table + 1)
+            lua_len(L, -1);
+            lua_pushinteger(L, 1);
+            lua_arith(L, LUA_OPADD);
+
+            // Add the next query string value at that index
+            PushQueryValueString(L, key, keylen, val, vallen);
+            lua_settable(L, -3);
+            lua_pop(L, 1);
+        } else if ((type == LUA_TNIL) || (type == LUA_TNONE)) { // Not seen before
+            // Add the k/v pair into the table
+            if (type == LUA_TNIL) { lua_pop(L, 1); }
+            PushQueryValueString(L, key, keylen, val, vallen);
+            lua_settable(L, -3);
+        } else {    // This value has been seen once before; need to make it an array
+            lua_createtable(L, 2, 0);
+            lua_rotate(L, -2, 1);       // Swap the table and original value
+            lua_pushinteger(L, 1);      // Push the integer 1 (future key)
+            lua_rotate(L, -2, 1);       // Swap the integer key and value
+            lua_settable(L, -3);        // Set the original key with a new table
+            lua_pushinteger(L, 2);      // Start pushing in the second (new) key
+            PushQueryValueString(L, key, keylen, val, vallen);
+            lua_settable(L, -3);        // Set the new key/value pair into table
+            lua_settable(L, -3);        // Finally, set the table into the query table
+        }
+
+        free(key);
+        free(val);
+    }
+
+    return true;
+}
+
+// Push an empty string if the query string value is NULL.
+//
+// Since the equivalent Lua value is Nil, which is also how one checks if
+// a key is not in a table, we need to push an empty string so that callers
+// can still check for the query string key in the table.
+static inline void PushQueryValueString(lua_State *L, const char *key, size_t keylen, const char *val, size_t vallen) {
+    assert(L);
+
+    if ((keylen > 0) && (key)) {
+        lua_pushlstring(L, val, vallen);
+    } else {
+        lua_pushstring(L, "");
+    }
+}
+
+// Return true if the FastCGI parameter is an HTTP header.
+static inline bool IsHeaderEnvVar(LuaDB_RequestParams *params, const char *env) {
+    return strncmp(env, params->pfx->val, params->pfx->len) == 0;
+}
+
+// Convert a single character of a FastCGI environment variable header name
+// to the equivalent character of the standard HTTP header name. `first`
+// tracks whether the next character begins a new word.
+//
+// This function assumes that HTTP Header keys are ASCII encoded, which is
+// currently required by RFC 2616 for HTTP Headers.
+static inline char ConvertHeaderChar(char cur, bool *first) {
+    // Convert all underscores to hyphens
+    if (cur == '_') {
+        *first = true;
+        return '-';
+    }
+
+    // Convert the first letter of any word to uppercase;
+    // the subsequent letters are all lowercase
+    if (*first) {
+        *first = false;
+        return (char)toupper(cur);
+    }
+
+    return (char)tolower(cur);
+}
+
+// Return true if the FastCGI environment variable header name converts to
+// the given HTTP header name (e.g. HTTP_CONTENT_LENGTH to Content-Length).
+static bool MatchEnvVarHeader(LuaDB_Setting *pfx, const char *in, size_t len, const char *key, size_t keylen) {
+    if ((len - pfx->len) != keylen) { return false; }
+
+    bool first = true;
+    for (size_t i = 0; i < keylen; i++) {
+        if (ConvertHeaderChar(in[i+pfx->len], &first) != key[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Return true if the FastCGI environment variable name converts to the
+// given lowercase name.
+static bool MatchEnvVarLower(const char *in, size_t len, const char *key, size_t keylen) {
+    if (len != keylen) { return false; }
+
+    for (size_t i = 0; i < len; i++) {
+        if ((char)tolower(in[i]) != key[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Push the standard HTTP header name for a FastCGI environment variable
+// header name (e.g. HTTP_CONTENT_LENGTH to Content-Length).
+static void PushEnvVarAsHeader(lua_State *L, LuaDB_Setting *pfx, const char *in, size_t len) {
+    assert(L);
+
+    luaL_Buffer b;
+    size_t outlen = len - pfx->len;
+    char *header = luaL_buffinitsize(L, &b, outlen);
+
+    bool first = true;
+    for (size_t i = 0; i < outlen; i++) {
+        header[i] = ConvertHeaderChar(in[i+pfx->len], &first);
+    }
+
+    luaL_pushresultsize(&b, outlen);
+}
+
+// Push the FastCGI environment variable name converted to lower case.
+static void PushEnvVarAsLower(lua_State *L, const char *in, size_t len) {
+    assert(L);
+
+    luaL_Buffer b;
+    char *var = luaL_buffinitsize(L, &b, len);
+
+    for (size_t i = 0; i < len; i++) {
+        var[i] = (char)tolower(in[i]);
+    }
+
+    luaL_pushresultsize(&b, len);
+}
@@ -0,0 +1,44 @@
+/*****************************************************************************
+ * LuaDB :: params.h
+ *
+ * Lazy HTTP request variable, header, and query string tables.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_PARAMS_H
+#define LUADB_PARAMS_H
+
+#include "deps/lua/lua.h"
+
+#include "config.h"
+
+/**
+ * @brief Add the `vars`, `headers`, and `query` fields to the request
+ * table at the given stack index.
+ *
+ * The fields are backed directly by the FastCGI parameters in @c envp.
+ * Entries are only converted into Lua values the first time they are
+ * accessed (or when the table is iterated with @c pairs), after which
+ * they are cached in the table. The `query` table is only parsed the
+ * first time it is accessed.
+ *
+ * @param L the Lua state
+ * @param idx the stack index of the request table
+ * @param envp the FastCGI parameters; must remain valid until the
+ *        parameters are closed with @c LuaDB_CloseRequestParams
+ * @param config the environment configuration
+ */
+void LuaDB_SetRequestParams(lua_State *L, int idx, char **envp, LuaDB_EnvConfig *config);
+
+/**
+ * @brief Detach the request tables most recently created in the given
+ * state from their FastCGI parameters. Entries which have not been
+ * accessed yet will be nil if Lua code accesses them after the end of
+ * the request.
+ */
+void LuaDB_CloseRequestParams(lua_State *L);
+
+#endif //LUADB_PARAMS_H
@@ -0,0 +1,367 @@
+/*****************************************************************************
+ * LuaDB :: pool.c
+ *
+ * Pool of pre-initialized LuaDB states reused across requests.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+
+#include "log.h"
+#include "pool.h"
+#include "state.h"
+
+static const char *const LUADB_POOL_GLOBALS_KEY = "luadb.globals";
+static const char *const LUADB_POOL_ROUTER_KEY = "luadb.router";
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static bool CreatePoolState(LuaDB_StatePool *pool, LuaDB_PoolState *ps);
+static void ClosePoolState(LuaDB_PoolState *ps);
+static bool ShouldRecyclePoolState(LuaDB_StatePool *pool, LuaDB_PoolState *ps);
+static bool LoadRouter(LuaDB_StatePool *pool, LuaDB_PoolState *ps);
+static void CheckRouterModified(LuaDB_StatePool *pool);
+static void SnapshotGlobals(lua_State *L);
+static void ResetGlobals(lua_State *L);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+bool LuaDB_StatePoolInit(LuaDB_StatePool *pool, LuaDB_EnvConfig *config, const char **paths, size_t npaths) {
+    assert(pool);
+    assert(config);
+
+    pool->size = (config->pool_size > 0) ? (size_t)config->pool_size : 1;
+    pool->max_requests = (size_t)config->pool_max_requests;
+    pool->max_memory = (size_t)config->pool_max_memory;
+    pool->arena = (config->pool_arena != 0);
+    pool->request_limit = (size_t)config->request_max_memory;
+    pool->state_limit = (size_t)config->state_max_memory;
+    pool->router_interval = (time_t)config->router_check_interval;
+    pool->router_checked = 0;
+    pool->router_mtime = 0;
+    pool->router_size = 0;
+    pool->config = config;
+    pool->paths = paths;
+    pool->npaths = npaths;
+    pool->setup = NULL;
+
+    pool->states = calloc(pool->size, sizeof(LuaDB_PoolState));
+    if (!pool->states) {
+        return false;
+    }
+
+    CheckRouterModified(pool);
+
+    for (size_t i = 0; i < pool->size; i++) {
+        if (!CreatePoolState(pool, &pool->states[i])) {
+            LuaDB_StatePoolClose(pool);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void LuaDB_StatePoolSetup(LuaDB_StatePool *pool, void (*setup)(lua_State *)) {
+    assert(pool);
+
+    pool->setup = setup;
+    if (!setup) { return; }
+
+    for (size_t i = 0; i < pool->size; i++) {
+        LuaDB_PoolState *ps = &pool->states[i];
+        if (ps->L) {
+            setup(ps->L);
+            SnapshotGlobals(ps->L);
+        }
+    }
+}
+
+LuaDB_PoolState *LuaDB_StatePoolAcquire(LuaDB_StatePool *pool) {
+    assert(pool);
+
+    CheckRouterModified(pool);
+
+    for (size_t i = 0; i < pool->size; i++) {
+        LuaDB_PoolState *ps = &pool->states[i];
+        if (ps->in_use) { continue; }
+
+        // Replace states holding an outdated routing engine
+        if (ps->L && ((ps->router_mtime != pool->router_mtime) ||
+                      (ps->router_size != pool->router_size))) {
+            ClosePoolState(ps);
+        }
+
+        // States which failed to be recreated are replaced on demand
+        if (!ps->L && !CreatePoolState(pool, ps)) {
+            continue;
+        }
+
+        ps->in_use = true;
+        LuaDB_AllocatorBeginRequest(ps->alloc);
+        return ps;
+    }
+
+    return NULL;
+}
+
+void LuaDB_StatePoolRelease(LuaDB_StatePool *pool, LuaDB_PoolState *ps, bool recycle) {
+    assert(pool);
+    assert(ps);
+
+    ps->uses++;
+    ps->in_use = false;
+
+    if (recycle || ShouldRecyclePoolState(pool, ps)) {
+        ClosePoolState(ps);
+        if (!CreatePoolState(pool, ps)) {
+            syslog(LOG_ERR, "Could not recreate pooled lua_State object.");
+        }
+        return;
+    }
+
+    lua_settop(ps->L, 0);
+    ResetGlobals(ps->L);
+}
+
+bool LuaDB_StatePoolPushRouter(LuaDB_PoolState *ps) {
+    assert(ps);
+    assert(ps->L);
+
+    if (lua_getfield(ps->L, LUA_REGISTRYINDEX, LUADB_POOL_ROUTER_KEY) != LUA_TFUNCTION) {
+        lua_pop(ps->L, 1);
+        return false;
+    }
+
+    return true;
+}
+
+void LuaDB_StatePoolClose(LuaDB_StatePool *pool) {
+    assert(pool);
+
+    if (!pool->states) { return; }
+    for (size_t i = 0; i < pool->size; i++) {
+        ClosePoolState(&pool->states[i]);
+    }
+
+    free(pool->states);
+    pool->states = NULL;
+    pool->size = 0;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Create a new LuaDB state for the given pool slot, with its own allocator.
+static bool CreatePoolState(LuaDB_StatePool *pool, LuaDB_PoolState *ps) {
+    assert(pool);
+    assert(ps);
+
+    ps->uses = 0;
+    ps->in_use = false;
+    ps->alloc = LuaDB_AllocatorNew(pool->arena);
+    if (!ps->alloc) {
+        return false;
+    }
+
+    LuaDB_AllocatorSetLimits(ps->alloc, pool->request_limit, pool->state_limit);
+
+    ps->L = LuaDB_NewStateWithAllocator(pool->paths, pool->npaths, ps->alloc);
+    if (!ps->L) {
+        LuaDB_AllocatorFree(ps->alloc);
+        ps->alloc = NULL;
+        return false;
+    }
+
+    LuaDB_PathAddAbsolute(ps->L, pool->config->root.val);
+    LoadRouter(pool, ps);
+    if (pool->setup) { pool->setup(ps->L); }
+    SnapshotGlobals(ps->L);
+    return true;
+}
+
+// Close the state in the given pool slot and release its memory in bulk.
+static void ClosePoolState(LuaDB_PoolState *ps) {
+    assert(ps);
+
+    if (ps->L) {
+        lua_close(ps->L);
+        ps->L = NULL;
+    }
+    LuaDB_AllocatorFree(ps->alloc);
+    ps->alloc = NULL;
+    ps->uses = 0;
+    ps->in_use = false;
+}
+
+// Return true if the state has served too many requests or has grown
+// too large to be returned to the pool. The size is what the state holds
+// from the system, so arena space freed by earlier requests and kept for
+// reuse counts towards it.
+static bool ShouldRecyclePoolState(LuaDB_StatePool *pool, LuaDB_PoolState *ps) {
+    assert(pool);
+    assert(ps);
+
+    if ((pool->max_requests > 0) && (ps->uses >= pool->max_requests)) {
+        return true;
+    }
+
+    if (pool->max_memory > 0) {
+        if (LuaDB_AllocatorFootprint(ps->alloc) > pool->max_memory) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Compile and run the routing engine once for the given state, saving the
+// function it returns in the registry.
+//
+// A routing engine which fails to load is logged, but the state is still
+// usable; requests routed through it will fail until the router changes.
+static bool LoadRouter(LuaDB_StatePool *pool, LuaDB_PoolState *ps) {
+    assert(pool);
+    assert(ps);
+    lua_State *L = ps->L;
+
+    ps->router_mtime = pool->router_mtime;
+    ps->router_size = pool->router_size;
+
+    int err = luaL_loadfile(L, pool->config->router.val);
+    if (err == LUA_OK) {
+        err = lua_pcall(L, 0, 1, 0);
+    }
+    if (err != LUA_OK) {
+        syslog(LOG_ERR, "Error occurred intializing routing engine: %s",
+               lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        syslog(LOG_ERR, "Routing engine '%s' did not return a function.",
+               pool->config->router.val);
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_POOL_ROUTER_KEY);
+    return true;
+}
+
+// Check whether the routing engine file has been modified, at most once
+// per configured interval.
+static void CheckRouterModified(LuaDB_StatePool *pool) {
+    assert(pool);
+
+    time_t now = time(NULL);
+    if ((pool->router_checked != 0) &&
+        ((now - pool->router_checked) < pool->router_interval)) {
+        return;
+    }
+    pool->router_checked = now;
+
+    struct stat st;
+    if (stat(pool->config->router.val, &st) != 0) {
+        return;
+    }
+
+    pool->router_mtime = st.st_mtime;
+    pool->router_size = st.st_size;
+}
+
+// Save a shallow copy of the global table (and its metatable) into the
+// registry so globals can be reset between requests.
+static void SnapshotGlobals(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 4, "out of memory");
+    lua_pushglobaltable(L);
+    lua_newtable(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, -3) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    // Keep the original metatable (if any) as the snapshot metatable
+    if (lua_getmetatable(L, -2)) {
+        lua_setmetatable(L, -2);
+    }
+
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_POOL_GLOBALS_KEY);
+    lua_pop(L, 1);
+}
+
+// Reset the global table to the snapshot taken when the state was created.
+//
+// Globals added by a request are removed, globals replaced by a request
+// are restored to their original value, and globals deleted by a request
+// are added back.
+static void ResetGlobals(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 5, "out of memory");
+    lua_pushglobaltable(L);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUADB_POOL_GLOBALS_KEY) != LUA_TTABLE) {
+        lua_pop(L, 2);
+        return;
+    }
+
+    // Clearing and modifying existing fields is permitted during traversal
+    lua_pushnil(L);
+    while (lua_next(L, -3) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -4);
+        if (!lua_rawequal(L, -1, -2)) {
+            lua_pushvalue(L, -3);
+            lua_insert(L, -2);
+            lua_rawset(L, -6);
+        } else {
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    // Add back any globals which were removed
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);
+        if (lua_rawget(L, -5) == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -5);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+
+    // Restore the original global metatable
+    if (lua_getmetatable(L, -1)) {
+        lua_setmetatable(L, -3);
+    } else {
+        lua_pushnil(L);
+        lua_setmetatable(L, -3);
+    }
+
+    lua_pop(L, 2);
+}
@@ -0,0 +1,111 @@
+/*****************************************************************************
+ * LuaDB :: pool.h
+ *
+ * Pool of pre-initialized LuaDB states reused across requests.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_POOL_H
+#define LUADB_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "config.h"
+
+/**
+ * @brief A single pooled @c lua_State and its usage counters.
+ */
+typedef struct LuaDB_PoolState {
+    lua_State *L;           /** the state; NULL if it has not been created */
+    LuaDB_Allocator *alloc; /** allocator owned by the state */
+    size_t uses;            /** number of requests served by this state */
+    bool in_use;            /** true while the state is checked out */
+    time_t router_mtime;    /** modification time of the loaded router */
+    off_t router_size;      /** size of the loaded router */
+} LuaDB_PoolState;
+
+/**
+ * @brief Pool of LuaDB states. Pools are not thread-safe; each thread
+ * serving requests should own its own pool.
+ */
+typedef struct LuaDB_StatePool {
+    LuaDB_PoolState *states;    /** array of pooled states */
+    size_t size;                /** number of states in @c states */
+    size_t max_requests;        /** recycle a state after this many requests; 0 to disable */
+    size_t max_memory;          /** recycle a state above this many bytes; 0 to disable */
+    bool arena;                 /** allocate small blocks from a per-state arena */
+    size_t request_limit;       /** bytes a request may allocate; 0 to disable */
+    size_t state_limit;         /** bytes a state may allocate; 0 to disable */
+    time_t router_interval;     /** seconds between router modification checks */
+    time_t router_checked;      /** last time the router was checked */
+    time_t router_mtime;        /** current modification time of the router */
+    off_t router_size;          /** current size of the router */
+    LuaDB_EnvConfig *config;    /** environment configuration */
+    const char **paths;         /** additional Lua include paths */
+    size_t npaths;              /** number of paths in @c paths */
+    void (*setup)(lua_State *); /** called on each new state; may be NULL */
+} LuaDB_StatePool;
+
+/**
+ * @brief Initialize a pool of states using the pool settings in the
+ * environment configuration. Every state in the pool is created eagerly.
+ *
+ * @param pool the pool to initialize
+ * @param config the environment configuration; must outlive the pool
+ * @param paths an array of C strings with additional Lua include paths
+ * @param npaths the number of Lua include paths in @c paths
+ * @returns true if every state in the pool could be created
+ */
+bool LuaDB_StatePoolInit(LuaDB_StatePool *pool, LuaDB_EnvConfig *config, const char **paths, size_t npaths);
+
+/**
+ * @brief Set a function which is called with every state in the pool,
+ * now and whenever a state is replaced, after the routing engine is
+ * loaded. Globals it sets are kept between requests.
+ *
+ * @param pool the pool
+ * @param setup the function to call with each state
+ */
+void LuaDB_StatePoolSetup(LuaDB_StatePool *pool, void (*setup)(lua_State *));
+
+/**
+ * @brief Check out a state from the pool. The per-request counters of
+ * the state's allocator are reset.
+ *
+ * If the routing engine file has changed since the state loaded it,
+ * the state is replaced with a new state before it is returned.
+ *
+ * @returns a pooled state or NULL if no state is available
+ */
+LuaDB_PoolState *LuaDB_StatePoolAcquire(LuaDB_StatePool *pool);
+
+/**
+ * @brief Return a state to the pool. Request-visible globals are reset
+ * to their values from when the state was created. The state is closed
+ * and replaced by a new state if it has exceeded the request or memory
+ * limits for the pool or if @c recycle is true.
+ */
+void LuaDB_StatePoolRelease(LuaDB_StatePool *pool, LuaDB_PoolState *ps, bool recycle);
+
+/**
+ * @brief Push the routing engine function loaded for the given state
+ * onto its stack.
+ *
+ * @returns true if the routing engine was pushed; false if the routing
+ *          engine could not be loaded (nothing is pushed)
+ */
+bool LuaDB_StatePoolPushRouter(LuaDB_PoolState *ps);
+
+/**
+ * @brief Close every state in the pool and free the pool memory.
+ */
+void LuaDB_StatePoolClose(LuaDB_StatePool *pool);
+
+#endif //LUADB_POOL_H
@@ -0,0 +1,343 @@
+/*****************************************************************************
+ * LuaDB :: profile.c
+ *
+ * Sampling profiler for Lua request handlers.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+// SA_RESTART and setitimer are not part of the base POSIX standard
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+
+#include "log.h"
+#include "profile.h"
+
+#define LUADB_PROFILE_NBUCKETS 1024
+#define LUADB_PROFILE_MAX_DEPTH 64
+#define LUADB_PROFILE_STACK_SIZE 2048
+#define LUADB_PROFILE_FRAME_SIZE 160
+
+static const char *const LUADB_PROFILE_REQUEST_KEY = "luadb.profile";
+
+// Distinct stacks kept per process; further stacks are only counted
+static const size_t LUADB_PROFILE_MAX_STACKS = 16384;
+
+// Number of times a single folded stack was sampled
+typedef struct LuaDB_ProfileStack {
+    struct LuaDB_ProfileStack *next;
+    unsigned long count;
+    char stack[];
+} LuaDB_ProfileStack;
+
+static const char *profile_path = NULL;
+static long profile_interval = 10000;
+static bool profile_enabled = false;
+
+// Flags shared with the signal handler
+static volatile sig_atomic_t profile_active = 0;    // every request is profiled
+static volatile sig_atomic_t profile_toggle = 0;    // SIGUSR2 was received
+static volatile sig_atomic_t profile_pending = 0;   // a sample is due
+static int profile_requests = 0;                    // requests profiling themselves
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static LuaDB_ProfileStack *profile_stacks[LUADB_PROFILE_NBUCKETS];
+static size_t profile_nstacks = 0;
+static unsigned long profile_dropped = 0;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static void HandleProfileSignal(int sig);
+static bool IsRequestProfiled(lua_State *L);
+static size_t FormatProfileStack(lua_State *L, char *buf, size_t size);
+static size_t AppendProfileFrame(char *buf, size_t len, size_t size, lua_Debug *ar);
+static void AddProfileStack(const char *stack, size_t len);
+static void WriteProfile(void);
+static void ClearProfile(void);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void LuaDB_ProfileInit(const char *path, long interval, bool enabled) {
+    profile_path = (path && (*path != '\0')) ? path : NULL;
+    profile_interval = (interval > 0) ? interval : 10000;
+    profile_enabled = enabled;
+}
+
+bool LuaDB_ProfileAvailable(void) {
+    return (profile_path != NULL);
+}
+
+void LuaDB_ProfileStart(void) {
+#ifndef _WIN32
+    if (!profile_path) { return; }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = HandleProfileSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    // Samples are taken every interval of CPU time used by the process,
+    // so idle workers are never interrupted
+    profile_active = profile_enabled;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = profile_interval / 1000000;
+    timer.it_interval.tv_usec = profile_interval % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        syslog(LOG_ERR, "Could not start profiling timer.");
+        return;
+    }
+
+    if (profile_active) {
+        syslog(LOG_INFO, "Profiling every request to %s.%d", profile_path, (int)getpid());
+    }
+#endif
+}
+
+void LuaDB_ProfileCheck(void) {
+    if (!profile_path) { return; }
+    if (!__atomic_exchange_n(&profile_toggle, 0, __ATOMIC_ACQ_REL)) { return; }
+
+    if (profile_active) {
+        profile_active = 0;
+        WriteProfile();
+        syslog(LOG_INFO, "Stopped profiling every request");
+    } else {
+        ClearProfile();
+        profile_active = 1;
+        syslog(LOG_INFO, "Profiling every request to %s.%d", profile_path, (int)getpid());
+    }
+}
+
+void LuaDB_ProfileStop(void) {
+#ifndef _WIN32
+    if (!profile_path) { return; }
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    profile_active = 0;
+
+    if (profile_nstacks > 0) {
+        WriteProfile();
+    }
+    ClearProfile();
+#endif
+}
+
+void LuaDB_ProfileHook(lua_State *L, lua_Debug *ar) {
+    if (!profile_pending) { return; }
+    if (!profile_active && !IsRequestProfiled(L)) { return; }
+    profile_pending = 0;
+
+    char stack[LUADB_PROFILE_STACK_SIZE];
+    size_t len = FormatProfileStack(L, stack, sizeof(stack));
+    if (len > 0) {
+        AddProfileStack(stack, len);
+    }
+}
+
+void LuaDB_ProfileEndRequest(lua_State *L) {
+    assert(L);
+
+    if (!profile_path || !IsRequestProfiled(L)) { return; }
+
+    luaL_checkstack(L, 1, "out of memory");
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_PROFILE_REQUEST_KEY);
+    __atomic_fetch_sub(&profile_requests, 1, __ATOMIC_RELAXED);
+    WriteProfile();
+}
+
+int LuaDB_ProfileRequest(lua_State *L) {
+    bool enable = lua_isnone(L, 1) || lua_toboolean(L, 1);
+    if (!profile_path) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    if (enable != IsRequestProfiled(L)) {
+        lua_pushboolean(L, enable);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUADB_PROFILE_REQUEST_KEY);
+        __atomic_fetch_add(&profile_requests, (enable) ? 1 : -1, __ATOMIC_RELAXED);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Signal handler for the profiling timer and profiling toggle. Samples
+// cannot be taken here, since the Lua stack may be in the middle of
+// changing; the next hook event takes the sample instead.
+static void HandleProfileSignal(int sig) {
+    if (sig == SIGUSR2) {
+        profile_toggle = 1;
+        return;
+    }
+
+    if (profile_active || (__atomic_load_n(&profile_requests, __ATOMIC_RELAXED) > 0)) {
+        profile_pending = 1;
+    }
+}
+
+// Return true if the request running on the given state enabled
+// profiling itself.
+static bool IsRequestProfiled(lua_State *L) {
+    luaL_checkstack(L, 1, "out of memory");
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_PROFILE_REQUEST_KEY);
+    bool profiled = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return profiled;
+}
+
+// Format the stack of the given state as a folded stack (outermost frame
+// first, separated by semicolons). Returns the length of the stack.
+static size_t FormatProfileStack(lua_State *L, char *buf, size_t size) {
+    assert(L);
+    assert(buf);
+    assert(size > 0);
+
+    lua_Debug frames[LUADB_PROFILE_MAX_DEPTH];
+    int depth = 0;
+    while ((depth < LUADB_PROFILE_MAX_DEPTH) && lua_getstack(L, depth, &frames[depth])) {
+        lua_getinfo(L, "Sn", &frames[depth]);
+        depth++;
+    }
+
+    size_t len = 0;
+    for (int i = depth - 1; i >= 0; i--) {
+        if ((len > 0) && (len < size - 1)) { buf[len++] = ';'; }
+        len = AppendProfileFrame(buf, len, size, &frames[i]);
+    }
+
+    buf[len] = '\0';
+    return len;
+}
+
+// Append a single frame to a folded stack. Lua functions are named with
+// the source and line they were defined on; C functions (such as the
+// `lmdb` and `json` functions) only by the name they were called by.
+static size_t AppendProfileFrame(char *buf, size_t len, size_t size, lua_Debug *ar) {
+    assert(buf);
+    assert(ar);
+
+    char frame[LUADB_PROFILE_FRAME_SIZE];
+    const char *name = (ar->name) ? ar->name : "?";
+    if (*ar->what == 'C') {
+        snprintf(frame, sizeof(frame), "%s [C]", name);
+    } else if (*ar->what == 'm') {
+        snprintf(frame, sizeof(frame), "main (%s)", ar->short_src);
+    } else {
+        snprintf(frame, sizeof(frame), "%s (%s:%d)", name, ar->short_src, ar->linedefined);
+    }
+
+    // Semicolons separate frames and the final space separates the count
+    for (const char *c = frame; *c && (len < size - 1); c++) {
+        buf[len++] = (*c == ';') ? ':' : *c;
+    }
+    return len;
+}
+
+// Count one sample of the given folded stack.
+static void AddProfileStack(const char *stack, size_t len) {
+    assert(stack);
+
+    // FNV-1a hash of the stack
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)stack[i]) * 16777619u;
+    }
+    LuaDB_ProfileStack **bucket = &profile_stacks[hash % LUADB_PROFILE_NBUCKETS];
+
+    pthread_mutex_lock(&profile_lock);
+    LuaDB_ProfileStack *s = *bucket;
+    for (; s && (strcmp(s->stack, stack) != 0); s = s->next);
+
+    if (s) {
+        s->count++;
+    } else if ((profile_nstacks < LUADB_PROFILE_MAX_STACKS) &&
+               (s = malloc(sizeof(LuaDB_ProfileStack) + len + 1))) {
+        memcpy(s->stack, stack, len + 1);
+        s->count = 1;
+        s->next = *bucket;
+        *bucket = s;
+        profile_nstacks++;
+    } else {
+        profile_dropped++;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Write every stack sampled so far to the output file for this process,
+// replacing any profile written earlier.
+static void WriteProfile(void) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", profile_path, (int)getpid());
+
+    pthread_mutex_lock(&profile_lock);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        pthread_mutex_unlock(&profile_lock);
+        syslog(LOG_ERR, "Could not write profile to %s", path);
+        return;
+    }
+
+    for (size_t i = 0; i < LUADB_PROFILE_NBUCKETS; i++) {
+        for (LuaDB_ProfileStack *s = profile_stacks[i]; s; s = s->next) {
+            fprintf(f, "%s %lu\n", s->stack, s->count);
+        }
+    }
+    fclose(f);
+
+    if (profile_dropped > 0) {
+        syslog(LOG_WARNING, "Profile %s is missing %lu samples of uncommon stacks",
+               path, profile_dropped);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Discard every stack sampled so far.
+static void ClearProfile(void) {
+    pthread_mutex_lock(&profile_lock);
+    for (size_t i = 0; i < LUADB_PROFILE_NBUCKETS; i++) {
+        LuaDB_ProfileStack *s = profile_stacks[i];
+        while (s) {
+            LuaDB_ProfileStack *next = s->next;
+            free(s);
+            s = next;
+        }
+        profile_stacks[i] = NULL;
+    }
+    profile_nstacks = 0;
+    profile_dropped = 0;
+    pthread_mutex_unlock(&profile_lock);
+}
@@ -0,0 +1,72 @@
+/*****************************************************************************
+ * LuaDB :: profile.h
+ *
+ * Sampling profiler for Lua request handlers.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_PROFILE_H
+#define LUADB_PROFILE_H
+
+#include <stdbool.h>
+
+#include "deps/lua/lua.h"
+
+/**
+ * @brief Configure the profiler. The profiler is only available if an
+ * output path is given. Must be called before any worker is forked.
+ *
+ * @param path profiles are written to this path with the process ID
+ *             appended; NULL or empty disables the profiler
+ * @param interval CPU time between samples in microseconds
+ * @param enabled true to profile every request from the start
+ */
+void LuaDB_ProfileInit(const char *path, long interval, bool enabled);
+
+/**
+ * @brief Return true if the profiler is available, in which case the
+ * request hook should also be called as functions return.
+ */
+bool LuaDB_ProfileAvailable(void);
+
+/**
+ * @brief Start the sampling timer for the calling process. Also installs
+ * the @c SIGUSR2 handler which toggles profiling every request.
+ */
+void LuaDB_ProfileStart(void);
+
+/**
+ * @brief Apply a pending @c SIGUSR2 toggle. Turning profiling off writes
+ * the profile collected so far. Should be called regularly by every
+ * thread serving requests.
+ */
+void LuaDB_ProfileCheck(void);
+
+/**
+ * @brief Stop the sampling timer and write the profile collected so far.
+ */
+void LuaDB_ProfileStop(void);
+
+/**
+ * @brief Take a sample of the stack of @c L if one is due. Called from
+ * the request hook on every count and return event.
+ */
+void LuaDB_ProfileHook(lua_State *L, lua_Debug *ar);
+
+/**
+ * @brief Stop profiling the request running on @c L if the request
+ * enabled profiling itself, writing the profile collected so far.
+ */
+void LuaDB_ProfileEndRequest(lua_State *L);
+
+/**
+ * @brief Lua function @c luadb.profile([enable]) which turns profiling
+ * on (the default) or off for the current request. Returns true if the
+ * profiler is available.
+ */
+int LuaDB_ProfileRequest(lua_State *L);
+
+#endif //LUADB_PROFILE_H
@@ -0,0 +1,235 @@
+/*****************************************************************************
+ * LuaDB :: sched.c
+ *
+ * Cooperative scheduling of requests served by a single thread.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+
+#include "profile.h"
+#include "sched.h"
+
+static const char *const LUADB_SCHED_CURRENT_KEY = "luadb.sched";
+static const char *const LUADB_SCHED_BUDGET_KEY = "luadb.budget";
+static const char *const LUADB_SCHED_PINS_KEY = "luadb.pins";
+
+// Number of VM instructions between request budget checks
+static const int LUADB_SCHED_BUDGET_INTERVAL = 1000;
+
+// Address used to recognize values yielded by LuaDB_SchedYield
+static const char LUADB_SCHED_YIELD_TAG = 0;
+
+/*
+ * FORWARD DECLARATIONS
+ */
+
+static int SchedSleepK(lua_State *L, int status, lua_KContext ctx);
+static void SchedRequestHook(lua_State *L, lua_Debug *ar);
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+long long LuaDB_SchedNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void LuaDB_SchedSetCurrent(lua_State *L, lua_State *co) {
+    assert(L);
+
+    luaL_checkstack(L, 1, "out of memory");
+    if (co) {
+        lua_pushthread(co);
+        lua_xmove(co, L, 1);
+    } else {
+        // Pins left by a request which ended early no longer apply
+        lua_pushnil(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_PINS_KEY);
+        lua_pushnil(L);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_CURRENT_KEY);
+}
+
+bool LuaDB_SchedCanYield(lua_State *L) {
+    assert(L);
+
+    if (!lua_isyieldable(L)) { return false; }
+
+    luaL_checkstack(L, 1, "out of memory");
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_PINS_KEY);
+    bool pinned = (lua_tointeger(L, -1) > 0);
+    lua_pop(L, 1);
+    if (pinned) { return false; }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_CURRENT_KEY);
+    bool current = (lua_tothread(L, -1) == L);
+    lua_pop(L, 1);
+    return current;
+}
+
+void LuaDB_SchedPin(lua_State *L, bool pin) {
+    assert(L);
+
+    luaL_checkstack(L, 1, "out of memory");
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_PINS_KEY);
+    lua_Integer pins = lua_tointeger(L, -1) + ((pin) ? 1 : -1);
+    lua_pop(L, 1);
+
+    if (pins > 0) {
+        lua_pushinteger(L, pins);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_PINS_KEY);
+}
+
+int LuaDB_SchedYield(lua_State *L, int fd, short events, long long timeout, lua_KContext ctx, lua_KFunction k) {
+    assert(L);
+
+    luaL_checkstack(L, 4, "out of memory");
+    lua_pushlightuserdata(L, (void *)&LUADB_SCHED_YIELD_TAG);
+    lua_pushinteger(L, fd);
+    lua_pushinteger(L, events);
+    lua_pushinteger(L, (timeout >= 0) ? LuaDB_SchedNow() + timeout : -1);
+    return lua_yieldk(L, 4, ctx, k);
+}
+
+void LuaDB_SchedBlock(int fd, short events, long long timeout) {
+    if (fd >= 0) {
+        struct pollfd pfd = { fd, events, 0 };
+        int ms = (timeout > INT_MAX) ? INT_MAX : (int)timeout;
+        while ((poll(&pfd, 1, ms) == -1) && (errno == EINTR));
+        return;
+    }
+
+    if (timeout < 0) { return; }
+    struct timespec ts;
+    ts.tv_sec = (time_t)(timeout / 1000);
+    ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR));
+}
+
+void LuaDB_SchedGetWait(lua_State *co, LuaDB_SchedWait *wait) {
+    assert(co);
+    assert(wait);
+
+    int nres = lua_gettop(co);
+    if (LuaDB_SchedIsWaiting(co)) {
+        wait->fd = (int)lua_tointeger(co, 2);
+        wait->events = (short)lua_tointeger(co, 3);
+        wait->deadline = (long long)lua_tointeger(co, 4);
+    } else {
+        wait->fd = -1;
+        wait->events = 0;
+        wait->deadline = LuaDB_SchedNow();
+    }
+
+    lua_pop(co, nres);
+}
+
+bool LuaDB_SchedIsWaiting(lua_State *co) {
+    assert(co);
+
+    return (lua_gettop(co) == 4) && (lua_touserdata(co, 1) == &LUADB_SCHED_YIELD_TAG);
+}
+
+void LuaDB_SchedBudgetInit(LuaDB_SchedBudget *budget, long timeout, long max_instructions) {
+    assert(budget);
+
+    budget->deadline = (timeout > 0) ? LuaDB_SchedNow() + timeout : -1;
+    budget->instructions = (max_instructions > 0) ? max_instructions : -1;
+    budget->exceeded = false;
+}
+
+void LuaDB_SchedSetBudget(lua_State *L, LuaDB_SchedBudget *budget) {
+    assert(L);
+
+    // The profiler shares the hook, and also samples as functions return
+    // so that time spent in C functions is attributed to them
+    bool profile = LuaDB_ProfileAvailable();
+    luaL_checkstack(L, 1, "out of memory");
+    if (budget && ((budget->deadline >= 0) || (budget->instructions >= 0) || profile)) {
+        lua_pushlightuserdata(L, budget);
+        lua_sethook(L, SchedRequestHook, LUA_MASKCOUNT | ((profile) ? LUA_MASKRET : 0),
+                    LUADB_SCHED_BUDGET_INTERVAL);
+    } else {
+        lua_pushnil(L);
+        lua_sethook(L, NULL, 0, 0);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_BUDGET_KEY);
+}
+
+bool LuaDB_SchedBudgetExpired(const LuaDB_SchedBudget *budget, long long now) {
+    assert(budget);
+
+    return budget->exceeded || ((budget->deadline >= 0) && (now >= budget->deadline));
+}
+
+void LuaDB_SchedBudgetExceed(LuaDB_SchedBudget *budget) {
+    assert(budget);
+
+    budget->exceeded = true;
+}
+
+int LuaDB_SchedSleep(lua_State *L) {
+    lua_Number secs = luaL_checknumber(L, 1);
+    long long timeout = (secs > 0) ? (long long)(secs * 1000) : 0;
+
+    if (LuaDB_SchedCanYield(L)) {
+        return LuaDB_SchedYield(L, -1, 0, timeout, 0, SchedSleepK);
+    }
+
+    LuaDB_SchedBlock(-1, 0, timeout);
+    return 0;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+// Continuation for `luadb.sleep` once the scheduler resumes the request.
+static int SchedSleepK(lua_State *L, int status, lua_KContext ctx) {
+    return 0;
+}
+
+// Hook enforcing the budget of the current request and taking samples
+// for the profiler.
+static void SchedRequestHook(lua_State *L, lua_Debug *ar) {
+    LuaDB_ProfileHook(L, ar);
+    if (ar->event != LUA_HOOKCOUNT) { return; }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_SCHED_BUDGET_KEY);
+    LuaDB_SchedBudget *budget = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!budget) { return; }
+
+    if ((budget->instructions > 0) && !budget->exceeded) {
+        budget->instructions -= LUADB_SCHED_BUDGET_INTERVAL;
+        if (budget->instructions < 0) { budget->instructions = 0; }
+    }
+    if ((budget->instructions != 0) && !LuaDB_SchedBudgetExpired(budget, LuaDB_SchedNow())) {
+        return;
+    }
+    LuaDB_SchedBudgetExceed(budget);
+
+    // Coroutines created by error handlers inherit the hook, so it is
+    // removed before they run; routers which catch the error with `pcall`
+    // are stopped once they next wait or return
+    lua_sethook(L, NULL, 0, 0);
+    luaL_error(L, "request exceeded its %s budget",
+               (budget->instructions == 0) ? "instruction" : "time");
+}
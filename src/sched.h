@@ -0,0 +1,146 @@
+/*****************************************************************************
+ * LuaDB :: sched.h
+ *
+ * Cooperative scheduling of requests served by a single thread.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_SCHED_H
+#define LUADB_SCHED_H
+
+#include <stdbool.h>
+
+#include "deps/lua/lua.h"
+
+/**
+ * @brief Event a request coroutine is waiting on before it can be resumed.
+ */
+typedef struct LuaDB_SchedWait {
+    int fd;                 /** file descriptor to poll; -1 for none */
+    short events;           /** poll events to wait for on @c fd */
+    long long deadline;     /** monotonic time (ms) to resume at; -1 for none */
+} LuaDB_SchedWait;
+
+/**
+ * @brief Time and instruction budget for a single request.
+ */
+typedef struct LuaDB_SchedBudget {
+    long long deadline;     /** monotonic time (ms) to finish by; -1 for none */
+    long long instructions; /** VM instructions left to run; -1 for no limit */
+    bool exceeded;          /** true once either limit has run out */
+} LuaDB_SchedBudget;
+
+/**
+ * @brief Return the current monotonic time in milliseconds.
+ */
+long long LuaDB_SchedNow(void);
+
+/**
+ * @brief Mark the given coroutine as the coroutine serving the current
+ * request in its state. Pass NULL to clear it at the end of the request.
+ */
+void LuaDB_SchedSetCurrent(lua_State *L, lua_State *co);
+
+/**
+ * @brief Return true if the calling function may yield back to the
+ * request scheduler (i.e. it is running directly on the current request
+ * coroutine and not across a C call boundary, and the request is not
+ * pinned).
+ */
+bool LuaDB_SchedCanYield(lua_State *L);
+
+/**
+ * @brief Pin the current request to its thread, or release one pin. While
+ * a request is pinned it never yields back to the scheduler; functions
+ * which would wait block the thread instead.
+ *
+ * Requests pin themselves while they hold a lock other requests on the
+ * same thread may block on (such as an LMDB write transaction), so the
+ * lock is never held by a suspended request which could only be resumed
+ * by the blocked thread.
+ *
+ * @param pin true to add a pin, false to release one
+ */
+void LuaDB_SchedPin(lua_State *L, bool pin);
+
+/**
+ * @brief Yield the current request coroutine back to the scheduler until
+ * the given file descriptor is ready or the timeout elapses. The function
+ * @c k is called with @c ctx once the coroutine is resumed. Callers must
+ * check @c LuaDB_SchedCanYield first and should return the result of
+ * this function directly.
+ *
+ * @param fd file descriptor to wait on; -1 to only wait for the timeout
+ * @param events poll events to wait for on @c fd
+ * @param timeout timeout in milliseconds; -1 to wait indefinitely
+ */
+int LuaDB_SchedYield(lua_State *L, int fd, short events, long long timeout, lua_KContext ctx, lua_KFunction k);
+
+/**
+ * @brief Block the calling thread until the given file descriptor is
+ * ready or the timeout elapses. Used in place of @c LuaDB_SchedYield when
+ * the caller cannot yield.
+ */
+void LuaDB_SchedBlock(int fd, short events, long long timeout);
+
+/**
+ * @brief Read the event a request coroutine yielded to wait on and pop
+ * the yielded values. Coroutines which yielded on their own (rather than
+ * through @c LuaDB_SchedYield) are resumed as soon as possible.
+ *
+ * @param co the request coroutine, after @c lua_resume returned LUA_YIELD
+ * @param wait [out] the event to wait on
+ */
+void LuaDB_SchedGetWait(lua_State *co, LuaDB_SchedWait *wait);
+
+/**
+ * @brief Return true if the given coroutine yielded through
+ * @c LuaDB_SchedYield, rather than on its own.
+ * @param co a coroutine, after @c lua_resume returned LUA_YIELD
+ */
+bool LuaDB_SchedIsWaiting(lua_State *co);
+
+/**
+ * @brief Initialize a request budget starting now.
+ *
+ * @param timeout wall-clock time limit in milliseconds; 0 for no limit
+ * @param max_instructions VM instruction limit; 0 for no limit
+ */
+void LuaDB_SchedBudgetInit(LuaDB_SchedBudget *budget, long timeout, long max_instructions);
+
+/**
+ * @brief Enforce the given budget on Lua code run by the state. Coroutines
+ * created from @c L afterwards (including the request coroutine) inherit
+ * the budget. Once the budget runs out, the running Lua code raises an
+ * error and its thread stops checking the budget, so error handlers can
+ * still run. Pass NULL to stop enforcing the budget at the end of the
+ * request.
+ *
+ * @param budget the request budget; must outlive the request
+ */
+void LuaDB_SchedSetBudget(lua_State *L, LuaDB_SchedBudget *budget);
+
+/**
+ * @brief Return true if the budget has run out by the given time. Used to
+ * enforce the time limit on requests which are waiting rather than
+ * running Lua code.
+ */
+bool LuaDB_SchedBudgetExpired(const LuaDB_SchedBudget *budget, long long now);
+
+/**
+ * @brief Mark the budget as exceeded, once a request is stopped for
+ * running out of it.
+ */
+void LuaDB_SchedBudgetExceed(LuaDB_SchedBudget *budget);
+
+/**
+ * @brief Suspend the current request for the given number of seconds.
+ * Other requests served by the same thread continue in the meantime;
+ * outside of a request, the calling thread sleeps.
+ */
+int LuaDB_SchedSleep(lua_State *L);
+
+#endif //LUADB_SCHED_H
@@ -18,9 +18,13 @@
 #include "deps/lua/lualib.h"
 #include "deps/lua/lauxlib.h"
 
+#include "alloc.h"
 #include "json.h"
 #include "lmdb.h"
+#include "log.h"
 #include "luadb.h"
+#include "profile.h"
+#include "sched.h"
 #include "state.h"
 #include "uuid.h"
 
@@ -32,6 +36,15 @@
 
 static char *AppendLuaDbPath(const char *cur_path, size_t len, const char *path, bool truncate);
 static void UpdateLuaPackagePath(lua_State *L, const char *path, bool truncate);
+static int PanicLuaState(lua_State *L);
+
+// LuaDB library functions
+static luaL_Reg luadb_lib_funcs[] = {
+        { "memstats", LuaDB_AllocMemStats },
+        { "profile", LuaDB_ProfileRequest },
+        { "sleep", LuaDB_SchedSleep },
+        { NULL, NULL },
+};
 
 /*
  * FORWARD DECLARATIONS
@@ -42,7 +55,17 @@ lua_State *LuaDB_NewState(void) {
 }
 
 lua_State *LuaDB_NewStateWithPaths(const char **paths, size_t npaths) {
-    lua_State *L = luaL_newstate();
+    return LuaDB_NewStateWithAllocator(paths, npaths, NULL);
+}
+
+lua_State *LuaDB_NewStateWithAllocator(const char **paths, size_t npaths, LuaDB_Allocator *alloc) {
+    lua_State *L;
+    if (alloc) {
+        L = lua_newstate(LuaDB_AllocatorAlloc, alloc);
+        if (L) { lua_atpanic(L, PanicLuaState); }
+    } else {
+        L = luaL_newstate();
+    }
     if (!L) {
         return NULL;
     }
@@ -52,6 +75,9 @@ lua_State *LuaDB_NewStateWithPaths(const char **paths, size_t npaths) {
     LuaDB_LmdbAddLib(L);
     LuaDB_UuidAddLib(L);
 
+    luaL_newlib(L, luadb_lib_funcs);
+    lua_setglobal(L, "luadb");
+
     if (paths && npaths > 0) {
         for (size_t i = 0; i < npaths; i++) {
             LuaDB_PathAddAbsolute(L, paths[i]);
@@ -135,3 +161,11 @@ static char *AppendLuaDbPath(const char *cur_path, size_t len, const char *path,
     free(pathcpy);
     return newpath;
 }
+
+// Log errors raised outside of any protected call before Lua aborts.
+static int PanicLuaState(lua_State *L) {
+    const char *msg = lua_tostring(L, -1);
+    syslog(LOG_CRIT, "Unprotected error in Lua state: %s",
+           (msg) ? msg : "(error object is not a string)");
+    return 0;
+}
@@ -11,6 +11,8 @@
 #ifndef LUADB_STATE_H
 #define LUADB_STATE_H
 
+#include "alloc.h"
+
 /**
  * @brief Create a new @c lua_State object instantiated with
  * the correct LuaDB libraries in the namespace.
@@ -30,6 +32,16 @@ lua_State *LuaDB_NewState(void);
  */
 lua_State *LuaDB_NewStateWithPaths(const char **paths, size_t npaths);
 
+/**
+ * @brief Create a new @c lua_State object exactly as
+ * @c LuaDB_NewStateWithPaths, allocating its memory from the given
+ * allocator.
+ *
+ * @param alloc the allocator for the new state; NULL to use the default
+ *              Lua allocator. The allocator must outlive the state.
+ */
+lua_State *LuaDB_NewStateWithAllocator(const char **paths, size_t npaths, LuaDB_Allocator *alloc);
+
 /**
  * @brief Add the given path to the Lua `package.path` global exactly
  * as it is given.
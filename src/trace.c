@@ -0,0 +1,120 @@
+/*****************************************************************************
+ * LuaDB :: trace.c
+ *
+ * Per-request phase timing.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "deps/lua/lua.h"
+#include "deps/lua/lauxlib.h"
+
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define LUADB_TRACE_LINE_SIZE 512
+
+static const char *const LUADB_TRACE_CURRENT_KEY = "luadb.trace";
+
+// Names of each phase, as logged and sent in Server-Timing headers
+static const char *const LUADB_TRACE_PHASE_NAMES[LUADB_TRACE_NPHASES] = {
+        "acquire", "router", "read", "route", "wait", "lmdb", "send",
+};
+
+/*
+ * PUBLIC FUNCTIONS
+ */
+
+void LuaDB_TraceBegin(LuaDB_Trace *trace, long long start, bool enabled) {
+    assert(trace);
+
+    memset(trace, 0, sizeof(LuaDB_Trace));
+    trace->enabled = enabled;
+    trace->start = start;
+    trace->mark = start;
+}
+
+void LuaDB_TraceMark(LuaDB_Trace *trace, LuaDB_TracePhase phase) {
+    assert(trace);
+    assert(phase < LUADB_TRACE_NPHASES);
+    if (!trace->enabled) { return; }
+
+    long long now = LuaDB_MetricsNow();
+    trace->phases[phase] += now - trace->mark;
+    trace->mark = now;
+}
+
+void LuaDB_TraceSetCurrent(lua_State *L, LuaDB_Trace *trace) {
+    assert(L);
+
+    luaL_checkstack(L, 1, "out of memory");
+    if (trace && trace->enabled) {
+        lua_pushlightuserdata(L, trace);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, LUADB_TRACE_CURRENT_KEY);
+}
+
+LuaDB_Trace *LuaDB_TraceGetCurrent(lua_State *L) {
+    assert(L);
+
+    luaL_checkstack(L, 1, "out of memory");
+    lua_getfield(L, LUA_REGISTRYINDEX, LUADB_TRACE_CURRENT_KEY);
+    LuaDB_Trace *trace = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return trace;
+}
+
+long long LuaDB_TraceNow(LuaDB_Trace *trace) {
+    return (trace) ? LuaDB_MetricsNow() : 0;
+}
+
+void LuaDB_TraceAdd(LuaDB_Trace *trace, LuaDB_TracePhase phase, long long since) {
+    assert(phase < LUADB_TRACE_NPHASES);
+    if (!trace) { return; }
+
+    trace->phases[phase] += LuaDB_MetricsNow() - since;
+}
+
+size_t LuaDB_TraceServerTiming(LuaDB_Trace *trace, char *buf, size_t size) {
+    assert(trace);
+    assert(buf);
+
+    // Durations are given in milliseconds
+    size_t len = 0;
+    for (size_t i = 0; (i < LUADB_TRACE_NPHASES) && (len < size); i++) {
+        if (trace->phases[i] == 0) { continue; }
+        int n = snprintf(buf + len, size - len, "%s%s;dur=%.3f", (len > 0) ? ", " : "",
+                         LUADB_TRACE_PHASE_NAMES[i], (double)trace->phases[i] / 1e6);
+        if (n < 0) { break; }
+        len += (size_t)n;
+    }
+
+    return len;
+}
+
+void LuaDB_TraceLog(LuaDB_Trace *trace, const char *uri, int status) {
+    assert(trace);
+
+    char line[LUADB_TRACE_LINE_SIZE];
+    size_t len = 0;
+    for (size_t i = 0; (i < LUADB_TRACE_NPHASES) && (len < sizeof(line)); i++) {
+        int n = snprintf(line + len, sizeof(line) - len, " %s=%.3f",
+                         LUADB_TRACE_PHASE_NAMES[i], (double)trace->phases[i] / 1e6);
+        if (n < 0) { break; }
+        len += (size_t)n;
+    }
+
+    syslog(LOG_INFO, "Request trace: uri=%s status=%d total=%.3f%s",
+           (uri) ? uri : "", status,
+           (double)(LuaDB_MetricsNow() - trace->start) / 1e6, line);
+}
@@ -0,0 +1,96 @@
+/*****************************************************************************
+ * LuaDB :: trace.h
+ *
+ * Per-request phase timing.
+ *
+ * Author:  Chris Rink <chrisrink10@gmail.com>
+ *
+ * License: MIT (see LICENSE document at source tree root)
+ *****************************************************************************/
+
+#ifndef LUADB_TRACE_H
+#define LUADB_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deps/lua/lua.h"
+
+/**
+ * @brief Phases of a request which are timed separately.
+ */
+typedef enum LuaDB_TracePhase {
+    LUADB_TRACE_ACQUIRE = 0,    /** checking out (or recreating) a pooled state */
+    LUADB_TRACE_ROUTER,         /** pushing the routing engine */
+    LUADB_TRACE_READ,           /** reading and parsing the request */
+    LUADB_TRACE_ROUTE,          /** running the routing engine */
+    LUADB_TRACE_WAIT,           /** waiting between runs of the routing engine */
+    LUADB_TRACE_LMDB,           /** LMDB calls, which are part of routing */
+    LUADB_TRACE_SEND,           /** sending the response */
+    LUADB_TRACE_NPHASES,
+} LuaDB_TracePhase;
+
+/**
+ * @brief Timing of a single request. Traces which are not enabled are
+ * never updated, so requests which are not sampled pay almost nothing.
+ */
+typedef struct LuaDB_Trace {
+    bool enabled;
+    long long start;                            /** when the request began (ns) */
+    long long mark;                             /** when the last phase ended (ns) */
+    long long phases[LUADB_TRACE_NPHASES];      /** time spent in each phase (ns) */
+} LuaDB_Trace;
+
+/**
+ * @brief Start timing a request which began at @c start (as given by
+ * @c LuaDB_MetricsNow ).
+ */
+void LuaDB_TraceBegin(LuaDB_Trace *trace, long long start, bool enabled);
+
+/**
+ * @brief Add the time since the last mark to the given phase.
+ */
+void LuaDB_TraceMark(LuaDB_Trace *trace, LuaDB_TracePhase phase);
+
+/**
+ * @brief Set the trace for the request running on the given state, so
+ * library functions can add to it. @c NULL (or a trace which is not
+ * enabled) clears it.
+ */
+void LuaDB_TraceSetCurrent(lua_State *L, LuaDB_Trace *trace);
+
+/**
+ * @brief Return the enabled trace for the request running on the given
+ * state or @c NULL if the request is not being traced.
+ */
+LuaDB_Trace *LuaDB_TraceGetCurrent(lua_State *L);
+
+/**
+ * @brief Return the current time for a call timed with
+ * @c LuaDB_TraceAdd or 0 if @c trace is @c NULL.
+ */
+long long LuaDB_TraceNow(LuaDB_Trace *trace);
+
+/**
+ * @brief Add the time since @c since (from @c LuaDB_TraceNow ) to the
+ * given phase without moving the mark. Does nothing if @c trace is
+ * @c NULL.
+ */
+void LuaDB_TraceAdd(LuaDB_Trace *trace, LuaDB_TracePhase phase, long long since);
+
+/**
+ * @brief Write the phases timed so far as a @c Server-Timing header value
+ * (without the header name or line ending). Phases which have taken no
+ * time (usually because they have not happened yet) are left out.
+ *
+ * @returns the length of the value; the value was truncated if this is
+ *          not less than @c size
+ */
+size_t LuaDB_TraceServerTiming(LuaDB_Trace *trace, char *buf, size_t size);
+
+/**
+ * @brief Log every phase of a completed request on one line.
+ */
+void LuaDB_TraceLog(LuaDB_Trace *trace, const char *uri, int status);
+
+#endif //LUADB_TRACE_H
@@ -43,7 +43,7 @@ local function http_debug(request)
     table.insert(body, "</ul>")
 
     table.insert(body, "<h3>Request Body</h3>")
-    table.insert(body, "<div><pre>" .. request.body .. "</pre></div>")
+    table.insert(body, "<div><pre>" .. request.body:all() .. "</pre></div>")
     table.insert(body, "</body></html>")
 
     -- Set the body in the response
@@ -199,6 +199,7 @@ function test_tx_data()
   tx1:put("", "1D1", "2D1", "3D2")
   tx1:put("", "1D1", "2D1", "3D3")
   tx1:put("", "1D1", "2D2")
+  tx1:put("", "1E1", "2E1")
   tx1:commit()
 
   local tx2 = testdb:begin(true)
@@ -206,6 +207,8 @@ function test_tx_data()
   lt:assert_equal(tx2:data("1A1"), 1)
   lt:assert_equal(tx2:data("1D1", "2D1"), 10)
   lt:assert_equal(tx2:data("1C1"), 11)
+  lt:assert_equal(tx2:data("1E1"), 10)
+  lt:assert_equal(tx2:data("1E0"), 0)
   tx2:rollback()
 end
 
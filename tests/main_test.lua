@@ -12,6 +12,7 @@ License: MIT (see LICENSE document at source tree root)
 local test_suite = {
 	require("json_test"),
 	require("lmdb_test"),
+	require("worker_test"),
 }
 
 -- Introduce yourself!
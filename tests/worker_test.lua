@@ -0,0 +1,778 @@
+--[[
+luadb :: worker_test.lua
+
+Test LuaDB worker processes serving HTTP requests.
+
+These tests start a worker with the native HTTP listener and send it
+requests with `curl`, or start it on a FastCGI socket and send it records
+through `bash`. Set the `LUADB` environment variable to the path of the
+`luadb` executable if it is not `../bin/luadb`.
+
+Author:  Chris Rink <chrisrink10@gmail.com>
+
+License: MIT (see LICENSE document at source tree root)
+]]--
+
+local LuaTest = require("test")
+local lt = LuaTest.new("worker")
+
+--[[ MODULE PRIVATE VARIABLES ]]--
+local luadb = os.getenv("LUADB") or "../bin/luadb"
+local testroot = nil
+local port = nil
+local master = nil
+
+--[[ PRIVATE FUNCTIONS ]]--
+
+-- Write the given string to a file
+local function write_file(path, contents)
+  local f = assert(io.open(path, "w"))
+  f:write(contents)
+  f:close()
+end
+
+-- Run a shell command and return its output; `io.popen` is not available
+local function run(cmd)
+  local out = testroot .. "/output"
+  os.execute(string.format("%s > %s", cmd, out))
+  local f = assert(io.open(out, "r"))
+  local s = f:read("*a")
+  f:close()
+  return s
+end
+
+-- Send a request to the worker and return the status code, body and
+-- response headers, or nil if the worker could not be reached
+local function request(path, data, headers)
+  local opts = { string.format("-D %s/headers", testroot) }
+  if data ~= nil then
+    write_file(testroot .. "/request", data)
+    opts[#opts+1] = string.format("--data-binary @%s/request", testroot)
+  end
+  for _, header in ipairs(headers or {}) do
+    opts[#opts+1] = string.format("-H '%s'", header)
+  end
+
+  local cmd = string.format("curl -s -m 10 -w '\\n%%{http_code}' %s 'http://127.0.0.1:%d%s'",
+                            table.concat(opts, " "), port, path)
+  local out = run(cmd)
+  local body, status = out:match("^(.*)\n(%d+)$")
+  if status == nil or status == "000" then
+    return nil
+  end
+
+  local f = assert(io.open(testroot .. "/headers", "r"))
+  local head = f:read("*a")
+  f:close()
+  return tonumber(status), body, head
+end
+
+-- Send the given requests at once, each on its own connection, and return
+-- the status code and total time (in seconds) of each, in order
+local function request_all(paths)
+  local cmds = {}
+  for i, path in ipairs(paths) do
+    cmds[i] = string.format("(curl -s -m 10 -o /dev/null -w '%%{http_code} %%{time_total}' " ..
+                            "'http://127.0.0.1:%d%s' > %s/all%d) &", port, path, testroot, i)
+  end
+  run(string.format("(%s wait)", table.concat(cmds, " ")))
+
+  local results = {}
+  for i = 1, #paths do
+    local f = assert(io.open(string.format("%s/all%d", testroot, i), "r"))
+    local status, secs = f:read("*a"):match("^(%d+) ([%d.]+)")
+    f:close()
+    results[i] = { status = tonumber(status), secs = tonumber(secs) }
+  end
+  return results
+end
+
+-- Send the given strings to the worker over a single connection, running
+-- the shell command `between` (if any) after each but the last, and
+-- return everything the worker sent back until it closed the connection
+-- or stopped answering
+local function send_raw(parts, between)
+  local cmds = {}
+  for i, part in ipairs(parts) do
+    local path = string.format("%s/part%d", testroot, i)
+    write_file(path, part)
+    cmds[i] = string.format("cat %s >&3", path)
+  end
+
+  write_file(testroot .. "/send.sh", string.format(
+    "exec 3<>/dev/tcp/127.0.0.1/%d\n%s\ntimeout 2 cat <&3\n",
+    port, table.concat(cmds, string.format("\n%s\n", between or ":"))))
+  return run(string.format("bash %s/send.sh 2>/dev/null", testroot))
+end
+
+-- Encode a FastCGI record of the given type for request 1 (or `id`)
+local function fcgi_record(rtype, content, id)
+  return string.pack(">BBI2I2BB", 1, rtype, id or 1, #content, 0, 0) .. content
+end
+
+-- Encode FastCGI name-value pairs; names and values must be shorter than
+-- 128 bytes
+local function fcgi_params(params)
+  local out = {}
+  for name, value in pairs(params) do
+    out[#out+1] = string.pack("BB", #name, #value) .. name .. value
+  end
+  return table.concat(out)
+end
+
+-- Encode a FastCGI request for the given path, returning the records
+-- which begin it separately from those carrying its body
+local function fcgi_request(path, body)
+  body = body or ""
+  local params = fcgi_params({
+    REQUEST_METHOD = (#body > 0) and "POST" or "GET",
+    REQUEST_URI = path,
+    DOCUMENT_URI = path,
+    QUERY_STRING = "",
+    CONTENT_LENGTH = tostring(#body),
+  })
+  local head = fcgi_record(1, string.pack(">I2Bxxxxx", 1, 0)) ..
+               fcgi_record(4, params) .. fcgi_record(4, "")
+  local stdin = ((#body > 0) and fcgi_record(5, body) or "") .. fcgi_record(5, "")
+  return head, stdin
+end
+
+-- Split the data the worker sent back into FastCGI records
+local function fcgi_records(data)
+  local records = {}
+  local pos = 1
+  while pos + 7 <= #data do
+    local _, rtype, _, len, pad = string.unpack(">BBI2I2B", data, pos)
+    records[#records+1] = { type = rtype, content = data:sub(pos + 8, pos + 7 + len) }
+    pos = pos + 8 + len + pad
+  end
+  return records
+end
+
+-- Send a FastCGI request for the given path to the worker and return the
+-- status code and body of the response, or nil if there was none
+local function fcgi(path, body)
+  local head, stdin = fcgi_request(path, body)
+  local out = {}
+  for _, record in ipairs(fcgi_records(send_raw({ head .. stdin }))) do
+    if record.type == 6 then out[#out+1] = record.content end
+  end
+
+  local response = table.concat(out)
+  local status = response:match("Status: (%d+)")
+  return tonumber(status), response:match("\r\n\r\n(.*)$")
+end
+
+-- Start a worker serving the given router with `-w 2 -t 2` (or the given
+-- worker options) and wait until it answers requests. The worker listens
+-- for HTTP unless `fastcgi` is true.
+local function start_worker(router, settings, options, fastcgi)
+  write_file(testroot .. "/router.lua", router)
+  write_file(testroot .. "/config.lua", string.format([[
+    local config = %s
+    config.root = %q
+    config.router = "router.lua"
+    return config
+  ]], settings or "{}", testroot))
+
+  local listen = string.format((fastcgi) and "-p:%d" or "-H %d", port)
+  local cmd = string.format("%s %s -f %s -c %s/config.lua >/dev/null 2>&1 & echo $!",
+                            luadb, listen, options or "-w 2 -t 2", testroot)
+  master = run(cmd):match("%d+")
+
+  for i = 1, 50 do
+    if ((fastcgi) and fcgi("/") or request("/")) ~= nil then
+      return true
+    end
+    os.execute("sleep 0.1")
+  end
+  return false
+end
+
+-- Stop the worker started by `start_worker`, along with its children
+local function stop_worker()
+  if master ~= nil then
+    os.execute(string.format("kill %s; while kill -0 %s 2>/dev/null; do sleep 0.1; done",
+                             master, master))
+    master = nil
+  end
+end
+
+--[[ TEST CASES ]]--
+
+-- Test that an environment opened while the router loads in the master
+-- process is not used by worker processes after they are forked
+function test_lmdb_fork()
+  lt:assert(start_worker([[
+    local env = lmdb.open("]] .. testroot .. [[/db", {maxreaders = 126, mapsize = 10485760})
+
+    -- Leave a reset read transaction pooled by the master
+    local tx = env:begin(true)
+    tx:get("count")
+    tx:close()
+
+    return function(request)
+      local tx = env:begin()
+      local count = (tonumber(tx:get("count")) or 0) + 1
+      tx:put(tostring(count), "count")
+      tx:commit()
+
+      -- Report the process holding the reader slot of an open transaction
+      local rtx = env:begin(true)
+      local value = rtx:get("count")
+      local pid = nil
+      for _, line in ipairs(env:readers()) do
+        pid = pid or line:match("^%s*(%d+)%s+%x+%s+%d+")
+      end
+      rtx:close()
+
+      db:begin(true):close()
+      return { status = 200, headers = {}, body = tostring(pid) .. " " .. value }
+    end
+  ]], string.format("{ db = { path = %q, maxreaders = 126, mapsize = 10485760 } }",
+                    testroot .. "/defaultdb")))
+
+  -- The first request was sent while waiting for the worker to start
+  for i = 2, 20 do
+    local status, body = request("/")
+    lt:assert_equal(status, 200)
+    local pid, count = (body or ""):match("^(%S+) (%d+)$")
+    lt:assert_not_equal(pid, "nil")
+    lt:assert_not_equal(pid, master)
+    lt:assert_equal(tonumber(count), i)
+  end
+end
+
+-- Test that an environment opened with fewer reader slots than every
+-- worker thread may pool read transactions in is given enough of them
+function test_lmdb_max_readers()
+  stop_worker()
+  lt:assert(start_worker([[
+    local env = lmdb.open("]] .. testroot .. [[/readers", {maxreaders = 2, mapsize = 10485760})
+
+    return function(request)
+      return { status = 200, headers = {}, body = tostring(env:max_readers()) }
+    end
+  ]], "{ pool_size = 3 }"))
+
+  -- 2 workers with 2 threads each pooling 3 transactions
+  local status, body = request("/")
+  lt:assert_equal(status, 200)
+  lt:assert((tonumber(body) or 0) >= 12)
+end
+
+-- Test that concurrent requests writing to the same environment on one
+-- worker thread wait for each other rather than deadlocking the thread
+function test_lmdb_writers()
+  stop_worker()
+  lt:assert(start_worker([[
+    local env = lmdb.open("]] .. testroot .. [[/writers", {maxreaders = 126, mapsize = 10485760})
+
+    return function(request)
+      if request.vars.document_uri == "/write" then
+        local tx = env:begin()
+        local count = (tonumber(tx:get("count")) or 0) + 1
+        tx:put(tostring(count), "count")
+        luadb.sleep(0.1)
+        tx:commit()
+      end
+
+      local tx = env:begin(true)
+      local count = tx:get("count") or "0"
+      tx:close()
+      return { status = 200, headers = {}, body = count }
+    end
+  ]], nil, "-w 1 -t 1"))
+
+  -- Send the writers together and wait for all of them to finish
+  local cmds = {}
+  for i = 1, 4 do
+    cmds[i] = string.format("curl -s -m 10 -o /dev/null -w '%%{http_code}\\n' " ..
+                            "'http://127.0.0.1:%d/write' &", port)
+  end
+  local out = run(string.format("(%s wait)", table.concat(cmds, " ")))
+  local _, ok = out:gsub("200", "")
+  lt:assert_equal(ok, 4)
+
+  local status, body = request("/")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "4")
+end
+
+-- Test that reading part of the request body with `read` and `lines`
+-- leaves the whole body available to `all`, in memory and spilled
+function test_body_partial()
+  lt:assert(start_worker([[
+    return function(request)
+      local body = request.body
+      local parts = {}
+      parts[#parts+1] = body:read(3) or "nil"
+      local it = body:lines()
+      parts[#parts+1] = it() or "nil"
+      parts[#parts+1] = it() or "nil"
+      parts[#parts+1] = body:read(100) or "nil"
+      parts[#parts+1] = body:read(1) or "nil"
+      parts[#parts+1] = tostring(#body)
+      parts[#parts+1] = body:all()
+      return { status = 200, headers = {}, body = table.concat(parts, "|") }
+    end
+  ]], "{ body_spill_size = 8 }"))
+
+  local status, body = request("/", "abcdef\nline two\ntail")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "abc|def|line two|tail|nil|20|abcdef\nline two\ntail")
+
+  status, body = request("/", "xyz")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "xyz|nil|nil|nil|nil|3|xyz")
+end
+
+-- Test that function and coroutine response bodies may wait, and are held
+-- to the same memory limit as the routing script
+function test_body_generators()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      local uri = request.vars.document_uri
+      if uri == "/function" then
+        local i = 0
+        return { status = 200, headers = {}, body = function()
+          i = i + 1
+          if i > 3 then return nil end
+          luadb.sleep(0.01)
+          return tostring(i)
+        end }
+      elseif uri == "/coroutine" then
+        return { status = 200, headers = {}, body = coroutine.create(function()
+          for i = 1, 3 do
+            luadb.sleep(0.01)
+            coroutine.yield(tostring(i))
+          end
+          return "done"
+        end) }
+      elseif uri == "/memory" then
+        local i = 0
+        return { status = 200, headers = {}, body = function()
+          i = i + 1
+          if i == 1 then return "start" end
+          if i > 2 then return nil end
+          local t = {}
+          for j = 1, 100000 do t[j] = string.rep("x", 64) .. j end
+          return "done"
+        end }
+      end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ request_max_memory = 1048576 }"))
+
+  local status, body = request("/function")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "123")
+
+  status, body = request("/coroutine")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "123done")
+
+  status, body = request("/memory")
+  lt:assert_equal(body, "start")
+
+  status, body = request("/")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "ok")
+end
+
+-- Test that requests waiting on a timer let others on the same thread run,
+-- including while holding LMDB read transactions, and that waiting
+-- requests are stopped once their time runs out
+function test_sched_interleave()
+  stop_worker()
+  lt:assert(start_worker([[
+    local env = lmdb.open("]] .. testroot .. [[/shared", {maxreaders = 126, mapsize = 10485760})
+
+    return function(request)
+      local uri = request.vars.document_uri
+      if uri == "/read" then
+        local tx = env:begin(true)
+        local before = tx:get("value")
+        luadb.sleep(0.5)
+        local after = tx:get("value")
+        tx:close()
+        return { status = 200, headers = {}, body = before .. after }
+      elseif uri == "/nap" then
+        luadb.sleep(5)
+      end
+
+      local tx = env:begin()
+      tx:put("x", "value")
+      tx:commit()
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ pool_size = 4, request_timeout = 1000 }", "-w 1 -t 1"))
+
+  -- Run serially, the last of these would take 2 seconds
+  local results = request_all({ "/read", "/read", "/read", "/read" })
+  for _, result in ipairs(results) do
+    lt:assert_equal(result.status, 200)
+    lt:assert(result.secs < 1.5)
+  end
+
+  results = request_all({ "/nap" })
+  lt:assert_equal(results[1].status, 503)
+  lt:assert(results[1].secs < 3)
+end
+
+-- Test that a request waiting for its body to arrive lets other requests
+-- on the same thread run and resumes once the body arrives
+function test_sched_fd()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      if request.vars.document_uri == "/echo" then
+        return { status = 200, headers = {}, body = request.body:all() }
+      end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], nil, "-w 1 -t 1", true))
+
+  local fast_head, fast_stdin = fcgi_request("/")
+  write_file(testroot .. "/fast", fast_head .. fast_stdin)
+  local fast = string.format("(exec 4<>/dev/tcp/127.0.0.1/%d; cat %s/fast >&4; " ..
+                             "timeout 2 cat <&4) > %s/fast.out", port, testroot, testroot)
+
+  -- Send the other request while the first waits for its body
+  local head, stdin = fcgi_request("/echo", "slow body")
+  local out = {}
+  for _, record in ipairs(fcgi_records(send_raw({ head, stdin }, fast))) do
+    if record.type == 6 then out[#out+1] = record.content end
+  end
+  lt:assert_equal(table.concat(out):match("\r\n\r\n(.*)$"), "slow body")
+
+  local f = assert(io.open(testroot .. "/fast.out", "r"))
+  local fast_out = f:read("*a")
+  f:close()
+  lt:assert_equal(fast_out:match("\r\n\r\n(ok)"), "ok")
+end
+
+-- Test that requests over their memory limits are answered with 503,
+-- without leaving LMDB transactions open, and that states report their
+-- arena
+function test_limits_memory()
+  stop_worker()
+  lt:assert(start_worker([[
+    local env = lmdb.open("]] .. testroot .. [[/leak", {maxreaders = 126, mapsize = 10485760})
+
+    local function grow()
+      local t = {}
+      for i = 1, 1000000 do t[i] = string.rep("x", 64) .. i end
+      return t
+    end
+
+    return function(request)
+      local uri = request.vars.document_uri
+      if uri == "/grow" then
+        grow()
+      elseif uri == "/leak" then
+        local tx = env:begin()
+        tx:put("leaked", "value")
+        grow()
+      elseif uri == "/write" then
+        local tx = env:begin()
+        local value = tx:get("value") or "none"
+        tx:put("written", "value")
+        tx:commit()
+        return { status = 200, headers = {}, body = value }
+      elseif uri == "/stats" then
+        local stats = luadb.memstats()
+        return { status = 200, headers = {},
+                 body = string.format("%d %d", stats.arena_bytes, stats.request_bytes) }
+      end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ request_max_memory = 1048576, pool_arena = 65536 }", "-w 1 -t 1"))
+
+  local status = request("/grow")
+  lt:assert_equal(status, 503)
+
+  -- The write transaction of the failed request must have been aborted
+  status = request("/leak")
+  lt:assert_equal(status, 503)
+  local body
+  status, body = request("/write")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "none")
+
+  status, body = request("/stats")
+  lt:assert_equal(status, 200)
+  local arena, used = (body or ""):match("^(%d+) (%d+)$")
+  lt:assert_equal(tonumber(arena), 65536)
+  lt:assert((tonumber(used) or 0) > 0)
+
+  -- Limit the size of the whole state instead
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      if request.vars.document_uri == "/grow" then
+        local t = {}
+        for i = 1, 1000000 do t[i] = string.rep("x", 64) .. i end
+      end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ state_max_memory = 4194304 }", "-w 1 -t 1"))
+
+  status = request("/grow")
+  lt:assert_equal(status, 503)
+  status, body = request("/")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, "ok")
+end
+
+-- Test that request latencies are served at the metrics path without
+-- running the router
+function test_metrics()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      return { status = 200, headers = {}, body = "router" }
+    end
+  ]], '{ metrics_path = "/metrics" }', "-w 1 -t 1"))
+
+  request("/")
+  local status, body = request("/metrics")
+  lt:assert_equal(status, 200)
+  local count = body:match('luadb_request_duration_seconds_count{route="/",status="200"} (%d+)')
+  lt:assert((tonumber(count) or 0) >= 2)
+  lt:assert_not_equal(body:match("luadb_requests_shed_total %d+"), nil)
+end
+
+-- Test that traced requests report their phases in a header
+function test_trace()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ trace_sample_rate = 1, trace_header = 1 }", "-w 1 -t 1"))
+
+  local status, _, head = request("/")
+  lt:assert_equal(status, 200)
+  local timing = head:match("[Ss]erver%-[Tt]iming: ([^\r\n]+)")
+  lt:assert_not_equal(timing, nil)
+  lt:assert_not_equal((timing or ""):match("route"), nil)
+end
+
+-- Test that a request profiling itself writes its samples once it ends
+function test_profile()
+  stop_worker()
+  lt:assert(start_worker([[
+    local function spin()
+      local start = os.clock()
+      while os.clock() - start < 0.2 do end
+    end
+
+    return function(request)
+      if request.vars.document_uri == "/profile" then
+        luadb.profile()
+        spin()
+      end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], string.format("{ profile_output = %q, profile_interval = 1000 }",
+                    testroot .. "/profile"), "-w 1 -t 1"))
+
+  local status = request("/profile")
+  lt:assert_equal(status, 200)
+  local profile = run(string.format("cat %s/profile.*", testroot))
+  lt:assert_not_equal(profile:match("spin %([^)]*router%.lua:%d+%)[^\n]* %d+"), nil)
+end
+
+-- Test that HTTP connections are kept alive and pipelined requests are
+-- answered in order
+function test_http_pipeline()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      local uri = request.vars.document_uri
+      if uri == "/a" then luadb.sleep(0.1) end
+      return { status = 200, headers = {}, body = uri }
+    end
+  ]], nil, "-w 1 -t 1"))
+
+  local url = string.format("http://127.0.0.1:%d/", port)
+  local out = run(string.format("curl -s -m 10 -w '%%{num_connects} ' " ..
+                                "-o /dev/null '%s' -o /dev/null '%s' -o /dev/null '%s'",
+                                url, url, url))
+  lt:assert_equal(out, "1 0 0 ")
+
+  out = send_raw({ "GET /a HTTP/1.1\r\nHost: luadb\r\n\r\n" ..
+                   "GET /b HTTP/1.1\r\nHost: luadb\r\nConnection: close\r\n\r\n" })
+  local _, responses = out:gsub("HTTP/1%.1 200", "")
+  lt:assert_equal(responses, 2)
+  lt:assert_not_equal(out:match("\r\n\r\n/a.*\r\n\r\n/b$"), nil)
+end
+
+-- Test that FastCGI web servers asking for the connection limits are told
+-- how many connections the worker accepts
+function test_fcgi_get_values()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ pool_size = 2, queue_size = 1 }", "-w 1 -t 1", true))
+
+  local names = { FCGI_MAX_CONNS = "", FCGI_MAX_REQS = "", FCGI_MPXS_CONNS = "" }
+  local records = fcgi_records(send_raw({ fcgi_record(9, fcgi_params(names), 0) }))
+  lt:assert_equal(#records, 1)
+  lt:assert_equal(records[1].type, 10)
+
+  local values = {}
+  local content = records[1].content
+  local pos = 1
+  while pos < #content do
+    local nlen, vlen = string.unpack("BB", content, pos)
+    local name = content:sub(pos + 2, pos + 1 + nlen)
+    values[name] = content:sub(pos + 2 + nlen, pos + 1 + nlen + vlen)
+    pos = pos + 2 + nlen + vlen
+  end
+  lt:assert_equal(values.FCGI_MAX_CONNS, "3")
+  lt:assert_equal(values.FCGI_MAX_REQS, "3")
+  lt:assert_equal(values.FCGI_MPXS_CONNS, "0")
+
+  -- Names asked for many times are answered only as often as they fit
+  local many = string.rep(fcgi_params({ FCGI_MAX_CONNS = "" }), 20)
+  records = fcgi_records(send_raw({ fcgi_record(9, many, 0) }))
+  lt:assert_equal(#records, 1)
+  lt:assert_equal(records[1].type, 10)
+  lt:assert(#records[1].content <= 120)
+  lt:assert_equal(records[1].content:sub(1, 17), string.pack("BB", 14, 1) .. "FCGI_MAX_CONNS3")
+end
+
+-- Test that requests beyond the queue are answered with 503
+function test_fcgi_shed()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      if request.vars.document_uri == "/sleep" then luadb.sleep(0.5) end
+      return { status = 200, headers = {}, body = "ok" }
+    end
+  ]], "{ pool_size = 1, queue_size = 1, queue_timeout = 5000 }", "-w 1 -t 1", true))
+
+  local head, stdin = fcgi_request("/sleep")
+  write_file(testroot .. "/sleep", head .. stdin)
+  local cmds = {}
+  for i = 1, 4 do
+    cmds[i] = string.format("(exec 3<>/dev/tcp/127.0.0.1/%d; cat %s/sleep >&3; " ..
+                            "timeout 5 cat <&3) > %s/shed%d &", port, testroot, testroot, i)
+  end
+  write_file(testroot .. "/shed.sh", table.concat(cmds, "\n") .. "\nwait\n")
+  run(string.format("bash %s/shed.sh", testroot))
+
+  local counts = {}
+  for i = 1, 4 do
+    local f = assert(io.open(string.format("%s/shed%d", testroot, i), "r"))
+    local status = f:read("*a"):match("Status: (%d+)") or "none"
+    f:close()
+    counts[status] = (counts[status] or 0) + 1
+  end
+  lt:assert_equal(counts["200"], 2)
+  lt:assert_equal(counts["503"], 2)
+end
+
+-- Test that cached responses are served without running the router, are
+-- kept separately for the headers they vary on, answer conditional
+-- requests and are evicted least recently used first
+function test_cache()
+  stop_worker()
+  lt:assert(start_worker([[
+    return function(request)
+      local body = uuid.uuid() .. string.rep(".", 1000)
+      if request.vars.document_uri == "/" then
+        return { status = 200, headers = {}, body = "ok" }
+      end
+      return { status = 200, headers = {}, body = body,
+               cache = { ttl = 60, vary = "Accept-Language" } }
+    end
+  ]], "{ cache_max_size = 3000 }", "-w 1 -t 1"))
+
+  local _, a, head = request("/a")
+  local status, body = request("/a")
+  lt:assert_equal(status, 200)
+  lt:assert_equal(body, a)
+
+  local etag = head:match("[Ee][Tt][Aa][Gg]: ([^\r\n]+)")
+  lt:assert_not_equal(etag, nil)
+  status = request("/a", nil, { "If-None-Match: " .. (etag or "") })
+  lt:assert_equal(status, 304)
+
+  -- Only two responses fit, so /b is evicted once /a was used after it
+  local _, b = request("/b")
+  request("/a")
+  request("/c")
+  _, body = request("/a")
+  lt:assert_equal(body, a)
+  _, body = request("/b")
+  lt:assert_not_equal(body, b)
+
+  local _, en = request("/v", nil, { "Accept-Language: en" })
+  _, body = request("/v", nil, { "Accept-Language: en" })
+  lt:assert_equal(body, en)
+  _, body = request("/v", nil, { "Accept-Language: fr" })
+  lt:assert_not_equal(body, en)
+end
+
+--[[ ADD TEST CASES ]]--
+
+-- Add setup and teardown code
+
+lt:add_setup(function()
+  testroot = os.tmpname()
+  os.remove(testroot)
+  os.execute(string.format("mkdir -p %s/db %s/defaultdb %s/readers %s/writers %s/shared %s/leak",
+                           testroot, testroot, testroot, testroot, testroot, testroot))
+  math.randomseed(os.time())
+  port = 20000 + math.random(20000)
+end)
+
+lt:add_teardown(function()
+  stop_worker()
+  os.execute(string.format("rm -rf %s", testroot))
+  testroot = nil
+end)
+
+lt:add_case("lmdb", function()
+  test_lmdb_fork()
+  test_lmdb_max_readers()
+  test_lmdb_writers()
+end)
+
+lt:add_case("body", function()
+  test_body_partial()
+  test_body_generators()
+end)
+
+lt:add_case("sched", function()
+  test_sched_interleave()
+  test_sched_fd()
+end)
+
+lt:add_case("limits", function()
+  test_limits_memory()
+end)
+
+lt:add_case("observe", function()
+  test_metrics()
+  test_trace()
+  test_profile()
+end)
+
+lt:add_case("connections", function()
+  test_http_pipeline()
+  test_fcgi_get_values()
+  test_fcgi_shed()
+end)
+
+lt:add_case("cache", function()
+  test_cache()
+end)
+
+return lt